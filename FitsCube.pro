@@ -0,0 +1,19 @@
+# -------------------------------------------------
+# Builds libfitscube first, then FitsCubeCombine and the
+# benchmarks that link it: qmake FitsCube.pro && make
+# -------------------------------------------------
+TEMPLATE = subdirs
+SUBDIRS = lib \
+    app \
+    headerbench \
+    fitsgen \
+    cubebench
+lib.file = src/FitsCubeLib.pro
+app.file = src/FitsCubeCombine.pro
+app.depends = lib
+headerbench.file = bench/FitsBench.pro
+headerbench.depends = lib
+fitsgen.file = bench/FitsGen.pro
+fitsgen.depends = lib
+cubebench.file = bench/CubeBench.pro
+cubebench.depends = lib
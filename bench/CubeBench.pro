@@ -0,0 +1,10 @@
+# -------------------------------------------------
+# Benchmarks, not needed to use FitsCubeCombine
+# -------------------------------------------------
+QT -= gui
+TARGET = cubebench
+CONFIG += console
+CONFIG -= app_bundle
+TEMPLATE = app
+SOURCES += cubebench.cpp
+include( cubegen.pri)
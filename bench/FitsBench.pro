@@ -0,0 +1,14 @@
+# -------------------------------------------------
+# Microbenchmarks, not needed to use FitsCubeCombine
+# -------------------------------------------------
+QT -= gui
+TARGET = headerbench
+CONFIG += console
+CONFIG -= app_bundle
+TEMPLATE = app
+INCLUDEPATH += ../src
+SOURCES += headerbench.cpp
+LIBS += -L$$OUT_PWD/../src -lfitscube
+PRE_TARGETDEPS += $$OUT_PWD/../src/libfitscube.a
+HEADERS += legacyheader.h \
+    ../src/fitsheader.h
@@ -0,0 +1,10 @@
+# -------------------------------------------------
+# Synthetic cube generator, not needed to use FitsCubeCombine
+# -------------------------------------------------
+QT -= gui
+TARGET = fitsgen
+CONFIG += console
+CONFIG -= app_bundle
+TEMPLATE = app
+SOURCES += fitsgen.cpp
+include( cubegen.pri)
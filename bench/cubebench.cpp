@@ -0,0 +1,260 @@
+/*
+ *   Copyright 2013 Pavol Federl (federl@gmail.com)
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ *
+ */
+
+// Benchmark of the combiner on synthetic cubes: writes a set of cubes with fitsgen's
+// generator into a scratch directory, then times the header parsing, clipData, whole
+// combines with several buffer budgets and queue depths and random access through
+// CubeReader. Every row reports MB/s and millions of voxels per second. The inputs are read
+// once before the timing starts, so the numbers are for data in the page cache unless the
+// cubes are bigger than the memory; use --io direct to see the disks.
+//
+// usage: cubebench [options]
+
+#include <iostream>
+#include <sstream>
+#include <cstdlib>
+#include <vector>
+#include <unistd.h>
+#include <QDir>
+#include <QFile>
+#include <QString>
+#include <QStringList>
+#include <QElapsedTimer>
+
+#include "cubegen.h"
+#include "extractor.h"
+#include "cubereader.h"
+
+using namespace std;
+
+static void usage( const char * prog)
+{
+    cerr << QString( "Usage: %1 [options]\n"
+                     "Options:\n"
+                     "  --naxis1 n, --naxis2 n, --naxis3 n  size of each cube (default 256 256 64)\n"
+                     "  --bitpix b    BITPIX of the cubes (default -32)\n"
+                     "  --files n     number of cubes (default 4)\n"
+                     "  --reps n      repetitions of the short benchmarks (default 5)\n"
+                     "  --io mode     I/O mode of the combines and of CubeReader (default buffered)\n"
+                     "  --queue-depth n  reads in flight in the asynchronous combines (default 32)\n"
+                     "  --dir path    scratch directory (default a new one in the temp directory)\n"
+                     "  --keep        do not delete the cubes at the end\n").arg( prog).toStdString();
+    exit( -1);
+}
+
+static int number( int argc, char ** argv, int & i)
+{
+    if( i + 1 >= argc)
+        usage( argv[0]);
+    bool ok;
+    int val = QString( argv[++ i]).toInt( & ok);
+    if( ! ok) {
+        cerr << "*** ERROR *** option " << argv[i - 1] << " needs a number.\n";
+        usage( argv[0]);
+    }
+    return val;
+}
+
+// keeps the compiler from throwing the work away
+static volatile double sink;
+
+static void report( const QString & name, double ms, double bytes, double voxels)
+{
+    double s = ms / 1000;
+    // the header parsing has no voxels
+    QString rate = voxels > 0 ? QString::number( voxels / s / 1e6, 'f', 2) : QString( "-");
+    cout << QString( "%1 %2 %3 %4\n").arg( name, -32).arg( ms, 10, 'f', 1)
+            .arg( bytes / s / 1e6, 10, 'f', 1).arg( rate, 12).toStdString();
+}
+
+static double elapsedMs( const QElapsedTimer & timer)
+{
+    return timer.nsecsElapsed() / 1e6;
+}
+
+// the whole data segment of a cube
+static vector<char> readData( const FitsInfo & info)
+{
+    QFile f( info.fileName);
+    vector<char> data( info.dataSize);
+    if( ! f.open( QFile::ReadOnly) || ! f.seek( info.dataOffset) || ! blockRead( f, & data[0], info.dataSize))
+        throw QString( "Cannot read %1").arg( info.fileName);
+    return data;
+}
+
+int main( int argc, char ** argv)
+{
+    SyntheticSet set;
+    int reps = 5;
+    int queueDepth = 32;
+    IoMode ioMode = IoBuffered;
+    bool keep = false;
+    QString dir = QString( "%1/cubebench-%2").arg( QDir::tempPath()).arg( int( getpid()));
+    for( int i = 1 ; i < argc ; i ++ ) {
+        QString arg = argv[i];
+        if( arg == "--naxis1") set.cube.naxis1 = number( argc, argv, i);
+        else if( arg == "--naxis2") set.cube.naxis2 = number( argc, argv, i);
+        else if( arg == "--naxis3") set.cube.naxis3 = number( argc, argv, i);
+        else if( arg == "--bitpix") set.cube.bitpix = number( argc, argv, i);
+        else if( arg == "--files") set.files = number( argc, argv, i);
+        else if( arg == "--reps") reps = number( argc, argv, i);
+        else if( arg == "--queue-depth") queueDepth = number( argc, argv, i);
+        else if( arg == "--keep") keep = true;
+        else if( arg == "--dir" && i + 1 < argc) dir = argv[++ i];
+        else if( arg == "--io" && i + 1 < argc && parseIoMode( argv[i + 1], ioMode)) i ++;
+        else usage( argv[0]);
+    }
+    if( set.cube.naxis1 < 1 || set.cube.naxis2 < 1 || set.cube.naxis3 < 1 || set.files < 1 || reps < 1
+            || queueDepth < 1)
+        usage( argv[0]);
+
+    QStringList inputs;
+    QString output = QDir( dir).filePath( "combined.fits");
+    try {
+        if( ! QDir().mkpath( dir))
+            throw QString( "Cannot create %1").arg( dir);
+        cerr << "Writing " << set.files << " cubes of " << set.cube.naxis1 << "x" << set.cube.naxis2
+             << "x" << set.cube.naxis3 << " BITPIX " << set.cube.bitpix << " to " << dir.toStdString() << "\n";
+        inputs = writeSyntheticSet( dir, "bench", set);
+
+        vector<FitsInfo> infos;
+        qint64 totalBytes = 0, totalVoxels = 0;
+        for( int i = 0 ; i < inputs.size() ; i ++ ) {
+            infos.push_back( parse( inputs[i]));
+            totalBytes += infos.back().dataSize;
+            totalVoxels += qint64( infos.back().naxis1) * infos.back().naxis2 * infos.back().naxis3;
+        }
+        // everything in the page cache, so the first row is not the odd one out
+        for( size_t i = 0 ; i < infos.size() ; i ++ )
+            readData( infos[i]);
+
+        cout << "benchmark                         time [ms]       MB/s   Mvoxels/s\n";
+
+        // header parsing, the bytes are the header blocks
+        {
+            QElapsedTimer timer; timer.start();
+            qint64 bytes = 0;
+            for( int r = 0 ; r < reps ; r ++ )
+                for( int i = 0 ; i < inputs.size() ; i ++ )
+                    bytes += parse( inputs[i]).dataOffset;
+            double ms = elapsedMs( timer);
+            report( QString( "parse() x %1").arg( reps * inputs.size()), ms, bytes, 0);
+        }
+
+        // clipData on the first cube in memory, the original is copied back between the runs
+        {
+            vector<char> original = readData( infos[0]), data;
+            double ms = 0;
+            for( int r = 0 ; r < reps ; r ++ ) {
+                data = original;
+                QElapsedTimer timer; timer.start();
+                clipData( & data[0], data.size(), -1000, 1000, infos[0]);
+                ms += elapsedMs( timer);
+            }
+            qint64 voxels = qint64( infos[0].naxis1) * infos[0].naxis2 * infos[0].naxis3;
+            report( "clipData", ms, double( original.size()) * reps, double( voxels) * reps);
+        }
+
+        // whole combines, the combiner's progress reports go nowhere; the last two keep many
+        // reads in flight, through io_uring (if the kernel has it) and through threads
+        qint64 budgets[] = { 8, 32, 128 };
+        for( int b = 0 ; b < 6 ; b ++ ) {
+            CombineOptions options;
+            options.ioMode = ioMode;
+            options.memory = (b < 3 ? budgets[b] : 32) * 1024 * 1024;
+            options.clip = b != 3;
+            options.queueDepth = b < 4 ? 1 : queueDepth;
+            options.ioThreads = b == 5;
+            QString name = b < 3 ? QString( "combineFITS --memory %1M").arg( budgets[b])
+                         : b == 3 ? QString( "combineFITS --no-clip")
+                         : b == 4 ? QString( "combineFITS --queue-depth %1").arg( queueDepth)
+                         : QString( "combineFITS --io-threads");
+            QDir().remove( output);
+            ostringstream silence;
+            streambuf * saved = cerr.rdbuf( silence.rdbuf());
+            QElapsedTimer timer; timer.start();
+            try {
+                combineFITS( inputs, output, options);
+            } catch ( ... ) {
+                cerr.rdbuf( saved);
+                throw;
+            }
+            double ms = elapsedMs( timer);
+            cerr.rdbuf( saved);
+            report( name, ms, totalBytes, totalVoxels);
+        }
+        QDir().remove( output);
+
+        // random access through CubeReader, on a fresh reader each time so the cache starts cold
+        const FitsInfo & info = infos[0];
+        int size = abs( info.bitpix) / 8;
+        srand( 1);
+        {
+            CubeReader reader( info, CubeReader::DefaultCacheSize, ioMode);
+            int n = 100000;
+            double sum = 0;
+            QElapsedTimer timer; timer.start();
+            for( int i = 0 ; i < n ; i ++ )
+                sum += reader.value( rand() % info.naxis1, rand() % info.naxis2, rand() % info.naxis3);
+            double ms = elapsedMs( timer);
+            report( QString( "CubeReader::value x %1").arg( n), ms, double( n) * size, n);
+            sink = sum;
+        }
+        {
+            CubeReader reader( info, CubeReader::DefaultCacheSize, ioMode);
+            int n = 1000;
+            vector<double> spectrum;
+            QElapsedTimer timer; timer.start();
+            for( int i = 0 ; i < n ; i ++ )
+                reader.readSpectrum( rand() % info.naxis1, rand() % info.naxis2, spectrum);
+            double ms = elapsedMs( timer);
+            double voxels = double( n) * info.naxis3;
+            report( QString( "CubeReader::readSpectrum x %1").arg( n), ms, voxels * size, voxels);
+        }
+        {
+            CubeReader reader( info, CubeReader::DefaultCacheSize, ioMode);
+            int n = 200, edge = 16;
+            int nx = qMin( edge, info.naxis1), ny = qMin( edge, info.naxis2), nz = qMin( edge, info.naxis3);
+            vector<double> values;
+            QElapsedTimer timer; timer.start();
+            for( int i = 0 ; i < n ; i ++ )
+                reader.readSubcube( rand() % (info.naxis1 - nx + 1), rand() % (info.naxis2 - ny + 1),
+                                    rand() % (info.naxis3 - nz + 1), nx, ny, nz, values);
+            double ms = elapsedMs( timer);
+            double voxels = double( n) * nx * ny * nz;
+            report( QString( "CubeReader::readSubcube x %1").arg( n), ms, voxels * size, voxels);
+        }
+    } catch ( const CubeError & e) {
+        cerr << "Error: " << e.message.toStdString() << "\n";
+        return -1;
+    } catch ( const char * msg) {
+        cerr << "Error: " << msg << "\n";
+        return -1;
+    } catch ( const QString & msg) {
+        cerr << "Error: " << msg.toStdString() << "\n";
+        return -1;
+    }
+
+    if( ! keep) {
+        QDir d( dir);
+        QStringList files = d.entryList( QStringList() << "bench_*.fits");
+        for( int i = 0 ; i < files.size() ; i ++ )
+            d.remove( d.filePath( files[i]));
+        QDir().rmdir( dir);
+    }
+    return 0;
+}
@@ -0,0 +1,180 @@
+/*
+ *   Copyright 2013 Pavol Federl (federl@gmail.com)
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ *
+ */
+
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include <vector>
+#include <QDir>
+#include <QFile>
+#include <QtEndian>
+
+#include "cubegen.h"
+#include "fitsheader.h"
+
+using namespace std;
+
+// xorshift64*, plenty for noise and the same on every machine
+struct Random {
+    quint64 s;
+    Random( quint64 seed) { s = seed * Q_UINT64_C( 0x9E3779B97F4A7C15) + 1; }
+    quint64 next() {
+        s ^= s >> 12; s ^= s << 25; s ^= s >> 27;
+        return s * Q_UINT64_C( 2685821657736338717);
+    }
+    // in [0..1)
+    double uniform() { return (next() >> 11) * (1.0 / 9007199254740992.0); }
+    // roughly normal, mean 0 and sigma 1
+    double noise() { return (uniform() + uniform() + uniform() + uniform() - 2) * 1.7320508; }
+};
+
+// BLANK of the integer BITPIX (8, 16 and 32, the ones the combiner reads)
+static qint64 blankValue( int bitpix)
+{
+    if( bitpix == 8) return 255;
+    if( bitpix == 16) return -32768;
+    return -2147483647 - 1;
+}
+
+static FitsHeader syntheticHeader( const SyntheticCube & cube)
+{
+    FitsHeader header;
+    header.setLogicalValue( "SIMPLE", true, "file does conform to FITS standard");
+    header.setIntValue( "BITPIX", cube.bitpix, "number of bits per data pixel");
+    header.setIntValue( "NAXIS", 3, "number of data axes");
+    header.setIntValue( "NAXIS1", cube.naxis1);
+    header.setIntValue( "NAXIS2", cube.naxis2);
+    header.setIntValue( "NAXIS3", cube.naxis3);
+    if( cube.bitpix > 0)
+        header.setIntValue( "BLANK", blankValue( cube.bitpix));
+    header.setStringValue( "CTYPE1", "RA---CAR");
+    header.setDoubleValue( "CRVAL1", 180);
+    header.setDoubleValue( "CRPIX1", (cube.naxis1 + 1) / 2.0);
+    header.setDoubleValue( "CDELT1", -1 / 60.0);
+    header.setStringValue( "CTYPE2", "DEC--CAR");
+    header.setDoubleValue( "CRVAL2", 10);
+    header.setDoubleValue( "CRPIX2", (cube.naxis2 + 1) / 2.0);
+    header.setDoubleValue( "CDELT2", 1 / 60.0);
+    header.setStringValue( "CTYPE3", "FREQ");
+    header.setDoubleValue( "CRVAL3", cube.frameStart);
+    header.setDoubleValue( "CRPIX3", 1);
+    header.setDoubleValue( "CDELT3", cube.cdelt3);
+    header.setStringValue( "CUNIT3", "Hz");
+    header.setStringValue( "BUNIT", "K");
+    header.setDoubleValue( "EQUINOX", 2000);
+    header.addRaw( "HISTORY synthetic cube written by fitsgen");
+    header.addRaw( "END");
+    return header;
+}
+
+// one value, big-endian
+static void store( double v, int bitpix, uchar * p)
+{
+    switch( bitpix) {
+    case 8: * p = uchar( qBound( 0.0, floor( v + 0.5), 254.0)); break;
+    case 16: qToBigEndian<quint16>( quint16( qint16( qBound( -32767.0, floor( v + 0.5), 32767.0))), p); break;
+    case 32: qToBigEndian<quint32>( quint32( qint32( qBound( -2147483647.0, floor( v + 0.5), 2147483647.0))), p); break;
+    case -32: { float f = float( v); quint32 bits; memcpy( & bits, & f, 4); qToBigEndian<quint32>( bits, p); break; }
+    case -64: { quint64 bits; memcpy( & bits, & v, 8); qToBigEndian<quint64>( bits, p); break; }
+    default: throw QString( "Illegal value BITPIX = %1").arg( bitpix);
+    }
+}
+
+static void storeBlank( int bitpix, uchar * p)
+{
+    if( bitpix < 0)
+        store( numeric_limits<double>::quiet_NaN(), bitpix, p);
+    else if( bitpix == 8)
+        * p = uchar( blankValue( 8));
+    else if( bitpix == 16)
+        qToBigEndian<quint16>( quint16( blankValue( 16)), p);
+    else
+        qToBigEndian<quint32>( quint32( blankValue( 32)), p);
+}
+
+// noise, or weights around 1
+static void writeCube( const QString & fileName, const SyntheticCube & cube, bool weights)
+{
+    QFile f( fileName);
+    if( ! f.open( QFile::WriteOnly | QFile::Truncate) || ! syntheticHeader( cube).write( f))
+        throw QString( "Cannot write %1").arg( fileName);
+
+    // the noise is scaled to use a good part of the integer ranges
+    double scale = 1, offset = 0;
+    if( cube.bitpix == 8) { scale = 20; offset = 128; }
+    if( cube.bitpix == 16) { scale = 1000; }
+    if( cube.bitpix == 32) { scale = 1e6; }
+    int size = abs( cube.bitpix) / 8;
+    Random random( cube.seed);
+    qint64 planePixels = qint64( cube.naxis1) * cube.naxis2;
+    vector<uchar> plane( planePixels * size);
+    for( int z = 0 ; z < cube.naxis3 ; z ++ ) {
+        for( qint64 i = 0 ; i < planePixels ; i ++ ) {
+            uchar * p = & plane[ i * size];
+            double u = random.uniform();
+            if( u < cube.blankFraction) {
+                storeBlank( cube.bitpix, p);
+                continue;
+            }
+            double v = random.noise();
+            if( weights)
+                v = 1 + 0.2 * v;
+            // a few strong outliers, RFI
+            else if( u > 0.995)
+                v *= 5000;
+            store( offset + scale * v, cube.bitpix, p);
+        }
+        if( f.write( (const char *) & plane[0], plane.size()) != qint64( plane.size()))
+            throw QString( "Cannot write %1").arg( fileName);
+    }
+    qint64 pad = (2880 - f.pos() % 2880) % 2880;
+    if( f.write( QByteArray( int( pad), 0)) != pad || ! f.flush())
+        throw QString( "Cannot write %1").arg( fileName);
+}
+
+void writeSyntheticCube( const QString & fileName, const SyntheticCube & cube)
+{
+    if( cube.bitpix != 8 && cube.bitpix != 16 && cube.bitpix != 32 && cube.bitpix != -32 && cube.bitpix != -64)
+        throw QString( "Cannot write cubes with BITPIX = %1").arg( cube.bitpix);
+    writeCube( fileName, cube, false);
+}
+
+QStringList writeSyntheticSet( const QString & dir, const QString & prefix, const SyntheticSet & set)
+{
+    if( set.gap > 0 && set.overlap > 0)
+        throw QString( "A set of cubes can have gaps or overlaps, not both");
+    if( set.overlap >= set.cube.naxis3)
+        throw QString( "The overlap has to be smaller than NAXIS3");
+    QDir d( dir);
+    QStringList names;
+    for( int i = 0 ; i < set.files ; i ++ ) {
+        SyntheticCube cube = set.cube;
+        cube.frameStart += double( i) * (cube.naxis3 + set.gap - set.overlap) * cube.cdelt3;
+        cube.seed = set.cube.seed * 1000 + i;
+        QString name = d.filePath( QString( "%1_%2_Icube.fits").arg( prefix).arg( i, 3, 10, QChar( '0')));
+        writeSyntheticCube( name, cube);
+        names << name;
+        if( set.weights) {
+            // around 1, with the same undefined fraction
+            cube.bitpix = -32;
+            cube.seed += 500;
+            QString wname = d.filePath( QString( "%1_%2_Weightcube.fits").arg( prefix).arg( i, 3, 10, QChar( '0')));
+            writeCube( wname, cube, true);
+        }
+    }
+    return names;
+}
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <QString>
+#include <QStringList>
+
+// what a synthetic cube looks like
+struct SyntheticCube {
+    int naxis1, naxis2, naxis3;
+    int bitpix;
+    // fraction of the values that are undefined: NaN, or BLANK for integer BITPIX
+    double blankFraction;
+    // frequency of the first channel and the channel width, in Hz
+    double frameStart, cdelt3;
+    quint64 seed;
+    SyntheticCube() {
+        naxis1 = 256; naxis2 = 256; naxis3 = 64; bitpix = -32; blankFraction = 0.01;
+        frameStart = 1.4e9; cdelt3 = 1e5; seed = 1;
+    }
+};
+
+// Writes a cube of noise with the WCS cards parse() wants. About half a percent of the
+// values are far outside the default clip range, so that the clipping has work to do.
+void writeSyntheticCube( const QString & fileName, const SyntheticCube & cube);
+
+// a set of cubes that follow each other in frequency, like the pieces of a survey
+struct SyntheticSet {
+    SyntheticCube cube; // the first one, the others move along in frequency
+    int files;
+    // channels missing between neighbouring cubes, or shared by them
+    int gap, overlap;
+    // also write a Weight cube for every cube
+    bool weights;
+    SyntheticSet() { files = 4; gap = 0; overlap = 0; weights = false; }
+};
+
+// Writes the cubes of a set into dir as <prefix>_000_Icube.fits, ... and, with weights,
+// <prefix>_000_Weightcube.fits, ..., which is how the survey names them. Returns the
+// names of the (I) cubes.
+QStringList writeSyntheticSet( const QString & dir, const QString & prefix, const SyntheticSet & set);
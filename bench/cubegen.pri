@@ -0,0 +1,7 @@
+# the synthetic cube generator shared by fitsgen and cubebench, with
+# libfitscube for the rest of the combiner
+INCLUDEPATH += $$PWD/../src
+SOURCES += $$PWD/cubegen.cpp
+HEADERS += $$PWD/cubegen.h
+LIBS += -L$$OUT_PWD/../src -lfitscube
+PRE_TARGETDEPS += $$OUT_PWD/../src/libfitscube.a
@@ -0,0 +1,114 @@
+/*
+ *   Copyright 2013 Pavol Federl (federl@gmail.com)
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ *
+ */
+
+// Writes sets of synthetic FITS cubes that look like the survey's cubes (noise, NaNs or
+// BLANKs, a few outliers, WCS cards), so the combiner can be tried and timed without
+// production data. The same options and seed always give the same files.
+//
+// usage: fitsgen [options] directory
+
+#include <iostream>
+#include <cstdlib>
+#include <QDir>
+#include <QString>
+#include <QStringList>
+
+#include "cubegen.h"
+
+using namespace std;
+
+static void usage( const char * prog)
+{
+    cerr << QString( "Usage: %1 [options] directory\n"
+                     "Options:\n"
+                     "  --naxis1 n, --naxis2 n, --naxis3 n  size of each cube (default 256 256 64)\n"
+                     "  --bitpix b      8, 16, 32, -32 (default) or -64\n"
+                     "  --blank f       fraction of NaN/BLANK values (default 0.01)\n"
+                     "  --files n       number of cubes (default 4)\n"
+                     "  --gap n         channels missing between neighbouring cubes\n"
+                     "  --overlap n     channels shared by neighbouring cubes\n"
+                     "  --weights       also write a *_Weightcube.fits for every cube\n"
+                     "  --start hz      frequency of the first channel (default 1.4e9)\n"
+                     "  --cdelt3 hz     channel width (default 1e5)\n"
+                     "  --seed n        random seed (default 1)\n"
+                     "  --prefix name   file names are <prefix>_000_Icube.fits, ... (default synth)\n")
+            .arg( prog).toStdString();
+    exit( -1);
+}
+
+static double number( int argc, char ** argv, int & i)
+{
+    if( i + 1 >= argc)
+        usage( argv[0]);
+    bool ok;
+    double val = QString( argv[++ i]).toDouble( & ok);
+    if( ! ok) {
+        cerr << "*** ERROR *** option " << argv[i - 1] << " needs a number.\n";
+        usage( argv[0]);
+    }
+    return val;
+}
+
+int main( int argc, char ** argv)
+{
+    SyntheticSet set;
+    QString prefix = "synth", dir;
+    for( int i = 1 ; i < argc ; i ++ ) {
+        QString arg = argv[i];
+        if( ! arg.startsWith( "--")) {
+            if( ! dir.isEmpty())
+                usage( argv[0]);
+            dir = arg;
+        }
+        else if( arg == "--naxis1") set.cube.naxis1 = int( number( argc, argv, i));
+        else if( arg == "--naxis2") set.cube.naxis2 = int( number( argc, argv, i));
+        else if( arg == "--naxis3") set.cube.naxis3 = int( number( argc, argv, i));
+        else if( arg == "--bitpix") set.cube.bitpix = int( number( argc, argv, i));
+        else if( arg == "--blank") set.cube.blankFraction = number( argc, argv, i);
+        else if( arg == "--start") set.cube.frameStart = number( argc, argv, i);
+        else if( arg == "--cdelt3") set.cube.cdelt3 = number( argc, argv, i);
+        else if( arg == "--seed") set.cube.seed = quint64( number( argc, argv, i));
+        else if( arg == "--files") set.files = int( number( argc, argv, i));
+        else if( arg == "--gap") set.gap = int( number( argc, argv, i));
+        else if( arg == "--overlap") set.overlap = int( number( argc, argv, i));
+        else if( arg == "--weights") set.weights = true;
+        else if( arg == "--prefix" && i + 1 < argc) prefix = argv[++ i];
+        else {
+            cerr << "*** ERROR *** unknown option " << arg.toStdString() << "\n";
+            usage( argv[0]);
+        }
+    }
+    if( dir.isEmpty())
+        usage( argv[0]);
+    if( set.cube.naxis1 < 1 || set.cube.naxis2 < 1 || set.cube.naxis3 < 1 || set.files < 1
+            || set.gap < 0 || set.overlap < 0) {
+        cerr << "*** ERROR *** the sizes have to be positive.\n";
+        exit( -1);
+    }
+
+    try {
+        if( ! QDir().mkpath( dir))
+            throw QString( "Cannot create %1").arg( dir);
+        QStringList names = writeSyntheticSet( dir, prefix, set);
+        for( int i = 0 ; i < names.size() ; i ++ )
+            cout << names[i].toStdString() << "\n";
+    } catch ( const QString & msg) {
+        cerr << "Error: " << msg.toStdString() << "\n";
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,128 @@
+/*
+ *   Copyright 2013 Pavol Federl (federl@gmail.com)
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ *
+ */
+
+// Microbenchmark of the FITS header parser: parses headers with a growing number of
+// HISTORY cards and does the lookups that extractor.cpp's parse() does, once with the
+// indexed FitsHeader and once with the old (linear, QString based) implementation.
+//
+// usage: headerbench [number of repetitions]
+
+#include <iostream>
+#include <cstdlib>
+#include <QByteArray>
+#include <QString>
+#include <QElapsedTimer>
+
+#include "fitsheader.h"
+#include "legacyheader.h"
+
+using namespace std;
+
+static void addCard( QByteArray & block, const QString & card)
+{
+    block.append( (card + QString( 80, ' ')).left( 80).toLatin1());
+}
+
+// a GALFACTS-like cube header with nHistory HISTORY cards between the axes and the rest
+static QByteArray makeHeader( int nHistory)
+{
+    QByteArray block;
+    addCard( block, "SIMPLE  =                    T / conforms to FITS standard");
+    addCard( block, "BITPIX  =                  -32 / array data type");
+    addCard( block, "NAXIS   =                    3 / number of array dimensions");
+    addCard( block, "NAXIS1  =                  512");
+    addCard( block, "NAXIS2  =                  512");
+    addCard( block, "NAXIS3  =                 1024");
+    for( int i = 0 ; i < nHistory ; i ++ )
+        addCard( block, QString( "HISTORY step %1 of the reduction, with a 'quote' in it").arg( i));
+    addCard( block, "CTYPE1  = 'RA---CAR'");
+    addCard( block, "CTYPE2  = 'DEC--CAR'");
+    addCard( block, "CTYPE3  = 'FREQ    '");
+    addCard( block, "CRVAL1  =        180.000000000 / reference value");
+    addCard( block, "CRVAL2  =        0.00000000000");
+    addCard( block, "CRVAL3  =    1299.865478515625");
+    addCard( block, "CDELT1  =   -0.016666666666667");
+    addCard( block, "CDELT2  =    0.016666666666667");
+    addCard( block, "CDELT3  =   0.4205322265625000");
+    addCard( block, "CRPIX1  =                  1.0");
+    addCard( block, "CRPIX2  =                  1.0");
+    addCard( block, "CRPIX3  =                  1.0");
+    addCard( block, "CUNIT3  = 'MHz     '");
+    addCard( block, "BUNIT   = 'K       '           / brightness unit");
+    addCard( block, "EQUINOX =               2000.0");
+    addCard( block, "END");
+    while( block.size() % 2880)
+        block.append( ' ');
+    return block;
+}
+
+// the lookups extractor.cpp does for every input file
+static const char * intKeys[] = { "BITPIX", "NAXIS", "NAXIS1", "NAXIS2", "NAXIS3", "BLANK", 0 };
+static const char * doubleKeys[] = {
+    "BZERO", "BSCALE", "CRVAL1", "CRVAL2", "CRVAL3", "CDELT1", "CDELT2", "CDELT3",
+    "CRPIX1", "CRPIX2", "CRPIX3", "EQUINOX", 0 };
+static const char * stringKeys[] = { "SIMPLE", "CTYPE1", "CTYPE2", "CTYPE3", "CUNIT3", "BUNIT", 0 };
+
+// the sum only keeps the compiler from throwing the work away
+template< class Header>
+static double lookups( Header & hdr)
+{
+    double sum = 0;
+    for( int i = 0 ; intKeys[i] ; i ++ )
+        sum += hdr.intValue( intKeys[i], 0);
+    for( int i = 0 ; doubleKeys[i] ; i ++ )
+        sum += hdr.doubleValue( doubleKeys[i], 0);
+    for( int i = 0 ; stringKeys[i] ; i ++ )
+        sum += hdr.stringValue( stringKeys[i], "''").size();
+    return sum;
+}
+
+int main( int argc, char ** argv)
+{
+    int reps = argc > 1 ? atoi( argv[1]) : 20;
+    if( reps < 1) reps = 1;
+
+    cout << "  history   cards    legacy [us]     indexed [us]   speedup\n";
+    int sizes[] = { 0, 100, 1000, 10000 };
+    for( int s = 0 ; s < 4 ; s ++ ) {
+        QByteArray data = makeHeader( sizes[s]);
+        double check1 = 0, check2 = 0;
+
+        QElapsedTimer timer; timer.start();
+        for( int r = 0 ; r < reps ; r ++ ) {
+            LegacyFitsHeader hdr = LegacyFitsHeader::parse( data.constData(), data.size());
+            check1 += lookups( hdr);
+        }
+        double legacy = timer.nsecsElapsed() / 1000.0 / reps;
+
+        timer.restart();
+        for( int r = 0 ; r < reps ; r ++ ) {
+            FitsHeader hdr = FitsHeader::parse( data.constData(), data.size());
+            check2 += lookups( hdr);
+        }
+        double indexed = timer.nsecsElapsed() / 1000.0 / reps;
+
+        if( check1 != check2) {
+            cerr << "Error: the two parsers disagree on " << sizes[s] << " HISTORY cards.\n";
+            return -1;
+        }
+        cout << QString( "%1 %2 %3 %4 %5x\n").arg( sizes[s], 9).arg( data.size() / 80, 7)
+                .arg( legacy, 14, 'f', 1).arg( indexed, 16, 'f', 1)
+                .arg( legacy / indexed, 9, 'f', 1).toStdString();
+    }
+    return 0;
+}
@@ -0,0 +1,97 @@
+#pragma once
+
+// The header parser as it was before the cards were indexed, kept only so that
+// headerbench can compare against it. Do not use it for anything else.
+
+#include <vector>
+#include <QString>
+#include <QVariant>
+
+struct LegacyFitsLine {
+    LegacyFitsLine( const QString & rawLine ) {
+        _raw = rawLine;
+    }
+    QString raw() { return _raw; }
+    QString key() { QString k, v, c; parse( k, v, c); return k; }
+    QString value() { QString k, v, c; parse( k, v, c); return v; }
+    QString comment() { QString k, v, c; parse( k, v, c); return c; }
+    // parse the line into key/value/comment
+    void parse( QString & key, QString & value, QString & comment ) {
+        key = _raw.left(8).trimmed();
+        value = comment = QString();
+        if( _raw.mid( 8, 2).trimmed() != "=") return;
+        int vStart = 10, vEnd = -1;
+        while( _raw[vStart].isSpace()) { vStart ++; if( vStart >= 80) { vStart = -1; break; }}
+        if( vStart == -1)
+            return;
+        if( _raw[vStart] != '\'') {
+            vEnd = _raw.indexOf( '/', vStart + 1); if( vEnd != -1) vEnd --; else vEnd = 79;
+        } else {
+            QString tmp = _raw; for(int i=0;i<=vStart;i++){tmp[i]=' ';} tmp.replace( "''", "..");
+            vEnd = tmp.indexOf( '\'', vStart + 1);
+            if( vEnd == -1)
+                throw QString( "Unterminated string in header for %1").arg(key);
+        }
+        value = _raw.mid( vStart, vEnd - vStart + 1).trimmed();
+        comment = _raw.mid( vEnd + 1).trimmed();
+        if( ! comment.isEmpty()) {
+            if( comment[0] != '/')
+                throw ("Syntax error in header: " + _raw.trimmed());
+            else
+                comment.remove(0,1);
+        }
+    }
+
+protected:
+    QString _raw;
+};
+
+struct LegacyFitsHeader
+{
+    // same as the old parse( QFile &), minus the reading
+    static LegacyFitsHeader parse( const char * data, qint64 size ) {
+        LegacyFitsHeader hdr;
+        for( qint64 pos = 0 ; pos + 80 <= size ; pos += 80 ) {
+            char line[80];
+            for( int i = 0 ; i < 80 ; i ++ )
+                line[i] = (data[pos+i] < 32 || data[pos+i] > 126) ? ' ' : data[pos+i];
+            QString rawLine = QByteArray( line, 80);
+            hdr._lines.push_back( rawLine);
+            if( rawLine.startsWith( "END     " ))
+                break;
+        }
+        return hdr;
+    }
+    int findLine( const QString & key ) {
+        for( size_t i = 0 ; i < _lines.size() ; i ++ )
+            if( _lines[i].key() == key )
+                return i;
+        return -1;
+    }
+    QVariant getValue( const QString & key, QVariant defaultValue = QVariant()) {
+        int ind = findLine( key);
+        if( ind < 0 )
+            return defaultValue;
+        return QVariant( _lines[ind].value());
+    }
+    int intValue( const QString & key, int defaultValue) {
+        QVariant value = getValue( key);
+        if( ! value.isValid())
+            return defaultValue;
+        return value.toInt();
+    }
+    double doubleValue( const QString & key, double defaultValue) {
+        QVariant value = getValue( key);
+        if( ! value.isValid())
+            return defaultValue;
+        return value.toDouble();
+    }
+    QString stringValue( const QString & key, const QString & defaultValue) {
+        QVariant value = getValue( key);
+        if( ! value.isValid())
+            return defaultValue;
+        return value.toString();
+    }
+
+    std::vector< LegacyFitsLine > _lines;
+};
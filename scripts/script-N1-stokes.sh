@@ -0,0 +1 @@
+./FitsCubeCombine --stokes '/export/ras/cyberska/data/galfacts-run1/cube%s.fits' '/export/ras/processed/FIELD1/run5/band0/N1_cubes/GALFACT_FIELD1_*_%Scube.fits'
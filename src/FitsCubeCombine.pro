@@ -6,6 +6,9 @@ TARGET = FitsCubeCombine
 CONFIG += console
 CONFIG -= app_bundle
 TEMPLATE = app
-SOURCES += main.cpp \
-    extractor.cpp
-HEADERS += extractor.h
+SOURCES += main.cpp
+# the combiner itself is libfitscube, built next to this by FitsCubeLib.pro
+LIBS += -L$$OUT_PWD -lfitscube
+PRE_TARGETDEPS += $$OUT_PWD/libfitscube.a
+HEADERS += extractor.h \
+    journal.h
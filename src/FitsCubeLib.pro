@@ -0,0 +1,53 @@
+# -------------------------------------------------
+# The combiner as a static library (libfitscube), for programs that
+# use fitscube.h instead of running FitsCubeCombine
+# -------------------------------------------------
+QT -= gui
+TARGET = fitscube
+CONFIG += staticlib
+TEMPLATE = lib
+SOURCES += extractor.cpp \
+    fitsheader.cpp \
+    pipeline.cpp \
+    clipkernels.cpp \
+    fileio.cpp \
+    asyncio.cpp \
+    bufferpool.cpp \
+    journal.cpp \
+    checksum.cpp \
+    transpose.cpp \
+    tilecompress.cpp \
+    cubereader.cpp \
+    convert.cpp \
+    stats.cpp \
+    preview.cpp \
+    overlap.cpp \
+    metrics.cpp \
+    cubewriter.cpp \
+    cubestage.cpp \
+    mosaic.cpp \
+    virtualcube.cpp \
+    fitscube.cpp
+HEADERS += extractor.h \
+    fitsheader.h \
+    pipeline.h \
+    clipkernels.h \
+    fileio.h \
+    asyncio.h \
+    bufferpool.h \
+    journal.h \
+    checksum.h \
+    transpose.h \
+    tilecompress.h \
+    cubereader.h \
+    convert.h \
+    stats.h \
+    preview.h \
+    overlap.h \
+    metrics.h \
+    cubewriter.h \
+    cubestage.h \
+    mosaic.h \
+    virtualcube.h \
+    fitscube.h \
+    fitspixel.h
@@ -0,0 +1,366 @@
+/*
+ *   Copyright 2013 Pavol Federl (federl@gmail.com)
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ *
+ */
+
+#include <cerrno>
+#include <cstring>
+
+#include <unistd.h>
+
+#include <QMutex>
+#include <QThread>
+#include <QWaitCondition>
+
+#include "asyncio.h"
+#include "fileio.h"
+#include "metrics.h"
+
+#ifdef Q_OS_LINUX
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#if defined( __NR_io_uring_setup) && defined( __has_include)
+#if __has_include( <linux/io_uring.h>)
+#include <linux/io_uring.h>
+#define HAVE_IO_URING
+#endif
+#endif
+#endif
+
+using namespace std;
+
+const qint64 AsyncReader::PieceSize;
+
+// the thread pool does not grow beyond this, whatever the depth
+static const int MaxIoThreads = 64;
+
+// where the pieces go to be read
+class IoQueue {
+public:
+    virtual ~IoQueue() {}
+    virtual const char * name() const = 0;
+    // starts the read of the rest of the piece (iov at offset + done); may wait for the
+    // next complete() to actually go out
+    virtual void submit( IoPiece * piece) = 0;
+    // blocks until a piece is back, with its result set
+    virtual IoPiece * complete() = 0;
+};
+
+// A pool of threads, each doing one pread at a time.
+class ThreadQueue : public IoQueue {
+public:
+    ThreadQueue( int threads) {
+        _stop = false;
+        for( int i = 0 ; i < threads ; i ++ ) {
+            _threads.push_back( new Worker( this));
+            _threads.back()-> start();
+        }
+    }
+    ~ThreadQueue() {
+        {
+            QMutexLocker locker( & _mutex);
+            _stop = true;
+            _work.wakeAll();
+        }
+        for( size_t i = 0 ; i < _threads.size() ; i ++ ) {
+            _threads[i]-> wait();
+            delete _threads[i];
+        }
+    }
+    const char * name() const { return "threads"; }
+    void submit( IoPiece * piece) {
+        QMutexLocker locker( & _mutex);
+        _todo.push_back( piece);
+        _work.wakeOne();
+    }
+    IoPiece * complete() {
+        QMutexLocker locker( & _mutex);
+        while( _finished.empty())
+            _done.wait( & _mutex);
+        IoPiece * piece = _finished.front();
+        _finished.pop_front();
+        return piece;
+    }
+    void work() {
+        while( true) {
+            IoPiece * piece;
+            {
+                QMutexLocker locker( & _mutex);
+                while( _todo.empty() && ! _stop)
+                    _work.wait( & _mutex);
+                if( _todo.empty())
+                    return;
+                piece = _todo.front();
+                _todo.pop_front();
+            }
+            ssize_t n = pread( piece-> fd, piece-> iov.iov_base, piece-> iov.iov_len, piece-> offset + piece-> done);
+            piece-> result = n < 0 ? - errno : n;
+            QMutexLocker locker( & _mutex);
+            _finished.push_back( piece);
+            _done.wakeOne();
+        }
+    }
+protected:
+    class Worker : public QThread {
+    public:
+        Worker( ThreadQueue * queue) { _queue = queue; }
+    protected:
+        void run() { _queue-> work(); }
+        ThreadQueue * _queue;
+    };
+    std::vector<Worker *> _threads;
+    std::deque<IoPiece *> _todo, _finished;
+    QMutex _mutex;
+    QWaitCondition _work, _done;
+    bool _stop;
+};
+
+#ifdef HAVE_IO_URING
+
+// io_uring through the raw system calls: a submission ring the pieces are put into as
+// readv requests, handed to the kernel in one io_uring_enter() when we wait, and a
+// completion ring the results come back in. Both rings are shared memory, the kernel reads
+// the tail of the one and writes the tail of the other, hence the acquire/release.
+class UringQueue : public IoQueue {
+public:
+    UringQueue() { _fd = -1; _sq = _cq = _sqes = MAP_FAILED; _sqSize = _cqSize = _sqesSize = 0; _unsubmitted = 0; }
+    ~UringQueue() {
+        if( _sqes != MAP_FAILED) munmap( _sqes, _sqesSize);
+        if( _cq != MAP_FAILED && _cq != _sq) munmap( _cq, _cqSize);
+        if( _sq != MAP_FAILED) munmap( _sq, _sqSize);
+        if( _fd >= 0) ::close( _fd);
+    }
+    // false if the kernel does not have io_uring (or it is turned off)
+    bool setup( int entries) {
+        struct io_uring_params p;
+        memset( & p, 0, sizeof( p));
+        _fd = int( syscall( __NR_io_uring_setup, unsigned( entries), & p));
+        if( _fd < 0)
+            return false;
+        _sqSize = p.sq_off.array + p.sq_entries * sizeof( unsigned);
+        _cqSize = p.cq_off.cqes + p.cq_entries * sizeof( struct io_uring_cqe);
+        // the newer kernels (5.4) map both rings in one go, older headers do not know it
+        bool single = false;
+#ifdef IORING_FEAT_SINGLE_MMAP
+        single = p.features & IORING_FEAT_SINGLE_MMAP;
+#endif
+        if( single)
+            _sqSize = _cqSize = qMax( _sqSize, _cqSize);
+        _sq = mmap( 0, _sqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _fd, IORING_OFF_SQ_RING);
+        if( _sq == MAP_FAILED)
+            return false;
+        _cq = single ? _sq : mmap( 0, _cqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _fd, IORING_OFF_CQ_RING);
+        if( _cq == MAP_FAILED)
+            return false;
+        _sqesSize = p.sq_entries * sizeof( struct io_uring_sqe);
+        _sqes = mmap( 0, _sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _fd, IORING_OFF_SQES);
+        if( _sqes == MAP_FAILED)
+            return false;
+        char * sq = (char *) _sq, * cq = (char *) _cq;
+        _sqTail = (unsigned *) (sq + p.sq_off.tail);
+        _sqMask = * (unsigned *) (sq + p.sq_off.ring_mask);
+        _sqArray = (unsigned *) (sq + p.sq_off.array);
+        _cqHead = (unsigned *) (cq + p.cq_off.head);
+        _cqTail = (unsigned *) (cq + p.cq_off.tail);
+        _cqMask = * (unsigned *) (cq + p.cq_off.ring_mask);
+        _cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+        return true;
+    }
+    const char * name() const { return "io_uring"; }
+    // there are never more pieces in flight than entries, so the ring cannot be full
+    void submit( IoPiece * piece) {
+        unsigned tail = * _sqTail;
+        unsigned index = tail & _sqMask;
+        struct io_uring_sqe * sqe = (struct io_uring_sqe *) _sqes + index;
+        memset( sqe, 0, sizeof( * sqe));
+        // readv rather than read, it is in every kernel with io_uring
+        sqe-> opcode = IORING_OP_READV;
+        sqe-> fd = piece-> fd;
+        sqe-> off = quint64( piece-> offset + piece-> done);
+        sqe-> addr = quint64( (quintptr) & piece-> iov);
+        sqe-> len = 1;
+        sqe-> user_data = quint64( (quintptr) piece);
+        _sqArray[ index] = index;
+        __atomic_store_n( _sqTail, tail + 1, __ATOMIC_RELEASE);
+        _unsubmitted ++;
+    }
+    IoPiece * complete() {
+        while( true) {
+            unsigned head = * _cqHead;
+            if( head != __atomic_load_n( _cqTail, __ATOMIC_ACQUIRE)) {
+                struct io_uring_cqe * cqe = _cqes + (head & _cqMask);
+                IoPiece * piece = (IoPiece *) (quintptr) cqe-> user_data;
+                piece-> result = cqe-> res;
+                __atomic_store_n( _cqHead, head + 1, __ATOMIC_RELEASE);
+                return piece;
+            }
+            // submits what is queued and sleeps until something comes back
+            int n = int( syscall( __NR_io_uring_enter, _fd, _unsubmitted, 1u, IORING_ENTER_GETEVENTS, (void *) 0, 0));
+            if( n < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY)
+                throw QString( "io_uring_enter failed: %1").arg( strerror( errno));
+            if( n > 0)
+                _unsubmitted -= qMin( unsigned( n), _unsubmitted);
+        }
+    }
+protected:
+    int _fd;
+    void * _sq, * _cq, * _sqes;
+    size_t _sqSize, _cqSize, _sqesSize;
+    unsigned * _sqTail, * _sqArray, _sqMask;
+    unsigned * _cqHead, * _cqTail, _cqMask;
+    struct io_uring_cqe * _cqes;
+    unsigned _unsubmitted;
+};
+
+#endif
+
+AsyncReader::AsyncReader( int depth, bool threads)
+{
+    _depth = qMax( 1, depth);
+    _metrics = 0;
+    _queue = 0;
+#ifdef HAVE_IO_URING
+    if( ! threads) {
+        UringQueue * uring = new UringQueue;
+        if( uring-> setup( _depth))
+            _queue = uring;
+        else
+            delete uring;
+    }
+#else
+    Q_UNUSED( threads);
+#endif
+    if( ! _queue)
+        _queue = new ThreadQueue( qMin( _depth, MaxIoThreads));
+    _slots.resize( _depth);
+    for( int i = 0 ; i < _depth ; i ++ )
+        _freeSlots.push_back( & _slots[i]);
+}
+
+AsyncReader::~AsyncReader()
+{
+    try {
+        drain();
+    } catch ( ... ) {
+    }
+    delete _queue;
+}
+
+const char * AsyncReader::backend() const
+{
+    return _queue-> name();
+}
+
+void AsyncReader::submit( int fd, char * buff, qint64 offset, qint64 size, qint64 need, qint64 tag,
+                          const QString & name)
+{
+    Request & req = _requests[ tag];
+    req.needEnd = offset + need;
+    req.pieces = 0;
+    req.name = name;
+    // the pieces end on PieceSize boundaries of the file, so they stay aligned whatever
+    // the offset of the read
+    for( qint64 pos = offset ; pos < offset + size ; ) {
+        qint64 end = qMin( offset + size, (pos / PieceSize + 1) * PieceSize);
+        IoPiece piece;
+        piece.fd = fd;
+        piece.offset = pos;
+        piece.size = end - pos;
+        piece.done = 0;
+        piece.result = 0;
+        piece.tag = tag;
+        piece.started = 0;
+        piece.iov.iov_base = buff + (pos - offset);
+        piece.iov.iov_len = size_t( piece.size);
+        _waiting.push_back( piece);
+        req.pieces ++;
+        pos = end;
+    }
+    if( req.pieces == 0)
+        _done.push_back( tag);
+    startPieces();
+}
+
+void AsyncReader::startPieces()
+{
+    while( ! _waiting.empty() && ! _freeSlots.empty()) {
+        IoPiece * slot = _freeSlots.back();
+        _freeSlots.pop_back();
+        * slot = _waiting.front();
+        _waiting.pop_front();
+        slot-> started = _metrics ? Metrics::now() : 0;
+        _queue-> submit( slot);
+    }
+}
+
+bool AsyncReader::finishPiece( IoPiece * piece)
+{
+    Request & req = _requests[ piece-> tag];
+    if( piece-> result == -EINTR || piece-> result == -EAGAIN) {
+        _queue-> submit( piece);
+        return false;
+    }
+    if( _metrics)
+        _metrics-> addLatency( OpRead, Metrics::now() - piece-> started, qMax( qint64( 0), piece-> result));
+    if( piece-> result > 0) {
+        piece-> done += piece-> result;
+        piece-> iov.iov_base = (char *) piece-> iov.iov_base + piece-> result;
+        piece-> iov.iov_len -= size_t( piece-> result);
+        // a short read goes on from where it stopped
+        if( piece-> done < piece-> size) {
+            piece-> started = _metrics ? Metrics::now() : 0;
+            _queue-> submit( piece);
+            return false;
+        }
+    }
+    else if( piece-> result < 0 && req.error.isEmpty())
+        req.error = strerror( int( - piece-> result));
+    // the end of the file, fine if the data the read needs is there
+    else if( piece-> result == 0 && piece-> offset + piece-> done < req.needEnd && req.error.isEmpty())
+        req.error = "unexpected end of file";
+    _freeSlots.push_back( piece);
+    return -- req.pieces == 0;
+}
+
+qint64 AsyncReader::wait()
+{
+    while( _done.empty()) {
+        if( _freeSlots.size() == _slots.size() && _waiting.empty())
+            throw QString( "AsyncReader::wait() without a read");
+        IoPiece * piece = _queue-> complete();
+        qint64 tag = piece-> tag;
+        if( finishPiece( piece))
+            _done.push_back( tag);
+        startPieces();
+    }
+    qint64 tag = _done.front();
+    _done.pop_front();
+    Request req = _requests[ tag];
+    _requests.erase( tag);
+    if( ! req.error.isEmpty())
+        throw QString( "Failed to read from: %1 (%2)").arg( req.name).arg( req.error);
+    return tag;
+}
+
+void AsyncReader::drain()
+{
+    _waiting.clear();
+    while( _freeSlots.size() < _slots.size()) {
+        IoPiece * piece = _queue-> complete();
+        _freeSlots.push_back( piece);
+    }
+    _requests.clear();
+    _done.clear();
+}
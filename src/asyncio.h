@@ -0,0 +1,83 @@
+#pragma once
+
+#include <deque>
+#include <map>
+#include <vector>
+#include <QString>
+#include <QtGlobal>
+#include <sys/uio.h>
+
+class Metrics;
+class IoQueue;
+
+// one piece of a read, what goes to the kernel (or to a thread) as one request
+struct IoPiece {
+    int fd;
+    qint64 offset, size;
+    qint64 done;    // bytes read so far, a short read is continued
+    qint64 result;  // of the last call: bytes read, 0 at the end of the file or -errno
+    qint64 tag;     // of the read the piece belongs to
+    qint64 started; // Metrics::now() at the submission, for the latency
+    struct iovec iov; // what is left to read, for io_uring
+};
+
+// Keeps many reads in flight at once, so NVMe arrays and parallel filesystems see a deep
+// queue instead of one pread after another. Every read is cut into aligned pieces of
+// PieceSize that go to the kernel on their own; the read is done when all of its pieces
+// are. The pieces go through io_uring where the kernel has it (5.1 and later, talked to
+// with the raw system calls, there is no liburing), and through a pool of threads doing
+// preads everywhere else.
+//
+// One thread submits and waits, the reader is not thread safe.
+class AsyncReader {
+public:
+    // size of the pieces, a multiple of IoAlignment so O_DIRECT reads stay aligned
+    static const qint64 PieceSize = 1024 * 1024;
+
+    // depth is the most pieces in flight at once; threads picks the thread pool even if
+    // io_uring is there (to compare them)
+    AsyncReader( int depth, bool threads = false);
+    // waits for the pieces still in flight, the buffers may be reused after this
+    ~AsyncReader();
+
+    // "io_uring" or "threads"
+    const char * backend() const;
+    // the latency of every piece goes to the metrics
+    void setMetrics( Metrics * metrics) { _metrics = metrics; }
+
+    // starts reading size bytes of fd at offset into buff. The read is good once the first
+    // need bytes are there, an O_DIRECT read rounded out past the end of the file comes back
+    // short. The tag is what wait() returns for it, name is for the error message.
+    void submit( int fd, char * buff, qint64 offset, qint64 size, qint64 need, qint64 tag,
+                 const QString & name);
+    // reads submitted and not returned by wait() yet
+    int pending() const { return int( _requests.size()); }
+    // blocks until one of the reads is done and returns its tag; they finish in any order;
+    // throws QString if the read failed
+    qint64 wait();
+    // forgets all the reads, after waiting for the pieces that are in flight
+    void drain();
+
+protected:
+    // one read, as submitted
+    struct Request {
+        qint64 needEnd; // file offset up to which the data has to be there
+        int pieces;     // pieces not finished yet
+        QString name, error;
+    };
+    // hands queued pieces to the backend while there are free slots
+    void startPieces();
+    // one piece came back, true if its read is now done
+    bool finishPiece( IoPiece * piece);
+
+    IoQueue * _queue;
+    int _depth;
+    // the pieces in flight are in slots that stay put, the kernel has pointers into them
+    std::vector<IoPiece> _slots;
+    std::vector<IoPiece *> _freeSlots;
+    std::deque<IoPiece> _waiting;
+    std::map<qint64, Request> _requests;
+    // tags of the reads that are done
+    std::deque<qint64> _done;
+    Metrics * _metrics;
+};
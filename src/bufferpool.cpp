@@ -0,0 +1,104 @@
+/*
+ *   Copyright 2013 Pavol Federl (federl@gmail.com)
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ *
+ */
+
+#include <cstring>
+#include <cerrno>
+
+#include <sys/mman.h>
+
+#include <QString>
+
+#include "bufferpool.h"
+#include "fileio.h"
+#include "extractor.h"
+
+using namespace std;
+
+// we aim for TargetBuffers buffers, so that every stage has some to work with, of no more
+// than MaxBufferSize each (including the slack), since smaller buffers go through the
+// pipeline more smoothly; large budgets get more buffers instead of larger ones
+static const int MinBuffers = 4;
+static const int TargetBuffers = 16;
+static const qint64 MinBufferSize = 1024 * 1024;
+static const qint64 MaxBufferSize = 64 * 1024 * 1024;
+static const qint64 HugePageSize = 2 * 1024 * 1024;
+
+BufferPool::BufferPool( qint64 budget, bool hugePages)
+{
+    // each buffer also needs the room to round an O_DIRECT read out to whole blocks
+    qint64 slack = 2 * IoAlignment;
+    qint64 stride = budget / TargetBuffers;
+    if( stride > MaxBufferSize) stride = MaxBufferSize;
+    if( stride < MinBufferSize) stride = MinBufferSize;
+    stride = stride / IoAlignment * IoAlignment;
+    _bufferSize = stride - slack;
+    _count = int( budget / stride);
+    if( _count < MinBuffers)
+        throw QString( "Memory budget of %1 is too small, at least %2 is needed.")
+            .arg( formatBytes( budget)).arg( formatBytes( MinBuffers * stride));
+    _arenaSize = _count * stride;
+
+    // one mapping for everything; huge pages save the TLB misses when the buffers are
+    // streamed through, but they have to be reserved by the admin (vm.nr_hugepages)
+    void * ptr = MAP_FAILED;
+#ifdef MAP_HUGETLB
+    if( hugePages) {
+        qint64 size = (_arenaSize + HugePageSize - 1) / HugePageSize * HugePageSize;
+        ptr = mmap( 0, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if( ptr != MAP_FAILED)
+            _arenaSize = size;
+        else
+            _hugePagesError = strerror( errno);
+    }
+#endif
+    if( ptr == MAP_FAILED) {
+        ptr = mmap( 0, _arenaSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if( ptr == MAP_FAILED)
+            throw QString( "Could not allocate %1 for the buffers: %2")
+                .arg( formatBytes( _arenaSize)).arg( strerror( errno));
+#ifdef MADV_HUGEPAGE
+        if( hugePages)
+            madvise( ptr, _arenaSize, MADV_HUGEPAGE);
+#endif
+    }
+    _arena = (char *) ptr;
+    for( int i = _count - 1 ; i >= 0 ; i -- )
+        _free.push_back( _arena + i * stride);
+}
+
+BufferPool::~BufferPool()
+{
+    munmap( _arena, _arenaSize);
+}
+
+char * BufferPool::acquire()
+{
+    QMutexLocker locker( & _mutex);
+    while( _free.empty())
+        _cond.wait( & _mutex);
+    char * buff = _free.back();
+    _free.pop_back();
+    return buff;
+}
+
+void BufferPool::release( char * buff)
+{
+    if( ! buff) return;
+    QMutexLocker locker( & _mutex);
+    _free.push_back( buff);
+    _cond.wakeOne();
+}
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <vector>
+#include <QMutex>
+#include <QWaitCondition>
+#include <QString>
+#include <QtGlobal>
+
+// A fixed number of equally sized buffers cut out of one allocation, sized by the memory
+// budget (--memory). All the stages that move data take their buffers from here, so the
+// memory used for the data does not grow beyond the budget no matter how many files,
+// outputs or threads there are.
+//
+// The buffers are aligned for O_DIRECT and have the extra room DataReader::read() needs.
+class BufferPool {
+public:
+    // throws QString if the memory cannot be had or the budget is too small
+    BufferPool( qint64 budget, bool hugePages = false);
+    ~BufferPool();
+
+    // blocks until a buffer is free
+    char * acquire();
+    void release( char * buff);
+
+    // total number of buffers, and how much data each of them can take
+    int count() const { return _count; }
+    qint64 bufferSize() const { return _bufferSize; }
+    // why there are no huge pages although they were asked for, empty if there are
+    const QString & hugePagesError() const { return _hugePagesError; }
+
+protected:
+    char * _arena;
+    qint64 _arenaSize;
+    qint64 _bufferSize;
+    int _count;
+    QString _hugePagesError;
+    std::vector<char *> _free;
+    QMutex _mutex;
+    QWaitCondition _cond;
+};
@@ -0,0 +1,227 @@
+/*
+ *   Copyright 2013 Pavol Federl (federl@gmail.com)
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ *
+ */
+
+#include <QtEndian>
+#include <QThread>
+#include <QThreadPool>
+#include <QRunnable>
+#include <QSemaphore>
+
+#include "checksum.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define SUM_HAVE_X86 1
+#include <immintrin.h>
+#endif
+
+// The kernels add the words into 64-bit accumulators and fold the carries back in at the
+// end, which gives the same result as adding with an end-around carry after every word.
+// 2^32 words fit before a 64-bit accumulator could overflow, far more than any buffer.
+
+static quint32 fold( quint64 sum)
+{
+    while( sum >> 32)
+        sum = (sum & 0xffffffffu) + (sum >> 32);
+    return quint32( sum);
+}
+
+// plain C++ version, also used for the tails the vector versions leave behind
+static quint64 sumScalar( const char * buff, qint64 n)
+{
+    quint64 sum = 0;
+    qint64 i = 0;
+    for( ; i + 4 <= n ; i += 4)
+        sum += qFromBigEndian<quint32>( (const uchar *) buff + i);
+    if( i < n) {
+        uchar last[4] = { 0, 0, 0, 0 };
+        for( int j = 0 ; i + j < n ; j ++ )
+            last[j] = buff[i + j];
+        sum += qFromBigEndian<quint32>( last);
+    }
+    return sum;
+}
+
+#ifdef SUM_HAVE_X86
+
+__attribute__((target("sse2")))
+static quint64 sumSSE2( const char * buff, qint64 n)
+{
+    const __m128i low = _mm_set1_epi64x( 0xffffffff);
+    __m128i acc = _mm_setzero_si128();
+    qint64 i = 0;
+    for( ; i + 16 <= n ; i += 16) {
+        __m128i v = _mm_loadu_si128( (const __m128i *) (buff + i));
+        // SSE2 has no byte shuffle: swap the bytes in each 16-bit word, then the words
+        v = _mm_or_si128( _mm_slli_epi16( v, 8), _mm_srli_epi16( v, 8));
+        v = _mm_shufflehi_epi16( _mm_shufflelo_epi16( v, 0xb1), 0xb1);
+        // widen the even and odd words into the 64-bit lanes
+        acc = _mm_add_epi64( acc, _mm_and_si128( v, low));
+        acc = _mm_add_epi64( acc, _mm_srli_epi64( v, 32));
+    }
+    quint64 lanes[2];
+    _mm_storeu_si128( (__m128i *) lanes, acc);
+    return lanes[0] + lanes[1] + sumScalar( buff + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static quint64 sumAVX2( const char * buff, qint64 n)
+{
+    const __m256i low = _mm256_set1_epi64x( 0xffffffff);
+    const __m256i swap = _mm256_setr_epi8( 3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12,
+                                           3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+    __m256i acc = _mm256_setzero_si256();
+    qint64 i = 0;
+    for( ; i + 32 <= n ; i += 32) {
+        __m256i v = _mm256_shuffle_epi8( _mm256_loadu_si256( (const __m256i *) (buff + i)), swap);
+        acc = _mm256_add_epi64( acc, _mm256_and_si256( v, low));
+        acc = _mm256_add_epi64( acc, _mm256_srli_epi64( v, 32));
+    }
+    quint64 lanes[4];
+    _mm256_storeu_si256( (__m256i *) lanes, acc);
+    return lanes[0] + lanes[1] + lanes[2] + lanes[3] + sumScalar( buff + i, n - i);
+}
+
+#endif // SUM_HAVE_X86
+
+// the kernel picked for this CPU
+struct SumKernel {
+    quint64 (* sum)( const char *, qint64);
+    const char * name;
+};
+
+static SumKernel pickKernel()
+{
+    SumKernel k;
+    k.sum = sumScalar;
+    k.name = "scalar";
+#ifdef SUM_HAVE_X86
+    __builtin_cpu_init();
+    if( __builtin_cpu_supports( "avx2")) {
+        k.sum = sumAVX2;
+        k.name = "avx2";
+    } else if( __builtin_cpu_supports( "sse2")) {
+        k.sum = sumSSE2;
+        k.name = "sse2";
+    }
+#endif
+    return k;
+}
+
+static const SumKernel & kernel()
+{
+    static SumKernel k = pickKernel();
+    return k;
+}
+
+// one slice of a big buffer, summed on the global thread pool
+struct SumTask : public QRunnable {
+    SumTask( const char * buff, qint64 n, quint64 * result, QSemaphore * done) {
+        _buff = buff; _n = n; _result = result; _done = done;
+    }
+    void run() {
+        * _result = kernel().sum( _buff, _n);
+        _done-> release();
+    }
+    const char * _buff; qint64 _n; quint64 * _result; QSemaphore * _done;
+};
+
+// buffers bigger than this are split across the cores
+static const qint64 ParallelSumSize = 8 * 1024 * 1024;
+
+quint32 fitsDataSum( const char * buff, qint64 n)
+{
+    int nParts = QThread::idealThreadCount();
+    if( n < ParallelSumSize || nParts < 2)
+        return fold( kernel().sum( buff, n));
+    // slice boundaries on a cache line, which keeps them on word boundaries too
+    qint64 step = (n / nParts + 63) / 64 * 64;
+    int nSlices = int( (n + step - 1) / step);
+    quint64 * results = new quint64[ nSlices];
+    QSemaphore done;
+    for( int s = 1 ; s < nSlices ; s ++ ) {
+        qint64 pos = s * step;
+        QThreadPool::globalInstance()-> start(
+                    new SumTask( buff + pos, qMin( step, n - pos), results + s, & done));
+    }
+    // the calling thread does the first slice itself
+    results[0] = kernel().sum( buff, qMin( step, n));
+    done.acquire( nSlices - 1);
+    // each slice sum is below 2^56, so a handful of them cannot overflow
+    quint64 sum = 0;
+    for( int s = 0 ; s < nSlices ; s ++ )
+        sum += fold( results[s]);
+    delete [] results;
+    return fold( sum);
+}
+
+quint32 fitsSumAdd( quint32 a, quint32 b)
+{
+    return fold( quint64( a) + b);
+}
+
+// Moving data by one byte moves every byte to the next less significant position of its
+// word (and the last byte of a word to the top of the next one). Since 256^4 = 1 modulo
+// 2^32-1, which is what ones' complement arithmetic works in, that is the same as rotating
+// the sum right by 8 bits.
+quint32 fitsSumAt( quint32 sum, qint64 offset)
+{
+    int r = int( offset % 4) * 8;
+    if( r == 0) return sum;
+    return (sum >> r) | (sum << (32 - r));
+}
+
+// ASCII encoding from the FITS checksum convention: every byte of the complemented sum is
+// spread over 4 characters, avoiding the punctuation between '9' and 'A' and between
+// 'Z' and 'a', and the result is rotated by one character
+QString fitsChecksumString( quint32 sum)
+{
+    static const int exclude[13] = { 0x3a, 0x3b, 0x3c, 0x3d, 0x3e, 0x3f, 0x40,
+                                     0x5b, 0x5c, 0x5d, 0x5e, 0x5f, 0x60 };
+    quint32 value = ~sum;
+    char asc[16];
+    for( int i = 0 ; i < 4 ; i ++ ) {
+        int byte = (value >> (24 - 8 * i)) & 0xff;
+        int ch[4];
+        for( int j = 0 ; j < 4 ; j ++ )
+            ch[j] = byte / 4 + '0';
+        ch[0] += byte % 4;
+        bool check = true;
+        while( check) {
+            check = false;
+            for( int k = 0 ; k < 13 ; k ++ ) {
+                for( int j = 0 ; j < 4 ; j += 2 ) {
+                    if( ch[j] == exclude[k] || ch[j+1] == exclude[k]) {
+                        ch[j] ++;
+                        ch[j+1] --;
+                        check = true;
+                    }
+                }
+            }
+        }
+        for( int j = 0 ; j < 4 ; j ++ )
+            asc[4 * j + i] = char( ch[j]);
+    }
+    QString res;
+    for( int i = 0 ; i < 16 ; i ++ )
+        res += QChar( asc[(i + 15) % 16]);
+    return res;
+}
+
+const char * fitsSumKernelName()
+{
+    return kernel().name;
+}
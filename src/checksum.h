@@ -0,0 +1,26 @@
+#pragma once
+
+#include <QString>
+#include <QtGlobal>
+
+// FITS checksums (the CHECKSUM/DATASUM convention): the 32-bit ones' complement sum of
+// the data taken as big-endian 32-bit words.
+
+// Sum of n bytes that start on a word boundary; if n is not a multiple of 4 the last word
+// is padded with zeros. Big buffers are summed on several cores with the best kernel for
+// this CPU (AVX2, SSE2 or plain C++).
+quint32 fitsDataSum( const char * buff, qint64 n);
+
+// ones' complement addition of two sums
+quint32 fitsSumAdd( quint32 a, quint32 b);
+
+// The sum of a piece of data that really starts 'offset' bytes into the data stream, given
+// its sum as if it started on a word boundary. This lets pieces be summed independently
+// (e.g. in parallel) and put together afterwards with fitsSumAdd().
+quint32 fitsSumAt( quint32 sum, qint64 offset);
+
+// the 16 character ASCII encoding of the complement of sum, for the CHECKSUM card
+QString fitsChecksumString( quint32 sum);
+
+// name of the kernel that was picked for this CPU
+const char * fitsSumKernelName();
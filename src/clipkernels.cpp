@@ -0,0 +1,245 @@
+/*
+ *   Copyright 2013 Pavol Federl (federl@gmail.com)
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ *
+ */
+
+#include <cmath>
+#include <cstring>
+#include <limits>
+
+#include <QtEndian>
+#include <QThread>
+#include <QThreadPool>
+#include <QRunnable>
+#include <QSemaphore>
+
+#include "clipkernels.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define CLIP_HAVE_X86 1
+#include <immintrin.h>
+#endif
+
+// The kernels compare the values in their native precision, so the limits are first
+// narrowed to the closest floats inside [min..max]. That way a float is clipped exactly
+// when it would have been clipped after converting it to double.
+static void floatLimits( double min, double max, float & fmin, float & fmax)
+{
+    fmin = float( min);
+    if( double( fmin) < min) fmin = nextafterf( fmin, std::numeric_limits<float>::infinity());
+    fmax = float( max);
+    if( double( fmax) > max) fmax = nextafterf( fmax, - std::numeric_limits<float>::infinity());
+}
+
+// plain C++ versions, also used for the tails the vector versions leave behind
+static void clip32Scalar( char * buff, qint64 n, float min, float max)
+{
+    quint32 nan = 0x7fc00000;
+    for( qint64 i = 0 ; i + 4 <= n ; i += 4) {
+        quint32 raw = qFromBigEndian<quint32>( (const uchar *) buff + i);
+        float val; memcpy( & val, & raw, 4);
+        if( val < min || val > max)
+            qToBigEndian<quint32>( nan, (uchar *) buff + i);
+    }
+}
+
+static void clip64Scalar( char * buff, qint64 n, double min, double max)
+{
+    quint64 nan = Q_UINT64_C( 0x7ff8000000000000);
+    for( qint64 i = 0 ; i + 8 <= n ; i += 8) {
+        quint64 raw = qFromBigEndian<quint64>( (const uchar *) buff + i);
+        double val; memcpy( & val, & raw, 8);
+        if( val < min || val > max)
+            qToBigEndian<quint64>( nan, (uchar *) buff + i);
+    }
+}
+
+#ifdef CLIP_HAVE_X86
+
+// The comparison mask is per lane and does not care about byte order, so the kernels only
+// swap a copy of the data for the comparison and then blend the original (big-endian)
+// bytes with a big-endian NaN. This saves swapping the result back.
+
+__attribute__((target("sse2")))
+static void clip32SSE2( char * buff, qint64 n, float min, float max)
+{
+    const __m128 vmin = _mm_set1_ps( min), vmax = _mm_set1_ps( max);
+    // quiet NaN 0x7fc00000 as it appears in memory when stored big-endian
+    const __m128 nanBE = _mm_castsi128_ps( _mm_set1_epi32( 0x0000c07f));
+    qint64 i = 0;
+    for( ; i + 16 <= n ; i += 16) {
+        __m128i raw = _mm_loadu_si128( (const __m128i *) (buff + i));
+        // SSE2 has no byte shuffle: swap the bytes in each 16-bit word, then the words
+        __m128i v = _mm_or_si128( _mm_slli_epi16( raw, 8), _mm_srli_epi16( raw, 8));
+        v = _mm_shufflehi_epi16( _mm_shufflelo_epi16( v, 0xb1), 0xb1);
+        __m128 f = _mm_castsi128_ps( v);
+        __m128 bad = _mm_or_ps( _mm_cmplt_ps( f, vmin), _mm_cmpgt_ps( f, vmax));
+        __m128 res = _mm_or_ps( _mm_andnot_ps( bad, _mm_castsi128_ps( raw)), _mm_and_ps( bad, nanBE));
+        _mm_storeu_si128( (__m128i *) (buff + i), _mm_castps_si128( res));
+    }
+    clip32Scalar( buff + i, n - i, min, max);
+}
+
+__attribute__((target("sse2")))
+static void clip64SSE2( char * buff, qint64 n, double min, double max)
+{
+    const __m128d vmin = _mm_set1_pd( min), vmax = _mm_set1_pd( max);
+    const __m128d nanBE = _mm_castsi128_pd( _mm_set1_epi64x( Q_INT64_C( 0x000000000000f87f)));
+    qint64 i = 0;
+    for( ; i + 16 <= n ; i += 16) {
+        __m128i raw = _mm_loadu_si128( (const __m128i *) (buff + i));
+        __m128i v = _mm_or_si128( _mm_slli_epi16( raw, 8), _mm_srli_epi16( raw, 8));
+        v = _mm_shufflehi_epi16( _mm_shufflelo_epi16( v, 0x1b), 0x1b);
+        __m128d f = _mm_castsi128_pd( v);
+        __m128d bad = _mm_or_pd( _mm_cmplt_pd( f, vmin), _mm_cmpgt_pd( f, vmax));
+        __m128d res = _mm_or_pd( _mm_andnot_pd( bad, _mm_castsi128_pd( raw)), _mm_and_pd( bad, nanBE));
+        _mm_storeu_si128( (__m128i *) (buff + i), _mm_castpd_si128( res));
+    }
+    clip64Scalar( buff + i, n - i, min, max);
+}
+
+__attribute__((target("avx2")))
+static void clip32AVX2( char * buff, qint64 n, float min, float max)
+{
+    const __m256 vmin = _mm256_set1_ps( min), vmax = _mm256_set1_ps( max);
+    const __m256 nanBE = _mm256_castsi256_ps( _mm256_set1_epi32( 0x0000c07f));
+    const __m256i swap = _mm256_setr_epi8( 3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12,
+                                           3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+    qint64 i = 0;
+    for( ; i + 32 <= n ; i += 32) {
+        __m256i raw = _mm256_loadu_si256( (const __m256i *) (buff + i));
+        __m256 f = _mm256_castsi256_ps( _mm256_shuffle_epi8( raw, swap));
+        __m256 bad = _mm256_or_ps( _mm256_cmp_ps( f, vmin, _CMP_LT_OQ), _mm256_cmp_ps( f, vmax, _CMP_GT_OQ));
+        __m256 res = _mm256_blendv_ps( _mm256_castsi256_ps( raw), nanBE, bad);
+        _mm256_storeu_si256( (__m256i *) (buff + i), _mm256_castps_si256( res));
+    }
+    clip32Scalar( buff + i, n - i, min, max);
+}
+
+__attribute__((target("avx2")))
+static void clip64AVX2( char * buff, qint64 n, double min, double max)
+{
+    const __m256d vmin = _mm256_set1_pd( min), vmax = _mm256_set1_pd( max);
+    const __m256d nanBE = _mm256_castsi256_pd( _mm256_set1_epi64x( Q_INT64_C( 0x000000000000f87f)));
+    const __m256i swap = _mm256_setr_epi8( 7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8,
+                                           7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8);
+    qint64 i = 0;
+    for( ; i + 32 <= n ; i += 32) {
+        __m256i raw = _mm256_loadu_si256( (const __m256i *) (buff + i));
+        __m256d f = _mm256_castsi256_pd( _mm256_shuffle_epi8( raw, swap));
+        __m256d bad = _mm256_or_pd( _mm256_cmp_pd( f, vmin, _CMP_LT_OQ), _mm256_cmp_pd( f, vmax, _CMP_GT_OQ));
+        __m256d res = _mm256_blendv_pd( _mm256_castsi256_pd( raw), nanBE, bad);
+        _mm256_storeu_si256( (__m256i *) (buff + i), _mm256_castpd_si256( res));
+    }
+    clip64Scalar( buff + i, n - i, min, max);
+}
+
+#endif // CLIP_HAVE_X86
+
+// the kernel set picked for this CPU
+struct ClipKernels {
+    void (* clip32)( char *, qint64, float, float);
+    void (* clip64)( char *, qint64, double, double);
+    const char * name;
+};
+
+static ClipKernels pickKernels()
+{
+    ClipKernels k;
+    k.clip32 = clip32Scalar;
+    k.clip64 = clip64Scalar;
+    k.name = "scalar";
+#ifdef CLIP_HAVE_X86
+    __builtin_cpu_init();
+    if( __builtin_cpu_supports( "avx2")) {
+        k.clip32 = clip32AVX2;
+        k.clip64 = clip64AVX2;
+        k.name = "avx2";
+    } else if( __builtin_cpu_supports( "sse2")) {
+        k.clip32 = clip32SSE2;
+        k.clip64 = clip64SSE2;
+        k.name = "sse2";
+    }
+#endif
+    return k;
+}
+
+static const ClipKernels & kernels()
+{
+    static ClipKernels k = pickKernels();
+    return k;
+}
+
+static void clipSlice( int bitpix, char * buff, qint64 n, double min, double max)
+{
+    if( bitpix == -32) {
+        float fmin, fmax;
+        floatLimits( min, max, fmin, fmax);
+        kernels().clip32( buff, n, fmin, fmax);
+    } else {
+        kernels().clip64( buff, n, min, max);
+    }
+}
+
+// one slice of a big buffer, clipped on the global thread pool
+struct ClipTask : public QRunnable {
+    ClipTask( int bitpix, char * buff, qint64 n, double min, double max, QSemaphore * done) {
+        _bitpix = bitpix; _buff = buff; _n = n; _min = min; _max = max; _done = done;
+    }
+    void run() {
+        clipSlice( _bitpix, _buff, _n, _min, _max);
+        _done-> release();
+    }
+    int _bitpix; char * _buff; qint64 _n; double _min, _max; QSemaphore * _done;
+};
+
+// buffers bigger than this are split across the cores
+static const qint64 ParallelClipSize = 8 * 1024 * 1024;
+
+static void clipParallel( int bitpix, char * buff, qint64 n, double min, double max)
+{
+    int nParts = QThread::idealThreadCount();
+    if( n < ParallelClipSize || nParts < 2) {
+        clipSlice( bitpix, buff, n, min, max);
+        return;
+    }
+    // slice boundaries on a cache line, which is also a multiple of the pixel size
+    qint64 step = (n / nParts + 63) / 64 * 64;
+    QSemaphore done;
+    int queued = 0;
+    for( qint64 pos = step ; pos < n ; pos += step) {
+        QThreadPool::globalInstance()-> start(
+                    new ClipTask( bitpix, buff + pos, qMin( step, n - pos), min, max, & done));
+        queued ++;
+    }
+    // the calling thread does the first slice itself
+    clipSlice( bitpix, buff, qMin( step, n), min, max);
+    done.acquire( queued);
+}
+
+void clipFloat32BE( char * buff, qint64 n, double min, double max)
+{
+    clipParallel( -32, buff, n, min, max);
+}
+
+void clipFloat64BE( char * buff, qint64 n, double min, double max)
+{
+    clipParallel( -64, buff, n, min, max);
+}
+
+const char * clipKernelName()
+{
+    return kernels().name;
+}
@@ -0,0 +1,13 @@
+#pragma once
+
+#include <QtGlobal>
+
+// Clipping kernels working directly on big-endian (FITS) data: every value outside of
+// [min..max] is replaced by a NaN, NaNs already present are left alone. The buffers are
+// modified in place and n is in bytes. The best implementation for the current CPU
+// (AVX2, SSE2 or plain C++) is picked on the first call.
+void clipFloat32BE( char * buff, qint64 n, double min, double max);
+void clipFloat64BE( char * buff, qint64 n, double min, double max);
+
+// name of the kernel set that was picked for this CPU
+const char * clipKernelName();
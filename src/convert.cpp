@@ -0,0 +1,328 @@
+/*
+ *   Copyright 2013 Pavol Federl (federl@gmail.com)
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ *
+ */
+
+#include <cstring>
+#include <cstdlib>
+#include <limits>
+
+#include "convert.h"
+#include "fitspixel.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define CONVERT_HAVE_X86 1
+#include <immintrin.h>
+#endif
+
+// everything the kernels need to know about the two formats
+struct Conversion {
+    bool inScaled; double bscale, bzero;
+    bool inBlank; qint64 blank;
+    bool outScaled; double outScale, outZero;
+    qint64 outBlank;
+};
+
+// converts n values from src to dst, which do not overlap
+typedef void (* Kernel)( const uchar * src, uchar * dst, qint64 n, const Conversion & c);
+
+// plain C++ version, also used for the tails the vector versions leave behind
+template <int In, int Out>
+static void convertScalar( const uchar * src, uchar * dst, qint64 n, const Conversion & c)
+{
+    typedef FitsPixel<In> Input;
+    typedef FitsPixel<Out> Output;
+    const double nan = std::numeric_limits<double>::quiet_NaN();
+    for( qint64 i = 0 ; i < n ; i ++ ) {
+        double v = Input::load( src + i * Input::Size);
+        if( Input::Integer && c.inBlank && v == c.blank)
+            v = nan;
+        else if( c.inScaled)
+            v = c.bzero + c.bscale * v;
+        if( Output::Integer && c.outScaled)
+            v = (v - c.outZero) / c.outScale;
+        Output::store( v, dst + i * Output::Size, c.outBlank);
+    }
+}
+
+#ifdef CONVERT_HAVE_X86
+
+// The vector kernels work on four values at a time as doubles, which holds any input value
+// exactly and rounds the same way as the plain version does. The loads swap the bytes and
+// widen the values, and give the lanes that hold the BLANK value.
+
+template <int Bitpix> struct LoadAVX2;
+template <> struct LoadAVX2<8> {
+    __attribute__((target("avx2")))
+    static __m256d load( const uchar * p, __m128i blank, __m256d & isBlank) {
+        int raw; memcpy( & raw, p, 4);
+        __m128i v = _mm_cvtepu8_epi32( _mm_cvtsi32_si128( raw));
+        isBlank = _mm256_castsi256_pd( _mm256_cvtepi32_epi64( _mm_cmpeq_epi32( v, blank)));
+        return _mm256_cvtepi32_pd( v);
+    }
+};
+template <> struct LoadAVX2<16> {
+    __attribute__((target("avx2")))
+    static __m256d load( const uchar * p, __m128i blank, __m256d & isBlank) {
+        const __m128i swap = _mm_setr_epi8( 1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14);
+        __m128i raw = _mm_shuffle_epi8( _mm_loadl_epi64( (const __m128i *) p), swap);
+        __m128i v = _mm_cvtepi16_epi32( raw);
+        isBlank = _mm256_castsi256_pd( _mm256_cvtepi32_epi64( _mm_cmpeq_epi32( v, blank)));
+        return _mm256_cvtepi32_pd( v);
+    }
+};
+template <> struct LoadAVX2<32> {
+    __attribute__((target("avx2")))
+    static __m256d load( const uchar * p, __m128i blank, __m256d & isBlank) {
+        const __m128i swap = _mm_setr_epi8( 3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+        __m128i v = _mm_shuffle_epi8( _mm_loadu_si128( (const __m128i *) p), swap);
+        isBlank = _mm256_castsi256_pd( _mm256_cvtepi32_epi64( _mm_cmpeq_epi32( v, blank)));
+        return _mm256_cvtepi32_pd( v);
+    }
+};
+template <> struct LoadAVX2<-32> {
+    __attribute__((target("avx2")))
+    static __m256d load( const uchar * p, __m128i, __m256d & isBlank) {
+        const __m128i swap = _mm_setr_epi8( 3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+        __m128i v = _mm_shuffle_epi8( _mm_loadu_si128( (const __m128i *) p), swap);
+        isBlank = _mm256_setzero_pd();
+        return _mm256_cvtps_pd( _mm_castsi128_ps( v));
+    }
+};
+template <> struct LoadAVX2<-64> {
+    __attribute__((target("avx2")))
+    static __m256d load( const uchar * p, __m128i, __m256d & isBlank) {
+        const __m256i swap = _mm256_setr_epi8( 7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8,
+                                               7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8);
+        isBlank = _mm256_setzero_pd();
+        return _mm256_castsi256_pd( _mm256_shuffle_epi8( _mm256_loadu_si256( (const __m256i *) p), swap));
+    }
+};
+
+// the vector kernels only store floating point values, integer outputs need the rounding
+// and saturation of the plain version
+template <int Bitpix> struct StoreAVX2;
+template <> struct StoreAVX2<-32> {
+    __attribute__((target("avx2")))
+    static void store( __m256d v, uchar * p) {
+        const __m128i swap = _mm_setr_epi8( 3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+        __m128i f = _mm_castps_si128( _mm256_cvtpd_ps( v));
+        _mm_storeu_si128( (__m128i *) p, _mm_shuffle_epi8( f, swap));
+    }
+};
+template <> struct StoreAVX2<-64> {
+    __attribute__((target("avx2")))
+    static void store( __m256d v, uchar * p) {
+        const __m256i swap = _mm256_setr_epi8( 7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8,
+                                               7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8);
+        _mm256_storeu_si256( (__m256i *) p, _mm256_shuffle_epi8( _mm256_castpd_si256( v), swap));
+    }
+};
+
+template <int In, int Out>
+__attribute__((target("avx2")))
+static void convertAVX2( const uchar * src, uchar * dst, qint64 n, const Conversion & c)
+{
+    enum { InSize = FitsPixel<In>::Size, OutSize = FitsPixel<Out>::Size };
+    // the inputs with a BLANK are at most 32 bits
+    const __m128i blank = _mm_set1_epi32( int( c.blank));
+    const __m256d scale = _mm256_set1_pd( c.bscale), zero = _mm256_set1_pd( c.bzero);
+    const __m256d nan = _mm256_set1_pd( std::numeric_limits<double>::quiet_NaN());
+    qint64 i = 0;
+    for( ; i + 4 <= n ; i += 4) {
+        __m256d isBlank;
+        __m256d v = LoadAVX2<In>::load( src + i * InSize, blank, isBlank);
+        if( c.inScaled)
+            v = _mm256_add_pd( zero, _mm256_mul_pd( scale, v));
+        if( c.inBlank)
+            v = _mm256_blendv_pd( v, nan, isBlank);
+        StoreAVX2<Out>::store( v, dst + i * OutSize);
+    }
+    convertScalar<In, Out>( src + i * InSize, dst + i * OutSize, n - i, c);
+}
+
+#endif // CONVERT_HAVE_X86
+
+static bool pickAVX2()
+{
+#ifdef CONVERT_HAVE_X86
+    __builtin_cpu_init();
+    return __builtin_cpu_supports( "avx2");
+#else
+    return false;
+#endif
+}
+
+static bool haveAVX2()
+{
+    static bool avx2 = pickAVX2();
+    return avx2;
+}
+
+template <int In>
+static Kernel kernelFrom( int out)
+{
+    switch( out) {
+    case   8: return convertScalar<In, 8>;
+    case  16: return convertScalar<In, 16>;
+    case  32: return convertScalar<In, 32>;
+#ifdef CONVERT_HAVE_X86
+    case -32: return haveAVX2() ? convertAVX2<In, -32> : convertScalar<In, -32>;
+    case -64: return haveAVX2() ? convertAVX2<In, -64> : convertScalar<In, -64>;
+#else
+    case -32: return convertScalar<In, -32>;
+    case -64: return convertScalar<In, -64>;
+#endif
+    }
+    throw QString( "Cannot convert to BITPIX = %1").arg( out);
+}
+
+static Kernel pickKernel( int in, int out)
+{
+    switch( in) {
+    case   8: return kernelFrom<8>( out);
+    case  16: return kernelFrom<16>( out);
+    case  32: return kernelFrom<32>( out);
+    case -32: return kernelFrom<-32>( out);
+    case -64: return kernelFrom<-64>( out);
+    }
+    throw QString( "Cannot convert from BITPIX = %1").arg( in);
+}
+
+PixelFormat pixelFormat( const FitsInfo & info)
+{
+    PixelFormat fmt;
+    fmt.bitpix = info.bitpix;
+    fmt.bscale = info.bscale;
+    fmt.bzero = info.bzero;
+    fmt.hasBlank = info.hasBlank;
+    fmt.blank = info.blank;
+    return fmt;
+}
+
+qint64 convertedSize( qint64 n, int inBitpix, int outBitpix)
+{
+    return n / (abs( inBitpix) / 8) * (abs( outBitpix) / 8);
+}
+
+// the raw values mean the same in both formats
+static bool sameFormat( const PixelFormat & in, const PixelFormat & out)
+{
+    return in.bitpix == out.bitpix && in.bscale == out.bscale && in.bzero == out.bzero
+            && (! in.hasBlank || (out.hasBlank && in.blank == out.blank));
+}
+
+// values converted at a time, through a buffer on the stack; this is what lets the output
+// overwrite the input it came from
+static const qint64 TileValues = 1024;
+
+qint64 convertPixels( char * buff, qint64 n, const PixelFormat & in, const PixelFormat & out)
+{
+    int inSize = abs( in.bitpix) / 8, outSize = abs( out.bitpix) / 8;
+    if( n % inSize) throw "Data chunk not a multiple of the pixel size...grrr";
+    if( sameFormat( in, out))
+        return n;
+
+    Conversion c;
+    c.inScaled = in.bscale != 1 || in.bzero != 0;
+    c.bscale = in.bscale; c.bzero = in.bzero;
+    c.inBlank = in.bitpix > 0 && in.hasBlank;
+    c.blank = in.blank;
+    c.outScaled = out.bscale != 1 || out.bzero != 0;
+    c.outScale = out.bscale; c.outZero = out.bzero;
+    c.outBlank = out.hasBlank ? out.blank : 0;
+    Kernel kernel = pickKernel( in.bitpix, out.bitpix);
+
+    // A tile of output only overwrites input of tiles that are already converted if the
+    // tiles go from the back when the values get bigger, and from the front otherwise.
+    uchar tile[ TileValues * 8];
+    uchar * data = (uchar *) buff;
+    qint64 count = n / inSize;
+    qint64 nTiles = (count + TileValues - 1) / TileValues;
+    for( qint64 k = 0 ; k < nTiles ; k ++ ) {
+        qint64 t = outSize > inSize ? nTiles - 1 - k : k;
+        qint64 first = t * TileValues;
+        qint64 m = qMin( TileValues, count - first);
+        kernel( data + first * inSize, tile, m, c);
+        memcpy( data + first * outSize, tile, m * outSize);
+    }
+    return count * outSize;
+}
+
+// physical values of n raw values, BLANKs become NaN
+template <int Bitpix>
+static void loadValues( const uchar * p, qint64 n, const PixelFormat & fmt, double * out)
+{
+    typedef FitsPixel<Bitpix> Pixel;
+    bool scaled = fmt.bscale != 1 || fmt.bzero != 0;
+    bool blank = Pixel::Integer && fmt.hasBlank;
+    double blankValue = double( fmt.blank);
+    const double nan = std::numeric_limits<double>::quiet_NaN();
+    for( qint64 i = 0 ; i < n ; i ++, p += Pixel::Size) {
+        double v = Pixel::load( p);
+        if( blank && v == blankValue)
+            v = nan;
+        else if( scaled)
+            v = fmt.bzero + fmt.bscale * v;
+        out[i] = v;
+    }
+}
+
+// and back, with the scaling taken off
+template <int Bitpix>
+static void storeValues( const double * in, qint64 n, const PixelFormat & fmt, uchar * p)
+{
+    typedef FitsPixel<Bitpix> Pixel;
+    bool scaled = fmt.bscale != 1 || fmt.bzero != 0;
+    for( qint64 i = 0 ; i < n ; i ++, p += Pixel::Size) {
+        double v = in[i];
+        if( Pixel::Integer && scaled)
+            v = (v - fmt.bzero) / fmt.bscale;
+        Pixel::store( v, p, fmt.hasBlank ? fmt.blank : 0);
+    }
+}
+
+void loadValues( const char * data, qint64 n, const PixelFormat & fmt, double * out)
+{
+    const uchar * p = (const uchar *) data;
+    switch( fmt.bitpix) {
+    case   8: loadValues<8>( p, n, fmt, out); return;
+    case  16: loadValues<16>( p, n, fmt, out); return;
+    case  32: loadValues<32>( p, n, fmt, out); return;
+    case  64: loadValues<64>( p, n, fmt, out); return;
+    case -32: loadValues<-32>( p, n, fmt, out); return;
+    case -64: loadValues<-64>( p, n, fmt, out); return;
+    }
+    throw QString( "Illegal value BITPIX = %1").arg( fmt.bitpix);
+}
+
+void storeValues( const double * in, qint64 n, const PixelFormat & fmt, char * data)
+{
+    uchar * p = (uchar *) data;
+    switch( fmt.bitpix) {
+    case   8: storeValues<8>( in, n, fmt, p); return;
+    case  16: storeValues<16>( in, n, fmt, p); return;
+    case  32: storeValues<32>( in, n, fmt, p); return;
+    case  64: storeValues<64>( in, n, fmt, p); return;
+    case -32: storeValues<-32>( in, n, fmt, p); return;
+    case -64: storeValues<-64>( in, n, fmt, p); return;
+    }
+    throw QString( "Illegal value BITPIX = %1").arg( fmt.bitpix);
+}
+
+const char * convertKernelName()
+{
+    return haveAVX2() ? "avx2" : "scalar";
+}
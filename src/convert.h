@@ -0,0 +1,39 @@
+#pragma once
+
+#include <QtGlobal>
+
+#include "extractor.h"
+
+// how the values of a cube are stored: the physical value is bzero + bscale * raw, and
+// raw values equal to blank (integer BITPIX only) are undefined
+struct PixelFormat {
+    int bitpix;
+    double bscale, bzero;
+    bool hasBlank;
+    qint64 blank;
+};
+
+// the format of a parsed cube
+PixelFormat pixelFormat( const FitsInfo & info);
+
+// Converts big-endian (FITS) data from one format to another, keeping the physical values:
+// BSCALE/BZERO of the input are applied and its BLANK values become NaN. An integer output
+// gets its own scaling taken off, values outside of its range are saturated and NaNs become
+// its BLANK. Every pair of input and output BITPIX has its own kernel, the ones to floating
+// point outputs also in AVX2, picked on the first call.
+//
+// The data is converted in place: buff holds n bytes of input and must have room for the
+// output, whose size is returned.
+qint64 convertPixels( char * buff, qint64 n, const PixelFormat & in, const PixelFormat & out);
+
+// n values in the format fmt as physical values, BSCALE/BZERO applied and BLANKs as NaN,
+// and back with the scaling taken off (integer BITPIX are rounded and saturated, NaN
+// becomes the BLANK)
+void loadValues( const char * data, qint64 n, const PixelFormat & fmt, double * out);
+void storeValues( const double * in, qint64 n, const PixelFormat & fmt, char * data);
+
+// size of n bytes of inBitpix data after the conversion to outBitpix
+qint64 convertedSize( qint64 n, int inBitpix, int outBitpix);
+
+// name of the kernel set that was picked for this CPU
+const char * convertKernelName();
@@ -0,0 +1,206 @@
+/*
+ *   Copyright 2013 Pavol Federl (federl@gmail.com)
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ *
+ */
+
+#include <cstring>
+#include <limits>
+
+#include "cubereader.h"
+#include "fitspixel.h"
+
+using namespace std;
+
+const qint64 CubeReader::BlockSize;
+const qint64 CubeReader::DefaultCacheSize;
+
+// runs of at least this many bytes are read straight into a buffer, past the cache
+static const qint64 DirectRunSize = 4 * CubeReader::BlockSize;
+
+// the scaling and the BLANK test are only done when the header asks for them
+template <int Bitpix>
+static void decodeValues( const uchar * p, qint64 n, double * out, const FitsInfo & info)
+{
+    typedef FitsPixel<Bitpix> Pixel;
+    bool scaled = info.bscale != 1 || info.bzero != 0;
+    if( ! scaled && ! info.hasBlank) {
+        for( qint64 i = 0 ; i < n ; i ++ )
+            out[i] = Pixel::load( p + i * Pixel::Size);
+        return;
+    }
+    double blank = info.blank;
+    for( qint64 i = 0 ; i < n ; i ++ ) {
+        double v = Pixel::load( p + i * Pixel::Size);
+        if( info.hasBlank && v == blank)
+            out[i] = numeric_limits<double>::quiet_NaN();
+        else
+            out[i] = info.bzero + info.bscale * v;
+    }
+}
+
+CubeReader::CubeReader( const QString & fileName, qint64 cacheSize, IoMode mode)
+{
+    _info = parse( fileName);
+    init( cacheSize, mode);
+}
+
+CubeReader::CubeReader( const FitsInfo & info, qint64 cacheSize, IoMode mode)
+{
+    _info = info;
+    init( cacheSize, mode);
+}
+
+void CubeReader::init( qint64 cacheSize, IoMode mode)
+{
+    switch( _info.bitpix) {
+    case   8: _decode = decodeValues<8>; break;
+    case  16: _decode = decodeValues<16>; break;
+    case  32: _decode = decodeValues<32>; break;
+    case  64: _decode = decodeValues<64>; break;
+    case -32: _decode = decodeValues<-32>; break;
+    case -64: _decode = decodeValues<-64>; break;
+    default: throw QString( "Illegal value BITPIX = %1").arg( _info.bitpix);
+    }
+    _pixelSize = abs( _info.bitpix) / 8;
+    _maxBlocks = int( qMax( qint64( 4), cacheSize / BlockSize));
+    _direct = 0;
+    _directSize = 0;
+    _hits = _misses = 0;
+    _reader = new DataReader( _info.fileName, mode);
+}
+
+CubeReader::~CubeReader()
+{
+    for( list<CacheBlock>::iterator it = _blocks.begin() ; it != _blocks.end() ; ++ it)
+        freeIoBuffer( it-> buff);
+    freeIoBuffer( _direct);
+    delete _reader;
+}
+
+const uchar * CubeReader::block( qint64 index)
+{
+    // the front block is checked first, runs of values mostly stay in one block
+    if( ! _blocks.empty() && _blocks.front().index == index) {
+        _hits ++;
+        return _blocks.front().data;
+    }
+    list<CacheBlock>::iterator found = _index.value( index, _blocks.end());
+    if( found != _blocks.end()) {
+        _hits ++;
+        _blocks.splice( _blocks.begin(), _blocks, found);
+        return _blocks.front().data;
+    }
+    _misses ++;
+    // reuse the least recently used block once the cache is full
+    if( int( _blocks.size()) >= _maxBlocks) {
+        _blocks.splice( _blocks.begin(), _blocks, -- _blocks.end());
+        _index.remove( _blocks.front().index);
+    } else {
+        CacheBlock blk;
+        blk.index = -1;
+        blk.data = 0;
+        blk.buff = allocIoBuffer( BlockSize);
+        if( ! blk.buff)
+            throw QString( "Could not allocate the cache of %1").arg( _info.fileName);
+        _blocks.push_front( blk);
+    }
+    CacheBlock & blk = _blocks.front();
+    // the last block ends with the data
+    qint64 start = index * BlockSize;
+    qint64 size = qMin( BlockSize, _info.dataOffset + _info.dataSize - start);
+    blk.index = -1;
+    blk.data = (const uchar *) _reader-> read( blk.buff, start, size);
+    blk.index = index;
+    _index.insert( index, _blocks.begin());
+    return blk.data;
+}
+
+// The blocks are aligned in the file and the data segment starts on a 2880 byte boundary,
+// so a value never straddles two blocks.
+void CubeReader::readRun( qint64 first, qint64 count, double * out)
+{
+    qint64 start = _info.dataOffset + first * _pixelSize;
+    qint64 size = count * _pixelSize;
+    if( size >= DirectRunSize) {
+        if( _directSize < size) {
+            freeIoBuffer( _direct);
+            _direct = allocIoBuffer( size);
+            _directSize = _direct ? size : 0;
+            if( ! _direct)
+                throw QString( "Could not allocate a buffer for %1").arg( _info.fileName);
+        }
+        _decode( (const uchar *) _reader-> read( _direct, start, size), count, out, _info);
+        return;
+    }
+    while( size > 0) {
+        qint64 index = start / BlockSize;
+        qint64 offset = start - index * BlockSize;
+        qint64 n = qMin( size, BlockSize - offset) / _pixelSize;
+        _decode( block( index) + offset, n, out, _info);
+        out += n;
+        start += n * _pixelSize;
+        size -= n * _pixelSize;
+    }
+}
+
+void CubeReader::checkBox( int x0, int y0, int z0, int nx, int ny, int nz) const
+{
+    if( x0 < 0 || y0 < 0 || z0 < 0 || nx < 0 || ny < 0 || nz < 0
+            || x0 + nx > width() || y0 + ny > height() || z0 + nz > depth())
+        throw QString( "%1x%2x%3 at %4,%5,%6 is outside of %7").arg( nx).arg( ny).arg( nz)
+            .arg( x0).arg( y0).arg( z0).arg( _info.fileName);
+}
+
+double CubeReader::value( int x, int y, int z)
+{
+    checkBox( x, y, z, 1, 1, 1);
+    double val;
+    readRun( (qint64( z) * height() + y) * width() + x, 1, & val);
+    return val;
+}
+
+void CubeReader::readPlane( int z, vector<double> & plane)
+{
+    checkBox( 0, 0, z, width(), height(), 1);
+    qint64 n = qint64( width()) * height();
+    plane.resize( n);
+    readRun( z * n, n, & plane[0]);
+}
+
+void CubeReader::readSpectrum( int x, int y, vector<double> & spectrum)
+{
+    checkBox( x, y, 0, 1, 1, depth());
+    spectrum.resize( depth());
+    qint64 planeSize = qint64( width()) * height();
+    qint64 pixel = qint64( y) * width() + x;
+    for( int z = 0 ; z < depth() ; z ++ )
+        readRun( z * planeSize + pixel, 1, & spectrum[z]);
+}
+
+void CubeReader::readSubcube( int x0, int y0, int z0, int nx, int ny, int nz, vector<double> & values)
+{
+    checkBox( x0, y0, z0, nx, ny, nz);
+    values.resize( qint64( nx) * ny * nz);
+    if( values.empty())
+        return;
+    // every row of the box is one contiguous run
+    double * out = & values[0];
+    for( int z = z0 ; z < z0 + nz ; z ++ ) {
+        for( int y = y0 ; y < y0 + ny ; y ++ ) {
+            readRun( (qint64( z) * height() + y) * width() + x0, nx, out);
+            out += nx;
+        }
+    }
+}
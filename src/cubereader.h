@@ -0,0 +1,78 @@
+#pragma once
+
+#include <vector>
+#include <list>
+#include <QHash>
+#include <QString>
+
+#include "extractor.h"
+#include "fileio.h"
+
+// Random access to the values of a FITS cube on disk. The file is read in aligned blocks
+// that are kept in an LRU cache, so access patterns that come back to the same parts of
+// the file (neighbouring spectra, small subcubes, single voxels) are served from memory
+// instead of doing a read per value. The batch calls convert whole runs of values with a
+// decoder compiled for the BITPIX of the cube, picked once when the cube is opened, and
+// runs that are big enough are read straight into a buffer, past the cache.
+//
+// The values come back as doubles with BZERO/BSCALE applied and BLANK turned into NaN.
+// The axes are the ones in the file, x = NAXIS1, y = NAXIS2, z = NAXIS3. A reader is not
+// thread safe, use one per thread.
+class CubeReader {
+public:
+    // size of the cached blocks, a multiple of IoAlignment so O_DIRECT works too
+    static const qint64 BlockSize = 64 * 1024;
+    static const qint64 DefaultCacheSize = 64 * 1024 * 1024;
+
+    CubeReader( const QString & fileName, qint64 cacheSize = DefaultCacheSize, IoMode mode = IoBuffered);
+    CubeReader( const FitsInfo & info, qint64 cacheSize = DefaultCacheSize, IoMode mode = IoBuffered);
+    ~CubeReader();
+
+    const FitsInfo & info() const { return _info; }
+    int width() const { return _info.naxis1; }
+    int height() const { return _info.naxis2; }
+    int depth() const { return _info.naxis3; }
+
+    // one voxel
+    double value( int x, int y, int z);
+    // the whole plane z, width * height values
+    void readPlane( int z, std::vector<double> & plane);
+    // all the values along z at (x,y), depth values
+    void readSpectrum( int x, int y, std::vector<double> & spectrum);
+    // the box [x0..x0+nx) x [y0..y0+ny) x [z0..z0+nz), x fastest
+    void readSubcube( int x0, int y0, int z0, int nx, int ny, int nz, std::vector<double> & values);
+
+    // cache statistics, in blocks
+    qint64 hits() const { return _hits; }
+    qint64 misses() const { return _misses; }
+
+protected:
+    void init( qint64 cacheSize, IoMode mode);
+    // the cached block with this index (file offset / BlockSize), read on a miss
+    const uchar * block( qint64 index);
+    // decodes count values starting with value number 'first' of the data segment
+    void readRun( qint64 first, qint64 count, double * out);
+    void checkBox( int x0, int y0, int z0, int nx, int ny, int nz) const;
+
+    // converts n big-endian values of the cube's BITPIX
+    typedef void (* Decoder)( const uchar * p, qint64 n, double * out, const FitsInfo & info);
+
+    struct CacheBlock {
+        qint64 index;
+        char * buff;
+        const uchar * data; // where in buff the block starts (O_DIRECT)
+    };
+
+    FitsInfo _info;
+    int _pixelSize;
+    Decoder _decode;
+    DataReader * _reader;
+    // the most recently used block is at the front
+    std::list<CacheBlock> _blocks;
+    QHash<qint64, std::list<CacheBlock>::iterator> _index;
+    int _maxBlocks;
+    // buffer for the runs that go past the cache
+    char * _direct;
+    qint64 _directSize;
+    qint64 _hits, _misses;
+};
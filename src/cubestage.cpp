@@ -0,0 +1,168 @@
+/*
+ *   Copyright 2013 Pavol Federl (federl@gmail.com)
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ *
+ */
+
+#include <cmath>
+#include <limits>
+
+#include "cubestage.h"
+#include "cubewriter.h"
+#include "stats.h"
+
+using namespace std;
+
+const char * const CubeCancelled = "Cancelled.";
+
+// values converted at once, on the stack
+static const qint64 RunValues = 1024;
+// longest run of values a combine hands to the stages at once, 8 MB of doubles
+static const qint64 StageRunValues = 1024 * 1024;
+
+void beginStages( const vector<CubeStage *> & stages, FitsInfo & info)
+{
+    for( size_t i = 0 ; i < stages.size() ; i ++ )
+        stages[i]-> begin( info);
+}
+
+void endStages( const vector<CubeStage *> & stages)
+{
+    for( size_t i = 0 ; i < stages.size() ; i ++ )
+        stages[i]-> end();
+}
+
+void ClipStage::process( int, qint64, double * values, qint64 n)
+{
+    const double nan = numeric_limits<double>::quiet_NaN();
+    for( qint64 i = 0 ; i < n ; i ++ )
+        if( values[i] < _min || values[i] > _max)
+            values[i] = nan;
+}
+
+ConvertStage::ConvertStage( int bitpix)
+{
+    if( bitpix != 8 && bitpix != 16 && bitpix != 32 && bitpix != -32 && bitpix != -64)
+        throw QString( "Cannot convert to BITPIX = %1").arg( bitpix);
+    _bitpix = bitpix;
+}
+
+void ConvertStage::begin( FitsInfo & info)
+{
+    info.bitpix = _bitpix;
+    info.bscale = 1;
+    info.bzero = 0;
+    info.hasBlank = _bitpix > 0;
+    info.blank = _bitpix == 8 ? 255 : _bitpix == 16 ? -32768 : _bitpix == 32 ? -2147483647 - 1 : 0;
+    info.header.setIntValue( "BITPIX", _bitpix);
+    info.header.removeKey( "BSCALE");
+    info.header.removeKey( "BZERO");
+    info.header.removeKey( "BLANK");
+    if( info.hasBlank)
+        info.header.setIntValue( "BLANK", info.blank);
+}
+
+// the values as they come back from the new format
+void ConvertStage::process( int, qint64, double * values, qint64 n)
+{
+    if( _bitpix == -64)
+        return;
+    PixelFormat fmt;
+    fmt.bitpix = _bitpix; fmt.bscale = 1; fmt.bzero = 0;
+    fmt.hasBlank = _bitpix > 0;
+    fmt.blank = _bitpix == 8 ? 255 : _bitpix == 16 ? -32768 : _bitpix == 32 ? -2147483647 - 1 : 0;
+    char buff[ RunValues * 8];
+    for( qint64 i = 0 ; i < n ; i += RunValues) {
+        qint64 m = qMin( RunValues, n - i);
+        storeValues( values + i, m, fmt, buff);
+        loadValues( buff, m, fmt, values + i);
+    }
+}
+
+StatsStage::StatsStage()
+{
+    _stats = 0;
+}
+
+StatsStage::~StatsStage()
+{
+    delete _stats;
+}
+
+void StatsStage::begin( FitsInfo & info)
+{
+    delete _stats;
+    _stats = new CubeStatistics( info.naxis3);
+    for( int z = 0 ; z < info.naxis3 ; z ++ )
+        _stats-> setFrequency( z, info.frameStart + z * info.cdelt3);
+}
+
+void StatsStage::process( int z, qint64, double * values, qint64 n)
+{
+    _stats-> addValues( z, values, n);
+}
+
+WriteStage::WriteStage( const QString & fileName)
+{
+    _fileName = fileName;
+    _writer = 0;
+    _planePixels = 0;
+}
+
+WriteStage::~WriteStage()
+{
+    delete _writer;
+}
+
+void WriteStage::begin( FitsInfo & info)
+{
+    delete _writer;
+    _writer = 0;
+    _writer = new CubeWriter( _fileName, info.header);
+    _planePixels = qint64( info.naxis1) * info.naxis2;
+}
+
+void WriteStage::process( int z, qint64 pixel, double * values, qint64 n)
+{
+    _writer-> write( z * _planePixels + pixel, values, n);
+}
+
+void WriteStage::end()
+{
+    _writer-> finish();
+}
+
+CubeStageFilter::CubeStageFilter( ChunkFilter * next, int convert, const vector<CubeStage *> & stages)
+    : ChannelFilter( next, convert)
+{
+    _stages = stages;
+}
+
+void CubeStageFilter::processPlane( int, int channel, qint64 pixel, char * data, qint64 n,
+                                    const PixelFormat & fmt, const FitsInfo &)
+{
+    int size = abs( fmt.bitpix) / 8;
+    // the stages see the values of the plane in as few runs as possible, a StatsStage
+    // merges its sums under a lock once per run
+    vector<double> values( size_t( qMin( n, StageRunValues)));
+    for( qint64 i = 0 ; i < n ; ) {
+        qint64 m = qMin( n - i, StageRunValues);
+        char * p = data + i * size;
+        loadValues( p, m, fmt, & values[0]);
+        for( size_t s = 0 ; s < _stages.size() ; s ++ )
+            _stages[s]-> process( channel, pixel + i, & values[0], m);
+        storeValues( & values[0], m, fmt, p);
+        i += m;
+    }
+}
@@ -0,0 +1,105 @@
+#pragma once
+
+#include <vector>
+#include <QString>
+
+#include "pipeline.h"
+#include "convert.h"
+
+class CubeStatistics;
+class CubeWriter;
+
+// Told how far a long operation got, in bytes of data; returning false cancels it, the
+// operation then throws a CubeError with the code Cancelled and the message CubeCancelled.
+// It can be called from several threads at once.
+class CubeProgress {
+public:
+    virtual ~CubeProgress() {}
+    virtual bool progress( qint64 done, qint64 total) = 0;
+};
+
+// the message of a cancelled operation
+extern const char * const CubeCancelled;
+
+// One step of processing on the values of a cube, as doubles with the scaling applied and
+// NaN for the undefined ones. A stage sees the cube once: begin() with the description of
+// the cube (which it may change, e.g. the BITPIX of a conversion, for the stages after it),
+// then process() for runs of values of single planes, in any order and from several
+// threads at once, and end() once all the values went through.
+//
+// The same stages run inside a combine (CombineOptions::stages), on the output cube, or on
+// a cube on disk with processCube().
+class CubeStage {
+public:
+    virtual ~CubeStage() {}
+    virtual void begin( FitsInfo & info) { Q_UNUSED( info); }
+    // n values of plane z starting with pixel (y * width + x); they can be changed in place
+    virtual void process( int z, qint64 pixel, double * values, qint64 n) = 0;
+    virtual void end() {}
+};
+
+// begin() of the stages one after another, each one sees info as the ones before left it;
+// end() of all of them
+void beginStages( const std::vector<CubeStage *> & stages, FitsInfo & info);
+void endStages( const std::vector<CubeStage *> & stages);
+
+// values outside of [min..max] become NaN
+class ClipStage : public CubeStage {
+public:
+    ClipStage( double min, double max) { _min = min; _max = max; }
+    void process( int z, qint64 pixel, double * values, qint64 n);
+protected:
+    double _min, _max;
+};
+
+// The values are stored as another BITPIX from here on: integers are rounded and
+// saturated (NaN is the BLANK), floats rounded to single precision. BSCALE/BZERO go away.
+class ConvertStage : public CubeStage {
+public:
+    ConvertStage( int bitpix);
+    void begin( FitsInfo & info);
+    void process( int z, qint64 pixel, double * values, qint64 n);
+protected:
+    int _bitpix;
+};
+
+// the plane statistics and the histogram, as --stats collects them
+class StatsStage : public CubeStage {
+public:
+    StatsStage();
+    ~StatsStage();
+    void begin( FitsInfo & info);
+    void process( int z, qint64 pixel, double * values, qint64 n);
+    // valid after begin()
+    const CubeStatistics & statistics() const { return * _stats; }
+protected:
+    CubeStatistics * _stats;
+};
+
+// writes the values into a new cube, with the header of the cube as it got to the stage
+class WriteStage : public CubeStage {
+public:
+    WriteStage( const QString & fileName);
+    ~WriteStage();
+    void begin( FitsInfo & info);
+    void process( int z, qint64 pixel, double * values, qint64 n);
+    void end();
+protected:
+    QString _fileName;
+    CubeWriter * _writer;
+    qint64 _planePixels;
+};
+
+// Pipeline filter that runs stages on the values of a combine, after the other filters.
+// The chunks are turned into doubles, passed through the stages and stored back, so the
+// stages can change the values that go into the output, but not their format.
+class CubeStageFilter : public ChannelFilter {
+public:
+    CubeStageFilter( ChunkFilter * next, int convert, const std::vector<CubeStage *> & stages);
+
+protected:
+    void processPlane( int output, int channel, qint64 pixel, char * data, qint64 n,
+                       const PixelFormat & fmt, const FitsInfo & info);
+
+    std::vector<CubeStage *> _stages;
+};
@@ -0,0 +1,102 @@
+/*
+ *   Copyright 2013 Pavol Federl (federl@gmail.com)
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ *
+ */
+
+#include <cerrno>
+#include <cstring>
+#include <cmath>
+
+#include <unistd.h>
+
+#include "cubewriter.h"
+
+using namespace std;
+
+// values converted per pwrite
+static const qint64 WriteRun = 64 * 1024;
+
+CubeWriter::CubeWriter( const QString & fileName, const FitsHeader & header)
+{
+    _fileName = fileName;
+    FitsHeader h = header;
+    _format.bitpix = h.intValue( "BITPIX");
+    _format.bscale = h.doubleValue( "BSCALE", 1);
+    _format.bzero = h.doubleValue( "BZERO", 0);
+    _format.hasBlank = _format.bitpix > 0 && h.findLine( "BLANK") >= 0;
+    _format.blank = _format.hasBlank ? h.intValue( "BLANK") : 0;
+    if( _format.bitpix != 8 && _format.bitpix != 16 && _format.bitpix != 32 && _format.bitpix != 64
+            && _format.bitpix != -32 && _format.bitpix != -64)
+        throw QString( "Cannot write cubes with BITPIX = %1").arg( _format.bitpix);
+    if( h.intValue( "NAXIS") != 3)
+        throw QString( "Cannot write %1: NAXIS is not 3").arg( fileName);
+    _naxis1 = h.intValue( "NAXIS1");
+    _naxis2 = h.intValue( "NAXIS2");
+    _naxis3 = h.intValue( "NAXIS3");
+
+    _file.setFileName( fileName);
+    if( ! _file.open( QFile::WriteOnly | QFile::Truncate) || ! h.write( _file) || ! _file.flush())
+        throw QString( "Cannot write the header of %1").arg( fileName);
+    _dataStart = _file.pos();
+    qint64 size = qint64( _naxis1) * _naxis2 * _naxis3 * (abs( _format.bitpix) / 8);
+    // sparse until written, the padding stays zeros
+    if( ! _file.resize( _dataStart + (size + 2879) / 2880 * 2880))
+        throw QString( "Could not resize %1").arg( fileName);
+}
+
+CubeWriter::~CubeWriter()
+{
+    _file.close();
+}
+
+void CubeWriter::write( qint64 first, const double * values, qint64 n)
+{
+    qint64 total = qint64( _naxis1) * _naxis2 * _naxis3;
+    if( first < 0 || n < 0 || first + n > total)
+        throw QString( "Values %1..%2 are outside of %3").arg( first).arg( first + n).arg( _fileName);
+    int size = abs( _format.bitpix) / 8;
+    vector<char> buff( qMin( n, WriteRun) * size);
+    while( n > 0) {
+        qint64 m = qMin( n, WriteRun);
+        storeValues( values, m, _format, & buff[0]);
+        const char * p = & buff[0];
+        qint64 left = m * size, offset = _dataStart + first * size;
+        while( left > 0) {
+            ssize_t k = pwrite( _file.handle(), p, size_t( left), offset);
+            if( k < 0 && errno == EINTR) continue;
+            if( k <= 0)
+                throw QString( "Failed to write to %1: %2").arg( _fileName).arg( strerror( errno));
+            p += k; left -= k; offset += k;
+        }
+        values += m; first += m; n -= m;
+    }
+}
+
+void CubeWriter::writePlane( int z, const vector<double> & plane)
+{
+    qint64 n = qint64( _naxis1) * _naxis2;
+    if( z < 0 || z >= _naxis3 || qint64( plane.size()) != n)
+        throw QString( "Plane %1 does not fit %2").arg( z).arg( _fileName);
+    write( z * n, & plane[0], n);
+}
+
+void CubeWriter::finish()
+{
+    if( ! _file.isOpen())
+        return;
+    if( fdatasync( _file.handle()) != 0)
+        throw QString( "Could not sync %1").arg( _fileName);
+    _file.close();
+}
@@ -0,0 +1,43 @@
+#pragma once
+
+#include <vector>
+#include <QFile>
+#include <QString>
+
+#include "convert.h"
+
+// Writes a FITS cube from physical values, the counterpart of CubeReader. The header is
+// written when the writer is created and the data segment gets its full size right away
+// (with the padding), so the values can be written in any order: every write goes to its
+// own offset, and several threads can write different parts of the cube at once.
+//
+// The values are stored in the format of the header: BSCALE/BZERO are taken off, integer
+// BITPIX are rounded and saturated and NaN becomes the BLANK.
+class CubeWriter {
+public:
+    // the header has to have NAXIS1..3 and END; throws QString if the file cannot be
+    // created
+    CubeWriter( const QString & fileName, const FitsHeader & header);
+    ~CubeWriter();
+
+    const QString & fileName() const { return _fileName; }
+    const PixelFormat & format() const { return _format; }
+    int width() const { return _naxis1; }
+    int height() const { return _naxis2; }
+    int depth() const { return _naxis3; }
+
+    // n values starting with value number 'first' of the data segment (x fastest)
+    void write( qint64 first, const double * values, qint64 n);
+    // the whole plane z, width * height values
+    void writePlane( int z, const std::vector<double> & plane);
+    // flushes the data to the disk and closes the file; the parts that were never written
+    // read as zeros
+    void finish();
+
+protected:
+    QString _fileName;
+    QFile _file;
+    PixelFormat _format;
+    int _naxis1, _naxis2, _naxis3;
+    qint64 _dataStart;
+};
@@ -20,6 +20,8 @@
 #include <algorithm>
 #include <iomanip>
 #include <vector>
+#include <cerrno>
+#include <cstring>
 
 #include <QFile>
 #include <QString>
@@ -28,164 +30,35 @@
 #include <QDir>
 #include <QFileInfo>
 #include <QTemporaryFile>
-#include <QTime>
-#include <cassert>
+#include <QRegExp>
+#include <QAtomicInt>
+#include <QThreadPool>
+#include <QRunnable>
+#include <QDateTime>
 
 #include "extractor.h"
+#include "pipeline.h"
+#include "clipkernels.h"
+#include "journal.h"
+#include "checksum.h"
+#include "metrics.h"
+#include "transpose.h"
+#include "tilecompress.h"
+#include "convert.h"
+#include "stats.h"
+#include "cubestage.h"
+#include "mosaic.h"
+#include "virtualcube.h"
+#include "preview.h"
+#include "overlap.h"
+
+#include <unistd.h>
+#ifdef Q_OS_LINUX
+#include <fcntl.h>
+#endif
 
 using namespace std;
 
-// this is used to sort the keys when writing header file
-// returns float for easier management down the road... :)
-static float keywordPriority( const QString & key)
-{
-    if( key == "SIMPLE") return 0;
-    if( key == "BITPIX") return 1;
-    if( key == "NAXIS") return 2;
-    if( key == "NAXIS1") return 3;
-    if( key == "NAXIS2") return 4;
-    if( key == "NAXIS3") return 5;
-    if( key == "NAXIS4") return 6;
-    if( key == "NAXIS5") return 7;
-    if( key == "END") return numeric_limits<float>::max();
-    return 1000000;
-}
-
-// FitsLine represents a single entry in the Fits header (I think it's called a card... :)
-struct FitsLine {
-    FitsLine( const QString & rawLine ) {
-        _raw = rawLine;
-    }
-    QString raw() { return _raw; }
-    QString key() { QString k, v, c; parse( k, v, c); return k; }
-    QString value() { QString k, v, c; parse( k, v, c); return v; }
-    QString comment() { QString k, v, c; parse( k, v, c); return c; }
-    // parse the line into key/value/comment
-    void parse( QString & key, QString & value, QString & comment ) {
-        // key is the first 8 characters (trimmed)
-        key = _raw.left(8).trimmed();
-        // by default, value & comment are empty
-        value = comment = QString();
-        // if there is no equal sign present, return the default values for value/comment, which is empty
-        if( _raw.mid( 8, 2).trimmed() != "=") return;
-        // find the start/end of the value
-        //   start = first non-white character
-        //   end   = last character of the value (if string, it's the closing quote, otherwise it's the last non-space
-        int vStart = 10, vEnd = -1;
-        while( _raw[vStart].isSpace()) { vStart ++; if( vStart >= 80) { vStart = -1; break; }}
-        if( vStart == -1) // entire line is empty after the '='
-            return;
-        if( _raw[vStart] != '\'') { // it's an unquoted value
-            // non-string value, find the end
-            vEnd = _raw.indexOf( '/', vStart + 1); if( vEnd != -1) vEnd --; else vEnd = 79;
-            //            vEnd = vStart + 1;
-            //            while( ! _raw[vEnd].isSpace()) { if( vEnd >= 80) break; else vEnd ++; }
-            //            vEnd --;
-        } else { // it's s quoted string
-            // temporarily remove all occurrences of double single-quotes and then find the next single quote
-            QString tmp = _raw; for(int i=0;i<=vStart;i++){tmp[i]=' ';} tmp.replace( "''", "..");
-            vEnd = tmp.indexOf( '\'', vStart + 1);
-            if( vEnd == -1) // we have an unterminated string here
-                throw QString( "Unterminated string in header for %1").arg(key);
-        }
-        // now that we know start/end, get the value
-        value = _raw.mid( vStart, vEnd - vStart + 1).trimmed();
-
-        // if this was a string value, get rid of the double single-quotes permanently, and remove the surrounding quotes too
-        //if( value[0] == '\'') value = value.mid( 1, value.length()-2).replace( "''", "'");
-
-        // is there a comment?
-        comment = _raw.mid( vEnd + 1).trimmed();
-        if( ! comment.isEmpty()) {
-            if( comment[0] != '/')
-                throw ("Syntax error in header: " + _raw.trimmed());
-            else
-                comment.remove(0,1);
-        }
-    }
-
-
-protected:
-    QString _raw;
-};
-
-// represents a FITS header
-struct FitsHeader
-{
-    // do the parse of the fits file
-    static FitsHeader parse( QFile & f );
-    // write the header to a file
-    bool write( QFile & f);
-    // was the parse successful?
-    bool isValid() const { return _valid; }
-    // find a line with a given key
-    int findLine( const QString & key ) {
-        for( size_t i = 0 ; i < _lines.size() ; i ++ )
-            if( _lines[i].key() == key )
-                return i;
-        return -1;
-    }
-    qint64 dataOffset() const { return _dataOffset; }
-    std::vector< FitsLine > & lines() { return _lines; }
-
-    // add a raw line to the header
-    void addRaw( const QString & line );
-
-    // sets a value in the header
-    void setIntValue( const QString & key, int value, const QString & comment = QString());
-    void setDoubleValue(const QString & pkey, double value, const QString & pcomment = QString());
-
-    // general access function to key/values, does not throw exceptions but can return
-    // variant with isValid() = false
-    QVariant getValue( const QString & key, QVariant defaultValue = QVariant());
-
-    // convenience functions that lookup key and convert it to requested type
-    // all these throw exceptions if (a) key is not defined (b) key does not have a value
-    // that can be converted to the requested type:
-
-    // find a line with 'key' and conver it's 'value' to integer
-    int intValue( const QString & key );
-    int intValue( const QString & key, int defaultValue);
-    QString stringValue( const QString & key );
-    QString stringValue( const QString & key, const QString & defaultValue);
-    double doubleValue( const QString & key );
-    double doubleValue( const QString & key, double defaultValue);
-
-
-protected:
-    // where does the data start? This is set only in parse()! Bad design, I know.
-    qint64 _dataOffset;
-    // is this header valid? This is also only set in parse();
-    bool _valid;
-    // the lines
-    std::vector< FitsLine > _lines;
-    // protected constructor
-    FitsHeader() { _valid = false; _dataOffset = 0; }
-    // convenienty 80 spaces string
-    static QString space80;
-};
-
-QString FitsHeader::space80 = "                                                                                ";
-
-// convenience function to convert fits string to a raw string (removing intial quotes & replacing all double quotes with single ones)
-static QString fitsString2raw( const QString & s)
-{
-    if( s.length() < 2) throw "fitsString2raw - string less than 2 characters.";
-    QString res = s;
-    // remove the leading and ending quotes
-    res[0] = res[ res.length()-1] = ' ';
-    // replace all double single-quotes with a single quote
-    res.replace( "''", "'");
-
-    return res;
-}
-
-// remove leading/trailing spaces from a fits string
-static QString fitsStringTrimmed( const QString & s)
-{
-    return QString( "'%1'").arg(fitsString2raw(s).trimmed());
-}
-
 // wrapper around regular QFile::read() - it makes sure to read in requested size 's' if possible
 bool blockRead( QFile & f, char * ptr, qint64 s)
 {
@@ -220,218 +93,6 @@ bool blockWrite( QFile & f, const char * ptr, qint64 s)
     return true;
 }
 
-// fits header parser
-FitsHeader FitsHeader::parse( QFile & f)
-{
-    FitsHeader hdr;
-
-    // read in header one 'line' (or card) at a time, which is 80 bytes
-    // until we find one that conains END
-    while( 1)
-    {
-        // read in another header block
-        char block[80];
-        if( ! blockRead( f, block, 80)) {
-            cerr << "Error: FitsHeader::parse() could not read card.\n";
-            return hdr;
-        }
-
-        // clean up the block by converting anything outside of ASCII [32..126]
-        // to spaces
-        for( size_t i = 0 ; i < sizeof( block) ; i ++ )
-            if( block[i] < 32 || block[i] > 126)
-                block[i] = ' ';
-
-        // data offset moves
-        hdr._dataOffset += sizeof( block);
-
-        // parse the block: one line at a time (there are 36 lines of 80 chars each,
-        // but they are not \0 terminated!!!)
-        QString rawLine = QByteArray( (char *) block, sizeof( block) );
-        // add this line to the header
-        hdr._lines.push_back( rawLine);
-        // if this is the 'END' line, terminate the parse
-        if( rawLine.startsWith( "END     " ))
-            break;
-    }
-    // adjust offset to be a multiple of 2880
-    hdr._dataOffset = ((hdr._dataOffset -1)/ 2880 + 1) * 2880;
-    // return this header
-    hdr._valid = true;
-    return hdr;
-}
-
-// will write out the header to a file
-// after sorting the lines by keyword priority and if keyword priority is the same then by
-// the current line position
-bool FitsHeader::write(QFile & f)
-{
-    // sort the lines based on a) keword priority, b) their current order
-    //vector< pair< QString, pair< double, int> > > lines;
-    typedef pair<QString, pair<double,int> > SortLine;
-    vector<SortLine> lines;
-    for( size_t i = 0 ; i < _lines.size() ; i ++ )
-        lines.push_back( make_pair(_lines[i].raw(), make_pair( keywordPriority( _lines[i].key()), i)));
-    // c++ does not support anonymous functions, but it does support local structures/classes with
-    // static functions... go figure :)
-    struct local { static bool cmp( const SortLine & v1, const SortLine & v2 ) {
-            // use std::pair built in comparison, it compares first to first, and only if equal
-            // it compares second to second
-            return( v1.second < v2.second );
-        }};
-    std::sort( lines.begin(), lines.end(), local::cmp);
-    // put all strings into one big array of bytes for wrting
-    QByteArray block;
-    for( size_t i = 0 ; i < lines.size() ; i ++ )
-        block.append( (lines[i].first + space80).left(80)); // paranoia
-    // pad with spaces so that the block is a multiple of 2880 bytes
-    while( block.size() % 2880 )
-        block.append( ' ');
-    //    cerr << "FitsHeader::write() block size = " << block.size() << " with " << lines.size() << " lines\n";
-    //    for( size_t i = 0 ; i < lines.size() ; i ++ )
-    //        cerr << lines[i].first.toStdString() << "\n";
-    if( ! blockWrite( f, block.constData(), block.size()))
-        return false;
-    else
-        return true;
-}
-
-// get a value from the header as int - throwing an exception if this fails!
-int FitsHeader::intValue( const QString & key)
-{
-    QVariant value = getValue( key);
-    if( ! value.isValid())
-        throw QString("Could not find key %1 in fits file.").arg(key);
-    bool ok;
-    int result = value.toInt( & ok);
-    if( ! ok )
-        throw QString("Found %1=%2 in fits file but expected an integer.").arg(key).arg(value.toString());
-
-    // value converted, return it
-    return result;
-}
-
-// get a value from the header as int - throwing an exception if this fails!
-int FitsHeader::intValue( const QString & key, int defaultValue)
-{
-    QVariant value = getValue( key);
-    if( ! value.isValid())
-        return defaultValue;
-    bool ok;
-    int result = value.toInt( & ok);
-    if( ! ok )
-        throw QString("Found %1=%2 in fits file but expected an integer.").arg(key).arg(value.toString());
-
-    // value converted, return it
-    return result;
-}
-
-
-// get a value from the header as double - throwing an exception if this fails!
-double FitsHeader::doubleValue( const QString & key)
-{
-    QVariant value = getValue( key);
-    if( ! value.isValid())
-        throw QString("Could not find key %1 in fits file.").arg(key);
-    bool ok;
-    double result = value.toDouble( & ok);
-    if( ! ok )
-        throw QString("Found %1=%2 in fits file but expected a double.").arg(key).arg(value.toString());
-
-    // value converted, return it
-    return result;
-}
-
-// get a value from the header as double - substituting default value if needed!
-double FitsHeader::doubleValue( const QString & key, double defaultValue)
-{
-    QVariant value = getValue( key);
-    if( ! value.isValid())
-        return defaultValue;
-    bool ok;
-    double result = value.toDouble( & ok);
-    if( ! ok )
-        throw QString("Found %1=%2 in fits file but expected a double.").arg(key).arg(value.toString());
-
-    // value converted, return it
-    return result;
-}
-
-
-// get a value from the header as string - throwing an exception if this fails!
-QString FitsHeader::stringValue( const QString & key)
-{
-    QVariant value = getValue( key);
-    if( ! value.isValid())
-        throw QString("Could not find key %1 in fits file.").arg(key);
-    return value.toString();
-}
-
-// get a value from the header as string - throwing an exception if this fails!
-QString FitsHeader::stringValue( const QString & key, const QString & defaultValue)
-{
-    QVariant value = getValue( key);
-    if( ! value.isValid())
-        return defaultValue;
-    return value.toString();
-}
-
-
-// get a value from the header as int
-QVariant FitsHeader::getValue( const QString & key, QVariant defaultValue)
-{
-    // find the line with this key
-    int ind = findLine( key);
-
-    // if there is no such line, report error
-    if( ind < 0 )
-        return defaultValue;
-
-    // return the value as qvariant
-    return QVariant( _lines[ind].value());
-}
-
-// set an integer value
-void FitsHeader::setIntValue(const QString & pkey, int value, const QString & pcomment)
-{
-    QString key = (pkey + space80).left(8);
-    QString comment = (pcomment + space80).left( 47);
-    // construct a line based on the parameters
-    QString rawLine = QString( "%1= %2 /  %3").arg( key, -8).arg( value, 20).arg( comment);
-    rawLine = (rawLine + space80).left(80); // just in case :)
-    // find a line with this key so that we can decide if we are adding a new line or
-    // replacing an existing one
-    int ind = findLine( pkey);
-    if( ind < 0 )
-        _lines.push_back( rawLine);
-    else
-        _lines[ind] = rawLine;
-}
-
-// set a double value
-void FitsHeader::setDoubleValue(const QString & pkey, double value, const QString & pcomment)
-{
-    QString space80 = "                                                                                ";
-    QString key = (pkey + space80).left(8);
-    QString comment = (pcomment + space80).left( 47);
-    // construct a line based on the parameters
-    QString rawLine = QString( "%1= %2 /  %3").arg( key, -8).arg( value, 20, 'G', 10).arg( comment);
-    rawLine = (rawLine + space80).left(80); // just in case :)
-    // find a line with this key so that we can decide if we are adding a new line or
-    // replacing an existing one
-    int ind = findLine( pkey);
-    if( ind < 0 )
-        _lines.push_back( rawLine);
-    else
-        _lines[ind] = rawLine;
-}
-
-// insert a raw line into fits - no syntax checking is done, except making sure it's padded to 80 chars
-void FitsHeader::addRaw(const QString & line)
-{
-    _lines.push_back( (line + space80).left(80));
-}
-
 // simple 3D array
 template <class T> struct M3D {
     M3D( int dx, int dy, int dz ) {
@@ -470,40 +131,6 @@ template <class T> struct M2D {
     int _dx, _dy;
 };
 
-// buffered 3D FITS cube accessor (by index x,y,z), specific to BITPIX = -32 (i.e. floats)
-// almost acts as a 3D matrix but the data is stored on the disk
-struct M3DFloatFile{
-    M3DFloatFile( QFile * fp, qint64 offset, int dx, int dy, int dz) {
-        _fp = fp; _offset = offset; _dx = dx; _dy = dy; _dz = dz;
-        _buffStart = _buffEnd = -1;
-        _buffSize = 4096;
-        _buff = new char[ _buffSize];
-        if( ! _buff) throw QString( "Could not allocate buffer");
-    }
-    ~M3DFloatFile() { delete[] _buff; }
-    float operator()(int x, int y, int z) {
-        qint64 ind = z; ind = ind * _dy + y; ind = ind * _dx + x; ind *= 4; ind += _offset;
-        // if buffer does not yet point to what we need, read in stuff into buffer
-        if( ind < _buffStart || ind + 3 > _buffEnd ) {
-            qint64 req = _buffSize;
-            if( ! _fp-> seek( ind)) throw QString( "Failed to seek to extract a float");
-            qint64 len = _fp-> read( _buff, req);
-            // cerr << "Reading " << ind << " + " << req << " --> " << len << "\n";
-            if( len < 4) throw QString( "Failed to read");
-            _buffStart = ind;
-            _buffEnd = _buffStart + len - 1;
-        }
-        char * p = _buff + (ind - _buffStart);
-        float val; uchar * d = (uchar *) (& val);
-        d[0] = p[3]; d[1] = p[2]; d[2] = p[1]; d[3] = p[0];
-        return val;
-    }
-
-    QFile * _fp; qint64 _offset; int _dx, _dy, _dz;
-    char * _buff;
-    qint64 _buffStart, _buffEnd, _buffSize;
-};
-
 // given a raw bitpix value (as found in FITS files), returns the number of bytes
 // which is basically abs(bitpix)/8
 static int bitpixToSize( int bitpix )
@@ -518,36 +145,9 @@ static int bitpixToSize( int bitpix )
 }
 
 
-// values extracted from the fits header
-struct FitsInfo {
-    int bitpix;
-    int naxis;
-    int naxis1, naxis2, naxis3;
-    double bscale, bzero;
-    double crpix1, crpix2, crpix3, crval1, crval2, crval3, cdelt1, cdelt2, cdelt3;
-    QString ctype1, ctype2, ctype3, cunit3, bunit;
-    double equinox;
-    int blank; bool hasBlank;
-    qint64 dataOffset, dataSize;
-    QString fileName;
-    double frameStart; // frequency of the first frame
-    double frameEnd; // frequency of the last frame
-    double frameNext; // frequence of the next frame if there should be one
-};
-
 // gets parsed (relevant information about a FITS file)
-FitsInfo parse( const QString & fname)
+FitsInfo parse( const FitsHeader & hdr, const QString & fname)
 {
-    //    cerr << QString( "parsing header from %1\n").arg( fname).toStdString();
-    // open raw file for reading
-    QFile fp( fname);
-    if( ! fp.open( QFile::ReadOnly))
-        throw QString( "Could not open FITS file for reading: %1").arg( fname);
-    // read in the header
-    FitsHeader hdr = FitsHeader::parse(fp);
-    if( ! hdr.isValid())
-        throw QString( "Could not parse FITS header from: %1").arg( fname);
-
     // extract some parameters from the fits file and also validate it a bit
     FitsInfo fits;
     fits.fileName = fname;
@@ -593,16 +193,10 @@ FitsInfo parse( const QString & fname)
     fits.bunit = hdr.stringValue( "BUNIT", "''"); fits.bunit = fitsStringTrimmed( fits.bunit);
     fits.equinox = hdr.doubleValue( "EQUINOX", 2000.0);
 
-    // make sure the data segment following header is big enough for the data
-    qint64 inputSize = fp.size();
     fits.dataSize = qint64(fits.naxis1) * fits.naxis2 * fits.naxis3 * bitpixToSize( fits.bitpix);
     fits.dataOffset = hdr.dataOffset();
-    if( fits.dataOffset + fits.dataSize > inputSize)
-        throw QString( "Invalid fits file size. Maybe accidentally truncated?");
-    // position the input to the offset
-    if( ! fp.seek( fits.dataOffset))
-        throw QString( "Could not read the data (seek failed)");
-    fp.close();
+    // keep the whole header around so that nobody has to read it again
+    fits.header = hdr;
 
     // figure out starting value of the frame
     fits.frameStart = (1-fits.crpix3) * fits.cdelt3 + fits.crval3;
@@ -611,82 +205,70 @@ FitsInfo parse( const QString & fname)
     return fits;
 }
 
+FitsInfo parse( const QString & fname)
+{
+    //    cerr << QString( "parsing header from %1\n").arg( fname).toStdString();
+    // open raw file for reading
+    QFile fp( fname);
+    if( ! fp.open( QFile::ReadOnly))
+        throw QString( "Could not open FITS file for reading: %1").arg( fname);
+    // read in the header
+    FitsHeader hdr = FitsHeader::parse(fp);
+    if( ! hdr.isValid())
+        throw QString( "Could not parse FITS header from: %1").arg( fname);
+    FitsInfo fits = parse( hdr, fname);
+
+    // make sure the data segment following header is big enough for the data
+    qint64 inputSize = fp.size();
+    if( fits.dataOffset + fits.dataSize > inputSize)
+        throw QString( "Invalid fits file size. Maybe accidentally truncated? %1").arg( fname);
+    // position the input to the offset
+    if( ! fp.seek( fits.dataOffset))
+        throw QString( "Could not read the data (seek failed)");
+    fp.close();
+    return fits;
+}
 
-// buffered 3D FITS cube accessor (by index x,y,z)
-// almost acts as a 3D matrix but the data is stored on the disk
-struct M3DBitpixFile {
-    M3DBitpixFile( FitsInfo fits, QFile * fp, qint64 offset, int dx, int dy, int dz) {
-        _fp = fp; _offset = offset; _dx = dx; _dy = dy; _dz = dz; _fits = fits;
-        _dataSize = bitpixToSize( _fits.bitpix);
-        _buffStart = _buffEnd = -1; // indicate invalid buffer
-        _buffSize = 4096;
-        _buff = new char[ _buffSize];
-        if( ! _buff) throw QString( "Could not allocate buffer");
-    }
-    ~M3DBitpixFile() { delete[] _buff; }
-    double operator()(int x, int y, int z) {
-        qint64 ind = z; ind = ind * _dy + y; ind = ind * _dx + x; ind *= _dataSize; ind += _offset;
-        // if buffer does not yet point to what we need, read in stuff into buffer
-        if( ind < _buffStart || ind + _dataSize -1 > _buffEnd ) {
-            qint64 req = _buffSize;
-            if( ! _fp-> seek( ind)) throw QString( "Failed to seek to extract data");
-            qint64 len = _fp-> read( _buff, req);
-            if( len < _dataSize) {
-                throw QString( "failed to read the minimum (%1").arg( _dataSize);
-            }
-            _buffStart = ind;
-            _buffEnd = _buffStart + len - 1;
-        }
-        char * p = _buff + (ind - _buffStart);
-        // put the endian-adjusted bytes to 'tmp'
-        char tmpBuff[8];
-        std::reverse_copy( p, p + _dataSize, tmpBuff);
-
-        // convert the raw bytes to an initial double
-        double original; char * tmp = tmpBuff;
-        switch( _fits.bitpix) {
-        case   8: original = double( * (quint8 *) tmp); break;
-        case  16: original = double( * (qint16 *) tmp); break;
-        case  32: original = double( * (qint32 *) tmp); break;
-        case  64: original = double( * (qint64 *) tmp); break;
-        case -32: original = double( * ( float *) tmp); break;
-        case -64: original = double( * (double *) tmp); break;
-        default: throw QString( "Illegal value BITPIX = %1").arg( _fits.bitpix);
-        }
-
-        // check to see if we should apply BLANK
-        if( _fits.hasBlank && original == _fits.bzero + _fits.blank * _fits.bscale)
-            return std::numeric_limits<double>::quiet_NaN();
-        else
-            return _fits.bzero + _fits.bscale * original;
-    }
-
-    QFile * _fp; qint64 _offset; int _dx, _dy, _dz, _dataSize;
-    char * _buff;
-    qint64 _buffStart, _buffEnd, _buffSize;
-    FitsInfo _fits;
-
-    //    double convertRawDataToDouble( char * p)
-    //    {
-    //        double original;
-    //        switch( _fits.bitpix) {
-    //        case   8: original = double( * (quint8 *) p); break;
-    //        case  16: original = double( * (qint16 *) p); break;
-    //        case  32: original = double( * (qint32 *) p); break;
-    //        case  64: original = double( * (qint64 *) p); break;
-    //        case -32: original = double( * ( float *) p); break;
-    //        case -64: original = double( * (double *) p); break;
-    //        default: throw QString( "Illegal value BITPIX = %1").arg( _fits.bitpix);
-    //        }
-    //        // check to see if we should apply BLANK
-    //        if( _fits.hasBlank && original == _fits.bzero + _fits.blank * _fits.bscale)
-    //            return std::numeric_limits<double>::quiet_NaN();
-    //        else
-    //            return _fits.bzero + _fits.bscale * original;
-    //    }
 
+// parses one header on the thread pool
+struct HeaderScanTask : public QRunnable {
+    HeaderScanTask( const QString & fname, FitsInfo * result, QString * error) {
+        _fname = fname; _result = result; _error = error;
+    }
+    void run() {
+        try {
+            * _result = parse( _fname);
+        } catch ( const char * msg) {
+            * _error = msg;
+        } catch ( const QString & msg) {
+            * _error = msg;
+        } catch ( ... ) {
+            * _error = QString( "Unknown error while parsing %1").arg( _fname);
+        }
+    }
+    QString _fname; FitsInfo * _result; QString * _error;
 };
 
+// parses the headers of all files in parallel, every file is opened and read only once
+static vector<FitsInfo> scanHeaders( const QStringList & fnames)
+{
+    vector<FitsInfo> result( fnames.size());
+    vector<QString> errors( fnames.size());
+    {
+        QThreadPool pool;
+        // reading headers is latency bound (NFS), not CPU bound, so use more threads than cores
+        pool.setMaxThreadCount( qMax( 1, qMin( fnames.size(), 32)));
+        for( int i = 0 ; i < fnames.size() ; i ++ )
+            pool.start( new HeaderScanTask( fnames[i], & result[i], & errors[i]));
+        pool.waitForDone();
+    }
+    // report the first error in the order the files were given
+    for( size_t i = 0 ; i < errors.size() ; i ++ )
+        if( ! errors[i].isEmpty())
+            throw errors[i];
+    return result;
+}
+
 QString formatBytes( qint64 size)
 {
     double s = size;
@@ -713,6 +295,20 @@ QString formatSeconds( double s)
 
 }
 
+// a stream buffer that takes everything and keeps nothing
+class NullBuffer : public std::streambuf {
+protected:
+    int overflow( int c) { return c; }
+    std::streamsize xsputn( const char *, std::streamsize n) { return n; }
+};
+
+std::ostream & combineLog( const CombineOptions & options)
+{
+    static NullBuffer nullBuffer;
+    static std::ostream nullStream( & nullBuffer);
+    return options.quiet ? nullStream : cerr;
+}
+
 struct FitsInfoLess {
     bool operator()( const FitsInfo & f1, const FitsInfo & f2) {
         return f1.frameStart < f2.frameStart;
@@ -725,54 +321,58 @@ struct FitsInfoGreater {
     }
 };
 
-static void checkForCompatibility( vector<FitsInfo> & fileInfo)
+// with 'convert' the values are converted to a common BITPIX on the way, so BITPIX, BSCALE
+// and BZERO may differ between the inputs; with 'merge' overlapping channels are expected
+static void checkForCompatibility( vector<FitsInfo> & fileInfo, bool convert, bool merge, ostream & log)
 {
     FitsInfo & f1 = fileInfo[0];
-    bool errors = false;
+    bool errors = false, formatErrors = false;
     for( size_t i = 1 ; i < fileInfo.size() ; i ++ ) {
         FitsInfo & f2 = fileInfo[i];
         string finfo = QString( "\n  %1\n  %2\n").arg(f1.fileName).arg(f2.fileName).toStdString();
-        if( f1.bitpix != f2.bitpix) {
-            cerr << "*** ERROR *** BITPIX incompatible between files:" << finfo; errors = true;
+        if( f1.bitpix != f2.bitpix && ! convert) {
+            log << "*** ERROR *** BITPIX incompatible between files:" << finfo; formatErrors = true;
         }
         if( f1.naxis != f2.naxis) {
-            cerr << "*** ERROR *** NAXIS incompatible between files:" << finfo; errors = true;
+            log << "*** ERROR *** NAXIS incompatible between files:" << finfo; errors = true;
         }
         if( f1.naxis1 != f2.naxis1) {
-            cerr << "*** ERROR *** NAXIS1 incompatible between files:" << finfo; errors = true;
+            log << "*** ERROR *** NAXIS1 incompatible between files:" << finfo; errors = true;
         }
         if( f1.naxis2 != f2.naxis2) {
-            cerr << "*** ERROR *** NAXIS2 incompatible between files:" << finfo; errors = true;
+            log << "*** ERROR *** NAXIS2 incompatible between files:" << finfo; errors = true;
         }
-        if( f1.bscale != f2.bscale) {
-            cerr << "*** ERROR *** BSCALE incompatible between files:" << finfo; errors = true;
+        if( f1.bscale != f2.bscale && ! convert) {
+            log << "*** ERROR *** BSCALE incompatible between files:" << finfo; formatErrors = true;
         }
-        if( f1.bzero != f2.bzero) {
-            cerr << "*** ERROR *** BZERO incompatible between files:" << finfo; errors = true;
+        if( f1.bzero != f2.bzero && ! convert) {
+            log << "*** ERROR *** BZERO incompatible between files:" << finfo; formatErrors = true;
         }
         if( f1.crpix1 != f2.crpix1) {
-            cerr << "*** ERROR *** CRPIX1 incompatible between files:" << finfo; errors = true;
+            log << "*** ERROR *** CRPIX1 incompatible between files:" << finfo; errors = true;
         }
         if( f1.crpix2 != f2.crpix2) {
-            cerr << "*** ERROR *** CRPIX2 incompatible between files:" << finfo; errors = true;
+            log << "*** ERROR *** CRPIX2 incompatible between files:" << finfo; errors = true;
         }
         if( f1.crval1 != f2.crval1) {
-            cerr << "*** ERROR *** CRVAL1 incompatible between files:" << finfo; errors = true;
+            log << "*** ERROR *** CRVAL1 incompatible between files:" << finfo; errors = true;
         }
         if( f1.crval2 != f2.crval2) {
-            cerr << "*** ERROR *** CRVAL2 incompatible between files:" << finfo; errors = true;
+            log << "*** ERROR *** CRVAL2 incompatible between files:" << finfo; errors = true;
         }
         if( f1.cdelt1 != f2.cdelt1) {
-            cerr << "*** ERROR *** CDELT1 incompatible between files:" << finfo; errors = true;
+            log << "*** ERROR *** CDELT1 incompatible between files:" << finfo; errors = true;
         }
         if( f1.cdelt2 != f2.cdelt2) {
-            cerr << "*** ERROR *** CDELT2 incompatible between files:" << finfo; errors = true;
+            log << "*** ERROR *** CDELT2 incompatible between files:" << finfo; errors = true;
         }
         if( f1.cdelt3 != f2.cdelt3) {
-            cerr << "*** ERROR *** CDELT3 incompatible between files:" << finfo; errors = true;
+            log << "*** ERROR *** CDELT3 incompatible between files:" << finfo; errors = true;
         }
     }
-    if( errors) throw "Incompatible FITS files.";
+    if( formatErrors)
+        log << "Use --convert -32 (or -64) to combine cubes stored in different formats.\n";
+    if( errors || formatErrors) throw CubeError( CubeError::InvalidArgument, "Incompatible FITS files.");
 
     // now check if they cover a consecutive range in the 3rd axis
 //    double currStart = f1.frameStart;
@@ -784,62 +384,122 @@ static void checkForCompatibility( vector<FitsInfo> & fileInfo)
         if( f1.cdelt3 < 0) diff = - diff;
 //        cerr << QString("diff = %1 (%2..%3)\n").arg(diff,20,'f').arg(f2.frameStart,20,'f').arg(currEnd,20,'f').toStdString();
         if( diff / fabs(f1.cdelt3) > fabs( f1.cdelt3 / 1e6)) {
-            cerr << "*** WARNING *** big gap (" << diff << ") between "
-                 << QFileInfo(f2.fileName).fileName().toStdString() << " and "
-                 << QFileInfo(f2.fileName).fileName().toStdString() << "\n";
+            log << "*** WARNING *** big gap (" << diff << ") between "
+                << QFileInfo(f2.fileName).fileName().toStdString() << " and "
+                << QFileInfo(f2.fileName).fileName().toStdString() << "\n";
         }
-        if( diff / fabs(f1.cdelt3) < -fabs( f1.cdelt3 / 1e6)) {
-            cerr << "*** WARNING *** big overlap (" << diff << ") between "
-                 << QFileInfo(f2.fileName).fileName().toStdString() << " and "
-                 << QFileInfo(f2.fileName).fileName().toStdString() << "\n";
+        if( diff / fabs(f1.cdelt3) < -fabs( f1.cdelt3 / 1e6) && ! merge) {
+            log << "*** WARNING *** big overlap (" << diff << ") between "
+                << QFileInfo(f2.fileName).fileName().toStdString() << " and "
+                << QFileInfo(f2.fileName).fileName().toStdString() << "\n";
         }
 //        currStart = f2.frameStart;
         currEnd = f2.frameStart + f2.cdelt3 * f2.naxis3;
     }
 }
 
-void clipData( char * buff, qint64 n, double min, double max, FitsInfo & info) {
-    if( info.bitpix != -32) {
-        static bool once = false;
-        if( ! once) {
-            once = true;
-            std::cerr << "Cannot apply data clipping to BITPIX = " << info.bitpix << "\n";
-            return;
-        }
+void clipData( char * buff, qint64 n, double min, double max, const FitsInfo & info) {
+    // integers are not clipped, reportFilter() says so
+    if( info.bitpix != -32 && info.bitpix != -64)
+        return;
+    if( n % bitpixToSize( info.bitpix)) throw "Data chunk not a multiple of the pixel size...grrr";
+    if( info.bitpix == -32)
+        clipFloat32BE( buff, n, min, max);
+    else
+        clipFloat64BE( buff, n, min, max);
+}
+
+// pipeline filter that clips the values of every chunk
+struct ClipFilter : public ChunkFilter {
+    ClipFilter( double min, double max) { _min = min; _max = max; }
+    void process( PipelineChunk & chunk, const FitsInfo & info) {
+        clipData( chunk.data, chunk.size, _min, _max, info);
+    }
+    double _min, _max;
+};
+
+// Pipeline filter that converts the values of every input to the same BITPIX, with the
+// scaling and BLANKs of the input applied. The next filter (clipping) then sees the
+// converted values.
+struct ConvertFilter : public ChunkFilter {
+    ConvertFilter( int bitpix, ChunkFilter * next) {
+        _out.bitpix = bitpix; _out.bscale = 1; _out.bzero = 0; _out.hasBlank = false; _out.blank = 0;
+        _outInfo.bitpix = bitpix; _outInfo.bscale = 1; _outInfo.bzero = 0; _outInfo.hasBlank = false;
+        _outInfo.blank = 0;
+        _next = next;
     }
-    if( n % sizeof(float)) throw "Data chunk not size of float...grrr";
-    for( int i = 0 ; i < n ; i += sizeof(float)) {
-        char * valPtr = buff + i;
-        float val;
-        // endian fix
-        char * p = (char *) (& val);
-        p[0] = valPtr[3];
-        p[1] = valPtr[2];
-        p[2] = valPtr[1];
-        p[3] = valPtr[0];
-        if( val < min || val > max)
-            val = std::numeric_limits<float>::quiet_NaN();
-        // restore endian
-        valPtr[3] = p[0];
-        valPtr[2] = p[1];
-        valPtr[1] = p[2];
-        valPtr[0] = p[3];
+    void process( PipelineChunk & chunk, const FitsInfo & info) {
+        chunk.size = convertPixels( chunk.data, chunk.size, pixelFormat( info), _out);
+        if( _next)
+            _next-> process( chunk, _outInfo);
     }
-}
+    qint64 outputSize( qint64 size, const FitsInfo & info) const {
+        return convertedSize( size, info.bitpix, _out.bitpix);
+    }
+    qint64 inputSize( qint64 size, const FitsInfo & info) const {
+        // the input has to fit before the conversion too
+        return qMin( size, convertedSize( size, _out.bitpix, info.bitpix));
+    }
+    PixelFormat _out;
+    // all that the next filter needs to know about the converted values
+    FitsInfo _outInfo;
+    ChunkFilter * _next;
+};
 
-// combine cubes into one
-void combineFITS( const QStringList & inputFilenames, const QString & outputFileName )
+// Pipeline filter that collects the statistics of the planes of every output. It runs after
+// the other filters, so it sees the values as they go into the output.
+struct StatsFilter : public ChannelFilter {
+    StatsFilter( ChunkFilter * next, int convert) : ChannelFilter( next, convert) {}
+    // the statistics of the next output
+    void addOutput( CubeStatistics * stats) { _stats.push_back( stats); }
+    void processPlane( int output, int channel, qint64 pixel, char * data, qint64 n,
+                       const PixelFormat & fmt, const FitsInfo & info) {
+        _stats[ output]-> add( data, n * (abs( fmt.bitpix) / 8), fmt, channel,
+                               qint64( info.naxis1) * info.naxis2, pixel);
+    }
+    vector<CubeStatistics *> _stats;
+};
+
+// Pipeline filter that feeds the preview pyramids of the outputs, after the other filters
+// like the statistics.
+struct PreviewFilter : public ChannelFilter {
+    PreviewFilter( ChunkFilter * next, int convert) : ChannelFilter( next, convert) {}
+    // the preview of the next output
+    void addOutput( PreviewPyramid * preview) { _previews.push_back( preview); }
+    void processPlane( int output, int channel, qint64 pixel, char * data, qint64 n,
+                       const PixelFormat & fmt, const FitsInfo &) {
+        _previews[ output]-> add( data, n * (abs( fmt.bitpix) / 8), fmt, channel, pixel);
+    }
+    vector<PreviewPyramid *> _previews;
+};
+
+// everything needed to produce one combined cube
+struct CombinePlan {
+    vector<FitsInfo> fileInfo; // inputs, sorted by frequency
+    int combinedNaxis3;
+    QString outputFileName;
+    // all the inputs as they were, when overlapping channels are merged
+    vector<OverlapSource> overlaps;
+};
+
+// parses the headers of all inputs, sorts them by frequency and makes sure they can be combined
+static CombinePlan planCombine( const QStringList & inputFilenames, const QString & outputFileName,
+                                const CombineOptions & options)
 {
+    ostream & log = combineLog( options);
+    CombinePlan plan;
+    plan.outputFileName = outputFileName;
+
     // parse all headers from the files info FitsInfo structures
-    cerr << "Parsing all headers:\n";
+    log << "Parsing all headers:\n";
     int combinedNaxis3 = 0;
-    vector<FitsInfo> fileInfo;
+    vector<FitsInfo> & fileInfo = plan.fileInfo;
+    fileInfo = scanHeaders( inputFilenames);
     {
-        for( int i = 0 ; i < inputFilenames.size() ; i ++ ) {
-            FitsInfo fits = parse( inputFilenames[i]);
-            fileInfo.push_back( fits);
+        for( size_t i = 0 ; i < fileInfo.size() ; i ++ ) {
+            const FitsInfo & fits = fileInfo[i];
             combinedNaxis3 += fits.naxis3;
-            cerr << QString("  %1 freq: %2..%3,%4\n")
+            log << QString("  %1 freq: %2..%3,%4\n")
                     .arg(QFileInfo(fits.fileName).fileName())
                     .arg(fits.frameStart,0,'f')
                     .arg(fits.frameEnd,0,'f')
@@ -847,101 +507,950 @@ void combineFITS( const QStringList & inputFilenames, const QString & outputFile
                     .toStdString();
         }
     }
-    cerr << "Found " << combinedNaxis3 << " frames.\n";
+    log << "Found " << combinedNaxis3 << " frames.\n";
+    plan.combinedNaxis3 = combinedNaxis3;
 
     // sort the files based on frequency
     {
-        FitsInfo fits = parse( fileInfo[0].fileName);
-        if( fits.cdelt3 < 0) {
-            cerr << "Sorting by freq. in descending order:\n";
+        if( fileInfo[0].cdelt3 < 0) {
+            log << "Sorting by freq. in descending order:\n";
             std::sort( fileInfo.begin(), fileInfo.end(), FitsInfoGreater());
         } else {
-            cerr << "Sorting by freq. in ascending order:\n";
+            log << "Sorting by freq. in ascending order:\n";
             std::sort( fileInfo.begin(), fileInfo.end(), FitsInfoLess());
         }
         for( size_t i = 0 ; i < fileInfo.size() ; i ++ )
-            cerr << QString("  %1").arg(fileInfo[i].fileName).toStdString() << "\n";
+            log << QString("  %1").arg(fileInfo[i].fileName).toStdString() << "\n";
     }
 
     // make sure fits headers are compatible
-    std::cerr << "Checking for compatibility\n";
-    checkForCompatibility( fileInfo);
+    log << "Checking for compatibility\n";
+    checkForCompatibility( fileInfo, options.convert != 0, options.mergeOverlaps, log);
 
-    // start writing the output
-    QFile ofp( outputFileName);
-    if( ! ofp.open( QFile::WriteOnly | QFile::Truncate))
-        throw QString( "Cannot open %1 for writing.").arg( outputFileName);
-
-    // parse the header of the first file
-    QFile fp1( fileInfo[0].fileName); if( ! fp1.open( QFile::ReadOnly)) throw QString("Cannot re-open %1").arg(inputFilenames[0]);
-    FitsHeader hdr1 = FitsHeader::parse( fp1);
-    fp1.close();
-
-    // prepare the output header - by copying the original header
-    FitsHeader outHeader = hdr1;
-    outHeader.setIntValue( "NAXIS3", combinedNaxis3);
+    return plan;
+}
+
+// the weight cube that goes with a cube, e.g. GALFACTS_N1_0001_Weightcube.fits for
+// GALFACTS_N1_0001_Icube.fits; an empty string if the name does not follow the pattern
+static QString weightCubeName( const QString & fileName)
+{
+    QFileInfo finfo( fileName);
+    QRegExp rx( "(.*)_(I|Q|U|V|Weight)cube\\.fits");
+    if( ! rx.exactMatch( finfo.fileName()))
+        return QString();
+    return QDir( finfo.path()).filePath( rx.cap( 1) + "_Weightcube.fits");
+}
+
+// Sets the plan up for merging overlapping channels: every input gets its place on the
+// channel grid of the first one, and the channels an input shares with the inputs before
+// it are cut off its front, the OverlapFilter blends them into the ones streamed already.
+// weightFiles are the weight cubes of the inputs, in the same order. A gap between the
+// inputs, or channels that are not on the grid, cannot be merged.
+static void mergeOverlaps( CombinePlan & plan, const QStringList & weightFiles, ostream & log)
+{
+    vector<FitsInfo> & fileInfo = plan.fileInfo;
+    const FitsInfo & f0 = fileInfo[0];
+    vector<OverlapSource> sources;
+    int end = 0;
+    for( size_t i = 0 ; i < fileInfo.size() ; i ++ ) {
+        const FitsInfo & info = fileInfo[i];
+        double pos = (info.frameStart - f0.frameStart) / f0.cdelt3;
+        int channel0 = int( floor( pos + 0.5));
+        if( fabs( pos - channel0) > 1e-3)
+            throw CubeError( CubeError::InvalidArgument,
+                             QString( "The channels of %1 are not on the grid of %2, cannot merge them.")
+                             .arg( info.fileName).arg( f0.fileName));
+        if( channel0 > end)
+            throw CubeError( CubeError::InvalidArgument,
+                             QString( "Gap of %1 channels before %2, cannot merge the overlaps.")
+                             .arg( channel0 - end).arg( info.fileName));
+        OverlapSource s;
+        s.info = info;
+        s.channel0 = channel0;
+        s.hasWeights = false;
+        sources.push_back( s);
+        end = qMax( end, channel0 + info.naxis3);
+    }
+
+    vector<FitsInfo> cut;
+    int covered = 0, merged = 0;
+    for( size_t i = 0 ; i < sources.size() ; i ++ ) {
+        OverlapSource & s = sources[i];
+        // the weights are only needed where the inputs overlap
+        bool overlaps = false;
+        for( size_t j = 0 ; j < sources.size() ; j ++ ) {
+            const OverlapSource & o = sources[j];
+            if( j != i && o.channel0 < s.channel0 + s.info.naxis3 && s.channel0 < o.channel0 + o.info.naxis3)
+                overlaps = true;
+        }
+        if( overlaps) {
+            if( weightFiles[i].isEmpty())
+                throw CubeError( CubeError::InvalidArgument,
+                                 QString( "No weight cube for %1").arg( s.info.fileName));
+            s.weights = weightFiles[i] == s.info.fileName ? s.info : parse( weightFiles[i]);
+            s.hasWeights = true;
+            if( s.weights.naxis1 != s.info.naxis1 || s.weights.naxis2 != s.info.naxis2
+                    || s.weights.naxis3 != s.info.naxis3)
+                throw CubeError( CubeError::InvalidArgument,
+                                 QString( "%1 is not the same size as %2").arg( s.weights.fileName).arg( s.info.fileName));
+        }
+        FitsInfo info = s.info;
+        int skip = qMin( covered - s.channel0, info.naxis3);
+        covered = qMax( covered, s.channel0 + info.naxis3);
+        merged += skip;
+        // all of it goes into channels of the inputs before
+        if( skip == info.naxis3)
+            continue;
+        qint64 planeBytes = qint64( info.naxis1) * info.naxis2 * bitpixToSize( info.bitpix);
+        info.dataOffset += skip * planeBytes;
+        info.dataSize -= skip * planeBytes;
+        info.naxis3 -= skip;
+        info.frameStart += skip * info.cdelt3;
+        cut.push_back( info);
+    }
+    if( merged == 0) {
+        log << "No overlapping channels to merge.\n";
+        return;
+    }
+    log << "Merging " << merged << " overlapping planes, " << end << " channels.\n";
+    fileInfo = cut;
+    plan.combinedNaxis3 = end;
+    plan.overlaps = sources;
+}
+
+// planes cut off the front of an input by mergeOverlaps() or selectChannels(); the filters
+// count the planes from the start of the data
+static int cutPlanes( const FitsInfo & info)
+{
+    qint64 planeBytes = qint64( info.naxis1) * info.naxis2 * bitpixToSize( info.bitpix);
+    return int( (info.dataOffset - info.header.dataOffset()) / planeBytes);
+}
+
+bool selectChannels( FitsInfo & info, double min, double max, int * cut)
+{
+    if( min > max)
+        std::swap( min, max);
+    // the planes z with min <= frameStart + z * cdelt3 <= max, a little slack for the rounding
+    double a = (min - info.frameStart) / info.cdelt3, b = (max - info.frameStart) / info.cdelt3;
+    if( a > b)
+        std::swap( a, b);
+    int first = int( qMax( 0.0, ceil( a - 1e-6)));
+    int last = int( qMin( double( info.naxis3 - 1), floor( b + 1e-6)));
+    if( first > last)
+        return false;
+    qint64 planeBytes = qint64( info.naxis1) * info.naxis2 * bitpixToSize( info.bitpix);
+    info.dataOffset += first * planeBytes;
+    info.naxis3 = last - first + 1;
+    info.dataSize = info.naxis3 * planeBytes;
+    info.frameStart += first * info.cdelt3;
+    info.frameEnd = info.frameStart + (info.naxis3 - 1) * info.cdelt3;
+    info.frameNext = info.frameEnd + info.cdelt3;
+    if( cut)
+        * cut = first;
+    return true;
+}
+
+// Cuts the plan down to the channels of --freq-range: the inputs without any are dropped,
+// the others only read from their first to their last channel in the range.
+static void selectFrequencies( CombinePlan & plan, const CombineOptions & options)
+{
+    ostream & log = combineLog( options);
+    vector<FitsInfo> selected;
+    int planes = 0;
+    for( size_t i = 0 ; i < plan.fileInfo.size() ; i ++ ) {
+        FitsInfo info = plan.fileInfo[i];
+        if( ! selectChannels( info, options.freqMin, options.freqMax))
+            continue;
+        planes += info.naxis3;
+        selected.push_back( info);
+    }
+    if( selected.empty())
+        throw CubeError( CubeError::InvalidArgument,
+                         QString( "No channels between %1 and %2 Hz").arg( options.freqMin, 0, 'f').arg( options.freqMax, 0, 'f'));
+    log << "Selected " << planes << " of " << plan.combinedNaxis3 << " channels from "
+        << selected.size() << " of " << plan.fileInfo.size() << " inputs.\n";
+    plan.fileInfo = selected;
+    plan.combinedNaxis3 = planes;
+}
+
+// The plan of a combine cut down to --region. The box is not contiguous in the inputs,
+// so the data goes through the band writer of the mosaics, which reads just its rows; the
+// inputs are stacked along z.
+static MosaicPlan regionPlan( const CombinePlan & plan, const CombineOptions & options)
+{
+    ostream & log = combineLog( options);
+    const FitsInfo & f0 = plan.fileInfo[0];
+    MosaicPlan mosaic;
+    mosaic.naxis1 = f0.naxis1;
+    mosaic.naxis2 = f0.naxis2;
+    mosaic.naxis3 = plan.combinedNaxis3;
+    mosaic.header = f0.header;
+    mosaic.header.setIntValue( "NAXIS3", plan.combinedNaxis3);
+    if( cutPlanes( f0))
+        mosaic.header.setDoubleValue( "CRPIX3", f0.crpix3 - cutPlanes( f0));
+    int z = 0;
+    for( size_t i = 0 ; i < plan.fileInfo.size() ; i ++ ) {
+        MosaicInput in;
+        in.info = plan.fileInfo[i];
+        in.x0 = in.y0 = 0;
+        in.z0 = z;
+        in.sx = in.sy = 0;
+        in.width = in.info.naxis1;
+        in.height = in.info.naxis2;
+        mosaic.inputs.push_back( in);
+        z += in.info.naxis3;
+    }
+    cropMosaic( mosaic, options.regionX, options.regionY, options.regionWidth, options.regionHeight);
+    log << "Extracting the region of " << mosaic.naxis1 << " x " << mosaic.naxis2 << " pixels at "
+        << options.regionX + 1 << "," << options.regionY + 1 << "\n";
+    return mosaic;
+}
+
+// an output file and its journal
+struct CombineOutput {
+    QFile file;
+    Journal journal;
+    // the header as written, with the CHECKSUM/DATASUM cards if checksum is set
+    FitsHeader header;
+    // where that header is, a compressed output has an empty primary header in front of it
+    qint64 headerOffset;
+    bool checksum;
+    // data sum of the data segment, as far as it was written
+    quint32 dataSum;
+    // bytes of data already in the output when resuming
+    qint64 committed;
+    // the plane statistics, collected while the data is copied
+    CubeStatistics * stats;
+    // the binned copies, built while the data is copied
+    PreviewPyramid * preview;
+    // where the progress of this output is told, see combineLog()
+    std::ostream * log;
+    CombineOutput() {
+        headerOffset = 0; checksum = false; dataSum = 0; committed = 0; stats = 0; preview = 0;
+        log = & cerr;
+    }
+    ~CombineOutput() { delete stats; delete preview; }
+};
+
+// drops the first 'committed' bytes of data from the inputs, they are already in the output;
+// when the values are converted to another BITPIX (convert) the output bytes are counted in
+// pixels of that BITPIX
+static void skipCommitted( vector<FitsInfo> & fileInfo, qint64 committed, int convert)
+{
+    while( ! fileInfo.empty()) {
+        int bitpix = convert ? convert : fileInfo[0].bitpix;
+        qint64 size = convertedSize( fileInfo[0].dataSize, fileInfo[0].bitpix, bitpix);
+        if( committed < size) {
+            qint64 skip = convertedSize( committed, bitpix, fileInfo[0].bitpix);
+            fileInfo[0].dataOffset += skip;
+            fileInfo[0].dataSize -= skip;
+            break;
+        }
+        committed -= size;
+        fileInfo.erase( fileInfo.begin());
+    }
+}
+
+// the options that change what goes into the output, a resume has to use the same ones
+static QStringList journalSettings( const CombineOptions & options)
+{
+    QStringList lines;
+    lines << QString( "checksum %1").arg( options.checksum ? "on" : "off");
+    lines << QString( "layout %1").arg( options.spectralMajor ? "spectral-major" : "normal");
+    if( options.clip)
+        lines << QString( "clip %1 %2").arg( QString::number( options.clipMin, 'g', 17))
+                                       .arg( QString::number( options.clipMax, 'g', 17));
+    else
+        lines << "clip off";
+    // only there when converting, so journals from before the option still match
+    if( options.convert)
+        lines << QString( "convert %1").arg( options.convert);
+    if( options.mergeOverlaps)
+        lines << "merge overlaps";
+    return lines;
+}
+
+// Fills in the DATASUM and CHECKSUM cards of a header whose data unit sums to dataSum.
+// CHECKSUM is chosen so that the whole HDU sums to -0 (all ones), which only needs the sum
+// of the header, the data was summed while it was copied.
+void setChecksumCards( FitsHeader & header, quint32 dataSum)
+{
+    QString stamp = QDateTime::currentDateTime().toUTC().toString( "yyyy-MM-ddThh:mm:ss");
+    header.setStringValue( "CHECKSUM", "0000000000000000", "HDU checksum updated " + stamp);
+    header.setStringValue( "DATASUM", QString::number( dataSum),
+                           "data unit checksum updated " + stamp);
+    QByteArray bytes = header.toBytes();
+    quint32 sum = fitsSumAdd( fitsDataSum( bytes.constData(), bytes.size()), dataSum);
+    header.setStringValue( "CHECKSUM", fitsChecksumString( sum), "HDU checksum updated " + stamp);
+}
+
+// Creates the output file and writes the combined header into it. When resuming, the output
+// is kept up to the last commit in its journal, and the plan is cut down to what is missing.
+// A compressed output starts with an empty primary header, the combined header becomes the
+// header of the table holding the tiles; it has no journal, it cannot be resumed.
+static void startOutput( CombinePlan & plan, CombineOutput & out, const CombineOptions & options)
+{
+    ostream & log = combineLog( options);
+    out.log = & log;
+    QFile & ofp = out.file;
+    bool resuming = options.resume && QFileInfo( plan.outputFileName).exists()
+            && QFileInfo( Journal::fileName( plan.outputFileName)).exists();
+    ofp.setFileName( plan.outputFileName);
+    QFile::OpenMode mode = resuming ? QFile::ReadWrite : QFile::WriteOnly | QFile::Truncate;
+    if( ! ofp.open( mode))
+        throw QString( "Cannot open %1 for writing.").arg( plan.outputFileName);
+
+    // prepare the output header - by copying the header of the first file; when resuming
+    // this writes the same bytes over the old header
+    FitsHeader & outHeader = out.header;
+    outHeader = plan.fileInfo[0].header;
+    outHeader.setIntValue( "NAXIS3", plan.combinedNaxis3);
+    // the reference channel moves with the channels cut off the front (--freq-range)
+    if( cutPlanes( plan.fileInfo[0]))
+        outHeader.setDoubleValue( "CRPIX3", plan.fileInfo[0].crpix3 - cutPlanes( plan.fileInfo[0]));
     // HACK for Sukhpreet's files
     // outHeader.setDoubleValue( "CRVAL3", fileInfo[0].crval3);
+    if( options.convert) {
+        // the values become plain floating point numbers
+        outHeader.setIntValue( "BITPIX", options.convert);
+        outHeader.removeKey( "BSCALE");
+        outHeader.removeKey( "BZERO");
+        outHeader.removeKey( "BLANK");
+    }
+    // the previews have the normal layout whatever the output has
+    if( options.preview)
+        out.preview = new PreviewPyramid( plan.outputFileName, outHeader, plan.fileInfo[0].naxis1,
+                                          plan.fileInfo[0].naxis2, plan.combinedNaxis3, options.preview);
+    // the statistics are only known at the end, the cards are reserved like the checksum
+    if( options.stats) {
+        out.stats = new CubeStatistics( plan.combinedNaxis3);
+        int channel = 0;
+        for( size_t i = 0 ; i < plan.fileInfo.size() ; i ++ ) {
+            const FitsInfo & info = plan.fileInfo[i];
+            for( int z = 0 ; z < info.naxis3 ; z ++ )
+                out.stats-> setFrequency( channel ++, info.frameStart + z * info.cdelt3);
+        }
+        outHeader.setDoubleValue( "DATAMIN", 0, "minimum data value");
+        outHeader.setDoubleValue( "DATAMAX", 0, "maximum data value");
+    }
+    if( options.spectralMajor)
+        outHeader = spectralMajorHeader( outHeader);
+    if( options.compress) {
+        FitsHeader primary = compressedPrimaryHeader();
+        if( options.checksum)
+            setChecksumCards( primary, 0);
+        if( ! primary.write( ofp))
+            throw QString( "Failed to write header to %1").arg( plan.outputFileName);
+        out.headerOffset = ofp.pos();
+        outHeader = compressedImageHeader( outHeader, options.tilePlanes, qrand() % 10000 + 1);
+    }
+    // the checksum cards are reserved now and filled in at the end, so the header keeps its
+    // size; the ones copied from the first input would be wrong anyway
+    out.checksum = options.checksum;
+    if( out.checksum) {
+        outHeader.setStringValue( "CHECKSUM", "0000000000000000", "HDU checksum");
+        outHeader.setStringValue( "DATASUM", "0", "data unit checksum");
+    }
     outHeader.write( ofp);
+    if( ! ofp.flush())
+        throw QString( "Failed to write header to %1").arg( plan.outputFileName);
+    qint64 dataStart = ofp.pos();
+    if( options.compress)
+        return;
+
+    if( ! resuming) {
+        out.journal.create( plan.outputFileName, plan.fileInfo, dataStart, journalSettings( options));
+        return;
+    }
+    // the journal checks that the inputs (and so the header) are the same as last time
+    qint64 dataSize = 0;
+    for( size_t i = 0 ; i < plan.fileInfo.size() ; i ++ ) {
+        const FitsInfo & info = plan.fileInfo[i];
+        dataSize += convertedSize( info.dataSize, info.bitpix, options.convert ? options.convert : info.bitpix);
+    }
+    qint64 committed = out.journal.resume( plan.outputFileName, plan.fileInfo, dataStart,
+                                           journalSettings( options), dataSize);
+    out.dataSum = out.journal.dataSum();
+    if( ofp.size() < dataStart + committed)
+        throw QString( "%1 is shorter than its journal says, cannot resume.").arg( plan.outputFileName);
+    // anything after the last commit may be garbage
+    if( ! ofp.resize( dataStart + committed) || ! ofp.seek( dataStart + committed))
+        throw QString( "Could not truncate %1 for resuming.").arg( plan.outputFileName);
+    log << "Resuming " << plan.outputFileName.toStdString() << " after "
+        << formatBytes( committed).toStdString() << " of data.\n";
+    out.committed = committed;
+    // the transpose needs all the inputs, it skips the committed rows itself
+    if( ! options.spectralMajor)
+        skipCommitted( plan.fileInfo, committed, options.convert);
+}
 
-    // do the actual concatenation
-    qint64 buffSize = 1024 * 1024 * 512;
-    char * buff = (char *) malloc( buffSize); assert( buff);
-    QTime timer; timer.start(); QTime timer2; timer2.start();
-    qint64 processed = 0;
-    qint64 totalBytes = 0;
-    for( size_t i = 0 ; i < fileInfo.size() ; i ++) {
-        totalBytes += fileInfo[i].dataSize;
-    }
-    cerr << "Starting concatenation of " << formatBytes(totalBytes).toStdString() << "\n";
-    for( size_t i = 0 ; i < fileInfo.size() ; i ++ ) {
-        QString fname = fileInfo[i].fileName;
-        cerr << "  appending " << fname.toStdString() << "\n";
-        QFile fp( fname);
-        if( ! fp.open( QFile::ReadOnly))
-            throw QString( "Could not open file for reading: %1").arg( fname);
-        // position the file to the offset
-        if( ! fp.seek( fileInfo[i].dataOffset))
-            throw QString( "Failed to seek to data segment: %1").arg( fname);
-        qint64 remaining = fileInfo[i].dataSize;
-        while( remaining > 0) {
-            qint64 wantToRead = buffSize;
-            if( remaining < wantToRead) wantToRead = remaining;
-            // read in a chunk of input
-            qint64 nRead = fp.read( buff, wantToRead);
-            if( nRead <= 0)
-                throw QString( "Failed to read from: %1").arg( fname);
-            clipData( buff, nRead, -1000, 1000, fileInfo[i]);
-            // write the chunk out
-            if( ! blockWrite( ofp, buff, nRead))
-                throw QString( "Failed to write to: %1").arg( outputFileName);
-            remaining -= nRead;
-            // statistics
-            processed += nRead;
-            if( timer2.elapsed() > 1000) {
-                cerr << "    speed: " << (processed / 1024 / 1024) / (timer.elapsed() / 1000.0)
-                     << " MB/s ";
-                cerr << "wrote: " << formatBytes(ofp.pos()).toStdString() << "("
-                     << (qint64)((processed * 100.0) / totalBytes) << "%) ";
-                cerr << "elapsed: " << formatSeconds( timer.elapsed() / 1000.0).toStdString() << " ";
-                double eta = (totalBytes - processed) * timer.elapsed() / processed / 1000;
-                cerr << "eta: " << formatSeconds( eta).toStdString() << "\n";
-                timer2.restart();
-            }
-        }
-    }
-
-    int pad = 2880 - ofp.pos() % 2880;
+// Fills in the DATAMIN/DATAMAX and DATASUM/CHECKSUM cards reserved by startOutput() and
+// writes the header over the old one.
+static void updateHeader( CombineOutput & out)
+{
+    ostream & log = * out.log;
+    FitsHeader & header = out.header;
+    int size = header.toBytes().size();
+    if( out.stats) {
+        double min, max;
+        if( out.stats-> range( min, max)) {
+            header.setDoubleValue( "DATAMIN", min, "minimum data value");
+            header.setDoubleValue( "DATAMAX", max, "maximum data value");
+        } else {
+            // all NaNs, blank cards keep the size of the header
+            header.removeKey( "DATAMIN");
+            header.removeKey( "DATAMAX");
+            header.addRaw( "");
+            header.addRaw( "");
+        }
+    }
+    if( out.checksum)
+        setChecksumCards( header, out.dataSum);
+
+    QFile & ofp = out.file;
+    qint64 end = ofp.pos();
+    if( ! ofp.seek( out.headerOffset) || ! header.write( ofp))
+        throw QString( "Could not write the checksum into %1").arg( ofp.fileName());
+    if( ofp.pos() != out.headerOffset + size || ! ofp.seek( end))
+        throw QString( "The header of %1 changed size.").arg( ofp.fileName());
+    if( out.checksum)
+        log << "DATASUM of " << QFileInfo( ofp.fileName()).fileName().toStdString()
+            << " is " << out.dataSum << "\n";
+}
+
+// pads the output to a multiple of 2880 bytes and closes it; the journal goes away only
+// once everything is on disk
+static void finishOutput( CombineOutput & out)
+{
+    ostream & log = * out.log;
+    QFile & ofp = out.file;
+    int pad = (2880 - ofp.pos() % 2880) % 2880;
     if( pad > 0) {
-        cerr << "Padding with " << pad << " bytes.\n";
+        log << "Padding " << QFileInfo(ofp.fileName()).fileName().toStdString()
+            << " with " << pad << " bytes.\n";
         std::vector<char> buff(pad,0);
         if( ! blockWrite( ofp, buff.data(), pad)) {
             throw QString("Could not pad the output file.");
         }
     }
     else {
-        cerr << "No padding needed.\n";
+        log << "No padding needed.\n";
+    }
+    // the padding is zeros, it does not change the data sum
+    if( out.stats || out.checksum)
+        updateHeader( out);
+    if( out.stats) {
+        QString name = CubeStatistics::fileName( ofp.fileName());
+        out.stats-> write( name, QFileInfo( ofp.fileName()).fileName());
+        log << "Plane statistics are in " << name.toStdString() << "\n";
+    }
+    if( out.preview) {
+        out.preview-> finish();
+        log << "Previews are in";
+        for( int i = 0 ; i < PreviewPyramid::LevelCount ; i ++ )
+            log << " " << PreviewPyramid::fileName( ofp.fileName(), PreviewPyramid::Levels[i]).toStdString();
+        log << "\n";
     }
+    if( ! ofp.flush() || fdatasync( ofp.handle()) != 0)
+        throw QString( "Could not sync %1").arg( ofp.fileName());
     ofp.close();
-    cerr << "Done.\n";
+    out.journal.remove();
+}
+
+// tells the user what is going to happen to the values, which are stored with bitpix
+static void reportFilter( const CombineOptions & options, int bitpix)
+{
+    ostream & log = combineLog( options);
+    if( options.clip && bitpix > 0)
+        log << "Cannot apply data clipping to BITPIX = " << bitpix << "\n";
+    else if( options.clip)
+        log << "Clipping values outside of [" << options.clipMin << ".." << options.clipMax
+            << "] using the " << clipKernelName() << " kernel.\n";
+    else
+        log << "Clipping is off, values are copied as they are.\n";
+    if( options.convert)
+        log << "Converting the values to BITPIX = " << options.convert << " using the "
+            << convertKernelName() << " kernels.\n";
+    if( options.stats)
+        log << "Collecting the plane statistics.\n";
+    if( options.preview)
+        log << "Building previews binned 2x2, 4x4 and 8x8 by " << options.preview << " channels.\n";
+    if( options.checksum)
+        log << "Computing the data sums using the " << fitsSumKernelName() << " kernel.\n";
+}
+
+void reportIoMode( IoMode mode, const QStringList & fileNames, ostream & log)
+{
+    if( mode == IoBuffered)
+        return;
+    log << "Using " << ioModeName( mode) << " I/O.\n";
+    if( mode != IoDirect)
+        return;
+    for( int i = 0 ; i < fileNames.size() ; i ++ ) {
+        if( ! directIoSupported( fileNames[i])) {
+            log << "Warning: O_DIRECT is not supported for " << fileNames[i].toStdString()
+                << ", using fadvise instead.\n";
+            return;
+        }
+    }
+}
+
+// reserves the whole output file (including the padding) so that the writers at different
+// offsets do not fragment it, and so that running out of space is found out right away
+void preallocateOutput( QFile & ofp, qint64 size)
+{
+#ifdef Q_OS_LINUX
+    if( fallocate( ofp.handle(), 0, 0, size) == 0)
+        return;
+    if( errno != EOPNOTSUPP && errno != ENOSYS)
+        throw QString( "Could not preallocate %1 for %2: %3").arg( formatBytes( size))
+            .arg( ofp.fileName()).arg( strerror( errno));
+#endif
+    // the filesystem cannot reserve the space, at least set the size
+    if( ! ofp.resize( size))
+        throw QString( "Could not resize %1").arg( ofp.fileName());
+}
+
+// every input goes to the filter with the output and the first channel it has there; the
+// inputs are counted through all the plans, as the copies number them in the chunks
+static void addInputs( ChannelFilter & filter, const vector<CombinePlan> & plans)
+{
+    int index = 0;
+    for( size_t p = 0 ; p < plans.size() ; p ++ ) {
+        int channel = 0;
+        for( size_t i = 0 ; i < plans[p].fileInfo.size() ; i ++ ) {
+            const FitsInfo & info = plans[p].fileInfo[i];
+            filter.addInput( index ++, int( p), channel - cutPlanes( info));
+            channel += info.naxis3;
+        }
+    }
+}
+
+// Copies the data of the plans to the outputs, whose headers have been written already.
+// By default one pipeline streams all the inputs one after another, so there is only ever
+// one read and one write stream competing for the disks, and the ring does not drain between
+// outputs. With parallelFiles the outputs are preallocated and several whole input files are
+// copied at once, each straight to its offset in the output.
+static void copyData( const vector<CombinePlan> & plans, const vector<CombineOutput *> & outputs,
+                      const CombineOptions & options, Metrics * metrics)
+{
+    ostream & log = combineLog( options);
+    reportFilter( options, options.convert ? options.convert : plans[0].fileInfo[0].bitpix);
+    QStringList files;
+    for( size_t p = 0 ; p < plans.size() ; p ++ ) {
+        files << outputs[p]-> file.fileName();
+        for( size_t i = 0 ; i < plans[p].fileInfo.size() ; i ++ )
+            files << plans[p].fileInfo[i].fileName;
+    }
+    reportIoMode( options.ioMode, files, log);
+    if( metrics) {
+        QStringList names;
+        qint64 bytes = 0;
+        int inputs = 0;
+        for( size_t p = 0 ; p < plans.size() ; p ++ ) {
+            names << outputs[p]-> file.fileName();
+            for( size_t i = 0 ; i < plans[p].fileInfo.size() ; i ++ )
+                bytes += plans[p].fileInfo[i].dataSize;
+            inputs += int( plans[p].fileInfo.size());
+        }
+        QString layout = options.spectralMajor ? "spectral-major" : options.compress ? "compress"
+                       : options.parallelFiles > 1 ? "parallel-files" : "stream";
+        metrics-> event( "start", QStringList() << Metrics::field( "outputs", names)
+                         << Metrics::field( "inputs", qint64( inputs)) << Metrics::field( "bytes", bytes)
+                         << Metrics::field( "layout", layout)
+                         << Metrics::field( "io", QString( ioModeName( options.ioMode)))
+                         << Metrics::field( "queue_depth", qint64( options.queueDepth))
+                         << Metrics::field( "memory", options.memory));
+    }
+    ClipFilter clip( options.clipMin, options.clipMax);
+    ChunkFilter * filter = options.clip ? & clip : 0;
+    ConvertFilter convert( options.convert, filter);
+    if( options.convert)
+        filter = & convert;
+    // the overlaps are blended into the values as they go to the output
+    OverlapFilter overlap( filter, options.convert);
+    if( options.clip)
+        overlap.setClip( options.clipMin, options.clipMax);
+    for( size_t p = 0 ; p < plans.size() ; p ++ ) {
+        if( plans[p].overlaps.empty())
+            continue;
+        overlap.addSources( plans[p].overlaps);
+        filter = & overlap;
+    }
+    // the stages of the library API see the values after the filters of the combine
+    CubeStageFilter stages( filter, options.convert, options.stages);
+    if( ! options.stages.empty()) {
+        addInputs( stages, plans);
+        filter = & stages;
+    }
+    // the statistics see the values last, after the conversion and the clipping
+    StatsFilter stats( filter, options.convert);
+    if( options.stats) {
+        addInputs( stats, plans);
+        for( size_t p = 0 ; p < plans.size() ; p ++ )
+            stats.addOutput( outputs[p]-> stats);
+        filter = & stats;
+    }
+    PreviewFilter preview( filter, options.convert);
+    if( options.preview) {
+        addInputs( preview, plans);
+        for( size_t p = 0 ; p < plans.size() ; p ++ )
+            preview.addOutput( outputs[p]-> preview);
+        filter = & preview;
+    }
+
+    if( options.queueDepth > 1 && (options.spectralMajor || options.compress || options.parallelFiles > 1))
+        log << "--queue-depth only applies to the streaming combine, reading one piece at a time.\n";
+    // the transpose reads every input in pieces for every slab, so it does its own I/O
+    if( options.spectralMajor) {
+        if( options.parallelFiles > 1)
+            log << "--parallel-files does not apply to the spectral-major layout.\n";
+        SpectralTranspose transpose( filter, options.memory);
+        transpose.setIoMode( options.ioMode);
+        transpose.setChecksum( options.checksum);
+        transpose.setMetrics( metrics);
+        transpose.setLog( & log);
+        // the chunks are numbered through all the inputs, like in addInputs()
+        int first = 0;
+        for( size_t p = 0 ; p < plans.size() ; p ++ ) {
+            CombineOutput & out = * outputs[p];
+            transpose.setFirstIndex( first);
+            out.dataSum = transpose.run( plans[p].fileInfo, & out.file, & out.journal,
+                                         out.committed, out.dataSum);
+            first += int( plans[p].fileInfo.size());
+        }
+        return;
+    }
+
+    // the tiles are read, encoded and written by the compressor
+    if( options.compress) {
+        if( options.parallelFiles > 1)
+            log << "--parallel-files does not apply to compressed output.\n";
+        TileCompressor compressor( filter, options.memory);
+        compressor.setIoMode( options.ioMode);
+        compressor.setChecksum( options.checksum);
+        compressor.setQuantizeLevel( options.quantizeLevel);
+        compressor.setMetrics( metrics);
+        compressor.setLog( & log);
+        // the chunks are numbered through all the inputs, like in addInputs()
+        int first = 0;
+        for( size_t p = 0 ; p < plans.size() ; p ++ ) {
+            CombineOutput & out = * outputs[p];
+            compressor.setFirstIndex( first);
+            out.dataSum = compressor.run( plans[p].fileInfo, & out.file, out.headerOffset, out.header);
+            first += int( plans[p].fileInfo.size());
+        }
+        return;
+    }
+
+    BufferPool pool( options.memory, options.hugePages);
+    if( ! pool.hugePagesError().isEmpty())
+        log << "Warning: no huge pages available (" << pool.hugePagesError().toStdString()
+            << "), using transparent huge pages if possible.\n";
+    log << "Using " << pool.count() << " buffers of " << formatBytes( pool.bufferSize()).toStdString()
+        << " (--memory " << formatBytes( options.memory).toStdString() << ")\n";
+
+    if( options.parallelFiles < 2) {
+        ConcatPipeline pipeline( filter, & pool);
+        pipeline.setZeroCopy( options.zeroCopy);
+        pipeline.setIoMode( options.ioMode);
+        pipeline.setQueueDepth( options.queueDepth, options.ioThreads);
+        pipeline.setChecksum( options.checksum);
+        pipeline.setMetrics( metrics);
+        pipeline.setLog( & log);
+        for( size_t p = 0 ; p < plans.size() ; p ++ ) {
+            for( size_t i = 0 ; i < plans[p].fileInfo.size() ; i ++ )
+                pipeline.addInput( plans[p].fileInfo[i], & outputs[p]-> file);
+            pipeline.setJournal( & outputs[p]-> file, & outputs[p]-> journal);
+            pipeline.setDataSum( & outputs[p]-> file, outputs[p]-> dataSum);
+        }
+        pipeline.run();
+        for( size_t p = 0 ; p < plans.size() ; p ++ )
+            outputs[p]-> dataSum = pipeline.dataSum( & outputs[p]-> file);
+        return;
+    }
+
+    ParallelFileCopy copy( filter, & pool);
+    copy.setThreads( options.parallelFiles);
+    copy.setZeroCopy( options.zeroCopy);
+    copy.setIoMode( options.ioMode);
+    copy.setChecksum( options.checksum);
+    copy.setMetrics( metrics);
+    copy.setLog( & log);
+    vector<qint64> ends;
+    for( size_t p = 0 ; p < plans.size() ; p ++ ) {
+        QFile & ofp = outputs[p]-> file;
+        copy.setDataSum( & ofp, outputs[p]-> dataSum);
+        copy.setJournal( & ofp, & outputs[p]-> journal);
+        if( ! ofp.flush())
+            throw QString( "Failed to write header to %1").arg( ofp.fileName());
+        // each input goes right after the previous one
+        qint64 offset = ofp.pos();
+        for( size_t i = 0 ; i < plans[p].fileInfo.size() ; i ++ ) {
+            const FitsInfo & info = plans[p].fileInfo[i];
+            copy.addInput( info, & ofp, offset);
+            offset += filter ? filter-> outputSize( info.dataSize, info) : info.dataSize;
+        }
+        preallocateOutput( ofp, (offset + 2879) / 2880 * 2880);
+        ends.push_back( offset);
+    }
+    copy.run();
+    // finishOutput() pads from the end of the data
+    for( size_t p = 0 ; p < plans.size() ; p ++ ) {
+        if( ! outputs[p]-> file.seek( ends[p]))
+            throw QString( "Failed to seek in %1").arg( outputs[p]-> file.fileName());
+        outputs[p]-> dataSum = copy.dataSum( & outputs[p]-> file);
+    }
+}
+
+// the combined cube as a parsed input would describe it, with the header of the first
+// input; the checksum and statistics cards come later
+static FitsInfo outputInfo( const CombinePlan & plan, const CombineOptions & options)
+{
+    FitsInfo info = plan.fileInfo[0];
+    info.fileName = plan.outputFileName;
+    info.naxis3 = plan.combinedNaxis3;
+    info.header.setIntValue( "NAXIS3", plan.combinedNaxis3);
+    if( cutPlanes( plan.fileInfo[0])) {
+        info.crpix3 -= cutPlanes( plan.fileInfo[0]);
+        info.header.setDoubleValue( "CRPIX3", info.crpix3);
+    }
+    if( options.convert) {
+        info.bitpix = options.convert;
+        info.bscale = 1; info.bzero = 0; info.hasBlank = false; info.blank = 0;
+        info.header.setIntValue( "BITPIX", options.convert);
+        info.header.removeKey( "BSCALE");
+        info.header.removeKey( "BZERO");
+        info.header.removeKey( "BLANK");
+    }
+    info.dataOffset = info.header.dataOffset();
+    info.dataSize = qint64( info.naxis1) * info.naxis2 * info.naxis3 * bitpixToSize( info.bitpix);
+    info.frameEnd = info.frameStart + (info.naxis3 - 1) * info.cdelt3;
+    info.frameNext = info.frameEnd + info.cdelt3;
+    return info;
+}
+
+// the options that contradict each other, whatever is combined
+static void checkOptions( const CombineOptions & options)
+{
+    if( options.clip && options.clipMin > options.clipMax)
+        throw CubeError( CubeError::InvalidArgument, "--clip-min is bigger than --clip-max");
+    if( options.compress && options.quantizeLevel == 0)
+        throw CubeError( CubeError::InvalidArgument, "--quantize cannot be 0");
+    if( options.compress && (options.resume || options.spectralMajor))
+        throw CubeError( CubeError::InvalidArgument,
+                         "--compress cannot be used with --resume or --spectral-major");
+    if( options.convert && (options.compress || options.spectralMajor))
+        throw CubeError( CubeError::InvalidArgument,
+                         "--convert cannot be used with --compress or --spectral-major");
+    if( options.stats && options.resume)
+        throw CubeError( CubeError::InvalidArgument,
+                         "--stats cannot be used with --resume, the statistics need all the data");
+    if( options.preview && (options.resume || options.spectralMajor))
+        throw CubeError( CubeError::InvalidArgument,
+                         "--preview cannot be used with --resume or --spectral-major");
+}
+
+// combine cubes into one
+void combineFITS( const QStringList & inputFilenames, const QString & outputFileName, const CombineOptions & options)
+{
+    checkOptions( options);
+    ostream & log = combineLog( options);
+    // the inputs go side by side, not one after another
+    if( options.mosaic) {
+        mosaicFITS( inputFilenames, outputFileName, options);
+        return;
+    }
+    if( options.freqRange && options.mergeOverlaps)
+        throw CubeError( CubeError::InvalidArgument, "--freq-range cannot be used with --merge-overlaps");
+    // a virtual cube has no data of its own, only what the reader can do on the fly works
+    if( options.virtualCube && (options.resume || options.checksum || options.spectralMajor || options.compress
+                                || options.stats || options.preview || options.mergeOverlaps
+                                || options.region || ! options.stages.empty()))
+        throw CubeError( CubeError::InvalidArgument,
+                         "A virtual cube can only be clipped, converted and cut with --freq-range");
+    CombinePlan plan = planCombine( inputFilenames, outputFileName, options);
+    if( options.mergeOverlaps) {
+        QStringList weights;
+        for( size_t i = 0 ; i < plan.fileInfo.size() ; i ++ )
+            weights << weightCubeName( plan.fileInfo[i].fileName);
+        mergeOverlaps( plan, weights, log);
+    }
+    if( options.freqRange)
+        selectFrequencies( plan, options);
+    if( options.region) {
+        writeMosaic( regionPlan( plan, options), outputFileName, options);
+        return;
+    }
+    if( options.virtualCube) {
+        writeVirtualCube( outputFileName, outputInfo( plan, options), plan.fileInfo, options);
+        return;
+    }
+
+    // opened before anything is written, the summary goes out when it goes out of scope,
+    // also if the combine fails
+    Metrics metrics( options.metrics);
+    metrics.setProgress( options.progress);
+
+    // the stages see the output cube as it will be
+    FitsInfo output = outputInfo( plan, options);
+    if( ! options.stages.empty()) {
+        FitsInfo staged = output;
+        beginStages( options.stages, staged);
+        // the values go back into the chunks, in the format of the output
+        if( staged.bitpix != output.bitpix || staged.bscale != output.bscale || staged.bzero != output.bzero
+                || staged.hasBlank != output.hasBlank)
+            throw CubeError( CubeError::InvalidArgument,
+                             "The stages of a combine cannot change the format of the output");
+    }
+
+    // start writing the output
+    CombineOutput out;
+    startOutput( plan, out, options);
+
+    // do the actual concatenation
+    copyData( vector<CombinePlan>( 1, plan), vector<CombineOutput *>( 1, & out), options,
+              options.metrics.isEmpty() && ! options.progress ? 0 : & metrics);
+    endStages( options.stages);
+
+    finishOutput( out);
+    log << "Done.\n";
+}
+
+// Stokes parameters in the order in which the batch mode combines them
+QStringList stokesParameters()
+{
+    return QStringList() << "I" << "Q" << "U" << "V" << "Weight";
+}
+
+// %S in the pattern becomes the Stokes name (e.g. Weight), %s its first letter (e.g. W)
+QString expandStokes( const QString & pattern, const QString & stokes)
+{
+    QString res = pattern;
+    res.replace( "%S", stokes);
+    res.replace( "%s", stokes.left(1));
+    return res;
+}
+
+// lists the files matching the wildcards in the file name part of the pattern; for each file
+// it also returns a key made up of the text matched by the wildcards, so that files of
+// different Stokes parameters can be paired up
+static QStringList expandWildcards( const QString & pattern, QStringList & keys)
+{
+    QFileInfo pinfo( pattern);
+    QString filter = pinfo.fileName();
+    // turn the wildcards into capture groups
+    QString rx;
+    for( int i = 0 ; i < filter.length() ; i ++ ) {
+        if( filter[i] == '*') rx += "(.*)";
+        else if( filter[i] == '?') rx += "(.)";
+        else rx += QRegExp::escape( QString( filter[i]));
+    }
+    QRegExp regexp( rx);
+
+    QDir dir( pinfo.path());
+    QStringList names = dir.entryList( QStringList() << filter, QDir::Files, QDir::Name);
+    QStringList files;
+    keys.clear();
+    for( int i = 0 ; i < names.size() ; i ++ ) {
+        if( ! regexp.exactMatch( names[i]))
+            throw QString( "Could not match %1 against %2").arg( names[i]).arg( filter);
+        files << dir.filePath( names[i]);
+        QStringList caps = regexp.capturedTexts();
+        caps.removeFirst(); // whole match
+        keys << caps.join( "\t");
+    }
+    return files;
+}
+
+// combines the cubes of all Stokes parameters in one go
+void combineStokesFITS( const QString & inputPattern, const QString & outputPattern, const CombineOptions & options)
+{
+    checkOptions( options);
+    ostream & log = combineLog( options);
+    QStringList stokes = stokesParameters();
+    // a stage sees one cube, these are five
+    if( ! options.stages.empty())
+        throw CubeError( CubeError::InvalidArgument, "Stages cannot be used in the Stokes batch mode");
+    if( options.region)
+        throw CubeError( CubeError::InvalidArgument, "--region cannot be used in the Stokes batch mode");
+    if( options.virtualCube)
+        throw CubeError( CubeError::InvalidArgument, "--virtual cannot be used in the Stokes batch mode");
+    if( options.freqRange && options.mergeOverlaps)
+        throw CubeError( CubeError::InvalidArgument, "--freq-range cannot be used with --merge-overlaps");
+
+    // the first Stokes parameter determines the frequency plan for all of them
+    QStringList keys;
+    QStringList inputs = expandWildcards( expandStokes( inputPattern, stokes[0]), keys);
+    if( inputs.isEmpty())
+        throw CubeError( CubeError::InvalidArgument,
+                         QString( "No input files match %1").arg( expandStokes( inputPattern, stokes[0])));
+    CombinePlan master = planCombine( inputs, expandStokes( outputPattern, stokes[0]), options);
+    vector<CombinePlan> plans;
+    plans.push_back( master);
+
+    // for the remaining parameters look up the matching file for every input of the
+    // master plan, in the already sorted order
+    for( int s = 1 ; s < stokes.size() ; s ++ ) {
+        QStringList skeys;
+        QStringList sinputs = expandWildcards( expandStokes( inputPattern, stokes[s]), skeys);
+        if( sinputs.size() != inputs.size())
+            throw CubeError( CubeError::InvalidArgument, QString( "Found %1 %2 cubes but %3 %4 cubes")
+                .arg( sinputs.size()).arg( stokes[s]).arg( inputs.size()).arg( stokes[0]));
+        log << "Parsing " << stokes[s].toStdString() << " headers\n";
+        CombinePlan plan;
+        plan.outputFileName = expandStokes( outputPattern, stokes[s]);
+        plan.combinedNaxis3 = master.combinedNaxis3;
+        QStringList sorted;
+        for( size_t i = 0 ; i < master.fileInfo.size() ; i ++ ) {
+            const FitsInfo & m = master.fileInfo[i];
+            int ind = skeys.indexOf( keys[ inputs.indexOf( m.fileName)]);
+            if( ind < 0)
+                throw CubeError( CubeError::InvalidArgument,
+                                 QString( "No %1 cube matching %2").arg( stokes[s]).arg( m.fileName));
+            sorted << sinputs[ind];
+        }
+        plan.fileInfo = scanHeaders( sorted);
+        for( size_t i = 0 ; i < master.fileInfo.size() ; i ++ ) {
+            const FitsInfo & m = master.fileInfo[i];
+            const FitsInfo & fits = plan.fileInfo[i];
+            if( fits.naxis3 != m.naxis3 || fabs( fits.frameStart - m.frameStart) > fabs( m.cdelt3 / 1e6))
+                throw CubeError( CubeError::InvalidArgument,
+                                 QString( "Frequency axis of %1 does not match %2").arg( fits.fileName).arg( m.fileName));
+        }
+        checkForCompatibility( plan.fileInfo, options.convert != 0, options.mergeOverlaps, log);
+        plans.push_back( plan);
+    }
+    // the same channels of every Stokes parameter
+    if( options.freqRange)
+        for( size_t p = 0 ; p < plans.size() ; p ++ )
+            selectFrequencies( plans[p], options);
+    // the Weight cubes (the last ones) weight the overlaps of all the others
+    if( options.mergeOverlaps) {
+        QStringList weights;
+        for( size_t i = 0 ; i < plans.back().fileInfo.size() ; i ++ )
+            weights << plans.back().fileInfo[i].fileName;
+        for( size_t p = 0 ; p < plans.size() ; p ++ )
+            mergeOverlaps( plans[p], weights, log);
+    }
+
+    Metrics metrics( options.metrics);
+    metrics.setProgress( options.progress);
+    vector<CombineOutput *> outputs;
+    try {
+        for( size_t p = 0 ; p < plans.size() ; p ++ ) {
+            outputs.push_back( new CombineOutput);
+            startOutput( plans[p], * outputs.back(), options);
+        }
+        copyData( plans, outputs, options, options.metrics.isEmpty() && ! options.progress ? 0 : & metrics);
+        for( size_t p = 0 ; p < outputs.size() ; p ++ )
+            finishOutput( * outputs[p]);
+    } catch ( ... ) {
+        for( size_t p = 0 ; p < outputs.size() ; p ++ )
+            delete outputs[p];
+        throw;
+    }
+    for( size_t p = 0 ; p < outputs.size() ; p ++ )
+        delete outputs[p];
+    log << "Done.\n";
 }
@@ -1,10 +1,147 @@
 #pragma once
 
 #include <vector>
+#include <iosfwd>
 #include <QString>
 #include <QStringList>
 #include <QVariant>
+#include <QFile>
 #include <cmath>
 
+#include "fitsheader.h"
+#include "fileio.h"
 
-void combineFITS( const QStringList & inputFilenames, const QString & outputFileName );
+class CubeStage;
+class CubeProgress;
+
+// values extracted from the fits header
+struct FitsInfo {
+    int bitpix;
+    int naxis;
+    int naxis1, naxis2, naxis3;
+    double bscale, bzero;
+    double crpix1, crpix2, crpix3, crval1, crval2, crval3, cdelt1, cdelt2, cdelt3;
+    QString ctype1, ctype2, ctype3, cunit3, bunit;
+    double equinox;
+    int blank; bool hasBlank;
+    qint64 dataOffset, dataSize;
+    QString fileName;
+    double frameStart; // frequency of the first frame
+    double frameEnd; // frequency of the last frame
+    double frameNext; // frequence of the next frame if there should be one
+    FitsHeader header; // the complete header, parsed only once
+};
+
+// parses the header of a FITS cube, throws QString if it cannot be combined
+FitsInfo parse( const QString & fname);
+// the same for a header that is already parsed, fname is only for the messages; the data
+// size is not checked against the file
+FitsInfo parse( const FitsHeader & header, const QString & fname);
+
+// wrappers around QFile::read()/write() that make sure the whole block is transferred
+bool blockRead( QFile & f, char * ptr, qint64 s);
+bool blockWrite( QFile & f, const char * ptr, qint64 s);
+
+// replaces values outside of [min..max] with NaNs (in place, on big-endian data)
+void clipData( char * buff, qint64 n, double min, double max, const FitsInfo & info);
+
+// cuts info down to the planes with frequencies in [min..max] (their order does not
+// matter): dataOffset, dataSize, naxis3 and the frame frequencies change; returns false if
+// there are none, cut is set to the number of planes cut off the front
+bool selectChannels( FitsInfo & info, double min, double max, int * cut = 0);
+
+// Fills in the DATASUM and CHECKSUM cards of a header whose data unit sums to dataSum.
+void setChecksumCards( FitsHeader & header, quint32 dataSum);
+// tells log about the I/O mode and, for IoDirect, about the first of the files whose
+// filesystem cannot do O_DIRECT (they are read and written with fadvise)
+void reportIoMode( IoMode mode, const QStringList & fileNames, std::ostream & log);
+// reserves size bytes for the output (fallocate), or at least makes it that big
+void preallocateOutput( QFile & ofp, qint64 size);
+
+// pretty printing for progress reports
+QString formatBytes( qint64 size);
+QString formatSeconds( double s);
+
+// What the combine throws when the inputs or the options cannot work, or when the
+// progress callback cancelled it; a read or write that went wrong throws a QString.
+// combineCubes() and processCube() (fitscube.h) return it for every failure.
+struct CubeError {
+    enum Code {
+        None,
+        InvalidArgument, // the inputs cannot be combined or processed as asked
+        Cancelled,       // the progress callback said stop
+        Failed           // reading or writing went wrong
+    };
+    Code code;
+    QString message;
+    CubeError() { code = None; }
+    CubeError( Code c, const QString & msg) { code = c; message = msg; }
+    // throws the error of another thread again, a failure as the QString it was
+    void rethrow() const {
+        if( code == Failed) throw message;
+        throw * this;
+    }
+};
+
+// knobs for the combine, set from the command line
+struct CombineOptions {
+    bool clip; // replace values outside of [clipMin..clipMax] with NaNs
+    double clipMin, clipMax;
+    bool zeroCopy; // without clipping let the kernel copy the data (copy_file_range/sendfile)
+    int parallelFiles; // copy this many whole files at once into a preallocated output (0 = stream)
+    IoMode ioMode; // how the data is read and written
+    int queueDepth; // reads of AsyncReader::PieceSize the streaming reader keeps in flight, 1 = one at a time
+    bool ioThreads; // keep them in flight with a pool of threads even where io_uring works
+    qint64 memory; // budget for all the data buffers together
+    bool hugePages; // back the buffers by huge pages
+    bool resume; // continue an interrupted combine from its journal
+    bool checksum; // compute the data sums on the way and put CHECKSUM/DATASUM in the header
+    bool spectralMajor; // write the output with the frequency axis first (transposed)
+    bool compress; // write a tile-compressed (RICE_1) image, as fpack does
+    double quantizeLevel; // floating point tiles are quantised to noise / level (fpack -q)
+    int tilePlanes; // planes per compressed tile
+    int convert; // BITPIX (-32 or -64) the values of all inputs are converted to, 0 = keep
+    bool stats; // collect plane statistics on the way, for DATAMIN/DATAMAX and output.stats
+    int preview; // write previews binned 2x2, 4x4 and 8x8 and by this many channels, 0 = none
+    bool mergeOverlaps; // average channels that several inputs have, weighted by the Weight cubes
+    bool mosaic; // place the inputs side by side on the pixel grid of their WCS, not along frequency
+    bool freqRange; // only the channels with frequencies in [freqMin..freqMax] (Hz)
+    double freqMin, freqMax;
+    bool region; // only the box of regionWidth x regionHeight pixels at (regionX,regionY), 0-based
+    int regionX, regionY, regionWidth, regionHeight;
+    bool virtualCube; // write only a descriptor of the combined cube, the data stays in the inputs
+    bool quiet; // nothing goes to stderr, for programs that use the combiner as a library
+    QString metrics; // where the JSON lines with the stage times etc. go (file, - or fd:n), "" = none
+    std::vector<CubeStage *> stages; // run on the values of the output, after the other filters
+    CubeProgress * progress; // told about the copied bytes, can cancel the combine
+    CombineOptions() {
+        clip = true; clipMin = -1000; clipMax = 1000;
+        zeroCopy = true; parallelFiles = 0; ioMode = IoBuffered;
+        queueDepth = 1; ioThreads = false;
+        memory = Q_INT64_C( 256) * 1024 * 1024; hugePages = false;
+        resume = false; checksum = false; spectralMajor = false;
+        compress = false; quantizeLevel = 4; tilePlanes = 1;
+        convert = 0; stats = false; preview = 0;
+        mergeOverlaps = false; mosaic = false;
+        freqRange = false; freqMin = freqMax = 0;
+        region = false; regionX = regionY = regionWidth = regionHeight = 0;
+        virtualCube = false;
+        quiet = false;
+        progress = 0;
+    }
+};
+
+void combineFITS( const QStringList & inputFilenames, const QString & outputFileName,
+                  const CombineOptions & options = CombineOptions());
+
+// where the combine tells what it is doing: stderr, or a stream that drops it all with
+// options.quiet; the pipelines and the other writers get it with their setLog()
+std::ostream & combineLog( const CombineOptions & options);
+
+// batch mode: combines the I, Q, U, V and Weight cubes in one run, sharing the frequency
+// plan; %S/%s in the patterns stand for the Stokes parameter, wildcards are allowed in the
+// file name part of the input pattern
+QStringList stokesParameters();
+QString expandStokes( const QString & pattern, const QString & stokes);
+void combineStokesFITS( const QString & inputPattern, const QString & outputPattern,
+                        const CombineOptions & options = CombineOptions());
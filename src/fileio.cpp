@@ -0,0 +1,315 @@
+/*
+ *   Copyright 2013 Pavol Federl (federl@gmail.com)
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ *
+ */
+
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <QFile>
+
+#include "fileio.h"
+#include "bufferpool.h"
+#include "metrics.h"
+#include "asyncio.h"
+
+using namespace std;
+
+// size of the O_DIRECT staging buffer of a writer without a pool
+static const qint64 StageSize = 8 * 1024 * 1024;
+// fadvise mode: how much dirty data we let pile up before starting the writeback
+static const qint64 WritebackWindow = 16 * 1024 * 1024;
+
+bool parseIoMode( const QString & name, IoMode & mode)
+{
+    if( name == "buffered") mode = IoBuffered;
+    else if( name == "direct") mode = IoDirect;
+    else if( name == "fadvise") mode = IoFadvise;
+    else return false;
+    return true;
+}
+
+const char * ioModeName( IoMode mode)
+{
+    if( mode == IoDirect) return "direct";
+    if( mode == IoFadvise) return "fadvise";
+    return "buffered";
+}
+
+char * allocIoBuffer( qint64 size)
+{
+    // a read rounded out to whole blocks can stick out by one block at each end
+    void * ptr = 0;
+    if( posix_memalign( & ptr, IoAlignment, size + 2 * IoAlignment) != 0)
+        return 0;
+    return (char *) ptr;
+}
+
+void freeIoBuffer( char * buff)
+{
+    free( buff);
+}
+
+static int openFile( const QString & fileName, int flags)
+{
+    return ::open( QFile::encodeName( fileName).constData(), flags);
+}
+
+// opens the file for O_DIRECT, or returns -1 if the filesystem does not do it (e.g. tmpfs)
+static int openDirect( const QString & fileName, int flags)
+{
+#ifdef O_DIRECT
+    int fd = openFile( fileName, flags | O_DIRECT);
+    if( fd >= 0)
+        return fd;
+    if( errno != EINVAL)
+        throw QString( "Could not open %1: %2").arg( fileName).arg( strerror( errno));
+#endif
+    return -1;
+}
+
+bool directIoSupported( const QString & fileName)
+{
+#ifdef O_DIRECT
+    int fd = openFile( fileName, O_RDONLY | O_DIRECT);
+    if( fd >= 0) {
+        ::close( fd);
+        return true;
+    }
+    // anything else is reported when the file is opened for real
+    return errno != EINVAL;
+#else
+    return false;
+#endif
+}
+
+DataReader::DataReader( const QString & fileName, IoMode mode)
+{
+    _fileName = fileName;
+    _mode = mode;
+    _directFd = -1;
+    _metrics = 0;
+    _fd = openFile( fileName, O_RDONLY);
+    if( _fd < 0)
+        throw QString( "Could not open file for reading: %1").arg( fileName);
+    if( _mode == IoDirect) {
+        _directFd = openDirect( fileName, O_RDONLY);
+        if( _directFd < 0) _mode = IoFadvise;
+    }
+#ifdef POSIX_FADV_SEQUENTIAL
+    if( _mode == IoFadvise)
+        posix_fadvise( _fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+}
+
+DataReader::~DataReader()
+{
+    if( _directFd >= 0) ::close( _directFd);
+    ::close( _fd);
+}
+
+// reads until the buffer is full or the end of the file, returns the number of bytes read
+static qint64 readAt( int fd, char * buff, qint64 size, qint64 offset, Metrics * metrics)
+{
+    qint64 done = 0;
+    while( done < size) {
+        LatencyTimer timer( metrics, OpRead);
+        ssize_t n = pread( fd, buff + done, size_t( size - done), offset + done);
+        timer.done( n > 0 ? n : 0);
+        if( n < 0 && errno == EINTR) continue;
+        if( n < 0) return -1;
+        if( n == 0) break;
+        done += n;
+    }
+    return done;
+}
+
+char * DataReader::read( char * buff, qint64 offset, qint64 size)
+{
+    if( _mode == IoDirect) {
+        // round the read out to whole blocks, the file may end before the last one does
+        qint64 start = offset / IoAlignment * IoAlignment;
+        qint64 end = (offset + size + IoAlignment - 1) / IoAlignment * IoAlignment;
+        qint64 got = readAt( _directFd, buff, end - start, start, _metrics);
+        if( got < offset + size - start)
+            throw QString( "Failed to read from: %1").arg( _fileName);
+        return buff + (offset - start);
+    }
+    if( readAt( _fd, buff, size, offset, _metrics) != size)
+        throw QString( "Failed to read from: %1").arg( _fileName);
+    readDone( offset, size);
+    return buff;
+}
+
+char * DataReader::submit( AsyncReader & io, char * buff, qint64 offset, qint64 size, qint64 tag)
+{
+    if( _mode == IoDirect) {
+        qint64 start = offset / IoAlignment * IoAlignment;
+        qint64 end = (offset + size + IoAlignment - 1) / IoAlignment * IoAlignment;
+        io.submit( _directFd, buff, start, end - start, offset + size - start, tag, _fileName);
+        return buff + (offset - start);
+    }
+    io.submit( _fd, buff, offset, size, size, tag, _fileName);
+    return buff;
+}
+
+void DataReader::readDone( qint64 offset, qint64 size)
+{
+#ifdef POSIX_FADV_DONTNEED
+    // we will not need these pages again
+    if( _mode == IoFadvise)
+        posix_fadvise( _fd, offset, size, POSIX_FADV_DONTNEED);
+#else
+    Q_UNUSED( offset); Q_UNUSED( size);
+#endif
+}
+
+DataWriter::DataWriter( const QString & fileName, qint64 offset, IoMode mode, BufferPool * pool)
+{
+    _pool = pool;
+    _fileName = fileName;
+    _mode = mode;
+    _directFd = -1;
+    _pos = _windowStart = _flushStart = offset;
+    _metrics = 0;
+    _stage = 0;
+    _stageSize = _staged = 0;
+    _fd = openFile( fileName, O_WRONLY);
+    if( _fd < 0)
+        throw QString( "Could not open file for writing: %1").arg( fileName);
+    if( _mode == IoDirect) {
+        _directFd = openDirect( fileName, O_WRONLY);
+        if( _directFd < 0) _mode = IoFadvise;
+    }
+    if( _mode == IoDirect) {
+        _stageSize = _pool ? _pool-> bufferSize() : StageSize;
+        _stage = _pool ? _pool-> acquire() : allocIoBuffer( _stageSize);
+        if( ! _stage) {
+            ::close( _fd); ::close( _directFd);
+            throw QString( "Could not allocate the O_DIRECT staging buffer");
+        }
+    }
+}
+
+DataWriter::~DataWriter()
+{
+    if( _pool)
+        _pool-> release( _stage);
+    else
+        freeIoBuffer( _stage);
+    if( _directFd >= 0) ::close( _directFd);
+    ::close( _fd);
+}
+
+void DataWriter::writeAt( int fd, const char * data, qint64 size, qint64 offset)
+{
+    while( size > 0) {
+        LatencyTimer timer( _metrics, OpWrite);
+        ssize_t n = pwrite( fd, data, size_t( size), offset);
+        timer.done( n > 0 ? n : 0);
+        if( n < 0 && errno == EINTR) continue;
+        if( n <= 0)
+            throw QString( "Failed to write to %1: %2").arg( _fileName).arg( strerror( errno));
+        data += n; size -= n; offset += n;
+    }
+}
+
+void DataWriter::write( const char * data, qint64 size)
+{
+    if( _mode != IoDirect) {
+        writeAt( _fd, data, size, _pos);
+        _pos += size;
+        if( _mode == IoFadvise && _pos - _windowStart >= WritebackWindow)
+            writeback();
+        return;
+    }
+    while( size > 0) {
+        // the head, up to the first block boundary, goes through the page cache
+        if( _staged == 0 && _pos % IoAlignment != 0) {
+            qint64 n = qMin( size, IoAlignment - _pos % IoAlignment);
+            writeAt( _fd, data, n, _pos);
+            _pos += n; data += n; size -= n;
+            continue;
+        }
+        qint64 n = qMin( size, _stageSize - _staged);
+        memcpy( _stage + _staged, data, n);
+        _staged += n; data += n; size -= n;
+        if( _staged == _stageSize) {
+            writeAt( _directFd, _stage, _staged, _pos);
+            _pos += _staged;
+            _staged = 0;
+        }
+    }
+}
+
+void DataWriter::flushStage()
+{
+    if( _staged > 0) {
+        // whole blocks directly, the tail through the page cache; if more data comes, its
+        // head up to the next block boundary goes through the page cache as well
+        qint64 aligned = _staged / IoAlignment * IoAlignment;
+        if( aligned > 0)
+            writeAt( _directFd, _stage, aligned, _pos);
+        writeAt( _fd, _stage + aligned, _staged - aligned, _pos + aligned);
+        _pos += _staged;
+        _staged = 0;
+    }
+}
+
+void DataWriter::finish()
+{
+    flushStage();
+    if( _mode == IoFadvise)
+        writeback();
+}
+
+qint64 DataWriter::sync()
+{
+    flushStage();
+    // both descriptors are the same file, one fdatasync covers them
+    LatencyTimer timer( _metrics, OpSync);
+    int res = fdatasync( _fd);
+    timer.done( 0);
+    if( res != 0)
+        throw QString( "Failed to sync %1: %2").arg( _fileName).arg( strerror( errno));
+    return _pos;
+}
+
+// Keeps at most two windows of dirty pages around: the one just written is handed to the
+// writeback right away, and the one before it is waited for and dropped from the cache.
+// This way the kernel never has a big pile of dirty pages to flush at once (the stalls),
+// and the data we wrote does not push everyone else out of the page cache.
+void DataWriter::writeback()
+{
+#ifdef SYNC_FILE_RANGE_WRITE
+    if( _flushStart < _windowStart)
+        sync_file_range( _fd, _flushStart, _windowStart - _flushStart,
+                         SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+#endif
+#ifdef POSIX_FADV_DONTNEED
+    if( _flushStart < _windowStart)
+        posix_fadvise( _fd, _flushStart, _windowStart - _flushStart, POSIX_FADV_DONTNEED);
+#endif
+#ifdef SYNC_FILE_RANGE_WRITE
+    if( _windowStart < _pos)
+        sync_file_range( _fd, _windowStart, _pos - _windowStart, SYNC_FILE_RANGE_WRITE);
+#endif
+    _flushStart = _windowStart;
+    _windowStart = _pos;
+}
@@ -0,0 +1,94 @@
+#pragma once
+
+#include <QString>
+#include <QtGlobal>
+
+class Metrics;
+class AsyncReader;
+
+// how the data segments are moved between the disks and memory
+enum IoMode {
+    IoBuffered, // plain reads/writes through the page cache
+    IoDirect,   // O_DIRECT, the data never goes through the page cache
+    IoFadvise   // through the page cache, but the pages are dropped right after use and
+                // the writeback is started as soon as a window of data is written
+};
+
+// converts --io option values (buffered, direct, fadvise) and back
+bool parseIoMode( const QString & name, IoMode & mode);
+const char * ioModeName( IoMode mode);
+
+// false if the filesystem of the file cannot do O_DIRECT (e.g. tmpfs), DataReader and
+// DataWriter then use fadvise for it
+bool directIoSupported( const QString & fileName);
+
+// O_DIRECT needs the file offsets, sizes and memory aligned to this, 4096 covers both
+// 512 byte and 4k sector disks
+static const qint64 IoAlignment = 4096;
+
+// Buffers for DataReader::read() have to come from here. They are aligned for O_DIRECT
+// and have room for rounding the reads out to whole blocks.
+char * allocIoBuffer( qint64 size);
+void freeIoBuffer( char * buff);
+
+// reads pieces of a file at given offsets
+class DataReader {
+public:
+    DataReader( const QString & fileName, IoMode mode);
+    ~DataReader();
+    // reads size bytes at offset into buff (from allocIoBuffer( size) or bigger), returns
+    // where in buff the data starts, which for O_DIRECT is not the start of buff
+    char * read( char * buff, qint64 offset, qint64 size);
+    // the same read, but started on io and done once io.wait() returns tag; returns where
+    // the data will be, readDone() has to be called when it is there
+    char * submit( AsyncReader & io, char * buff, qint64 offset, qint64 size, qint64 tag);
+    void readDone( qint64 offset, qint64 size);
+    // descriptor for the normal (not O_DIRECT) reads
+    int handle() const { return _fd; }
+    // the latency of every pread goes to the metrics
+    void setMetrics( Metrics * metrics) { _metrics = metrics; }
+protected:
+    QString _fileName;
+    IoMode _mode;
+    int _fd, _directFd;
+    Metrics * _metrics;
+};
+
+class BufferPool;
+
+// writes a stream of data into an existing file starting at a given offset
+class DataWriter {
+public:
+    // the O_DIRECT staging buffer comes from the pool, if there is one
+    DataWriter( const QString & fileName, qint64 offset, IoMode mode, BufferPool * pool = 0);
+    ~DataWriter();
+    void write( const char * data, qint64 size);
+    // writes out whatever is still staged, has to be called once all the data was written
+    void finish();
+    // offset right after the last byte written
+    qint64 position() const { return _pos + _staged; }
+    // makes everything written so far durable (fdatasync) and returns position(); what was
+    // waiting in the O_DIRECT staging buffer is written out first
+    qint64 sync();
+    // the latency of every pwrite and fdatasync goes to the metrics
+    void setMetrics( Metrics * metrics) { _metrics = metrics; }
+protected:
+    // writes out the O_DIRECT staging buffer, the writes after it go on from there
+    void flushStage();
+    void writeAt( int fd, const char * data, qint64 size, qint64 offset);
+    // fadvise mode: kicks off the writeback and drops the pages written before
+    void writeback();
+
+    QString _fileName;
+    IoMode _mode;
+    int _fd, _directFd;
+    // O_DIRECT writes go through an aligned staging buffer, _pos is where it starts
+    qint64 _pos;
+    char * _stage;
+    qint64 _stageSize, _staged;
+    BufferPool * _pool;
+    // fadvise mode: start of the data not handed to the writeback yet, and of the window
+    // that is being written back
+    qint64 _windowStart, _flushStart;
+    Metrics * _metrics;
+};
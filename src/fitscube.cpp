@@ -0,0 +1,81 @@
+/*
+ *   Copyright 2013 Pavol Federl (federl@gmail.com)
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ *
+ */
+
+#include <QFileInfo>
+
+#include "fitscube.h"
+
+using namespace std;
+
+static bool fail( CubeError * error, CubeError::Code code, const QString & message)
+{
+    if( error) {
+        error-> code = code;
+        error-> message = message;
+    }
+    return false;
+}
+
+bool combineCubes( const QStringList & inputs, const QString & output,
+                   const CombineOptions & options, CubeError * error)
+{
+    if( inputs.isEmpty())
+        return fail( error, CubeError::InvalidArgument, "No input cubes");
+    if( output.isEmpty())
+        return fail( error, CubeError::InvalidArgument, "No output file");
+    try {
+        combineFITS( inputs, output, options);
+    } catch ( const CubeError & e) {
+        return fail( error, e.code, e.message);
+    } catch ( const char * msg) {
+        return fail( error, CubeError::Failed, msg);
+    } catch ( const QString & msg) {
+        return fail( error, CubeError::Failed, msg);
+    }
+    if( error) * error = CubeError();
+    return true;
+}
+
+bool processCube( const QString & input, const vector<CubeStage *> & stages,
+                  CubeProgress * progress, CubeError * error)
+{
+    if( ! QFileInfo( input).exists())
+        return fail( error, CubeError::InvalidArgument, QString( "%1 does not exist").arg( input));
+    try {
+        CubeReader reader( input);
+        FitsInfo info = reader.info();
+        beginStages( stages, info);
+        qint64 planeBytes = qint64( reader.width()) * reader.height() * (abs( reader.info().bitpix) / 8);
+        vector<double> plane;
+        for( int z = 0 ; z < reader.depth() ; z ++ ) {
+            reader.readPlane( z, plane);
+            for( size_t s = 0 ; s < stages.size() ; s ++ )
+                stages[s]-> process( z, 0, & plane[0], qint64( plane.size()));
+            if( progress && ! progress-> progress( (z + 1) * planeBytes, reader.depth() * planeBytes))
+                throw CubeError( CubeError::Cancelled, CubeCancelled);
+        }
+        endStages( stages);
+    } catch ( const CubeError & e) {
+        return fail( error, e.code, e.message);
+    } catch ( const char * msg) {
+        return fail( error, CubeError::Failed, msg);
+    } catch ( const QString & msg) {
+        return fail( error, CubeError::Failed, msg);
+    }
+    if( error) * error = CubeError();
+    return true;
+}
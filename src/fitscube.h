@@ -0,0 +1,29 @@
+#pragma once
+
+// The combiner as a library: everything a program needs to combine cubes, read and write
+// them and run its own processing on the values in memory, without going through files
+// in between. Build it with FitsCubeLib.pro (a static library, libfitscube).
+//
+// The calls below do not throw, they return false and describe the problem in a
+// CubeError (extractor.h). The classes they are built on (CubeReader, CubeWriter, the
+// stages) throw a QString, like the rest of the combiner.
+
+#include <vector>
+#include <QString>
+#include <QStringList>
+
+#include "extractor.h"
+#include "cubereader.h"
+#include "cubewriter.h"
+#include "cubestage.h"
+
+// Combines the inputs into output like combineFITS(). The stages of the options run on the
+// values that go into the output, options.progress is told about the copied bytes.
+bool combineCubes( const QStringList & inputs, const QString & output,
+                   const CombineOptions & options = CombineOptions(), CubeError * error = 0);
+
+// Runs the stages on a cube on disk, plane by plane: begin() with the cube's description,
+// process() once for every plane and end(). Nothing is written unless a stage does it
+// (e.g. WriteStage). The progress is in bytes of the input's data.
+bool processCube( const QString & input, const std::vector<CubeStage *> & stages,
+                  CubeProgress * progress = 0, CubeError * error = 0);
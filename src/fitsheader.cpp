@@ -0,0 +1,485 @@
+/*
+ *   Copyright 2013 Pavol Federl (federl@gmail.com)
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ *
+ */
+
+#include <iostream>
+#include <cstring>
+#include <cstdlib>
+#include <cerrno>
+#include <climits>
+#include <locale.h>
+#include <limits>
+#include <algorithm>
+
+#include "fitsheader.h"
+#include "extractor.h"
+
+using namespace std;
+
+// this is used to sort the keys when writing header file
+// returns float for easier management down the road... :)
+static float keywordPriority( const QString & key)
+{
+    if( key == "SIMPLE") return 0;
+    if( key == "XTENSION") return 0;
+    if( key == "BITPIX") return 1;
+    if( key == "NAXIS") return 2;
+    if( key == "NAXIS1") return 3;
+    if( key == "NAXIS2") return 4;
+    if( key == "NAXIS3") return 5;
+    if( key == "NAXIS4") return 6;
+    if( key == "NAXIS5") return 7;
+    // extensions (the binary table of a compressed image)
+    if( key == "PCOUNT") return 8;
+    if( key == "GCOUNT") return 9;
+    if( key == "TFIELDS") return 10;
+    if( key == "END") return numeric_limits<float>::max();
+    return 1000000;
+}
+
+QString FitsHeader::space80 = "                                                                                ";
+
+// convenience function to convert fits string to a raw string (removing intial quotes & replacing all double quotes with single ones)
+static QString fitsString2raw( const QString & s)
+{
+    if( s.length() < 2) throw "fitsString2raw - string less than 2 characters.";
+    QString res = s;
+    // remove the leading and ending quotes
+    res[0] = res[ res.length()-1] = ' ';
+    // replace all double single-quotes with a single quote
+    res.replace( "''", "'");
+
+    return res;
+}
+
+// remove leading/trailing spaces from a fits string
+QString fitsStringTrimmed( const QString & s)
+{
+    return QString( "'%1'").arg(fitsString2raw(s).trimmed());
+}
+
+// a card is parsed only once, when it is created
+FitsLine::FitsLine( const char * raw80)
+{
+    // clean up the line by converting anything outside of ASCII [32..126] to spaces
+    for( int i = 0 ; i < 80 ; i ++ )
+        _raw[i] = (raw80[i] < 32 || raw80[i] > 126) ? ' ' : raw80[i];
+    parse();
+}
+
+FitsLine::FitsLine( const QString & rawLine)
+{
+    QByteArray latin = rawLine.toLatin1();
+    int n = qMin( latin.size(), 80);
+    for( int i = 0 ; i < 80 ; i ++ ) {
+        char c = i < n ? latin[i] : ' ';
+        _raw[i] = (c < 32 || c > 126) ? ' ' : c;
+    }
+    parse();
+}
+
+// packs the trimmed key into an integer, space padded, so that keys can be compared and
+// hashed without making strings; keys longer than 8 characters cannot be in a card so
+// they get 0, which no card has
+quint64 FitsLine::keyCode( const char * key, int len)
+{
+    while( len > 0 && key[0] == ' ') { key ++; len --; }
+    while( len > 0 && key[len-1] == ' ') len --;
+    if( len > 8) return 0;
+    quint64 code = 0;
+    for( int i = 0 ; i < 8 ; i ++ )
+        code = (code << 8) | quint8( i < len ? key[i] : ' ');
+    return code;
+}
+
+// finds the key/value/comment in the card, the rules are the same as they always were:
+//   key = first 8 characters (trimmed)
+//   value/comment are only present if characters 9-10 are '= ' (or ' =')
+//   value = from the first non-space after that to the closing quote for strings,
+//           or until the '/' for everything else (trimmed)
+//   comment = whatever follows the value, it has to start with '/'
+void FitsLine::parse()
+{
+    _error = NoError;
+    _kStart = 0; _kLen = 8;
+    while( _kLen > 0 && _raw[_kStart] == ' ') { _kStart ++; _kLen --; }
+    while( _kLen > 0 && _raw[_kStart + _kLen - 1] == ' ') _kLen --;
+    _keyCode = keyCode( _raw + _kStart, _kLen);
+    // by default, value & comment are empty
+    _vStart = _cStart = 80; _vLen = _cLen = 0;
+    bool hasEqual = (_raw[8] == '=' && _raw[9] == ' ') || (_raw[8] == ' ' && _raw[9] == '=');
+    if( ! hasEqual) return;
+    int vStart = 10, vEnd = -1;
+    while( vStart < 80 && _raw[vStart] == ' ') vStart ++;
+    if( vStart == 80) // entire line is empty after the '='
+        return;
+    if( _raw[vStart] != '\'') { // it's an unquoted value
+        vEnd = 79;
+        for( int i = vStart + 1 ; i < 80 ; i ++ )
+            if( _raw[i] == '/') { vEnd = i - 1; break; }
+    } else { // it's a quoted string, skip the double single-quotes
+        for( int i = vStart + 1 ; i < 80 ; i ++ ) {
+            if( _raw[i] != '\'') continue;
+            if( i + 1 < 80 && _raw[i+1] == '\'') { i ++; continue; }
+            vEnd = i; break;
+        }
+        if( vEnd == -1) { // we have an unterminated string here
+            _error = UnterminatedString;
+            return;
+        }
+    }
+    // value, trimmed
+    while( vStart <= vEnd && _raw[vEnd] == ' ') vEnd --;
+    _vStart = vStart; _vLen = vEnd - vStart + 1;
+    // is there a comment?
+    int cStart = vStart + _vLen, cEnd = 79;
+    while( cStart <= cEnd && _raw[cStart] == ' ') cStart ++;
+    while( cStart <= cEnd && _raw[cEnd] == ' ') cEnd --;
+    if( cStart <= cEnd) {
+        if( _raw[cStart] != '/') {
+            _error = SyntaxError;
+            return;
+        }
+        cStart ++;
+    }
+    _cStart = cStart; _cLen = cEnd - cStart + 1;
+}
+
+// report the problems found by parse()
+void FitsLine::check() const
+{
+    if( _error == UnterminatedString)
+        throw QString( "Unterminated string in header for %1").arg( key());
+    if( _error == SyntaxError)
+        throw ("Syntax error in header: " + raw().trimmed());
+}
+
+// fits header parser
+FitsHeader FitsHeader::parse( QFile & f)
+{
+    FitsHeader hdr;
+
+    // read in the header one 2880 byte block at a time, until we find the card with END;
+    // each block holds 36 lines (cards) of 80 characters, which are not \0 terminated!!!
+    bool done = false;
+    while( ! done)
+    {
+        char block[2880];
+        if( ! blockRead( f, block, sizeof( block))) {
+            cerr << "Error: FitsHeader::parse() could not read header block.\n";
+            return FitsHeader();
+        }
+        done = hdr.addBlock( block);
+    }
+    // return this header
+    hdr._valid = true;
+    return hdr;
+}
+
+// parse a header from memory, the header is invalid if there is no END in it
+FitsHeader FitsHeader::parse( const char * data, qint64 size)
+{
+    FitsHeader hdr;
+    for( qint64 pos = 0 ; pos + 2880 <= size ; pos += 2880 ) {
+        if( hdr.addBlock( data + pos)) {
+            hdr._valid = true;
+            return hdr;
+        }
+    }
+    return FitsHeader();
+}
+
+// adds the cards of one 2880 byte block, returns true if one of them was the END card
+bool FitsHeader::addBlock( const char * block)
+{
+    // data offset moves
+    _dataOffset += 2880;
+    for( int card = 0 ; card < 36 ; card ++ ) {
+        const char * line = block + card * 80;
+        addLine( FitsLine( line));
+        // if this is the 'END' line, terminate the parse
+        if( memcmp( line, "END     ", 8) == 0)
+            return true;
+    }
+    return false;
+}
+
+void FitsHeader::addLine( const FitsLine & line)
+{
+    _lines.push_back( line);
+    // lookups return the first card with the key
+    if( ! _index.contains( line.keyCode()))
+        _index.insert( line.keyCode(), int( _lines.size()) - 1);
+}
+
+int FitsHeader::findLine( const char * key) const
+{
+    return _index.value( FitsLine::keyCode( key, strlen( key)), -1);
+}
+
+// the header as it goes into the file: the lines sorted by keyword priority (and if the
+// keyword priority is the same then by the current line position), padded with spaces to
+// a multiple of 2880 bytes
+QByteArray FitsHeader::toBytes() const
+{
+    // sort the lines based on a) keword priority, b) their current order
+    //vector< pair< QString, pair< double, int> > > lines;
+    typedef pair<QString, pair<double,int> > SortLine;
+    vector<SortLine> lines;
+    for( size_t i = 0 ; i < _lines.size() ; i ++ )
+        lines.push_back( make_pair(_lines[i].raw(), make_pair( keywordPriority( _lines[i].key()), i)));
+    // c++ does not support anonymous functions, but it does support local structures/classes with
+    // static functions... go figure :)
+    struct local { static bool cmp( const SortLine & v1, const SortLine & v2 ) {
+            // use std::pair built in comparison, it compares first to first, and only if equal
+            // it compares second to second
+            return( v1.second < v2.second );
+        }};
+    std::sort( lines.begin(), lines.end(), local::cmp);
+    // put all strings into one big array of bytes for wrting
+    QByteArray block;
+    for( size_t i = 0 ; i < lines.size() ; i ++ )
+        block.append( (lines[i].first + space80).left(80)); // paranoia
+    // pad with spaces so that the block is a multiple of 2880 bytes
+    while( block.size() % 2880 )
+        block.append( ' ');
+    //    cerr << "FitsHeader::toBytes() block size = " << block.size() << " with " << lines.size() << " lines\n";
+    //    for( size_t i = 0 ; i < lines.size() ; i ++ )
+    //        cerr << lines[i].first.toStdString() << "\n";
+    return block;
+}
+
+// will write out the header to a file
+bool FitsHeader::write(QFile & f)
+{
+    QByteArray block = toBytes();
+    if( ! blockWrite( f, block.constData(), block.size()))
+        return false;
+    else
+        return true;
+}
+
+// copies the value of a card into a \0 terminated buffer, for strtol/strtod
+static void valueToBuffer( const FitsLine & line, char buff[81])
+{
+    int n = line.valueLength();
+    memcpy( buff, line.valueData(), n);
+    buff[n] = 0;
+}
+
+// QString::toInt/toDouble always use the C locale, but strtod uses the current one, which
+// QCoreApplication sets from the environment
+static locale_t cLocale()
+{
+    static locale_t loc = newlocale( LC_ALL_MASK, "C", (locale_t) 0);
+    return loc;
+}
+
+static bool lineToInt( const FitsLine & line, int & result)
+{
+    char buff[81];
+    valueToBuffer( line, buff);
+    if( buff[0] == 0 || buff[0] == ' ') return false;
+    char * end;
+    errno = 0;
+    long val = strtol( buff, & end, 10);
+    if( * end != 0 || errno == ERANGE || val < INT_MIN || val > INT_MAX)
+        return false;
+    result = int( val);
+    return true;
+}
+
+static bool lineToDouble( const FitsLine & line, double & result)
+{
+    char buff[81];
+    valueToBuffer( line, buff);
+    if( buff[0] == 0 || buff[0] == ' ') return false;
+    char * end;
+    result = strtod_l( buff, & end, cLocale());
+    return * end == 0;
+}
+
+// get a value from the header as int - throwing an exception if this fails!
+int FitsHeader::intValue( const char * key) const
+{
+    int ind = findLine( key);
+    if( ind < 0)
+        throw QString("Could not find key %1 in fits file.").arg(key);
+    int result;
+    if( ! lineToInt( _lines[ind], result))
+        throw QString("Found %1=%2 in fits file but expected an integer.").arg(key).arg(_lines[ind].value());
+
+    // value converted, return it
+    return result;
+}
+
+// get a value from the header as int - substituting default value if needed!
+int FitsHeader::intValue( const char * key, int defaultValue) const
+{
+    int ind = findLine( key);
+    if( ind < 0)
+        return defaultValue;
+    int result;
+    if( ! lineToInt( _lines[ind], result))
+        throw QString("Found %1=%2 in fits file but expected an integer.").arg(key).arg(_lines[ind].value());
+
+    // value converted, return it
+    return result;
+}
+
+
+// get a value from the header as double - throwing an exception if this fails!
+double FitsHeader::doubleValue( const char * key) const
+{
+    int ind = findLine( key);
+    if( ind < 0)
+        throw QString("Could not find key %1 in fits file.").arg(key);
+    double result;
+    if( ! lineToDouble( _lines[ind], result))
+        throw QString("Found %1=%2 in fits file but expected a double.").arg(key).arg(_lines[ind].value());
+
+    // value converted, return it
+    return result;
+}
+
+// get a value from the header as double - substituting default value if needed!
+double FitsHeader::doubleValue( const char * key, double defaultValue) const
+{
+    int ind = findLine( key);
+    if( ind < 0)
+        return defaultValue;
+    double result;
+    if( ! lineToDouble( _lines[ind], result))
+        throw QString("Found %1=%2 in fits file but expected a double.").arg(key).arg(_lines[ind].value());
+
+    // value converted, return it
+    return result;
+}
+
+
+// get a value from the header as string - throwing an exception if this fails!
+QString FitsHeader::stringValue( const char * key) const
+{
+    int ind = findLine( key);
+    if( ind < 0)
+        throw QString("Could not find key %1 in fits file.").arg(key);
+    return _lines[ind].value();
+}
+
+// get a value from the header as string - substituting default value if needed!
+QString FitsHeader::stringValue( const char * key, const QString & defaultValue) const
+{
+    int ind = findLine( key);
+    if( ind < 0)
+        return defaultValue;
+    return _lines[ind].value();
+}
+
+
+// get a value from the header as variant
+QVariant FitsHeader::getValue( const QString & key, QVariant defaultValue) const
+{
+    // find the line with this key
+    int ind = findLine( key);
+
+    // if there is no such line, report error
+    if( ind < 0 )
+        return defaultValue;
+
+    // return the value as qvariant
+    return QVariant( _lines[ind].value());
+}
+
+// set an integer value
+void FitsHeader::setIntValue(const QString & pkey, qint64 value, const QString & pcomment)
+{
+    QString key = (pkey + space80).left(8);
+    QString comment = (pcomment + space80).left( 47);
+    // construct a line based on the parameters
+    QString rawLine = QString( "%1= %2 /  %3").arg( key, -8).arg( value, 20).arg( comment);
+    rawLine = (rawLine + space80).left(80); // just in case :)
+    // find a line with this key so that we can decide if we are adding a new line or
+    // replacing an existing one
+    setLine( pkey, rawLine);
+}
+
+// set a logical value, T or F in column 30
+void FitsHeader::setLogicalValue(const QString & pkey, bool value, const QString & pcomment)
+{
+    QString key = (pkey + space80).left(8);
+    QString rawLine = QString( "%1= %2 / %3").arg( key, -8).arg( value ? "T" : "F", 20).arg( pcomment);
+    rawLine = (rawLine + space80).left(80); // just in case :)
+    setLine( pkey, rawLine);
+}
+
+// set a double value
+void FitsHeader::setDoubleValue(const QString & pkey, double value, const QString & pcomment)
+{
+    QString space80 = "                                                                                ";
+    QString key = (pkey + space80).left(8);
+    QString comment = (pcomment + space80).left( 47);
+    // construct a line based on the parameters
+    QString rawLine = QString( "%1= %2 /  %3").arg( key, -8).arg( value, 20, 'G', 10).arg( comment);
+    rawLine = (rawLine + space80).left(80); // just in case :)
+    // find a line with this key so that we can decide if we are adding a new line or
+    // replacing an existing one
+    setLine( pkey, rawLine);
+}
+
+// set a string value, quoted and with the quotes inside doubled; the string is padded to
+// at least 8 characters as the standard asks
+void FitsHeader::setStringValue(const QString & pkey, const QString & value, const QString & pcomment)
+{
+    QString key = (pkey + space80).left(8);
+    QString escaped = QString( value).replace( "'", "''");
+    QString quoted = "'" + (escaped + "        ").left( qMax( 8, escaped.length())) + "'";
+    // construct a line based on the parameters
+    QString rawLine = QString( "%1= %2 / %3").arg( key, -8).arg( quoted, -20).arg( pcomment);
+    rawLine = (rawLine + space80).left(80); // just in case :)
+    setLine( pkey, rawLine);
+}
+
+// insert a raw line into fits - no syntax checking is done, except making sure it's padded to 80 chars
+void FitsHeader::addRaw(const QString & line)
+{
+    addLine( FitsLine( line));
+}
+
+void FitsHeader::removeKey( const QString & pkey)
+{
+    QByteArray key = pkey.toLatin1();
+    quint64 code = FitsLine::keyCode( key.constData(), key.size());
+    if( ! _index.contains( code))
+        return;
+    // the indices of the cards after the removed ones change, so index the rest again
+    std::vector< FitsLine > lines;
+    lines.swap( _lines);
+    _index.clear();
+    for( size_t i = 0 ; i < lines.size() ; i ++ )
+        if( lines[i].keyCode() != code)
+            addLine( lines[i]);
+}
+
+// replace the line with the same key (the card keeps its position), or add a new one
+void FitsHeader::setLine( const QString & key, const QString & rawLine)
+{
+    int ind = findLine( key);
+    if( ind < 0 )
+        addLine( FitsLine( rawLine));
+    else
+        _lines[ind] = FitsLine( rawLine);
+}
+
@@ -0,0 +1,118 @@
+#pragma once
+
+#include <vector>
+#include <QString>
+#include <QVariant>
+#include <QFile>
+#include <QHash>
+
+// FitsLine represents a single entry in the Fits header (I think it's called a card... :)
+// The card is parsed only once, when it is created, into the offsets of the key, value and
+// comment inside the raw 80 characters, so looking at it later does not allocate anything.
+class FitsLine {
+public:
+    FitsLine( const char * raw80 );
+    FitsLine( const QString & rawLine );
+    QString raw() const { return QString::fromLatin1( _raw, 80); }
+    QString key() const { return QString::fromLatin1( _raw + _kStart, _kLen); }
+    QString value() const { check(); return QString::fromLatin1( _raw + _vStart, _vLen); }
+    QString comment() const { check(); return QString::fromLatin1( _raw + _cStart, _cLen); }
+
+    // the key packed into an integer, this is what the header index uses
+    quint64 keyCode() const { return _keyCode; }
+    static quint64 keyCode( const char * key, int len);
+    // direct access to the characters of the value
+    const char * valueData() const { check(); return _raw + _vStart; }
+    int valueLength() const { check(); return _vLen; }
+
+protected:
+    // find the key/value/comment, errors are only reported when the value is asked for
+    void parse();
+    // throws if the card could not be parsed
+    void check() const;
+
+    char _raw[80];
+    quint64 _keyCode;
+    quint8 _kStart, _kLen, _vStart, _vLen, _cStart, _cLen;
+    enum { NoError, UnterminatedString, SyntaxError } _error;
+};
+
+// represents a FITS header
+struct FitsHeader
+{
+    // do the parse of the fits file
+    static FitsHeader parse( QFile & f );
+    // parse a header that is already in memory (whole 2880 byte blocks)
+    static FitsHeader parse( const char * data, qint64 size );
+    // write the header to a file
+    bool write( QFile & f);
+    // the bytes write() puts in the file
+    QByteArray toBytes() const;
+    // was the parse successful?
+    bool isValid() const { return _valid; }
+    // find a line with a given key (the first one, if there are more)
+    int findLine( const char * key ) const;
+    int findLine( const QString & key ) const { return findLine( key.toLatin1().constData()); }
+    qint64 dataOffset() const { return _dataOffset; }
+    const std::vector< FitsLine > & lines() const { return _lines; }
+
+    // add a raw line to the header
+    void addRaw( const QString & line );
+
+    // sets a value in the header
+    void setIntValue( const QString & key, qint64 value, const QString & comment = QString());
+    void setLogicalValue( const QString & key, bool value, const QString & comment = QString());
+    void setDoubleValue(const QString & pkey, double value, const QString & pcomment = QString());
+    void setStringValue(const QString & pkey, const QString & value, const QString & pcomment = QString());
+    // removes all the cards with the key
+    void removeKey( const QString & key);
+
+    // general access function to key/values, does not throw exceptions but can return
+    // variant with isValid() = false
+    QVariant getValue( const QString & key, QVariant defaultValue = QVariant()) const;
+
+    // convenience functions that lookup key and convert it to requested type
+    // all these throw exceptions if (a) key is not defined (b) key does not have a value
+    // that can be converted to the requested type. The numbers are converted straight
+    // from the card, without any temporary strings:
+
+    // find a line with 'key' and conver it's 'value' to integer
+    int intValue( const char * key ) const;
+    int intValue( const char * key, int defaultValue) const;
+    QString stringValue( const char * key ) const;
+    QString stringValue( const char * key, const QString & defaultValue) const;
+    double doubleValue( const char * key ) const;
+    double doubleValue( const char * key, double defaultValue) const;
+
+    int intValue( const QString & key ) const { return intValue( key.toLatin1().constData()); }
+    int intValue( const QString & key, int defaultValue) const { return intValue( key.toLatin1().constData(), defaultValue); }
+    QString stringValue( const QString & key ) const { return stringValue( key.toLatin1().constData()); }
+    QString stringValue( const QString & key, const QString & defaultValue) const { return stringValue( key.toLatin1().constData(), defaultValue); }
+    double doubleValue( const QString & key ) const { return doubleValue( key.toLatin1().constData()); }
+    double doubleValue( const QString & key, double defaultValue) const { return doubleValue( key.toLatin1().constData(), defaultValue); }
+
+    // empty (invalid) header
+    FitsHeader() { _valid = false; _dataOffset = 0; }
+
+protected:
+    // append a line and index it
+    void addLine( const FitsLine & line);
+    // parse one 2880 byte block, returns true if it contained the END card
+    bool addBlock( const char * block);
+    // replace the line with the same key, or add it
+    void setLine( const QString & key, const QString & rawLine);
+
+    // where does the data start? This is set only in parse()! Bad design, I know.
+    qint64 _dataOffset;
+    // is this header valid? This is also only set in parse();
+    bool _valid;
+    // the lines
+    std::vector< FitsLine > _lines;
+    // key code -> index of the first line with that key
+    QHash< quint64, int > _index;
+    // convenienty 80 spaces string
+    static QString space80;
+};
+
+// remove leading/trailing spaces from a fits string
+QString fitsStringTrimmed( const QString & s);
@@ -0,0 +1,69 @@
+#pragma once
+
+#include <cmath>
+#include <cstring>
+#include <QtEndian>
+
+// a physical value as a raw integer, NaN becomes the BLANK and the rest is saturated
+inline qint64 fitsToInteger( double v, double min, double max, qint64 blank)
+{
+    if( v != v) return blank;
+    v = floor( v + 0.5);
+    return qint64( v < min ? min : v > max ? max : v);
+}
+
+// Loads and stores one big-endian (FITS) value of every BITPIX as a double, which holds
+// all of them exactly except for the biggest 64-bit integers. Storing to an integer
+// BITPIX rounds, saturates and turns NaNs into the given BLANK.
+template <int Bitpix> struct FitsPixel;
+template <> struct FitsPixel<8> {
+    enum { Size = 1, Integer = 1 };
+    static double load( const uchar * p) { return * p; }
+    static void store( double v, uchar * p, qint64 blank) { * p = uchar( fitsToInteger( v, 0, 255, blank)); }
+};
+template <> struct FitsPixel<16> {
+    enum { Size = 2, Integer = 1 };
+    static double load( const uchar * p) { return qint16( qFromBigEndian<quint16>( p)); }
+    static void store( double v, uchar * p, qint64 blank) {
+        qToBigEndian<quint16>( quint16( fitsToInteger( v, -32768, 32767, blank)), p);
+    }
+};
+template <> struct FitsPixel<32> {
+    enum { Size = 4, Integer = 1 };
+    static double load( const uchar * p) { return qint32( qFromBigEndian<quint32>( p)); }
+    static void store( double v, uchar * p, qint64 blank) {
+        qToBigEndian<quint32>( quint32( fitsToInteger( v, -2147483648.0, 2147483647.0, blank)), p);
+    }
+};
+template <> struct FitsPixel<64> {
+    enum { Size = 8, Integer = 1 };
+    static double load( const uchar * p) { return double( qint64( qFromBigEndian<quint64>( p))); }
+    static void store( double v, uchar * p, qint64 blank) {
+        qToBigEndian<quint64>( quint64( fitsToInteger( v, -9223372036854775808.0, 9223372036854774784.0, blank)), p);
+    }
+};
+template <> struct FitsPixel<-32> {
+    enum { Size = 4, Integer = 0 };
+    static double load( const uchar * p) {
+        quint32 bits = qFromBigEndian<quint32>( p);
+        float val; memcpy( & val, & bits, 4);
+        return val;
+    }
+    static void store( double v, uchar * p, qint64) {
+        float val = float( v);
+        quint32 bits; memcpy( & bits, & val, 4);
+        qToBigEndian<quint32>( bits, p);
+    }
+};
+template <> struct FitsPixel<-64> {
+    enum { Size = 8, Integer = 0 };
+    static double load( const uchar * p) {
+        quint64 bits = qFromBigEndian<quint64>( p);
+        double val; memcpy( & val, & bits, 8);
+        return val;
+    }
+    static void store( double v, uchar * p, qint64) {
+        quint64 bits; memcpy( & bits, & v, 8);
+        qToBigEndian<quint64>( bits, p);
+    }
+};
@@ -0,0 +1,138 @@
+/*
+ *   Copyright 2013 Pavol Federl (federl@gmail.com)
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ *
+ */
+
+#include <QFileInfo>
+#include <QDateTime>
+#include <QStringList>
+
+#include <unistd.h>
+
+#include "journal.h"
+
+using namespace std;
+
+static const char * JournalMagic = "FitsCubeCombine journal 2";
+
+Journal::Journal()
+{
+    _dataStart = _committed = 0;
+    _dataSum = 0;
+}
+
+Journal::~Journal()
+{
+    _file.close();
+}
+
+QString Journal::fileName( const QString & output)
+{
+    return output + ".journal";
+}
+
+// Every input is identified by its path, size and modification time, so that a resume
+// with different (or modified) inputs is refused.
+QStringList Journal::describe( const vector<FitsInfo> & inputs, qint64 dataStart,
+                              const QStringList & settings)
+{
+    QStringList lines;
+    lines << JournalMagic;
+    lines << QString( "header %1").arg( dataStart);
+    lines << settings;
+    for( size_t i = 0 ; i < inputs.size() ; i ++ ) {
+        QFileInfo finfo( inputs[i].fileName);
+        lines << QString( "input %1 %2 %3 %4 %5").arg( inputs[i].dataOffset).arg( inputs[i].dataSize)
+                 .arg( finfo.size()).arg( finfo.lastModified().toTime_t()).arg( inputs[i].fileName);
+    }
+    return lines;
+}
+
+void Journal::appendLine( const QString & line)
+{
+    QByteArray data = (line + "\n").toLocal8Bit();
+    if( _file.write( data) != data.size() || ! _file.flush() || fdatasync( _file.handle()) != 0)
+        throw QString( "Could not write the journal %1").arg( _file.fileName());
+}
+
+void Journal::create( const QString & output, const vector<FitsInfo> & inputs, qint64 dataStart,
+                      const QStringList & settings)
+{
+    _file.setFileName( fileName( output));
+    if( ! _file.open( QFile::WriteOnly | QFile::Truncate))
+        throw QString( "Cannot open the journal %1 for writing.").arg( _file.fileName());
+    _dataStart = dataStart;
+    _committed = 0;
+    _dataSum = 0;
+    QStringList lines = describe( inputs, dataStart, settings);
+    for( int i = 0 ; i < lines.size() ; i ++ )
+        appendLine( lines[i]);
+}
+
+qint64 Journal::resume( const QString & output, const vector<FitsInfo> & inputs, qint64 dataStart,
+                       const QStringList & settings, qint64 dataSize)
+{
+    _file.setFileName( fileName( output));
+    if( ! _file.open( QFile::ReadOnly))
+        throw QString( "Cannot open the journal %1.").arg( _file.fileName());
+    QByteArray data = _file.readAll();
+    QString text = QString::fromLocal8Bit( data.constData(), data.size());
+    _file.close();
+    // a line without the newline was cut off by the crash
+    QStringList lines = text.split( "\n");
+    lines.removeLast();
+
+    QStringList expected = describe( inputs, dataStart, settings);
+    for( int i = 0 ; i < expected.size() ; i ++ ) {
+        if( i >= lines.size() || lines[i] != expected[i])
+            throw QString( "The journal %1 does not match the inputs or the options (line %2), "
+                           "cannot resume.")
+                .arg( _file.fileName()).arg( i + 1);
+    }
+    _committed = 0;
+    _dataSum = 0;
+    for( int i = expected.size() ; i < lines.size() ; i ++ ) {
+        QStringList words = lines[i].split( " ");
+        bool ok = words.size() == 3 && words[0] == "committed";
+        qint64 committed = ok ? words[1].toLongLong( & ok) : 0;
+        quint32 dataSum = ok ? words[2].toUInt( & ok) : 0;
+        if( ! ok || committed < _committed || committed > dataSize)
+            throw QString( "The journal %1 is corrupted (line %2), cannot resume.")
+                .arg( _file.fileName()).arg( i + 1);
+        _committed = committed;
+        _dataSum = dataSum;
+    }
+    _dataStart = dataStart;
+
+    if( ! _file.open( QFile::WriteOnly | QFile::Append))
+        throw QString( "Cannot open the journal %1 for writing.").arg( _file.fileName());
+    return _committed;
+}
+
+void Journal::commit( qint64 outputOffset, quint32 dataSum)
+{
+    qint64 committed = outputOffset - _dataStart;
+    if( ! isOpen() || committed <= _committed)
+        return;
+    appendLine( QString( "committed %1 %2").arg( committed).arg( dataSum));
+    _committed = committed;
+    _dataSum = dataSum;
+}
+
+void Journal::remove()
+{
+    _file.close();
+    _file.remove();
+}
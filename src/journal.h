@@ -0,0 +1,56 @@
+#pragma once
+
+#include <vector>
+#include <QString>
+#include <QFile>
+#include <QStringList>
+
+#include "extractor.h"
+
+// Sidecar file next to an output (output.journal) that records the inputs of the combine,
+// in the order in which they go into the output, and how many bytes of the data segment
+// are known to be safely on disk (together with the data sum of those bytes). If the
+// combine dies, --resume uses it to continue from the last committed position instead of
+// starting all over.
+//
+// The journal is only ever appended to, a commit adds one line, so a crash in the middle
+// of writing it loses at most that line.
+// how often the writers commit to the journal, in ms
+static const int CommitInterval = 2000;
+
+class Journal {
+public:
+    Journal();
+    ~Journal();
+
+    static QString fileName( const QString & output);
+
+    // starts a new journal for the inputs, dataStart is where the data segment begins and
+    // settings are lines describing the options that change the output (e.g. "checksum on")
+    void create( const QString & output, const std::vector<FitsInfo> & inputs, qint64 dataStart,
+                 const QStringList & settings);
+    // opens the journal of an interrupted combine and returns the number of committed data
+    // bytes; throws if the journal does not belong to these inputs, or if it commits more than
+    // the dataSize bytes of the output's data segment
+    qint64 resume( const QString & output, const std::vector<FitsInfo> & inputs, qint64 dataStart,
+                   const QStringList & settings, qint64 dataSize);
+    // records that the output is good up to outputOffset, which the caller made durable,
+    // and the data sum of everything before it
+    void commit( qint64 outputOffset, quint32 dataSum);
+    // data sum at the last commit
+    quint32 dataSum() const { return _dataSum; }
+    // the combine finished, the journal is not needed anymore
+    void remove();
+
+    bool isOpen() const { return _file.isOpen(); }
+
+protected:
+    void appendLine( const QString & line);
+    // the lines describing the inputs, the same for create() and resume()
+    static QStringList describe( const std::vector<FitsInfo> & inputs, qint64 dataStart,
+                                 const QStringList & settings);
+
+    QFile _file;
+    qint64 _dataStart, _committed;
+    quint32 _dataSum;
+};
@@ -26,17 +26,116 @@
 #include <QFile>
 #include <QTextStream>
 #include <QTime>
+#include <QRegExp>
 
 #include "extractor.h"
+#include "journal.h"
 
 using namespace std;
 
 static void usage( const QString & prog )
 {
-    cerr << QString( "Error! Usage: %1 output [list of fits files]\n").arg(prog).toStdString();
+    cerr << QString( "Error! Usage: %1 [options] output [list of fits files]\n"
+                     "       %1 [options] --stokes outputPattern inputPattern\n"
+                     "  In the --stokes mode %S in the patterns is replaced by I, Q, U, V and Weight\n"
+                     "  (%s by I, Q, U, V and W) and all five cubes are combined in one run, e.g.\n"
+                     "  %1 --stokes 'cube%s.fits' 'images/GALFACTS_N1_*_%Scube.fits'\n"
+                     "Options:\n"
+                     "  --clip-min value  values below this become NaN (default -1000)\n"
+                     "  --clip-max value  values above this become NaN (default 1000)\n"
+                     "  --no-clip         copy the values as they are\n"
+                     "  --no-zero-copy    with --no-clip, copy through memory instead of in the kernel\n"
+                     "  --parallel-files n  preallocate the output and copy n input files at once\n"
+                     "  --io mode         buffered (default), direct (O_DIRECT, bypasses the page cache)\n"
+                     "                    or fadvise (page cache, but dropped right after use)\n"
+                     "  --queue-depth n   keep n reads of 1M in flight (io_uring, or reader threads on\n"
+                     "                    kernels without it) instead of one read at a time (default 1)\n"
+                     "  --io-threads      with --queue-depth, use the reader threads even if io_uring works\n"
+                     "  --memory size     memory for the data buffers, e.g. 512M or 4G (default 256M)\n"
+                     "  --huge-pages      put the data buffers in huge pages\n"
+                     "  --resume          continue an interrupted combine (needs output.journal)\n"
+                     "  --checksum        add CHECKSUM/DATASUM cards, computed while the data is copied\n"
+                     "  --spectral-major  write the cube with the frequency axis first, so that every\n"
+                     "                    spectrum is contiguous in the file\n"
+                     "  --compress        write a tile-compressed image (RICE_1, as fpack), floating\n"
+                     "                    point values are quantised with dithering\n"
+                     "  --quantize q      quantisation step is noise / q, or -q if q < 0 (default 4)\n"
+                     "  --tile-planes n   planes per compressed tile (default 1)\n"
+                     "  --convert bitpix  convert all values to -32 or -64 (with BSCALE/BZERO/BLANK\n"
+                     "                    applied), so cubes stored in different formats combine\n"
+                     "  --stats           collect plane statistics on the way, for DATAMIN/DATAMAX\n"
+                     "                    and a table in output.stats\n"
+                     "  --preview n       also write copies binned 2x2, 4x4 and 8x8 and by n channels\n"
+                     "                    (output.preview2.fits, ...)\n"
+                     "  --merge-overlaps  channels that several inputs have become their average,\n"
+                     "                    weighted by the matching *_Weightcube.fits planes\n"
+                     "  --freq-range f1:f2  only the channels with frequencies from f1 to f2 (Hz), only\n"
+                     "                    they are read\n"
+                     "  --region x1:x2,y1:y2  only this box of pixels (from 1, inclusive, as FITS\n"
+                     "                    sections), the rows of the box are all that is read\n"
+                     "  --mosaic          put the inputs side by side on the pixel grid of their WCS\n"
+                     "                    (fields of the same frequencies), instead of along frequency\n"
+                     "  --virtual         write only a descriptor of the combined cube (header and where\n"
+                     "                    its planes are in the inputs), for VirtualCubeReader\n"
+                     "  --metrics target  write JSON lines with the stage times, I/O latencies and\n"
+                     "                    bytes per input to a file, - (stdout) or fd:n\n").arg(prog).toStdString();
     exit( -1 );
 }
 
+// returns the value of the option at argv[i] and moves past it
+static QString optionValue( int argc, char ** argv, int & i)
+{
+    if( i + 1 >= argc) {
+        cerr << "*** ERROR *** option " << argv[i] << " needs a value.\n";
+        usage( argv[0]);
+    }
+    i ++;
+    return argv[i];
+}
+
+static double doubleOption( int argc, char ** argv, int & i)
+{
+    QString opt = argv[i];
+    bool ok;
+    double val = optionValue( argc, argv, i).toDouble( & ok);
+    if( ! ok) {
+        cerr << "*** ERROR *** option " << opt.toStdString() << " needs a number.\n";
+        usage( argv[0]);
+    }
+    return val;
+}
+
+static int intOption( int argc, char ** argv, int & i)
+{
+    QString opt = argv[i];
+    bool ok;
+    int val = optionValue( argc, argv, i).toInt( & ok);
+    if( ! ok || val < 1) {
+        cerr << "*** ERROR *** option " << opt.toStdString() << " needs a positive integer.\n";
+        usage( argv[0]);
+    }
+    return val;
+}
+
+// size with an optional K, M or G suffix
+static qint64 sizeOption( int argc, char ** argv, int & i)
+{
+    QString opt = argv[i];
+    QString val = optionValue( argc, argv, i).toUpper();
+    qint64 mult = 1;
+    if( val.endsWith( "K")) mult = 1024;
+    else if( val.endsWith( "M")) mult = 1024 * 1024;
+    else if( val.endsWith( "G")) mult = 1024 * 1024 * 1024;
+    if( mult > 1) val.chop( 1);
+    bool ok;
+    double size = val.toDouble( & ok);
+    if( ! ok || size <= 0) {
+        cerr << "*** ERROR *** option " << opt.toStdString() << " needs a size, e.g. 512M.\n";
+        usage( argv[0]);
+    }
+    return qint64( size * mult);
+}
+
 int main( int argc, char ** argv)
 {
     QCoreApplication app(argc, argv);
@@ -45,28 +144,155 @@ int main( int argc, char ** argv)
     qsrand(QTime(0,0,0).msecsTo(QTime::currentTime()));
 
     // get the command line arguments
-    if( argc < 3 ) {
+    CombineOptions options;
+    bool stokesMode = false;
+    QStringList args;
+    for( int i = 1 ; i < argc ; i ++ ) {
+        QString arg = argv[i];
+        if( ! args.isEmpty() || ! arg.startsWith( "--"))
+            args << arg;
+        else if( arg == "--stokes")
+            stokesMode = true;
+        else if( arg == "--clip-min")
+            options.clipMin = doubleOption( argc, argv, i);
+        else if( arg == "--clip-max")
+            options.clipMax = doubleOption( argc, argv, i);
+        else if( arg == "--no-clip")
+            options.clip = false;
+        else if( arg == "--no-zero-copy")
+            options.zeroCopy = false;
+        else if( arg == "--parallel-files")
+            options.parallelFiles = intOption( argc, argv, i);
+        else if( arg == "--queue-depth")
+            options.queueDepth = intOption( argc, argv, i);
+        else if( arg == "--io-threads")
+            options.ioThreads = true;
+        else if( arg == "--memory")
+            options.memory = sizeOption( argc, argv, i);
+        else if( arg == "--huge-pages")
+            options.hugePages = true;
+        else if( arg == "--resume")
+            options.resume = true;
+        else if( arg == "--checksum")
+            options.checksum = true;
+        else if( arg == "--spectral-major")
+            options.spectralMajor = true;
+        else if( arg == "--compress")
+            options.compress = true;
+        else if( arg == "--quantize")
+            options.quantizeLevel = doubleOption( argc, argv, i);
+        else if( arg == "--tile-planes")
+            options.tilePlanes = intOption( argc, argv, i);
+        else if( arg == "--stats")
+            options.stats = true;
+        else if( arg == "--merge-overlaps")
+            options.mergeOverlaps = true;
+        else if( arg == "--preview")
+            options.preview = intOption( argc, argv, i);
+        else if( arg == "--freq-range") {
+            QStringList val = optionValue( argc, argv, i).split( ":");
+            bool ok1 = false, ok2 = false;
+            if( val.size() == 2) {
+                options.freqMin = val[0].toDouble( & ok1);
+                options.freqMax = val[1].toDouble( & ok2);
+            }
+            if( ! ok1 || ! ok2) {
+                cerr << "*** ERROR *** --freq-range needs two frequencies, e.g. 1.4e9:1.42e9\n";
+                usage( argv[0]);
+            }
+            options.freqRange = true;
+        }
+        else if( arg == "--region") {
+            QRegExp rx( "(\\d+):(\\d+),(\\d+):(\\d+)");
+            QString val = optionValue( argc, argv, i);
+            if( ! rx.exactMatch( val) || rx.cap(1).toInt() < 1 || rx.cap(3).toInt() < 1
+                    || rx.cap(2).toInt() < rx.cap(1).toInt() || rx.cap(4).toInt() < rx.cap(3).toInt()) {
+                cerr << "*** ERROR *** --region needs x1:x2,y1:y2 with 1 <= x1 <= x2 and 1 <= y1 <= y2\n";
+                usage( argv[0]);
+            }
+            options.region = true;
+            options.regionX = rx.cap(1).toInt() - 1;
+            options.regionY = rx.cap(3).toInt() - 1;
+            options.regionWidth = rx.cap(2).toInt() - options.regionX;
+            options.regionHeight = rx.cap(4).toInt() - options.regionY;
+        }
+        else if( arg == "--mosaic")
+            options.mosaic = true;
+        else if( arg == "--virtual")
+            options.virtualCube = true;
+        else if( arg == "--metrics")
+            options.metrics = optionValue( argc, argv, i);
+        else if( arg == "--convert") {
+            QString val = optionValue( argc, argv, i);
+            options.convert = val.toInt();
+            if( options.convert != -32 && options.convert != -64) {
+                cerr << "*** ERROR *** --convert takes -32 or -64, not " << val.toStdString() << "\n";
+                usage( argv[0]);
+            }
+        }
+        else if( arg == "--io") {
+            QString mode = optionValue( argc, argv, i);
+            if( ! parseIoMode( mode, options.ioMode)) {
+                cerr << "*** ERROR *** unknown I/O mode " << mode.toStdString() << "\n";
+                usage( argv[0]);
+            }
+        }
+        else {
+            cerr << "*** ERROR *** unknown option " << arg.toStdString() << "\n";
+            usage( argv[0]);
+        }
+    }
+    if( args.size() < 2 || (stokesMode && args.size() != 2)) {
         usage( argv[0]);
     }
-    QStringList inputFiles;
-    for( int i = 2 ; i < argc ; i ++ )
-        inputFiles << argv[i];
-    QString outputFile = argv[1];
+    if( options.mosaic && stokesMode) {
+        cerr << "*** ERROR *** --mosaic cannot be used with --stokes.\n";
+        exit(-1);
+    }
+    if( options.virtualCube && (stokesMode || options.mosaic)) {
+        cerr << "*** ERROR *** --virtual cannot be used with --stokes or --mosaic.\n";
+        exit(-1);
+    }
+    QString outputFile = args[0];
+    QStringList inputFiles = args.mid( 1);
 //    cerr << "Input files:\n";
 //    for( int i = 0 ; i < inputFiles.size() ; i ++ )
 //        cerr << QString("  %1 %2\n").arg(i,3).arg(inputFiles[i]).toStdString();
 //    cerr << QString("Output file:\n  %1\n").arg(outputFile).toStdString();
 
-    if( QFileInfo(outputFile).exists()) {
-        cerr << "*** ERROR *** output file already exists, I refuse to overwrite it.\n";
-        exit(-1);
+    QStringList outputFiles;
+    if( stokesMode) {
+        QStringList stokes = stokesParameters();
+        for( int i = 0 ; i < stokes.size() ; i ++ )
+            outputFiles << expandStokes( outputFile, stokes[i]);
+        if( outputFiles.size() > 1 && outputFiles[0] == outputFiles[1]) {
+            cerr << "*** ERROR *** output pattern must contain %S or %s.\n";
+            exit(-1);
+        }
+    } else {
+        outputFiles << outputFile;
+    }
+    for( int i = 0 ; i < outputFiles.size() ; i ++ ) {
+        // an output with a journal is an interrupted combine, --resume continues it
+        if( options.resume && QFileInfo( Journal::fileName( outputFiles[i])).exists())
+            continue;
+        if( QFileInfo(outputFiles[i]).exists()) {
+            cerr << "*** ERROR *** output file " << outputFiles[i].toStdString()
+                 << " already exists, I refuse to overwrite it.\n";
+            exit(-1);
+        }
     }
 
 
     bool success = false;
     try {
-        combineFITS( inputFiles, outputFile );
+        if( stokesMode)
+            combineStokesFITS( inputFiles[0], outputFile, options);
+        else
+            combineFITS( inputFiles, outputFile, options);
         success = true;
+    } catch ( const CubeError & e) {
+        cerr << "Error: " << e.message.toStdString() << "\n";
     } catch ( const char * msg) {
         cerr << "Error: " << msg << "\n";
     } catch ( const QString & msg) {
@@ -75,6 +301,8 @@ int main( int argc, char ** argv)
         cerr << "Error: unknown.\n";
     }
     if( ! success) {
+        if( QFileInfo( Journal::fileName( outputFiles[0])).exists())
+            cerr << "Run the same command with --resume to continue where it stopped.\n";
         cerr << "Aborting...\n";
         exit(-1);
     }
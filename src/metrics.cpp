@@ -0,0 +1,274 @@
+/*
+ *   Copyright 2013 Pavol Federl (federl@gmail.com)
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ *
+ */
+
+#include <cerrno>
+#include <cstring>
+#include <cmath>
+#include <exception>
+
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <QDateTime>
+#include <QFile>
+
+#include "metrics.h"
+#include "cubestage.h"
+
+using namespace std;
+
+const int Metrics::Buckets;
+
+static const char * stageNames[ StageCount] = { "read", "filter", "checksum", "write", "copy" };
+static const char * opNames[ OpCount] = { "read", "write", "sync", "copy" };
+
+// a JSON string, with the quotes
+static QString jsonString( const QString & s)
+{
+    QString res = "\"";
+    for( int i = 0 ; i < s.length() ; i ++ ) {
+        QChar c = s[i];
+        if( c == '"' || c == '\\')
+            res += QString( "\\") + c;
+        else if( c.unicode() < 0x20)
+            res += QString( "\\u%1").arg( int( c.unicode()), 4, 16, QChar( '0'));
+        else
+            res += c;
+    }
+    return res + "\"";
+}
+
+Metrics::Latency::Latency()
+{
+    count = bytes = nsecs = max = 0;
+    for( int i = 0 ; i < Buckets ; i ++ )
+        buckets[i] = 0;
+}
+
+Metrics::Metrics( const QString & target)
+{
+    _ownFd = true;
+    _finished = false;
+    _lastProgress = -1;
+    _buffers = _buffersInUse = _buffersPeak = 0;
+    _callback = 0;
+    if( target.isEmpty()) {
+        _fd = -1;
+        _ownFd = false;
+    }
+    else if( target == "-") {
+        _fd = 1;
+        _ownFd = false;
+    }
+    else if( target.startsWith( "fd:")) {
+        bool ok;
+        _fd = target.mid( 3).toInt( & ok);
+        if( ! ok || _fd < 0 || fcntl( _fd, F_GETFD) < 0)
+            throw QString( "No open file descriptor %1 for the metrics").arg( target.mid( 3));
+        _ownFd = false;
+    }
+    else {
+        // appended, so that several runs can share one file
+        _fd = ::open( QFile::encodeName( target).constData(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+        if( _fd < 0)
+            throw QString( "Could not open %1 for the metrics: %2").arg( target).arg( strerror( errno));
+    }
+    _timer.start();
+}
+
+Metrics::~Metrics()
+{
+    if( ! _finished) {
+        try {
+            finish();
+        } catch ( ... ) {
+        }
+    }
+    if( _ownFd)
+        ::close( _fd);
+}
+
+qint64 Metrics::now()
+{
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, & ts);
+    return qint64( ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+QString Metrics::field( const QString & key, qint64 value)
+{
+    return jsonString( key) + ":" + QString::number( value);
+}
+
+QString Metrics::field( const QString & key, double value)
+{
+    // JSON has no NaN or infinity
+    if( ! (value - value == 0))
+        return jsonString( key) + ":null";
+    return jsonString( key) + ":" + QString::number( value, 'g', 15);
+}
+
+QString Metrics::field( const QString & key, const QString & value)
+{
+    return jsonString( key) + ":" + jsonString( value);
+}
+
+QString Metrics::field( const QString & key, const QStringList & values)
+{
+    QStringList quoted;
+    for( int i = 0 ; i < values.size() ; i ++ )
+        quoted << jsonString( values[i]);
+    return jsonString( key) + ":[" + quoted.join( ",") + "]";
+}
+
+// one line in one write, so that the lines of a pipe or a shared file do not get mixed up
+void Metrics::write( const QString & line)
+{
+    if( _fd < 0)
+        return;
+    QByteArray data = (line + "\n").toUtf8();
+    const char * p = data.constData();
+    qint64 size = data.size();
+    while( size > 0) {
+        ssize_t n = ::write( _fd, p, size_t( size));
+        if( n < 0 && errno == EINTR) continue;
+        // the metrics are not worth failing the combine for
+        if( n <= 0) return;
+        p += n; size -= n;
+    }
+}
+
+void Metrics::event( const QString & event, const QStringList & fields)
+{
+    QStringList all;
+    all << field( "event", event)
+        << field( "time", QDateTime::currentDateTime().toMSecsSinceEpoch() / 1000.0)
+        << field( "elapsed", _timer.nsecsElapsed() / 1e9)
+        << fields;
+    write( "{" + all.join( ",") + "}");
+}
+
+void Metrics::addLatency( MetricsOp op, qint64 nsecs, qint64 bytes)
+{
+    int bucket = 0;
+    for( qint64 us = nsecs / 1000 ; us > 1 && bucket < Buckets - 1 ; us >>= 1)
+        bucket ++;
+    QMutexLocker locker( & _mutex);
+    Latency & l = _latency[op];
+    l.count ++;
+    l.bytes += bytes;
+    l.nsecs += nsecs;
+    if( nsecs > l.max) l.max = nsecs;
+    l.buckets[ bucket] ++;
+}
+
+void Metrics::addStage( MetricsStage stage, int threads, qint64 busyNsecs, qint64 waitNsecs)
+{
+    QMutexLocker locker( & _mutex);
+    Stage & s = _stages[stage];
+    s.threads += threads;
+    s.busy += busyNsecs;
+    s.wait += waitNsecs;
+}
+
+void Metrics::addFileBytes( const QString & fileName, qint64 read, qint64 written)
+{
+    QMutexLocker locker( & _mutex);
+    // a combine has a few hundred inputs at most, and they come one after another
+    for( size_t i = _files.size() ; i > 0 ; i -- ) {
+        if( _files[i - 1].fileName == fileName) {
+            _files[i - 1].read += read;
+            _files[i - 1].written += written;
+            return;
+        }
+    }
+    FileBytes f;
+    f.fileName = fileName;
+    f.read = read;
+    f.written = written;
+    _files.push_back( f);
+}
+
+void Metrics::setBuffers( int total)
+{
+    QMutexLocker locker( & _mutex);
+    _buffers = total;
+    _buffersInUse = _buffersPeak = 0;
+}
+
+void Metrics::buffersTaken( int n)
+{
+    QMutexLocker locker( & _mutex);
+    _buffersInUse += n;
+    if( _buffersInUse > _buffersPeak) _buffersPeak = _buffersInUse;
+}
+
+void Metrics::progress( qint64 done, qint64 total)
+{
+    if( _callback && ! _callback-> progress( done, total))
+        throw CubeError( CubeError::Cancelled, CubeCancelled);
+    QStringList fields;
+    {
+        QMutexLocker locker( & _mutex);
+        qint64 ms = _timer.elapsed();
+        if( _lastProgress >= 0 && ms - _lastProgress < 1000)
+            return;
+        _lastProgress = ms;
+        fields << field( "bytes", done) << field( "total", total)
+               << field( "mb_per_s", ms > 0 ? done / 1e3 / ms : 0.0);
+        if( _buffers > 0)
+            fields << field( "buffers", qint64( _buffers)) << field( "buffers_in_use", qint64( _buffersInUse))
+                   << field( "buffers_peak", qint64( _buffersPeak));
+    }
+    event( "progress", fields);
+}
+
+void Metrics::finish()
+{
+    _finished = true;
+    QMutexLocker locker( & _mutex);
+    for( int s = 0 ; s < StageCount ; s ++ ) {
+        const Stage & st = _stages[s];
+        if( st.threads == 0)
+            continue;
+        event( "stage", QStringList() << field( "stage", QString( stageNames[s]))
+               << field( "threads", qint64( st.threads)) << field( "busy_s", st.busy / 1e9)
+               << field( "wait_s", st.wait / 1e9));
+    }
+    for( int op = 0 ; op < OpCount ; op ++ ) {
+        const Latency & l = _latency[op];
+        if( l.count == 0)
+            continue;
+        // the bucket i has the calls that took [2^i..2^(i+1)) us, the first one also the
+        // faster ones; trailing empty buckets are left out
+        int n = Buckets;
+        while( n > 0 && l.buckets[n - 1] == 0) n --;
+        QStringList counts;
+        for( int i = 0 ; i < n ; i ++ )
+            counts << QString::number( l.buckets[i]);
+        event( "latency", QStringList() << field( "op", QString( opNames[op]))
+               << field( "count", l.count) << field( "bytes", l.bytes)
+               << field( "total_s", l.nsecs / 1e9) << field( "max_s", l.max / 1e9)
+               << QString( "\"histogram_us_log2\":[%1]").arg( counts.join( ",")));
+    }
+    for( size_t i = 0 ; i < _files.size() ; i ++ )
+        event( "file", QStringList() << field( "file", _files[i].fileName)
+               << field( "bytes_read", _files[i].read) << field( "bytes_written", _files[i].written));
+    // a destructor running because of an exception means the combine failed
+    event( "end", QStringList() << QString( "\"ok\":%1").arg( uncaught_exception() ? "false" : "true"));
+}
@@ -0,0 +1,121 @@
+#pragma once
+
+#include <vector>
+#include <QMutex>
+#include <QString>
+#include <QStringList>
+#include <QElapsedTimer>
+
+class CubeProgress;
+
+// the stages of a copy whose time is measured
+enum MetricsStage {
+    StageRead,     // reading the inputs into the buffers
+    StageFilter,   // clipping, conversion, statistics, ...
+    StageChecksum, // data sums
+    StageWrite,    // writing the outputs
+    StageCopy,     // kernel copies (copy_file_range/sendfile)
+    StageCount
+};
+
+// the calls whose latency goes into a histogram
+enum MetricsOp {
+    OpRead,  // one pread
+    OpWrite, // one pwrite
+    OpSync,  // fdatasync of a journal commit
+    OpCopy,  // one copy_file_range/sendfile
+    OpCount
+};
+
+// Machine readable metrics of a combine, as JSON lines: one object per line, written to a
+// file, to stdout or to an inherited file descriptor, so a scheduler or a dashboard can
+// follow the run. While the data is copied there is a "progress" line every second; at the
+// end come the time every stage spent working and waiting, the latency histograms of the
+// reads, writes and syncs, and the bytes that went through each input.
+//
+// All the calls can come from several threads at once. The stages add up their times
+// locally and report them once, when they finish; the latencies are added per call.
+class Metrics {
+public:
+    // target is a file name (appended to), "-" for stdout or fd:n, or empty for no output
+    // at all; throws QString if it cannot be opened
+    Metrics( const QString & target);
+    // writes the summary if finish() was not called yet; the "end" line says whether this
+    // happens because of an exception
+    ~Metrics();
+
+    // monotonic clock in ns, for timing the calls
+    static qint64 now();
+
+    // a line {"event":event, "time":..., "elapsed":..., fields}; fields is a list of
+    // "key":value pairs made with the helpers below
+    void event( const QString & event, const QStringList & fields = QStringList());
+    static QString field( const QString & key, qint64 value);
+    static QString field( const QString & key, double value);
+    static QString field( const QString & key, const QString & value);
+    static QString field( const QString & key, const QStringList & values);
+
+    void addLatency( MetricsOp op, qint64 nsecs, qint64 bytes);
+    // threads is how many threads the stage had, the times are their sums
+    void addStage( MetricsStage stage, int threads, qint64 busyNsecs, qint64 waitNsecs);
+    void addFileBytes( const QString & fileName, qint64 read, qint64 written);
+    // how many of the data buffers hold data, reported with the progress
+    void setBuffers( int total);
+    void buffersTaken( int n);
+
+    // at most once a second, the rest is dropped; the callback sees every call, and the
+    // copy is cancelled (a CubeError with the code Cancelled is thrown) when it returns false
+    void progress( qint64 done, qint64 total);
+    void setProgress( CubeProgress * callback) { _callback = callback; }
+
+    // the summary lines and an "end" line
+    void finish();
+
+    // 1 us, 2 us, 4 us, ... 2^31 us (~36 min) and more
+    static const int Buckets = 32;
+
+protected:
+    void write( const QString & line);
+
+    struct Latency {
+        qint64 count, bytes, nsecs, max;
+        qint64 buckets[ Buckets];
+        Latency();
+    };
+    struct Stage {
+        int threads;
+        qint64 busy, wait;
+        Stage() { threads = 0; busy = wait = 0; }
+    };
+    struct FileBytes {
+        QString fileName;
+        qint64 read, written;
+    };
+
+    int _fd;
+    bool _ownFd, _finished;
+    QElapsedTimer _timer;
+    qint64 _lastProgress;
+    QMutex _mutex;
+    Latency _latency[ OpCount];
+    Stage _stages[ StageCount];
+    // in the order in which they were first seen
+    std::vector<FileBytes> _files;
+    int _buffers, _buffersInUse, _buffersPeak;
+    CubeProgress * _callback;
+};
+
+// times a call and adds it to the latency histogram of op, does nothing without metrics
+class LatencyTimer {
+public:
+    LatencyTimer( Metrics * metrics, MetricsOp op) {
+        _metrics = metrics; _op = op; _start = metrics ? Metrics::now() : 0;
+    }
+    void done( qint64 bytes) {
+        if( _metrics) _metrics-> addLatency( _op, Metrics::now() - _start, bytes);
+    }
+protected:
+    Metrics * _metrics;
+    MetricsOp _op;
+    qint64 _start;
+};
@@ -0,0 +1,526 @@
+/*
+ *   Copyright 2013 Pavol Federl (federl@gmail.com)
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ *
+ */
+
+#include <iostream>
+#include <cerrno>
+#include <cmath>
+#include <cstring>
+#include <limits>
+
+#include <unistd.h>
+
+#include <QFileInfo>
+#include <QMutex>
+
+#include "mosaic.h"
+#include "fitsheader.h"
+#include "pipeline.h"
+#include "convert.h"
+#include "checksum.h"
+#include "metrics.h"
+
+using namespace std;
+
+// how far from a whole pixel the offset of an input may be
+static const double GridTolerance = 0.01;
+// the rows of a window are read in one piece, gaps included, unless the gaps between them
+// are bigger than this
+static const qint64 CoalesceGap = 64 * 1024;
+
+// BLANK of a mosaic of integer cubes that have none
+static qint64 defaultBlank( int bitpix)
+{
+    if( bitpix == 8) return 255;
+    if( bitpix == 16) return -32768;
+    if( bitpix == 32) return Q_INT64_C( -2147483648);
+    return Q_INT64_C( -9223372036854775807) - 1;
+}
+
+// the axis type without the quotes and the padding, e.g. RA---CAR
+static QString axisType( const QString & ctype)
+{
+    // the value still has its quotes
+    QString t = fitsStringTrimmed( ctype);
+    return t.mid( 1, t.size() - 2).toUpper();
+}
+
+// celestial longitudes wrap around at 360 degrees
+static bool isLongitude( const QString & ctype)
+{
+    QString t = axisType( ctype);
+    return t.startsWith( "RA") || t.startsWith( "GLON") || t.startsWith( "ELON");
+}
+
+// the projection code of a 4-3 form axis type (RA---CAR), empty for linear axes
+static QString projection( const QString & ctype)
+{
+    QString t = axisType( ctype);
+    if( t.size() != 8 || t[4] != '-')
+        return QString();
+    return t.mid( 5);
+}
+
+// position of the first pixel of an input on the grid of the first one, along one axis
+static double gridOffset( double crval, double crpix, double crval0, double crpix0, double cdelt,
+                          bool longitude)
+{
+    double diff = crval - crval0;
+    if( longitude)
+        diff = remainder( diff, 360.0);
+    return diff / cdelt - crpix + crpix0;
+}
+
+static void checkMosaic( const vector<FitsInfo> & fileInfo, ostream & log)
+{
+    const FitsInfo & f1 = fileInfo[0];
+    bool errors = false;
+    // the inputs are placed by a straight shift of their reference pixels, which is only
+    // right for the plate carree projection (and linear axes)
+    QString proj1 = projection( f1.ctype1), proj2 = projection( f1.ctype2);
+    if( (! proj1.isEmpty() && proj1 != "CAR") || (! proj2.isEmpty() && proj2 != "CAR")) {
+        log << "*** ERROR *** only CAR projections can be mosaicked, not "
+            << f1.ctype1.toStdString() << " " << f1.ctype2.toStdString() << "\n  "
+            << f1.fileName.toStdString() << "\n";
+        errors = true;
+    }
+    for( size_t i = 1 ; i < fileInfo.size() ; i ++ ) {
+        const FitsInfo & f2 = fileInfo[i];
+        string finfo = QString( "\n  %1\n  %2\n").arg(f1.fileName).arg(f2.fileName).toStdString();
+        if( f1.bitpix != f2.bitpix) {
+            log << "*** ERROR *** BITPIX incompatible between files:" << finfo; errors = true;
+        }
+        if( f1.bscale != f2.bscale || f1.bzero != f2.bzero) {
+            log << "*** ERROR *** BSCALE/BZERO incompatible between files:" << finfo; errors = true;
+        }
+        if( f1.bitpix > 0 && (f1.hasBlank != f2.hasBlank || f1.blank != f2.blank)) {
+            log << "*** ERROR *** BLANK incompatible between files:" << finfo; errors = true;
+        }
+        if( f1.naxis3 != f2.naxis3) {
+            log << "*** ERROR *** NAXIS3 incompatible between files:" << finfo; errors = true;
+        }
+        if( f1.ctype1 != f2.ctype1 || f1.ctype2 != f2.ctype2 || f1.ctype3 != f2.ctype3) {
+            log << "*** ERROR *** CTYPE incompatible between files:" << finfo; errors = true;
+        }
+        if( f1.cdelt1 != f2.cdelt1 || f1.cdelt2 != f2.cdelt2) {
+            log << "*** ERROR *** CDELT1/CDELT2 incompatible between files:" << finfo; errors = true;
+        }
+        if( f1.cdelt3 != f2.cdelt3 || fabs( f1.frameStart - f2.frameStart) > fabs( f1.cdelt3 / 1e6)) {
+            log << "*** ERROR *** frequency axis incompatible between files:" << finfo; errors = true;
+        }
+    }
+    if( errors) throw CubeError( CubeError::InvalidArgument, "Incompatible FITS files.");
+}
+
+MosaicPlan planMosaic( const QStringList & inputs, ostream & log)
+{
+    if( inputs.isEmpty())
+        throw CubeError( CubeError::InvalidArgument, "No input cubes for the mosaic");
+    vector<FitsInfo> fileInfo;
+    for( int i = 0 ; i < inputs.size() ; i ++ )
+        fileInfo.push_back( parse( inputs[i]));
+    checkMosaic( fileInfo, log);
+
+    const FitsInfo & f1 = fileInfo[0];
+    vector<int> xs, ys;
+    int minX = 0, minY = 0, maxX = f1.naxis1, maxY = f1.naxis2;
+    for( size_t i = 0 ; i < fileInfo.size() ; i ++ ) {
+        const FitsInfo & f = fileInfo[i];
+        double dx = gridOffset( f.crval1, f.crpix1, f1.crval1, f1.crpix1, f1.cdelt1, isLongitude( f1.ctype1));
+        double dy = gridOffset( f.crval2, f.crpix2, f1.crval2, f1.crpix2, f1.cdelt2, isLongitude( f1.ctype2));
+        int x = int( floor( dx + 0.5)), y = int( floor( dy + 0.5));
+        if( fabs( dx - x) > GridTolerance || fabs( dy - y) > GridTolerance)
+            throw CubeError( CubeError::InvalidArgument,
+                             QString( "%1 is not on the pixel grid of %2 (offset %3, %4 pixels)")
+                             .arg( f.fileName).arg( f1.fileName).arg( dx).arg( dy));
+        xs.push_back( x); ys.push_back( y);
+        minX = qMin( minX, x); maxX = qMax( maxX, x + f.naxis1);
+        minY = qMin( minY, y); maxY = qMax( maxY, y + f.naxis2);
+    }
+
+    MosaicPlan plan;
+    plan.naxis1 = maxX - minX;
+    plan.naxis2 = maxY - minY;
+    plan.naxis3 = f1.naxis3;
+    for( size_t i = 0 ; i < fileInfo.size() ; i ++ ) {
+        MosaicInput in;
+        in.info = fileInfo[i];
+        in.x0 = xs[i] - minX;
+        in.y0 = ys[i] - minY;
+        in.z0 = 0;
+        in.sx = in.sy = 0;
+        in.width = in.info.naxis1;
+        in.height = in.info.naxis2;
+        plan.inputs.push_back( in);
+    }
+    plan.header = f1.header;
+    plan.header.setIntValue( "NAXIS1", plan.naxis1);
+    plan.header.setIntValue( "NAXIS2", plan.naxis2);
+    plan.header.setDoubleValue( "CRPIX1", f1.crpix1 - minX);
+    plan.header.setDoubleValue( "CRPIX2", f1.crpix2 - minY);
+    // the uncovered pixels need a BLANK
+    if( f1.bitpix > 0 && ! f1.hasBlank)
+        plan.header.setIntValue( "BLANK", defaultBlank( f1.bitpix));
+    return plan;
+}
+
+void cropMosaic( MosaicPlan & plan, int x, int y, int width, int height)
+{
+    if( x < 0 || y < 0 || width < 1 || height < 1 || x + width > plan.naxis1 || y + height > plan.naxis2)
+        throw CubeError( CubeError::InvalidArgument,
+                         QString( "The region %1:%2,%3:%4 is not inside the %5 x %6 pixels of the output")
+                         .arg( x + 1).arg( x + width).arg( y + 1).arg( y + height).arg( plan.naxis1).arg( plan.naxis2));
+    vector<MosaicInput> inputs;
+    for( size_t i = 0 ; i < plan.inputs.size() ; i ++ ) {
+        MosaicInput in = plan.inputs[i];
+        int xa = qMax( x, in.x0), xb = qMin( x + width, in.x0 + in.width);
+        int ya = qMax( y, in.y0), yb = qMin( y + height, in.y0 + in.height);
+        if( xa >= xb || ya >= yb)
+            continue;
+        in.sx += xa - in.x0;
+        in.sy += ya - in.y0;
+        in.width = xb - xa;
+        in.height = yb - ya;
+        in.x0 = xa - x;
+        in.y0 = ya - y;
+        inputs.push_back( in);
+    }
+    plan.inputs = inputs;
+    plan.naxis1 = width;
+    plan.naxis2 = height;
+    plan.header.setIntValue( "NAXIS1", width);
+    plan.header.setIntValue( "NAXIS2", height);
+    plan.header.setDoubleValue( "CRPIX1", plan.header.doubleValue( "CRPIX1") - x);
+    plan.header.setDoubleValue( "CRPIX2", plan.header.doubleValue( "CRPIX2") - y);
+}
+
+// builds the bands of the mosaic on several threads
+class MosaicBuilder {
+public:
+    MosaicBuilder( const MosaicPlan & plan, const CombineOptions & options, int fd, qint64 dataStart,
+                   Metrics * metrics);
+    ~MosaicBuilder();
+    // returns the data sum of the data segment
+    quint32 run();
+    void loop();
+protected:
+    void buildBand( int z, int y0, int y1, char * band, char * scratch, qint64 * busy);
+    void fail( const QString & msg);
+    void fail( const CubeError & error);
+
+    const MosaicPlan & _plan;
+    const CombineOptions & _options;
+    int _fd;
+    qint64 _dataStart;
+    Metrics * _metrics;
+    int _pixelSize, _bandRows, _bandsPerPlane, _threads;
+    qint64 _scratchSize;
+    qint64 _tasks, _next;
+    vector<char> _fill; // one undefined pixel
+    vector<DataReader *> _readers;
+    CopyProgress * _progress;
+    QMutex _mutex;
+    bool _failed;
+    CubeError _error;
+    quint32 _dataSum;
+};
+
+MosaicBuilder::MosaicBuilder( const MosaicPlan & plan, const CombineOptions & options, int fd,
+                              qint64 dataStart, Metrics * metrics)
+    : _plan( plan), _options( options)
+{
+    _fd = fd;
+    _dataStart = dataStart;
+    _metrics = metrics;
+    _progress = 0;
+    _failed = false;
+    _dataSum = 0;
+    _next = 0;
+    const FitsInfo & f1 = plan.inputs[0].info;
+    _pixelSize = abs( f1.bitpix) / 8;
+
+    // NaN stored in the format of the output is its BLANK
+    PixelFormat fmt = pixelFormat( f1);
+    fmt.hasBlank = f1.bitpix > 0;
+    fmt.blank = f1.hasBlank ? f1.blank : defaultBlank( f1.bitpix);
+    double nan = numeric_limits<double>::quiet_NaN();
+    _fill.resize( _pixelSize);
+    storeValues( & nan, 1, fmt, & _fill[0]);
+
+    // every thread has a band and a buffer for the rows of the inputs, which with the gaps
+    // between the windows can be wider than the band
+    _threads = options.parallelFiles > 1 ? options.parallelFiles : 4;
+    qint64 rowBytes = qint64( plan.naxis1) * _pixelSize, inputRowBytes = 0;
+    for( size_t i = 0 ; i < plan.inputs.size() ; i ++ )
+        inputRowBytes = qMax( inputRowBytes, qint64( plan.inputs[i].info.naxis1) * _pixelSize);
+    qint64 rows = options.memory / _threads / (rowBytes + inputRowBytes);
+    if( rows < 1) {
+        rows = 1;
+        combineLog( _options) << "A row of the mosaic is " << formatBytes( rowBytes).toStdString()
+                              << ", --memory is too small for " << _threads << " bands of whole rows.\n";
+    }
+    _bandRows = int( qMin( rows, qint64( plan.naxis2)));
+    _scratchSize = _bandRows * inputRowBytes;
+    _bandsPerPlane = (plan.naxis2 + _bandRows - 1) / _bandRows;
+    _tasks = qint64( _bandsPerPlane) * plan.naxis3;
+    _threads = int( qMin( qint64( _threads), _tasks));
+
+    // pread is all they do, so the threads share them
+    for( size_t i = 0 ; i < plan.inputs.size() ; i ++ ) {
+        _readers.push_back( new DataReader( plan.inputs[i].info.fileName, options.ioMode));
+        _readers.back()-> setMetrics( metrics);
+    }
+}
+
+MosaicBuilder::~MosaicBuilder()
+{
+    for( size_t i = 0 ; i < _readers.size() ; i ++ )
+        delete _readers[i];
+}
+
+void MosaicBuilder::fail( const QString & msg)
+{
+    fail( CubeError( CubeError::Failed, msg));
+}
+
+void MosaicBuilder::fail( const CubeError & error)
+{
+    QMutexLocker locker( & _mutex);
+    if( _failed) return;
+    _failed = true;
+    _error = error;
+}
+
+// rows [y0..y1) of plane z
+void MosaicBuilder::buildBand( int z, int y0, int y1, char * band, char * scratch, qint64 * busy)
+{
+    int width = _plan.naxis1;
+    qint64 bytes = qint64( y1 - y0) * width * _pixelSize;
+    qint64 t0 = _metrics ? Metrics::now() : 0;
+    // one pixel, then the filled part over and over
+    memcpy( band, & _fill[0], _pixelSize);
+    for( qint64 filled = _pixelSize ; filled < bytes ; filled *= 2)
+        memcpy( band + filled, band, qMin( filled, bytes - filled));
+    // backwards, so the first input that covers a pixel ends up on top
+    for( size_t i = _plan.inputs.size() ; i > 0 ; i -- ) {
+        const MosaicInput & in = _plan.inputs[i - 1];
+        int ya = qMax( y0, in.y0), yb = qMin( y1, in.y0 + in.height);
+        if( ya >= yb || z < in.z0 || z >= in.z0 + in.info.naxis3)
+            continue;
+        qint64 rowBytes = qint64( in.info.naxis1) * _pixelSize, pieceBytes = qint64( in.width) * _pixelSize;
+        // the piece of the first row, the others follow every rowBytes
+        qint64 offset = in.info.dataOffset + ((qint64( z - in.z0) * in.info.naxis2 + in.sy + (ya - in.y0))
+                                              * in.info.naxis1 + in.sx) * _pixelSize;
+        char * out = band + (qint64( ya - y0) * width + in.x0) * _pixelSize;
+        qint64 t1 = _metrics ? Metrics::now() : 0, bytesRead = 0;
+        if( rowBytes - pieceBytes <= CoalesceGap) {
+            qint64 size = (yb - ya - 1) * rowBytes + pieceBytes;
+            const char * data = _readers[i - 1]-> read( scratch, offset, size);
+            for( int y = ya ; y < yb ; y ++ )
+                memcpy( out + qint64( y - ya) * width * _pixelSize, data + (y - ya) * rowBytes, pieceBytes);
+            bytesRead = size;
+        } else {
+            for( int y = ya ; y < yb ; y ++ ) {
+                const char * data = _readers[i - 1]-> read( scratch, offset + (y - ya) * rowBytes, pieceBytes);
+                memcpy( out + qint64( y - ya) * width * _pixelSize, data, pieceBytes);
+            }
+            bytesRead = (yb - ya) * pieceBytes;
+        }
+        if( _metrics) {
+            busy[ StageRead] += Metrics::now() - t1;
+            _metrics-> addFileBytes( in.info.fileName, bytesRead, 0);
+        }
+    }
+    if( _options.clip)
+        clipData( band, bytes, _options.clipMin, _options.clipMax, _plan.inputs[0].info);
+    qint64 t2 = _metrics ? Metrics::now() : 0;
+    qint64 position = (qint64( z) * _plan.naxis2 + y0) * width * _pixelSize;
+    if( _options.checksum) {
+        quint32 sum = fitsSumAt( fitsDataSum( band, bytes), position);
+        QMutexLocker locker( & _mutex);
+        _dataSum = fitsSumAdd( _dataSum, sum);
+    }
+    qint64 t3 = _metrics ? Metrics::now() : 0;
+    const char * p = band;
+    qint64 left = bytes, offset = _dataStart + position;
+    while( left > 0) {
+        LatencyTimer timer( _metrics, OpWrite);
+        ssize_t n = pwrite( _fd, p, size_t( left), offset);
+        timer.done( n > 0 ? n : 0);
+        if( n < 0 && errno == EINTR) continue;
+        if( n <= 0)
+            throw QString( "Failed to write the mosaic: %1").arg( strerror( errno));
+        p += n; left -= n; offset += n;
+    }
+    if( _metrics) {
+        qint64 t4 = Metrics::now();
+        // the filling and the copying of the rows count as the filter
+        busy[ StageFilter] += t2 - t0;
+        busy[ StageChecksum] += t3 - t2;
+        busy[ StageWrite] += t4 - t3;
+    }
+    _progress-> add( bytes);
+}
+
+void MosaicBuilder::loop()
+{
+    qint64 bandBytes = qint64( _bandRows) * _plan.naxis1 * _pixelSize;
+    char * band = allocIoBuffer( bandBytes), * scratch = allocIoBuffer( _scratchSize);
+    qint64 busy[ StageCount] = { 0 };
+    try {
+        if( ! band || ! scratch)
+            throw QString( "Could not allocate %1 for the mosaic").arg( formatBytes( bandBytes + _scratchSize));
+        while( true) {
+            qint64 task;
+            {
+                QMutexLocker locker( & _mutex);
+                if( _failed || _next >= _tasks)
+                    break;
+                task = _next ++;
+            }
+            int z = int( task / _bandsPerPlane);
+            int y0 = int( task % _bandsPerPlane) * _bandRows;
+            buildBand( z, y0, qMin( y0 + _bandRows, _plan.naxis2), band, scratch, busy);
+        }
+        // the reads are inside the filter time, take them out
+        busy[ StageFilter] -= busy[ StageRead];
+        for( int s = 0 ; _metrics && s < StageCount ; s ++ )
+            if( busy[s] > 0)
+                _metrics-> addStage( MetricsStage( s), 1, busy[s], 0);
+    } catch ( const CubeError & e) {
+        fail( e);
+    } catch ( const char * msg) {
+        fail( msg);
+    } catch ( const QString & msg) {
+        fail( msg);
+    } catch ( ... ) {
+        fail( "Unknown error in mosaic thread.");
+    }
+    freeIoBuffer( band);
+    freeIoBuffer( scratch);
+}
+
+quint32 MosaicBuilder::run()
+{
+    qint64 total = qint64( _plan.naxis1) * _plan.naxis2 * _plan.naxis3 * _pixelSize;
+    combineLog( _options) << "Building " << _threads << " bands of " << _bandRows << " rows at a time\n";
+    CopyProgress progress( total, combineLog( _options), _metrics);
+    _progress = & progress;
+    typedef StageThread<MosaicBuilder> Thread;
+    vector<Thread *> threads;
+    for( int i = 0 ; i < _threads ; i ++ )
+        threads.push_back( new Thread( this, & MosaicBuilder::loop));
+    for( size_t i = 0 ; i < threads.size() ; i ++ )
+        threads[i]-> start();
+    for( size_t i = 0 ; i < threads.size() ; i ++ ) {
+        threads[i]-> wait();
+        delete threads[i];
+    }
+    _progress = 0;
+    if( _failed)
+        _error.rethrow();
+    return _dataSum;
+}
+
+void mosaicFITS( const QStringList & inputs, const QString & output, const CombineOptions & options)
+{
+    ostream & log = combineLog( options);
+    MosaicPlan plan = planMosaic( inputs, log);
+    // all the inputs have the same channels
+    if( options.freqRange) {
+        int cut = 0;
+        for( size_t i = 0 ; i < plan.inputs.size() ; i ++ )
+            if( ! selectChannels( plan.inputs[i].info, options.freqMin, options.freqMax, & cut))
+                throw CubeError( CubeError::InvalidArgument,
+                                 QString( "No channels between %1 and %2 Hz").arg( options.freqMin, 0, 'f').arg( options.freqMax, 0, 'f'));
+        plan.naxis3 = plan.inputs[0].info.naxis3;
+        plan.header.setIntValue( "NAXIS3", plan.naxis3);
+        plan.header.setDoubleValue( "CRPIX3", plan.inputs[0].info.crpix3 - cut);
+    }
+    if( options.region)
+        cropMosaic( plan, options.regionX, options.regionY, options.regionWidth, options.regionHeight);
+    log << "Mosaic of " << plan.inputs.size() << " cubes is " << plan.naxis1 << " x " << plan.naxis2
+        << " x " << plan.naxis3 << "\n";
+    for( size_t i = 0 ; i < plan.inputs.size() ; i ++ )
+        log << QString( "  %1 at %2,%3\n").arg( QFileInfo( plan.inputs[i].info.fileName).fileName())
+                .arg( plan.inputs[i].x0).arg( plan.inputs[i].y0).toStdString();
+    writeMosaic( plan, output, options);
+}
+
+void writeMosaic( const MosaicPlan & plan, const QString & output, const CombineOptions & options)
+{
+    ostream & log = combineLog( options);
+    if( options.resume || options.spectralMajor || options.compress || options.convert || options.stats
+            || options.preview || options.mergeOverlaps || options.virtualCube || ! options.stages.empty())
+        throw CubeError( CubeError::InvalidArgument,
+                         "A mosaic or a region can only be clipped and checksummed, --resume, --spectral-major, "
+                         "--compress, --convert, --stats, --preview, --merge-overlaps and --virtual do not apply");
+    if( plan.inputs.empty())
+        throw CubeError( CubeError::InvalidArgument, "No input covers the output");
+
+    Metrics metrics( options.metrics);
+    metrics.setProgress( options.progress);
+    Metrics * m = options.metrics.isEmpty() && ! options.progress ? 0 : & metrics;
+
+    QFile ofp( output);
+    if( ! ofp.open( QFile::WriteOnly | QFile::Truncate))
+        throw QString( "Cannot open %1 for writing.").arg( output);
+    FitsHeader header = plan.header;
+    if( options.checksum) {
+        header.setStringValue( "CHECKSUM", "0000000000000000", "HDU checksum");
+        header.setStringValue( "DATASUM", "0", "data unit checksum");
+    }
+    if( ! header.write( ofp) || ! ofp.flush())
+        throw QString( "Failed to write header to %1").arg( output);
+    qint64 dataStart = ofp.pos();
+    int pixelSize = abs( plan.inputs[0].info.bitpix) / 8;
+    qint64 dataSize = qint64( plan.naxis1) * plan.naxis2 * plan.naxis3 * pixelSize;
+    // the padding is what the preallocation leaves there, zeros
+    preallocateOutput( ofp, dataStart + (dataSize + 2879) / 2880 * 2880);
+
+    if( m) {
+        qint64 bytes = 0;
+        // what is read, not the size of the inputs
+        for( size_t i = 0 ; i < plan.inputs.size() ; i ++ )
+            bytes += qint64( plan.inputs[i].width) * plan.inputs[i].height * plan.inputs[i].info.naxis3 * pixelSize;
+        m-> event( "start", QStringList() << Metrics::field( "outputs", QStringList() << output)
+                   << Metrics::field( "inputs", qint64( plan.inputs.size())) << Metrics::field( "bytes", bytes)
+                   << Metrics::field( "layout", QString( options.mosaic ? "mosaic" : "region"))
+                   << Metrics::field( "io", QString( ioModeName( options.ioMode)))
+                   << Metrics::field( "memory", options.memory));
+    }
+    if( options.clip && plan.inputs[0].info.bitpix > 0)
+        log << "Cannot apply data clipping to BITPIX = " << plan.inputs[0].info.bitpix << "\n";
+    else if( options.clip)
+        log << "Clipping values outside of [" << options.clipMin << ".." << options.clipMax << "]\n";
+    QStringList files;
+    for( size_t i = 0 ; i < plan.inputs.size() ; i ++ )
+        files << plan.inputs[i].info.fileName;
+    reportIoMode( options.ioMode, files, log);
+    MosaicBuilder builder( plan, options, ofp.handle(), dataStart, m);
+    quint32 dataSum = builder.run();
+
+    if( options.checksum) {
+        setChecksumCards( header, dataSum);
+        if( ! ofp.seek( 0) || ! header.write( ofp))
+            throw QString( "Could not write the checksum into %1").arg( output);
+        log << "DATASUM of " << QFileInfo( output).fileName().toStdString() << " is " << dataSum << "\n";
+    }
+    if( ! ofp.flush() || fdatasync( ofp.handle()) != 0)
+        throw QString( "Could not sync %1").arg( output);
+    ofp.close();
+    log << "Done.\n";
+}
@@ -0,0 +1,52 @@
+#pragma once
+
+#include <vector>
+#include <QString>
+#include <QStringList>
+
+#include "extractor.h"
+
+// Spatial mosaics: cubes of different fields (different CRVAL1/2, CRPIX1/2 and NAXIS1/2)
+// that have the same frequency axis are put side by side into one cube. The pixel grid of
+// the mosaic is the grid of the first input, grown to cover all of them; every input has
+// to sit on it, i.e. the same CTYPE and CDELT and reference pixels that are a whole number
+// of pixels apart, as the fields of a survey in the CAR projection are. Nothing is
+// resampled. Where the inputs overlap the first one in the list wins, the pixels that no
+// input covers are NaN (BLANK for integer BITPIX).
+
+// one input and where it goes: the box [sx..sx+width) x [sy..sy+height) of all its planes
+// (from info.dataOffset on, channels may have been cut off) goes to (x0,y0,z0) and on
+struct MosaicInput {
+    FitsInfo info;
+    int x0, y0, z0;
+    int sx, sy, width, height;
+};
+
+// The inputs placed on the grid of the output. The same plan also describes a combine
+// along frequency that is cut down to a region (--region): there the inputs are stacked
+// in z instead of side by side.
+struct MosaicPlan {
+    std::vector<MosaicInput> inputs; // in the order in which they were given
+    int naxis1, naxis2, naxis3;
+    FitsHeader header; // of the output, with its size and the WCS moved along
+};
+
+// parses the inputs and works out the grid, throws if they do not line up; what does not
+// fit goes to log
+MosaicPlan planMosaic( const QStringList & inputs, std::ostream & log);
+
+// cuts the output down to the box of width x height pixels at (x,y), the inputs outside of
+// it are dropped and the others only read where they are inside
+void cropMosaic( MosaicPlan & plan, int x, int y, int width, int height);
+
+// Writes the output of a plan. The output is preallocated and built in bands of image
+// rows: a band is filled from the rows of the inputs that cross it and written to its
+// place with one pwrite, so several threads work on different bands at once
+// (--parallel-files, default 4) and the memory stays within --memory whatever the size of
+// the output. The rows of an input window are read with one pread when the gaps between
+// them are small, one per row otherwise, so the reads scale with the output. Clipping,
+// --checksum, --io and --metrics apply as for a combine.
+void writeMosaic( const MosaicPlan & plan, const QString & output, const CombineOptions & options);
+
+// planMosaic() and writeMosaic(), with --freq-range and --region applied
+void mosaicFITS( const QStringList & inputs, const QString & output, const CombineOptions & options);
@@ -0,0 +1,169 @@
+/*
+ *   Copyright 2013 Pavol Federl (federl@gmail.com)
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ *
+ */
+
+#include <cstdlib>
+#include <limits>
+
+#include "overlap.h"
+
+using namespace std;
+
+static qint64 planePixels( const FitsInfo & info)
+{
+    return qint64( info.naxis1) * info.naxis2;
+}
+
+static int pixelSize( const FitsInfo & info)
+{
+    return abs( info.bitpix) / 8;
+}
+
+// reads m physical values of plane z of a cube, starting at pixel
+static void readValues( DataReader * reader, const FitsInfo & info, int z, qint64 pixel, qint64 m,
+                        vector<char> & buff, double * out)
+{
+    qint64 offset = info.header.dataOffset() + (z * planePixels( info) + pixel) * pixelSize( info);
+    buff.resize( m * pixelSize( info));
+    reader-> read( & buff[0], offset, buff.size());
+    loadValues( & buff[0], m, pixelFormat( info), out);
+}
+
+OverlapFilter::OverlapFilter( ChunkFilter * next, int convert)
+{
+    _next = next;
+    _format.bitpix = convert; _format.bscale = 1; _format.bzero = 0;
+    _format.hasBlank = false; _format.blank = 0;
+    _clip = false; _clipMin = _clipMax = 0;
+}
+
+OverlapFilter::~OverlapFilter()
+{
+    for( size_t o = 0 ; o < _outputs.size() ; o ++ ) {
+        for( size_t i = 0 ; i < _outputs[o]-> readers.size() ; i ++ ) {
+            delete _outputs[o]-> readers[i];
+            delete _outputs[o]-> weightReaders[i];
+        }
+        delete _outputs[o];
+    }
+}
+
+void OverlapFilter::setClip( double min, double max)
+{
+    _clip = true;
+    _clipMin = min;
+    _clipMax = max;
+}
+
+void OverlapFilter::addSources( const vector<OverlapSource> & sources)
+{
+    Output * out = new Output;
+    _outputs.push_back( out);
+    out-> sources = sources;
+    for( size_t i = 0 ; i < sources.size() ; i ++ ) {
+        const OverlapSource & s = sources[i];
+        out-> readers.push_back( new DataReader( s.info.fileName, IoBuffered));
+        out-> weightReaders.push_back( s.hasWeights ? new DataReader( s.weights.fileName, IoBuffered) : 0);
+        _inputs[ s.info.fileName] = qMakePair( int( _outputs.size() - 1), int( i));
+    }
+}
+
+void OverlapFilter::process( PipelineChunk & chunk, const FitsInfo & info)
+{
+    if( _next)
+        _next-> process( chunk, info);
+    if( ! _inputs.contains( info.fileName))
+        return;
+    QPair<int, int> ind = _inputs.value( info.fileName);
+    const Output & out = * _outputs[ ind.first];
+
+    // the chunk is counted in the input, its values are in the format of the output now
+    PixelFormat fmt = _format.bitpix ? _format : pixelFormat( info);
+    int size = abs( fmt.bitpix) / 8;
+    qint64 pixel = (chunk.fileOffset - info.header.dataOffset()) / pixelSize( info);
+    qint64 count = chunk.size / size;
+    char * data = chunk.data;
+    qint64 plane = planePixels( info);
+    while( count > 0) {
+        int z = int( pixel / plane);
+        qint64 start = pixel - z * plane;
+        qint64 m = qMin( count, plane - start);
+        blend( out, ind.second, z, start, m, data, fmt);
+        data += m * size;
+        pixel += m;
+        count -= m;
+    }
+}
+
+void OverlapFilter::blend( const Output & out, int s, int z, qint64 pixel, qint64 m, char * data,
+                           const PixelFormat & fmt) const
+{
+    const OverlapSource & src = out.sources[s];
+    int channel = src.channel0 + z;
+    // the other inputs with this channel, most channels have none
+    vector<int> others;
+    for( size_t t = 0 ; t < out.sources.size() ; t ++ ) {
+        const OverlapSource & o = out.sources[t];
+        if( int( t) != s && channel >= o.channel0 && channel < o.channel0 + o.info.naxis3)
+            others.push_back( int( t));
+    }
+    if( others.empty())
+        return;
+    // a weight cube is summed up, everything else averaged
+    bool sum = src.weights.fileName == src.info.fileName;
+
+    vector<double> values( m), weights( m), num( m, 0), den( m, 0);
+    vector<char> buff;
+    for( size_t k = 0 ; k <= others.size() ; k ++ ) {
+        int t = k == 0 ? s : others[k - 1];
+        const OverlapSource & o = out.sources[t];
+        int plane = channel - o.channel0;
+        if( ! o.hasWeights)
+            throw QString( "No weights for %1").arg( o.info.fileName);
+        if( k == 0)
+            loadValues( data, m, fmt, & values[0]);
+        else
+            readValues( out.readers[t], o.info, plane, pixel, m, buff, & values[0]);
+        if( sum)
+            weights = values;
+        else
+            readValues( out.weightReaders[t], o.weights, plane, pixel, m, buff, & weights[0]);
+        for( qint64 i = 0 ; i < m ; i ++ ) {
+            double v = values[i], w = weights[i];
+            // NaNs fail all of these
+            if( ! (v - v == 0) || ! (w > 0 && w - w == 0))
+                continue;
+            if( _clip && (v < _clipMin || v > _clipMax))
+                continue;
+            num[i] += w * v;
+            den[i] += w;
+        }
+    }
+    const double nan = numeric_limits<double>::quiet_NaN();
+    for( qint64 i = 0 ; i < m ; i ++ )
+        values[i] = sum ? den[i] : den[i] > 0 ? num[i] / den[i] : nan;
+    storeValues( & values[0], m, fmt, data);
+}
+
+qint64 OverlapFilter::outputSize( qint64 size, const FitsInfo & info) const
+{
+    return _next ? _next-> outputSize( size, info) : size;
+}
+
+qint64 OverlapFilter::inputSize( qint64 size, const FitsInfo & info) const
+{
+    return _next ? _next-> inputSize( size, info) : size;
+}
@@ -0,0 +1,63 @@
+#pragma once
+
+#include <vector>
+#include <QHash>
+#include <QPair>
+#include <QString>
+
+#include "pipeline.h"
+#include "convert.h"
+
+// one input of a combine whose channels overlap: the whole cube, before the overlap was
+// cut off its front, and its weight cube
+struct OverlapSource {
+    FitsInfo info;
+    // same size as info; it is info itself when the cube being combined is a weight cube,
+    // whose overlapping planes are summed up
+    FitsInfo weights;
+    bool hasWeights;
+    // output channel of its first plane
+    int channel0;
+};
+
+// Pipeline filter for combines whose inputs overlap in frequency. The inputs are streamed
+// cut down so that every output channel comes from the first input that has it; where
+// other inputs have the channel too, their values are read (for the same pixels as the
+// chunk) and the chunk becomes the average weighted by the planes of the weight cubes:
+//
+//     out = sum( w * v) / sum( w), over the inputs with a finite v and a finite w > 0
+//
+// and NaN if there are none. It runs after the conversion and the clipping, so the chunk
+// holds the values as they go to the output; the values of the other inputs are clipped
+// the same way before they are averaged. Only the overlapping planes are touched.
+class OverlapFilter : public ChunkFilter {
+public:
+    // convert is the BITPIX the values were converted to, 0 = they stay as they are
+    OverlapFilter( ChunkFilter * next, int convert);
+    ~OverlapFilter();
+    void setClip( double min, double max);
+    // the inputs of one output
+    void addSources( const std::vector<OverlapSource> & sources);
+
+    void process( PipelineChunk & chunk, const FitsInfo & info);
+    qint64 outputSize( qint64 size, const FitsInfo & info) const;
+    qint64 inputSize( qint64 size, const FitsInfo & info) const;
+
+protected:
+    struct Output {
+        std::vector<OverlapSource> sources;
+        // pread is all they do, so the workers can share them
+        std::vector<DataReader *> readers, weightReaders;
+    };
+    // blends the other inputs into m values of plane z of source s
+    void blend( const Output & out, int s, int z, qint64 pixel, qint64 m, char * data,
+                const PixelFormat & fmt) const;
+
+    ChunkFilter * _next;
+    PixelFormat _format;
+    bool _clip;
+    double _clipMin, _clipMax;
+    std::vector<Output *> _outputs;
+    // input file name -> output and source index
+    QHash<QString, QPair<int, int> > _inputs;
+};
@@ -0,0 +1,971 @@
+/*
+ *   Copyright 2013 Pavol Federl (federl@gmail.com)
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ *
+ */
+
+#include <iostream>
+#include <map>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+
+#include <QThread>
+#include <QAtomicInt>
+#include <QFileInfo>
+
+#include "pipeline.h"
+#include "checksum.h"
+#include "asyncio.h"
+
+#include <unistd.h>
+#ifdef Q_OS_LINUX
+#include <sys/syscall.h>
+#include <sys/sendfile.h>
+#endif
+
+using namespace std;
+
+void ChunkQueue::push( const PipelineChunk & chunk)
+{
+    QMutexLocker locker( & _mutex);
+    _chunks.push_back( chunk);
+    _cond.wakeOne();
+}
+
+bool ChunkQueue::pop( PipelineChunk & chunk)
+{
+    QMutexLocker locker( & _mutex);
+    while( _chunks.empty() && ! _aborted)
+        _cond.wait( & _mutex);
+    if( _aborted)
+        return false;
+    chunk = _chunks.front();
+    _chunks.pop_front();
+    return true;
+}
+
+bool ChunkQueue::tryPop( PipelineChunk & chunk)
+{
+    QMutexLocker locker( & _mutex);
+    if( _chunks.empty() || _aborted)
+        return false;
+    chunk = _chunks.front();
+    _chunks.pop_front();
+    return true;
+}
+
+void ChunkQueue::abort()
+{
+    QMutexLocker locker( & _mutex);
+    _aborted = true;
+    _cond.wakeAll();
+}
+
+CopyProgress::CopyProgress( qint64 totalBytes, ostream & log, Metrics * metrics)
+    : _log( log)
+{
+    _total = totalBytes;
+    _processed = 0;
+    _metrics = metrics;
+    _log << "Starting concatenation of " << formatBytes( _total).toStdString() << "\n";
+    _timer.start();
+    _timer2.start();
+}
+
+void CopyProgress::add( qint64 bytes)
+{
+    QMutexLocker locker( & _mutex);
+    _processed += bytes;
+    if( _metrics)
+        _metrics-> progress( _processed, _total);
+    if( _timer2.elapsed() > 1000) {
+        _log << "    speed: " << (_processed / 1024 / 1024) / (_timer.elapsed() / 1000.0)
+             << " MB/s ";
+        _log << "wrote: " << formatBytes(_processed).toStdString() << "("
+             << (qint64)((_processed * 100.0) / _total) << "%) ";
+        _log << "elapsed: " << formatSeconds( _timer.elapsed() / 1000.0).toStdString() << " ";
+        double eta = (_total - _processed) * _timer.elapsed() / _processed / 1000;
+        _log << "eta: " << formatSeconds( eta).toStdString() << "\n";
+        _timer2.restart();
+    }
+}
+
+ChannelFilter::ChannelFilter( ChunkFilter * next, int convert)
+{
+    _next = next;
+    _format.bitpix = convert; _format.bscale = 1; _format.bzero = 0;
+    _format.hasBlank = false; _format.blank = 0;
+}
+
+void ChannelFilter::addInput( int index, int output, int channel0)
+{
+    if( index >= int( _inputs.size()))
+        _inputs.resize( index + 1);
+    Input & in = _inputs[ index];
+    in.output = output;
+    in.channel0 = channel0;
+}
+
+void ChannelFilter::process( PipelineChunk & chunk, const FitsInfo & info)
+{
+    // the index of the first value is counted in the input, before any conversion
+    qint64 first = (chunk.fileOffset - info.header.dataOffset()) / (abs( info.bitpix) / 8);
+    if( _next)
+        _next-> process( chunk, info);
+    int ind = chunk.fileIndex;
+    if( ind < 0 || ind >= int( _inputs.size()) || _inputs[ind].output < 0)
+        throw QString( "%1 is not an input of the filter").arg( info.fileName);
+    const Input & in = _inputs[ind];
+    PixelFormat fmt = _format.bitpix ? _format : pixelFormat( info);
+    int size = abs( fmt.bitpix) / 8;
+    qint64 planePixels = qint64( info.naxis1) * info.naxis2;
+    qint64 n = chunk.size / size;
+    for( qint64 i = 0 ; i < n ; ) {
+        qint64 index = first + i;
+        qint64 pixel = index % planePixels;
+        qint64 m = qMin( n - i, planePixels - pixel);
+        processPlane( in.output, in.channel0 + int( index / planePixels), pixel, chunk.data + i * size, m,
+                      fmt, info);
+        i += m;
+    }
+}
+
+qint64 ChannelFilter::outputSize( qint64 size, const FitsInfo & info) const
+{
+    return _next ? _next-> outputSize( size, info) : size;
+}
+
+qint64 ChannelFilter::inputSize( qint64 size, const FitsInfo & info) const
+{
+    return _next ? _next-> inputSize( size, info) : size;
+}
+
+ConcatPipeline::ConcatPipeline( ChunkFilter * filter, BufferPool * pool)
+{
+    _filter = filter;
+    _pool = pool;
+    _bufferSize = pool-> bufferSize();
+    _nWorkers = 0;
+    _zeroCopy = true;
+    _ioMode = IoBuffered;
+    _queueDepth = 1;
+    _ioThreads = false;
+    _checksum = false;
+    _metrics = 0;
+    _log = & cerr;
+    _failed = false;
+}
+
+void ConcatPipeline::addInput( const FitsInfo & info, QFile * output)
+{
+    _fileInfo.push_back( info);
+    _outputs.push_back( output);
+}
+
+void ConcatPipeline::setWorkers( int count)
+{
+    _nWorkers = count;
+}
+
+void ConcatPipeline::setZeroCopy( bool on)
+{
+    _zeroCopy = on;
+}
+
+void ConcatPipeline::setIoMode( IoMode mode)
+{
+    _ioMode = mode;
+}
+
+void ConcatPipeline::setQueueDepth( int depth, bool threads)
+{
+    _queueDepth = depth;
+    _ioThreads = threads;
+}
+
+void ConcatPipeline::setJournal( QFile * output, Journal * journal)
+{
+    _journals[ output] = journal;
+}
+
+void ConcatPipeline::setChecksum( bool on)
+{
+    _checksum = on;
+}
+
+void ConcatPipeline::setDataSum( QFile * output, quint32 sum)
+{
+    _dataSums[ output] = sum;
+}
+
+quint32 ConcatPipeline::dataSum( QFile * output) const
+{
+    std::map<QFile *, quint32>::const_iterator it = _dataSums.find( output);
+    return it == _dataSums.end() ? 0 : it-> second;
+}
+
+void ConcatPipeline::setMetrics( Metrics * metrics)
+{
+    _metrics = metrics;
+}
+
+void ConcatPipeline::commit( QFile * output, DataWriter * writer)
+{
+    std::map<QFile *, Journal *>::iterator it = _journals.find( output);
+    if( it != _journals.end())
+        it-> second-> commit( writer-> sync(), dataSum( output));
+}
+
+void ConcatPipeline::fail( const QString & msg)
+{
+    fail( CubeError( CubeError::Failed, msg));
+}
+
+void ConcatPipeline::fail( const CubeError & error)
+{
+    {
+        QMutexLocker locker( & _errorMutex);
+        if( _failed) return;
+        _failed = true;
+        _error = error;
+    }
+    _freeQueue.abort();
+    _readQueue.abort();
+    _writeQueue.abort();
+}
+
+bool ConcatPipeline::failed()
+{
+    QMutexLocker locker( & _errorMutex);
+    return _failed;
+}
+
+// reader stage: fills free buffers with the data segments of the input files, in order
+void ConcatPipeline::readerLoop()
+{
+    // time spent reading, and waiting for free buffers
+    qint64 busy = 0, wait = 0;
+    try {
+        qint64 seq = _queueDepth > 1 ? readChunksAsync( busy, wait) : readChunks( busy, wait);
+        if( seq < 0)
+            return;
+        // let the workers know there is nothing more coming
+        PipelineChunk end;
+        end.last = true;
+        end.seq = seq;
+        _readQueue.push( end);
+        if( _metrics)
+            _metrics-> addStage( StageRead, 1, busy, wait);
+    } catch ( const CubeError & e) {
+        fail( e);
+    } catch ( const char * msg) {
+        fail( msg);
+    } catch ( const QString & msg) {
+        fail( msg);
+    } catch ( ... ) {
+        fail( "Unknown error in reader.");
+    }
+}
+
+qint64 ConcatPipeline::readChunks( qint64 & busy, qint64 & wait)
+{
+    qint64 seq = 0;
+    for( size_t i = 0 ; i < _fileInfo.size() ; i ++ ) {
+        QString fname = _fileInfo[i].fileName;
+        * _log << "  appending " << fname.toStdString() << "\n";
+        DataReader reader( fname, _ioMode);
+        reader.setMetrics( _metrics);
+        qint64 offset = _fileInfo[i].dataOffset;
+        qint64 remaining = _fileInfo[i].dataSize;
+        // the chunk has to fit into the buffer after the filter too
+        qint64 chunkSize = _filter ? _filter-> inputSize( _bufferSize, _fileInfo[i]) : _bufferSize;
+        while( remaining > 0) {
+            PipelineChunk chunk;
+            qint64 t0 = _metrics ? Metrics::now() : 0;
+            if( ! _freeQueue.pop( chunk))
+                return -1;
+            qint64 t1 = _metrics ? Metrics::now() : 0;
+            qint64 wantToRead = chunkSize;
+            if( remaining < wantToRead) wantToRead = remaining;
+            // read in a chunk of input
+            chunk.data = reader.read( chunk.buffer, offset, wantToRead);
+            if( _metrics) {
+                wait += t1 - t0;
+                busy += Metrics::now() - t1;
+                _metrics-> buffersTaken( 1);
+                _metrics-> addFileBytes( fname, wantToRead, 0);
+            }
+            chunk.size = wantToRead;
+            chunk.fileOffset = offset;
+            chunk.seq = seq ++;
+            chunk.fileIndex = i;
+            chunk.last = false;
+            _readQueue.push( chunk);
+            offset += wantToRead;
+            remaining -= wantToRead;
+        }
+    }
+    return seq;
+}
+
+// The reads of all the free buffers are started at once, going through the inputs in their
+// order, and every chunk goes to the workers as soon as it is there; the writer puts them
+// back in sequence. An input stays open until the last of its reads is back.
+qint64 ConcatPipeline::readChunksAsync( qint64 & busy, qint64 & wait)
+{
+    vector<DataReader *> readers( _fileInfo.size(), (DataReader *) 0);
+    // chunks of every input being read
+    vector<int> reading( _fileInfo.size(), 0);
+    std::map<qint64, PipelineChunk> chunks;
+    AsyncReader io( _queueDepth, _ioThreads);
+    io.setMetrics( _metrics);
+    // in one piece, the writer is printing too
+    * _log << QString( "Reading with %1, %2 reads of %3 in flight.\n").arg( io.backend()).arg( _queueDepth)
+            .arg( formatBytes( AsyncReader::PieceSize)).toStdString();
+    qint64 seq = 0;
+    try {
+        size_t next = 0;
+        int current = -1;
+        qint64 offset = 0, remaining = 0, chunkSize = 0;
+        while( true) {
+            if( remaining == 0 && next < _fileInfo.size()) {
+                current = int( next ++);
+                const FitsInfo & info = _fileInfo[current];
+                * _log << "  appending " << info.fileName.toStdString() << "\n";
+                readers[current] = new DataReader( info.fileName, _ioMode);
+                offset = info.dataOffset;
+                remaining = info.dataSize;
+                chunkSize = _filter ? _filter-> inputSize( _bufferSize, info) : _bufferSize;
+                continue;
+            }
+            if( remaining == 0 && io.pending() == 0)
+                break;
+            // a free buffer starts the next read, without one a read that is done goes on
+            PipelineChunk chunk;
+            qint64 t0 = _metrics ? Metrics::now() : 0;
+            bool free = remaining > 0 && (io.pending() > 0 ? _freeQueue.tryPop( chunk) : _freeQueue.pop( chunk));
+            qint64 t1 = _metrics ? Metrics::now() : 0;
+            if( free) {
+                chunk.size = qMin( chunkSize, remaining);
+                chunk.fileOffset = offset;
+                chunk.seq = seq ++;
+                chunk.fileIndex = current;
+                chunk.last = false;
+                chunk.data = readers[current]-> submit( io, chunk.buffer, offset, chunk.size, chunk.seq);
+                chunks[ chunk.seq] = chunk;
+                reading[current] ++;
+                offset += chunk.size;
+                remaining -= chunk.size;
+                if( _metrics) {
+                    wait += t1 - t0;
+                    busy += Metrics::now() - t1;
+                    _metrics-> buffersTaken( 1);
+                }
+                continue;
+            }
+            if( io.pending() == 0) {
+                // aborted
+                seq = -1;
+                break;
+            }
+            qint64 tag = io.wait();
+            qint64 t2 = _metrics ? Metrics::now() : 0;
+            chunk = chunks[ tag];
+            chunks.erase( tag);
+            int ind = chunk.fileIndex;
+            readers[ind]-> readDone( chunk.fileOffset, chunk.size);
+            if( _metrics) {
+                wait += t2 - t0;
+                _metrics-> addFileBytes( _fileInfo[ind].fileName, chunk.size, 0);
+            }
+            _readQueue.push( chunk);
+            if( -- reading[ind] == 0 && (ind != current || remaining == 0)) {
+                delete readers[ind];
+                readers[ind] = 0;
+            }
+        }
+    } catch ( ... ) {
+        // the reads in flight go into the buffers and the files, they have to finish first
+        io.drain();
+        for( size_t i = 0 ; i < readers.size() ; i ++ )
+            delete readers[i];
+        throw;
+    }
+    for( size_t i = 0 ; i < readers.size() ; i ++ )
+        delete readers[i];
+    return seq;
+}
+
+// worker stage: applies the filter, chunks can leave in a different order than they came in
+void ConcatPipeline::workerLoop()
+{
+    // time spent filtering, summing and waiting for chunks
+    qint64 filter = 0, sum = 0, wait = 0;
+    try {
+        PipelineChunk chunk;
+        qint64 t0 = _metrics ? Metrics::now() : 0;
+        while( _readQueue.pop( chunk)) {
+            if( chunk.last) {
+                // put the marker back for the other workers and tell the writer
+                _readQueue.push( chunk);
+                _writeQueue.push( chunk);
+                break;
+            }
+            qint64 t1 = _metrics ? Metrics::now() : 0;
+            if( _filter)
+                _filter->process( chunk, _fileInfo[chunk.fileIndex]);
+            qint64 t2 = _metrics ? Metrics::now() : 0;
+            // the sum is of the data as it goes into the output, so after the filter
+            if( _checksum)
+                chunk.dataSum = fitsDataSum( chunk.data, chunk.size);
+            qint64 t3 = _metrics ? Metrics::now() : 0;
+            wait += t1 - t0; filter += t2 - t1; sum += t3 - t2;
+            t0 = t3;
+            _writeQueue.push( chunk);
+        }
+        if( _metrics) {
+            _metrics-> addStage( StageFilter, 1, filter, wait);
+            if( _checksum)
+                _metrics-> addStage( StageChecksum, 1, sum, 0);
+        }
+    } catch ( const CubeError & e) {
+        fail( e);
+    } catch ( const char * msg) {
+        fail( msg);
+    } catch ( const QString & msg) {
+        fail( msg);
+    } catch ( ... ) {
+        fail( "Unknown error in worker.");
+    }
+}
+
+// writer stage: puts the chunks back in order, appends them to the outputs and recycles buffers
+void ConcatPipeline::writerLoop()
+{
+    // writer of the output the chunks are going to at the moment, it starts where the
+    // output's QFile is (after the header) and leaves it positioned after the data
+    QFile * output = 0;
+    DataWriter * writer = 0;
+    // the journal gets a commit every few seconds, so a crash loses only that much
+    QElapsedTimer commitTimer; commitTimer.start();
+    // time spent writing, and waiting for the next chunk in sequence
+    qint64 busy = 0, wait = 0;
+    try {
+        qint64 totalBytes = 0;
+        for( size_t i = 0 ; i < _fileInfo.size() ; i ++) {
+            totalBytes += _filter ? _filter-> outputSize( _fileInfo[i].dataSize, _fileInfo[i])
+                                  : _fileInfo[i].dataSize;
+        }
+        CopyProgress progress( totalBytes, * _log, _metrics);
+        std::map<qint64, PipelineChunk> pending;
+        qint64 next = 0, total = -1;
+        while( total < 0 || next < total) {
+            PipelineChunk chunk;
+            qint64 t0 = _metrics ? Metrics::now() : 0;
+            if( ! _writeQueue.pop( chunk))
+                break;
+            qint64 t1 = _metrics ? Metrics::now() : 0;
+            wait += t1 - t0;
+            if( chunk.last) {
+                total = chunk.seq;
+                continue;
+            }
+            pending[ chunk.seq] = chunk;
+            // write out everything that is now in sequence
+            while( ! pending.empty() && pending.begin()-> first == next) {
+                PipelineChunk c = pending.begin()-> second;
+                pending.erase( pending.begin());
+                if( _outputs[ c.fileIndex] != output) {
+                    // done with the previous output (its staging buffer goes back to the pool)
+                    if( writer)
+                        closeWriter( output, writer);
+                    output = _outputs[ c.fileIndex];
+                    if( ! output-> flush())
+                        throw QString( "Failed to write to: %1").arg( output-> fileName());
+                    writer = new DataWriter( output-> fileName(), output-> pos(), _ioMode, _pool);
+                    writer-> setMetrics( _metrics);
+                }
+                // the data segment starts on a 2880 byte boundary, so the offset in the file
+                // is as good as the offset in the data segment for lining up the words
+                if( _checksum)
+                    _dataSums[ output] = fitsSumAdd( _dataSums[ output],
+                                                     fitsSumAt( c.dataSum, writer-> position()));
+                writer-> write( c.data, c.size);
+                if( commitTimer.elapsed() > CommitInterval) {
+                    commit( output, writer);
+                    commitTimer.restart();
+                }
+                next ++;
+                progress.add( c.size);
+                if( _metrics) {
+                    _metrics-> addFileBytes( _fileInfo[ c.fileIndex].fileName, 0, c.size);
+                    _metrics-> buffersTaken( -1);
+                }
+                // recycle the buffer
+                c.size = 0;
+                _freeQueue.push( c);
+            }
+            if( _metrics)
+                busy += Metrics::now() - t1;
+        }
+        if( writer && ! failed())
+            closeWriter( output, writer);
+        if( _metrics)
+            _metrics-> addStage( StageWrite, 1, busy, wait);
+    } catch ( const CubeError & e) {
+        fail( e);
+    } catch ( const char * msg) {
+        fail( msg);
+    } catch ( const QString & msg) {
+        fail( msg);
+    } catch ( ... ) {
+        fail( "Unknown error in writer.");
+    }
+    delete writer;
+}
+
+// flushes the writer and moves the output's QFile after the data, for the padding
+void ConcatPipeline::closeWriter( QFile * output, DataWriter * & writer)
+{
+    writer-> finish();
+    commit( output, writer);
+    qint64 end = writer-> position();
+    delete writer;
+    writer = 0;
+    if( ! output-> seek( end))
+        throw QString( "Failed to seek in: %1").arg( output-> fileName());
+}
+
+// how much the kernel copies per call, small enough for the progress to be printed
+static const qint64 ZeroCopyStep = 256 * 1024 * 1024;
+
+// Copies size bytes from inFd at inOffset to outFd at outOffset without bringing them into
+// user space. Returns the number of bytes copied. If the filesystems/kernel do not support
+// it, this is less than size, and the rest has to be copied the normal way.
+// sendfile moves the file position of outFd, so it is only used when allowSendfile is set.
+static qint64 kernelCopy( int inFd, qint64 inOffset, int outFd, qint64 outOffset, qint64 size,
+                          CopyProgress & progress, Metrics * metrics, bool allowSendfile = true)
+{
+    qint64 done = 0;
+#ifdef Q_OS_LINUX
+    // copy_file_range can clone the extents (XFS/btrfs reflinks, NFS server side copy)
+#ifdef __NR_copy_file_range
+    // shared by the threads of ParallelFileCopy, cleared by the first that gets ENOSYS
+    static QAtomicInt haveCopyRange( 1);
+    while( haveCopyRange.loadAcquire() && done < size) {
+        loff_t in = inOffset + done, out = outOffset + done;
+        LatencyTimer timer( metrics, OpCopy);
+        ssize_t n = syscall( __NR_copy_file_range, inFd, & in, outFd, & out,
+                             size_t( qMin( size - done, ZeroCopyStep)), 0);
+        timer.done( n > 0 ? n : 0);
+        if( n > 0) {
+            done += n;
+            progress.add( n);
+            continue;
+        }
+        if( n == 0)
+            throw QString( "Unexpected end of input file.");
+        if( errno == EINTR)
+            continue;
+        if( errno != ENOSYS && errno != EXDEV && errno != EINVAL && errno != EOPNOTSUPP)
+            throw QString( "copy_file_range failed: %1").arg( strerror( errno));
+        // not for these files, the older kernels do not support it at all
+        if( errno == ENOSYS) haveCopyRange.storeRelease( 0);
+        break;
+    }
+#endif
+    // sendfile still saves the copy to user space, but it writes at the file position
+    if( done < size && allowSendfile) {
+        if( lseek( outFd, outOffset + done, SEEK_SET) < 0)
+            throw QString( "Failed to seek in the output: %1").arg( strerror( errno));
+        while( done < size) {
+            off_t in = inOffset + done;
+            LatencyTimer timer( metrics, OpCopy);
+            ssize_t n = sendfile( outFd, inFd, & in, size_t( qMin( size - done, ZeroCopyStep)));
+            timer.done( n > 0 ? n : 0);
+            if( n > 0) {
+                done += n;
+                progress.add( n);
+                continue;
+            }
+            if( n == 0)
+                throw QString( "Unexpected end of input file.");
+            if( errno == EINTR)
+                continue;
+            if( errno != ENOSYS && errno != EINVAL && errno != EOPNOTSUPP)
+                throw QString( "sendfile failed: %1").arg( strerror( errno));
+            break;
+        }
+    }
+#else
+    Q_UNUSED( inFd); Q_UNUSED( inOffset); Q_UNUSED( outFd); Q_UNUSED( outOffset);
+    Q_UNUSED( size); Q_UNUSED( progress); Q_UNUSED( metrics);
+#endif
+    return done;
+}
+
+void ConcatPipeline::zeroCopyInputs()
+{
+    qint64 totalBytes = 0;
+    for( size_t i = 0 ; i < _fileInfo.size() ; i ++)
+        totalBytes += _fileInfo[i].dataSize;
+    * _log << "Copying the data in the kernel\n";
+    CopyProgress progress( totalBytes, * _log, _metrics);
+    qint64 start = _metrics ? Metrics::now() : 0;
+    size_t i = 0;
+    for( ; i < _fileInfo.size() ; i ++ ) {
+        FitsInfo & info = _fileInfo[i];
+        * _log << "  appending " << info.fileName.toStdString() << "\n";
+        QFile fp( info.fileName);
+        if( ! fp.open( QFile::ReadOnly))
+            throw QString( "Could not open file for reading: %1").arg( info.fileName);
+        QFile & output = * _outputs[i];
+        // the header was written through QFile, it has to be on disk before we go around it
+        if( ! output.flush())
+            throw QString( "Failed to write to: %1").arg( output.fileName());
+        qint64 outPos = output.pos();
+        qint64 done = kernelCopy( fp.handle(), info.dataOffset, output.handle(), outPos,
+                                  info.dataSize, progress, _metrics);
+        if( _metrics)
+            _metrics-> addFileBytes( info.fileName, done, done);
+        // keep QFile's idea of the position in sync
+        if( ! output.seek( outPos + done))
+            throw QString( "Failed to seek in: %1").arg( output.fileName());
+        std::map<QFile *, Journal *>::iterator jit = _journals.find( & output);
+        if( jit != _journals.end()) {
+            if( fdatasync( output.handle()) != 0)
+                throw QString( "Failed to sync %1: %2").arg( output.fileName()).arg( strerror( errno));
+            jit-> second-> commit( outPos + done, dataSum( & output));
+        }
+        if( done < info.dataSize) {
+            // the rest of this file and all the remaining ones go through the ring
+            info.dataOffset += done;
+            info.dataSize -= done;
+            break;
+        }
+    }
+    if( _metrics)
+        _metrics-> addStage( StageCopy, 1, Metrics::now() - start, 0);
+    if( i < _fileInfo.size())
+        * _log << "Kernel copy is not supported here, copying the rest through memory.\n";
+    _fileInfo.erase( _fileInfo.begin(), _fileInfo.begin() + i);
+    _outputs.erase( _outputs.begin(), _outputs.begin() + i);
+}
+
+void ConcatPipeline::run()
+{
+    // without a filter the data does not need to come to user space at all; the kernel
+    // copies through the page cache though, so not if we were asked to stay out of it,
+    // and the data sums need to see the data
+    if( ! _filter && _zeroCopy && _ioMode == IoBuffered && ! _checksum) {
+        zeroCopyInputs();
+        if( _fileInfo.empty())
+            return;
+    }
+
+    // the ring takes the whole pool, except for the O_DIRECT staging buffer of the writer
+    int nBuffers = _pool-> count() - (_ioMode == IoDirect ? 1 : 0);
+    std::vector<char *> ring;
+    for( int i = 0 ; i < nBuffers ; i ++ ) {
+        PipelineChunk chunk;
+        chunk.buffer = chunk.data = _pool-> acquire();
+        ring.push_back( chunk.buffer);
+        _freeQueue.push( chunk);
+    }
+    if( _metrics)
+        _metrics-> setBuffers( nBuffers);
+
+    // by default use one worker per core, but there is no point having more workers
+    // than there are buffers available to them
+    int nWorkers = _nWorkers;
+    if( nWorkers <= 0) nWorkers = QThread::idealThreadCount();
+    if( nWorkers > nBuffers - 2) nWorkers = nBuffers - 2;
+    if( nWorkers < 1) nWorkers = 1;
+
+    typedef StageThread<ConcatPipeline> Thread;
+    std::vector<Thread *> threads;
+    threads.push_back( new Thread( this, & ConcatPipeline::readerLoop));
+    for( int i = 0 ; i < nWorkers ; i ++ )
+        threads.push_back( new Thread( this, & ConcatPipeline::workerLoop));
+    threads.push_back( new Thread( this, & ConcatPipeline::writerLoop));
+    for( size_t i = 0 ; i < threads.size() ; i ++ )
+        threads[i]-> start();
+    for( size_t i = 0 ; i < threads.size() ; i ++ ) {
+        threads[i]-> wait();
+        delete threads[i];
+    }
+    for( size_t i = 0 ; i < ring.size() ; i ++ )
+        _pool-> release( ring[i]);
+
+    if( failed())
+        _error.rethrow();
+}
+
+ParallelFileCopy::ParallelFileCopy( ChunkFilter * filter, BufferPool * pool)
+{
+    _filter = filter;
+    _pool = pool;
+    _nThreads = 4;
+    _zeroCopy = true;
+    _ioMode = IoBuffered;
+    _progress = 0;
+    _checksum = false;
+    _metrics = 0;
+    _log = & cerr;
+    _next = 0;
+    _failed = false;
+}
+
+void ParallelFileCopy::addInput( const FitsInfo & info, QFile * output, qint64 outputOffset)
+{
+    _fileInfo.push_back( info);
+    _outputs.push_back( output);
+    _outputOffsets.push_back( outputOffset);
+    _outputSizes.push_back( _filter ? _filter-> outputSize( info.dataSize, info) : info.dataSize);
+    _finished.push_back( false);
+    _fileSums.push_back( 0);
+}
+
+void ParallelFileCopy::setJournal( QFile * output, Journal * journal)
+{
+    _journals[ output] = journal;
+}
+
+void ParallelFileCopy::setThreads( int count)
+{
+    _nThreads = count < 1 ? 1 : count;
+}
+
+void ParallelFileCopy::setZeroCopy( bool on)
+{
+    _zeroCopy = on;
+}
+
+void ParallelFileCopy::setIoMode( IoMode mode)
+{
+    _ioMode = mode;
+}
+
+void ParallelFileCopy::setChecksum( bool on)
+{
+    _checksum = on;
+}
+
+void ParallelFileCopy::setDataSum( QFile * output, quint32 sum)
+{
+    _baseSums[ output] = sum;
+}
+
+// the inputs were summed at their offsets in the output, so they just add up
+quint32 ParallelFileCopy::dataSum( QFile * output) const
+{
+    std::map<QFile *, quint32>::const_iterator it = _baseSums.find( output);
+    quint32 sum = it == _baseSums.end() ? 0 : it-> second;
+    for( size_t i = 0 ; i < _outputs.size() ; i ++ )
+        if( _outputs[i] == output)
+            sum = fitsSumAdd( sum, _fileSums[i]);
+    return sum;
+}
+
+void ParallelFileCopy::setMetrics( Metrics * metrics)
+{
+    _metrics = metrics;
+}
+
+void ParallelFileCopy::fail( const QString & msg)
+{
+    fail( CubeError( CubeError::Failed, msg));
+}
+
+void ParallelFileCopy::fail( const CubeError & error)
+{
+    QMutexLocker locker( & _mutex);
+    if( _failed) return;
+    _failed = true;
+    _error = error;
+}
+
+bool ParallelFileCopy::failed()
+{
+    QMutexLocker locker( & _mutex);
+    return _failed;
+}
+
+// The output is durable up to the end of the last of the files that finished one after
+// another from its start, with the data sum of those files.
+void ParallelFileCopy::fileDone( int ind)
+{
+    QMutexLocker locker( & _commitMutex);
+    _finished[ind] = true;
+    QFile * output = _outputs[ind];
+    std::map<QFile *, Journal *>::iterator jit = _journals.find( output);
+    if( jit == _journals.end())
+        return;
+    std::map<QFile *, quint32>::const_iterator bit = _baseSums.find( output);
+    quint32 sum = bit == _baseSums.end() ? 0 : bit-> second;
+    qint64 end = -1;
+    bool grew = false;
+    // the inputs of an output were added in the order they are in it
+    for( size_t i = 0 ; i < _outputs.size() ; i ++ ) {
+        if( _outputs[i] != output)
+            continue;
+        if( ! _finished[i])
+            break;
+        sum = fitsSumAdd( sum, _fileSums[i]);
+        end = _outputOffsets[i] + _outputSizes[i];
+        grew = grew || int( i) == ind;
+    }
+    // nothing new if the file is after one still being copied
+    if( ! grew)
+        return;
+    if( fdatasync( output-> handle()) != 0)
+        throw QString( "Failed to sync %1: %2").arg( output-> fileName()).arg( strerror( errno));
+    jit-> second-> commit( end, sum);
+}
+
+// copies one input file to its place in the output
+void ParallelFileCopy::copyFile( int ind, char * & buff, CopyProgress & progress, qint64 * busy)
+{
+    const FitsInfo & info = _fileInfo[ind];
+    * _log << "  copying " << info.fileName.toStdString() << "\n";
+    DataReader reader( info.fileName, _ioMode);
+    reader.setMetrics( _metrics);
+    qint64 done = 0;
+    if( ! _filter && _zeroCopy && _ioMode == IoBuffered && ! _checksum) {
+        qint64 t0 = _metrics ? Metrics::now() : 0;
+        done = kernelCopy( reader.handle(), info.dataOffset, _outputs[ind]-> handle(),
+                           _outputOffsets[ind], info.dataSize, progress, _metrics, false);
+        if( _metrics) {
+            busy[ StageCopy] += Metrics::now() - t0;
+            _metrics-> addFileBytes( info.fileName, done, done);
+        }
+    }
+    if( done == info.dataSize)
+        return;
+    // the rest goes through memory; a filter can change the size of the data, so the
+    // input and the output move on separately
+    if( ! buff) {
+        buff = _pool-> acquire();
+        if( _metrics)
+            _metrics-> buffersTaken( 1);
+    }
+    qint64 chunkSize = _filter ? _filter-> inputSize( _pool-> bufferSize(), info) : _pool-> bufferSize();
+    qint64 written = done;
+    DataWriter writer( _outputs[ind]-> fileName(), _outputOffsets[ind] + written, _ioMode, _pool);
+    writer.setMetrics( _metrics);
+    while( done < info.dataSize && ! failed()) {
+        PipelineChunk chunk;
+        chunk.buffer = buff;
+        chunk.size = qMin( chunkSize, info.dataSize - done);
+        chunk.fileIndex = ind;
+        chunk.fileOffset = info.dataOffset + done;
+        qint64 t0 = _metrics ? Metrics::now() : 0;
+        chunk.data = reader.read( buff, chunk.fileOffset, chunk.size);
+        qint64 t1 = _metrics ? Metrics::now() : 0;
+        qint64 read = chunk.size;
+        done += chunk.size;
+        if( _filter)
+            _filter-> process( chunk, info);
+        qint64 t2 = _metrics ? Metrics::now() : 0;
+        if( _checksum)
+            _fileSums[ind] = fitsSumAdd( _fileSums[ind], fitsSumAt(
+                        fitsDataSum( chunk.data, chunk.size), _outputOffsets[ind] + written));
+        qint64 t3 = _metrics ? Metrics::now() : 0;
+        writer.write( chunk.data, chunk.size);
+        written += chunk.size;
+        progress.add( chunk.size);
+        if( _metrics) {
+            busy[ StageRead] += t1 - t0;
+            busy[ StageFilter] += t2 - t1;
+            if( _checksum)
+                busy[ StageChecksum] += t3 - t2;
+            busy[ StageWrite] += Metrics::now() - t3;
+            _metrics-> addFileBytes( info.fileName, read, chunk.size);
+        }
+    }
+    writer.finish();
+}
+
+void ParallelFileCopy::copyLoop()
+{
+    // the buffer is only taken from the pool when the kernel cannot do the copy
+    char * buff = 0;
+    qint64 busy[ StageCount] = { 0 };
+    try {
+        while( true) {
+            size_t ind;
+            {
+                QMutexLocker locker( & _mutex);
+                if( _failed || _next >= _fileInfo.size())
+                    break;
+                ind = _next ++;
+            }
+            copyFile( int( ind), buff, * _progress, busy);
+            // a failure elsewhere stops the copy part way
+            if( ! failed())
+                fileDone( int( ind));
+        }
+        // the threads only wait for the disks, which is in the read and write times
+        for( int s = 0 ; _metrics && s < StageCount ; s ++ )
+            if( busy[s] > 0)
+                _metrics-> addStage( MetricsStage( s), 1, busy[s], 0);
+    } catch ( const CubeError & e) {
+        fail( e);
+    } catch ( const char * msg) {
+        fail( msg);
+    } catch ( const QString & msg) {
+        fail( msg);
+    } catch ( ... ) {
+        fail( "Unknown error in copy thread.");
+    }
+    if( buff && _metrics)
+        _metrics-> buffersTaken( -1);
+    _pool-> release( buff);
+}
+
+void ParallelFileCopy::run()
+{
+    qint64 totalBytes = 0;
+    for( size_t i = 0 ; i < _fileInfo.size() ; i ++)
+        totalBytes += _filter ? _filter-> outputSize( _fileInfo[i].dataSize, _fileInfo[i])
+                              : _fileInfo[i].dataSize;
+    // every thread needs a buffer, and with O_DIRECT also one for staging the writes
+    int nThreads = qMin( _nThreads, int( _fileInfo.size()));
+    int perThread = _ioMode == IoDirect ? 2 : 1;
+    if( nThreads > _pool-> count() / perThread) {
+        nThreads = _pool-> count() / perThread;
+        * _log << "Only enough memory for " << nThreads << " files at a time, see --memory.\n";
+    }
+    * _log << "Copying " << nThreads << " files at a time\n";
+    CopyProgress progress( totalBytes, * _log, _metrics);
+    if( _metrics)
+        _metrics-> setBuffers( _pool-> count());
+    _progress = & progress;
+
+    typedef StageThread<ParallelFileCopy> Thread;
+    std::vector<Thread *> threads;
+    for( int i = 0 ; i < nThreads ; i ++ )
+        threads.push_back( new Thread( this, & ParallelFileCopy::copyLoop));
+    for( size_t i = 0 ; i < threads.size() ; i ++ )
+        threads[i]-> start();
+    for( size_t i = 0 ; i < threads.size() ; i ++ ) {
+        threads[i]-> wait();
+        delete threads[i];
+    }
+    _progress = 0;
+
+    if( failed())
+        _error.rethrow();
+}
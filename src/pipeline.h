@@ -0,0 +1,282 @@
+#pragma once
+
+#include <vector>
+#include <deque>
+#include <map>
+#include <QFile>
+#include <QMutex>
+#include <QWaitCondition>
+#include <QThread>
+#include <QElapsedTimer>
+
+#include "extractor.h"
+#include "convert.h"
+#include "fileio.h"
+#include "bufferpool.h"
+#include "journal.h"
+#include "metrics.h"
+
+// prints the speed/eta lines to log while the data is being copied, and passes the progress
+// on to the metrics if there are any
+class CopyProgress {
+public:
+    CopyProgress( qint64 totalBytes, std::ostream & log, Metrics * metrics = 0);
+    // can be called from several threads
+    void add( qint64 bytes);
+protected:
+    qint64 _total, _processed;
+    QElapsedTimer _timer, _timer2;
+    Metrics * _metrics;
+    std::ostream & _log;
+    QMutex _mutex;
+};
+
+// a piece of input data travelling through the pipeline
+struct PipelineChunk {
+    char * buffer;  // one of the ring buffers
+    char * data;    // where in the buffer the data starts
+    qint64 size;    // number of valid bytes in data
+    qint64 fileOffset; // where in the input file the data was read from
+    qint64 seq;     // position of the chunk in the output stream
+    int fileIndex;  // which input file the data came from
+    bool last;      // end of stream marker (no data), seq is then the total number of chunks
+    quint32 dataSum; // FITS data sum of the chunk as if it started on a word boundary
+    PipelineChunk() { buffer = data = 0; size = 0; fileOffset = 0; seq = 0; fileIndex = -1; last = false; dataSum = 0; }
+};
+
+// blocking queue of chunks, the number of chunks in flight is bounded by the
+// number of ring buffers, so there is no need to limit the queue itself
+class ChunkQueue {
+public:
+    ChunkQueue() { _aborted = false; }
+    void push( const PipelineChunk & chunk);
+    // blocks until a chunk is available, returns false if the pipeline was aborted
+    bool pop( PipelineChunk & chunk);
+    // takes a chunk if there is one, without waiting
+    bool tryPop( PipelineChunk & chunk);
+    // wakes up everyone waiting on the queue
+    void abort();
+protected:
+    std::deque<PipelineChunk> _chunks;
+    QMutex _mutex;
+    QWaitCondition _cond;
+    bool _aborted;
+};
+
+// processing applied to every chunk between the read and the write (e.g. clipping),
+// it is called from several worker threads at once so it must be reentrant
+struct ChunkFilter {
+    virtual ~ChunkFilter() {}
+    virtual void process( PipelineChunk & chunk, const FitsInfo & info) = 0;
+    // A filter that converts the values to another BITPIX changes the size of the data: the
+    // number of bytes that size bytes of this input turn into, and the most input that fits
+    // into size bytes both before and after the filter.
+    virtual qint64 outputSize( qint64 size, const FitsInfo &) const { return size; }
+    virtual qint64 inputSize( qint64 size, const FitsInfo &) const { return size; }
+};
+
+// Base of the filters that look at the values on their way into the outputs, after the
+// filters before them (next). It knows which output and channels every input goes to and
+// hands the values of each chunk to processPlane() one plane at a time; the sizes are
+// those of next.
+class ChannelFilter : public ChunkFilter {
+public:
+    // convert is the BITPIX the values have been converted to, 0 = they are as read
+    ChannelFilter( ChunkFilter * next, int convert);
+    // the planes of the input with PipelineChunk::fileIndex index are the channels of
+    // output from channel0 on
+    void addInput( int index, int output, int channel0);
+
+    void process( PipelineChunk & chunk, const FitsInfo & info);
+    qint64 outputSize( qint64 size, const FitsInfo & info) const;
+    qint64 inputSize( qint64 size, const FitsInfo & info) const;
+
+protected:
+    // n values in the format fmt at data, from pixel on in the plane of the input (info)
+    // that is channel of output; called from several workers at once
+    virtual void processPlane( int output, int channel, qint64 pixel, char * data, qint64 n,
+                               const PixelFormat & fmt, const FitsInfo & info) = 0;
+
+    struct Input {
+        int output, channel0;
+        Input() { output = -1; channel0 = 0; }
+    };
+    ChunkFilter * _next;
+    // the format of the values after a conversion, bitpix 0 = they stay as they are
+    PixelFormat _format;
+    // the inputs by file index, so the same file can be given more than once; only read
+    // while the data is copied
+    std::vector<Input> _inputs;
+};
+
+// thread running one of the loops of a pipeline (or of the mosaic builder)
+template< class Pipeline>
+class StageThread : public QThread {
+public:
+    typedef void (Pipeline::*Loop)();
+    StageThread( Pipeline * pipeline, Loop loop) { _pipeline = pipeline; _loop = loop; }
+protected:
+    void run() { (_pipeline->*_loop)(); }
+    Pipeline * _pipeline;
+    Loop _loop;
+};
+
+// concatenates the data segments of the input files into the output files using three
+// stages: a reader thread, a pool of filter workers and a writer thread. The stages pass
+// a fixed ring of buffers between each other, so that reading the next chunk overlaps
+// with filtering and writing of the previous ones.
+class ConcatPipeline {
+public:
+    // the ring buffers come from the pool
+    ConcatPipeline( ChunkFilter * filter, BufferPool * pool);
+
+    // queues up the data segment of an input to be appended to the output, inputs are
+    // processed in the order in which they were added
+    void addInput( const FitsInfo & info, QFile * output);
+
+    // number of filter workers, 0 means pick automatically
+    void setWorkers( int count);
+    // without a filter the data can be copied by the kernel (copy_file_range/sendfile),
+    // without passing through the ring at all; on by default
+    void setZeroCopy( bool on);
+    // how the inputs are read and the outputs written
+    void setIoMode( IoMode mode);
+    // how many reads of PieceSize the reader keeps in flight (AsyncReader), 1 = one read
+    // of a whole chunk at a time; threads picks the thread pool over io_uring
+    void setQueueDepth( int depth, bool threads = false);
+    // the writer commits its progress on the output to the journal every few seconds
+    void setJournal( QFile * output, Journal * journal);
+    // computes the data sum (DATASUM) of every output on the way, in the workers; the data
+    // then has to come through memory, so this turns off the zero copy
+    void setChecksum( bool on);
+    // data sum of what is already in the output (resume), to continue from
+    void setDataSum( QFile * output, quint32 sum);
+    // data sum of the output's whole data segment, after run()
+    quint32 dataSum( QFile * output) const;
+    // the stages report their times, the I/O latencies and the bytes of every input here
+    void setMetrics( Metrics * metrics);
+    // where the progress is told, stderr by default (see combineLog())
+    void setLog( std::ostream * log) { _log = log; }
+
+    // runs the pipeline to completion, throws QString on errors (CubeError when cancelled)
+    void run();
+
+    // used by the stage threads
+    void readerLoop();
+    void workerLoop();
+    void writerLoop();
+
+protected:
+    // records the first error and tears down all stages
+    void fail( const QString & msg);
+    void fail( const CubeError & error);
+    bool failed();
+    // the reader stage one read at a time, or with many in flight; they add up the times
+    // of the stage and return the number of chunks read, -1 if the pipeline was aborted
+    qint64 readChunks( qint64 & busy, qint64 & wait);
+    qint64 readChunksAsync( qint64 & busy, qint64 & wait);
+    // copies as many inputs as possible in the kernel and removes them from the list,
+    // whatever is left over goes through the ring
+    void zeroCopyInputs();
+    void closeWriter( QFile * output, DataWriter * & writer);
+    // makes the output durable up to the current position and records it in its journal
+    void commit( QFile * output, DataWriter * writer);
+
+    std::vector<FitsInfo> _fileInfo;
+    std::vector<QFile *> _outputs; // output of each input
+    ChunkFilter * _filter;
+    BufferPool * _pool;
+    int _nWorkers;
+    bool _zeroCopy;
+    IoMode _ioMode;
+    int _queueDepth;
+    bool _ioThreads;
+    qint64 _bufferSize;
+    std::map<QFile *, Journal *> _journals;
+    bool _checksum;
+    // running data sum of each output, kept by the writer
+    std::map<QFile *, quint32> _dataSums;
+    Metrics * _metrics;
+    std::ostream * _log;
+
+    // free buffers -> reader -> _readQueue -> workers -> _writeQueue -> writer -> free buffers
+    ChunkQueue _freeQueue, _readQueue, _writeQueue;
+
+    QMutex _errorMutex;
+    CubeError _error;
+    bool _failed;
+};
+
+// copies whole input files straight to their final offsets in the (preallocated) outputs,
+// several files at a time, each with its own pread/pwrite stream. This keeps more
+// requests in flight than the single stream of ConcatPipeline, which is what striped
+// storage and NFS need to get to their full speed.
+class ParallelFileCopy {
+public:
+    ParallelFileCopy( ChunkFilter * filter, BufferPool * pool);
+
+    // the data segment of info goes to output at outputOffset, the header of the output
+    // must already be flushed to the file
+    void addInput( const FitsInfo & info, QFile * output, qint64 outputOffset);
+
+    // number of files copied at the same time, it is also limited by the buffers in the pool
+    void setThreads( int count);
+    // without a filter, let the kernel copy the data (copy_file_range) if it can
+    void setZeroCopy( bool on);
+    // how the inputs are read and the outputs written
+    void setIoMode( IoMode mode);
+    // the files finish out of order, so a commit goes to the journal of the output
+    // whenever the files finished from its start on get longer
+    void setJournal( QFile * output, Journal * journal);
+    // computes the data sum of every output, see ConcatPipeline
+    void setChecksum( bool on);
+    void setDataSum( QFile * output, quint32 sum);
+    quint32 dataSum( QFile * output) const;
+    // see ConcatPipeline
+    void setMetrics( Metrics * metrics);
+    void setLog( std::ostream * log) { _log = log; }
+
+    // runs the copy to completion, throws QString on errors (CubeError when cancelled)
+    void run();
+
+    // used by the copy threads
+    void copyLoop();
+
+protected:
+    // busy is where the time of each MetricsStage is added up
+    void copyFile( int ind, char * & buff, CopyProgress & progress, qint64 * busy);
+    // the input ind is completely in its output, commits what can be
+    void fileDone( int ind);
+    void fail( const QString & msg);
+    void fail( const CubeError & error);
+    bool failed();
+
+    std::vector<FitsInfo> _fileInfo;
+    std::vector<QFile *> _outputs;
+    std::vector<qint64> _outputOffsets;
+    // the size of every input in the output, and whether it is there yet
+    std::vector<qint64> _outputSizes;
+    std::vector<bool> _finished;
+    std::map<QFile *, Journal *> _journals;
+    ChunkFilter * _filter;
+    BufferPool * _pool;
+    int _nThreads;
+    bool _zeroCopy;
+    IoMode _ioMode;
+    CopyProgress * _progress;
+    bool _checksum;
+    // data sum of each input at its place in the output, and of what was there before
+    std::vector<quint32> _fileSums;
+    std::map<QFile *, quint32> _baseSums;
+    Metrics * _metrics;
+    std::ostream * _log;
+
+    // next file to be picked up by a thread
+    QMutex _mutex;
+    size_t _next;
+    CubeError _error;
+    bool _failed;
+    // the finished files and the journals, kept apart from _mutex so the syncs do not hold
+    // up the threads picking the next file
+    QMutex _commitMutex;
+};
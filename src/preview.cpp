@@ -0,0 +1,249 @@
+/*
+ *   Copyright 2013 Pavol Federl (federl@gmail.com)
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ *
+ */
+
+#include <cstdlib>
+#include <limits>
+
+#include "preview.h"
+#include "fitspixel.h"
+
+using namespace std;
+
+const int PreviewPyramid::LevelCount;
+const int PreviewPyramid::Levels[ PreviewPyramid::LevelCount] = { 2, 4, 8 };
+
+// the finite values of one row [x0..x1) go into the 2x2 cells of that row
+typedef void (* RowAdder)( const uchar * p, int x0, int x1, const PixelFormat & fmt,
+                           double * sum, quint32 * count);
+
+template <int Bitpix>
+static void addRow( const uchar * p, int x0, int x1, const PixelFormat & fmt,
+                    double * sum, quint32 * count)
+{
+    typedef FitsPixel<Bitpix> Pixel;
+    bool scaled = fmt.bscale != 1 || fmt.bzero != 0;
+    bool blank = Pixel::Integer && fmt.hasBlank;
+    double blankValue = double( fmt.blank);
+    for( int x = x0 ; x < x1 ; x ++, p += Pixel::Size) {
+        double v = Pixel::load( p);
+        if( blank && v == blankValue)
+            continue;
+        if( scaled)
+            v = fmt.bzero + fmt.bscale * v;
+        // NaN and infinities
+        if( ! (v - v == 0))
+            continue;
+        sum[ x >> 1] += v;
+        count[ x >> 1] ++;
+    }
+}
+
+static RowAdder pickRowAdder( int bitpix)
+{
+    switch( bitpix) {
+    case   8: return addRow<8>;
+    case  16: return addRow<16>;
+    case  32: return addRow<32>;
+    case  64: return addRow<64>;
+    case -32: return addRow<-32>;
+    case -64: return addRow<-64>;
+    }
+    throw QString( "Illegal value BITPIX = %1").arg( bitpix);
+}
+
+// Binning an axis by factor: the new pixel 1 covers the old pixels 1..factor, and the
+// reference pixel moves with it. The CD matrix, if there is one, is scaled like CDELT.
+static void binAxis( FitsHeader & header, int axis, int factor, int length)
+{
+    header.setIntValue( QString( "NAXIS%1").arg( axis), length);
+    QString key = QString( "CDELT%1").arg( axis);
+    if( header.findLine( key) >= 0)
+        header.setDoubleValue( key, header.doubleValue( key) * factor);
+    key = QString( "CRPIX%1").arg( axis);
+    if( header.findLine( key) >= 0)
+        header.setDoubleValue( key, (header.doubleValue( key) - 0.5) / factor + 0.5);
+    for( int i = 1 ; i <= 3 ; i ++ ) {
+        key = QString( "CD%1_%2").arg( i).arg( axis);
+        if( header.findLine( key) >= 0)
+            header.setDoubleValue( key, header.doubleValue( key) * factor);
+    }
+}
+
+PreviewPyramid::PreviewPyramid( const QString & output, const FitsHeader & header, int nx, int ny,
+                                int channels, int spectralBin)
+{
+    _nx = nx; _ny = ny; _channels = channels; _spectralBin = spectralBin;
+    _bins = (channels + spectralBin - 1) / spectralBin;
+    _cellsX = (nx + 1) / 2; _cellsY = (ny + 1) / 2;
+    _written = 0;
+    for( int i = 0 ; i < LevelCount ; i ++ )
+        _files[i] = 0;
+
+    for( int i = 0 ; i < LevelCount ; i ++ ) {
+        int f = Levels[i];
+        int ox = (nx + f - 1) / f, oy = (ny + f - 1) / f;
+        // averages, whatever the output is stored as
+        FitsHeader h = header;
+        h.setIntValue( "BITPIX", -32);
+        const char * drop[] = { "BSCALE", "BZERO", "BLANK", "DATAMIN", "DATAMAX", "CHECKSUM", "DATASUM" };
+        for( size_t k = 0 ; k < sizeof( drop) / sizeof( drop[0]) ; k ++ )
+            h.removeKey( drop[k]);
+        binAxis( h, 1, f, ox);
+        binAxis( h, 2, f, oy);
+        binAxis( h, 3, spectralBin, _bins);
+
+        QString name = fileName( output, f);
+        _files[i] = new QFile( name);
+        if( ! _files[i]-> open( QFile::WriteOnly | QFile::Truncate) || ! h.write( * _files[i]))
+            throw QString( "Cannot write the preview %1").arg( name);
+        _dataStart[i] = _files[i]-> pos();
+        // the planes are written where they belong as the bins fill up, the padding is there
+        qint64 size = qint64( ox) * oy * _bins * 4;
+        if( ! _files[i]-> resize( _dataStart[i] + (size + 2879) / 2880 * 2880))
+            throw QString( "Could not resize %1").arg( name);
+    }
+}
+
+PreviewPyramid::~PreviewPyramid()
+{
+    for( int i = 0 ; i < LevelCount ; i ++ )
+        delete _files[i];
+    for( map<int, Bin *>::iterator it = _open.begin() ; it != _open.end() ; ++ it)
+        delete it-> second;
+}
+
+QString PreviewPyramid::fileName( const QString & output, int factor)
+{
+    QString base = output;
+    if( base.endsWith( ".fits", Qt::CaseInsensitive))
+        base.chop( 5);
+    return QString( "%1.preview%2.fits").arg( base).arg( factor);
+}
+
+void PreviewPyramid::add( const char * data, qint64 n, const PixelFormat & fmt, int channel0, qint64 firstPixel)
+{
+    int pixelSize = abs( fmt.bitpix) / 8;
+    RowAdder adder = pickRowAdder( fmt.bitpix);
+    qint64 planePixels = qint64( _nx) * _ny;
+    qint64 count = n / pixelSize;
+    const uchar * p = (const uchar *) data;
+    qint64 pixel = firstPixel;
+    // the part of each plane is summed up on its own first, only the merge is done under the lock
+    vector<double> sums;
+    vector<quint32> counts;
+    while( count > 0) {
+        qint64 z = pixel / planePixels;
+        qint64 start = pixel - z * planePixels;
+        qint64 m = qMin( count, planePixels - start);
+        int channel = channel0 + int( z);
+        if( channel < 0 || channel >= _channels)
+            throw QString( "Preview of channel %1 of a cube with %2").arg( channel).arg( _channels);
+        int row0 = int( start / _nx) / 2, row1 = int( (start + m - 1) / _nx) / 2 + 1;
+        sums.assign( size_t( row1 - row0) * _cellsX, 0);
+        counts.assign( sums.size(), 0);
+        for( qint64 i = start ; i < start + m ; ) {
+            int y = int( i / _nx), x0 = int( i % _nx);
+            int x1 = int( qMin( qint64( _nx), x0 + (start + m - i)));
+            size_t cell = size_t( y / 2 - row0) * _cellsX;
+            adder( p + (i - start) * pixelSize, x0, x1, fmt, & sums[ cell], & counts[ cell]);
+            i += x1 - x0;
+        }
+        merge( channel / _spectralBin, m, row0, row1, & sums[0], & counts[0]);
+        p += m * pixelSize;
+        pixel += m;
+        count -= m;
+    }
+}
+
+void PreviewPyramid::merge( int bin, qint64 values, int row0, int row1, const double * sum, const quint32 * count)
+{
+    Bin * b;
+    {
+        QMutexLocker locker( & _mutex);
+        map<int, Bin *>::iterator it = _open.find( bin);
+        if( it == _open.end()) {
+            b = new Bin;
+            b-> sum.resize( size_t( _cellsX) * _cellsY, 0);
+            b-> count.resize( b-> sum.size(), 0);
+            b-> received = 0;
+            _open[ bin] = b;
+        }
+        else
+            b = it-> second;
+        size_t offset = size_t( row0) * _cellsX, cells = size_t( row1 - row0) * _cellsX;
+        for( size_t i = 0 ; i < cells ; i ++ ) {
+            b-> sum[ offset + i] += sum[i];
+            b-> count[ offset + i] += count[i];
+        }
+        b-> received += values;
+        int planes = qMin( _spectralBin, _channels - bin * _spectralBin);
+        if( b-> received < qint64( planes) * _nx * _ny)
+            return;
+        // complete, nothing else will touch it
+        _open.erase( bin);
+        _written ++;
+    }
+    try {
+        writeBin( bin, * b);
+    } catch ( ... ) {
+        delete b;
+        throw;
+    }
+    delete b;
+}
+
+void PreviewPyramid::writeBin( int bin, const Bin & b)
+{
+    const double nan = numeric_limits<double>::quiet_NaN();
+    vector<uchar> plane;
+    for( int i = 0 ; i < LevelCount ; i ++ ) {
+        int f = Levels[i], k = f / 2;
+        int ox = (_nx + f - 1) / f, oy = (_ny + f - 1) / f;
+        plane.resize( size_t( ox) * oy * 4);
+        uchar * o = & plane[0];
+        for( int y = 0 ; y < oy ; y ++ ) {
+            int cy1 = qMin( (y + 1) * k, _cellsY);
+            for( int x = 0 ; x < ox ; x ++, o += 4) {
+                int cx1 = qMin( (x + 1) * k, _cellsX);
+                double s = 0; qint64 c = 0;
+                for( int cy = y * k ; cy < cy1 ; cy ++ ) {
+                    for( int cx = x * k ; cx < cx1 ; cx ++ ) {
+                        s += b.sum[ size_t( cy) * _cellsX + cx];
+                        c += b.count[ size_t( cy) * _cellsX + cx];
+                    }
+                }
+                FitsPixel<-32>::store( c ? s / c : nan, o, 0);
+            }
+        }
+        QMutexLocker locker( & _fileMutex);
+        QFile & file = * _files[i];
+        if( ! file.seek( _dataStart[i] + qint64( bin) * plane.size())
+                || ! blockWrite( file, (const char *) & plane[0], plane.size()))
+            throw QString( "Could not write to %1").arg( file.fileName());
+    }
+}
+
+void PreviewPyramid::finish()
+{
+    if( _written != _bins)
+        throw QString( "The previews are missing %1 of %2 planes").arg( _bins - _written).arg( _bins);
+    for( int i = 0 ; i < LevelCount ; i ++ ) {
+        if( ! _files[i]-> flush())
+            throw QString( "Could not write to %1").arg( _files[i]-> fileName());
+        _files[i]-> close();
+    }
+}
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <map>
+#include <vector>
+#include <QFile>
+#include <QMutex>
+#include <QString>
+
+#include "convert.h"
+#include "fitsheader.h"
+
+// Quick-look versions of a cube, binned 2x2, 4x4 and 8x8 in space and by a number of
+// channels in frequency, each written to its own FITS file next to the output. They are
+// built from the chunks of data while they go through the combine; the chunks can come in
+// any order and from several threads at once.
+//
+// The values are averaged without the NaNs, a pixel with no finite values is NaN. A spectral
+// bin is summed up 2x2 binned, the bigger levels are made from those sums, and it is written
+// out and dropped as soon as all of its planes went by. So only the bins the chunks in
+// flight fall into are in memory, at 3 bytes per pixel of one plane each.
+class PreviewPyramid {
+public:
+    // header is the header of the output (normal layout), the previews get a copy of it
+    // with the axes and the WCS scaled
+    PreviewPyramid( const QString & output, const FitsHeader & header, int nx, int ny,
+                    int channels, int spectralBin);
+    ~PreviewPyramid();
+
+    // Adds n bytes of values in the format fmt. channel0 is the channel of the first plane of
+    // the input they come from and firstPixel the index of the first value in the input.
+    void add( const char * data, qint64 n, const PixelFormat & fmt, int channel0, qint64 firstPixel);
+
+    // pads and closes the files, all the planes must have been added
+    void finish();
+
+    // the file with the level binned factor x factor
+    static QString fileName( const QString & output, int factor);
+
+    static const int LevelCount = 3;
+    static const int Levels[ LevelCount];
+
+protected:
+    // the sums of one spectral bin, 2x2 binned
+    struct Bin {
+        std::vector<double> sum;
+        std::vector<quint32> count;
+        // values added so far, including the NaNs
+        qint64 received;
+    };
+    // adds the local sums of rows [row0..row1) of 2x2 cells to a bin, and writes the bin out
+    // if that was the last of it
+    void merge( int bin, qint64 values, int row0, int row1, const double * sum, const quint32 * count);
+    void writeBin( int bin, const Bin & b);
+
+    int _nx, _ny, _channels, _spectralBin, _bins;
+    // size of the 2x2 binned planes
+    int _cellsX, _cellsY;
+    QFile * _files[ LevelCount];
+    qint64 _dataStart[ LevelCount];
+    QMutex _mutex;
+    std::map<int, Bin *> _open;
+    int _written;
+    // only one thread writes to the files at a time
+    QMutex _fileMutex;
+};
@@ -0,0 +1,245 @@
+/*
+ *   Copyright 2013 Pavol Federl (federl@gmail.com)
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ *
+ */
+
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <limits>
+
+#include <QFile>
+#include <QStringList>
+
+#include "stats.h"
+#include "fitspixel.h"
+
+using namespace std;
+
+const int CubeStatistics::HistogramBins;
+
+// The bin of a value is made from the bits of the value as a float, turned around so that
+// they sort like the values do, and cut down to the sign, the exponent and the top 4 bits
+// of the mantissa.
+static inline int histogramBin( double v)
+{
+    float f = float( v);
+    quint32 bits; memcpy( & bits, & f, 4);
+    bits = (bits & 0x80000000u) ? ~ bits : bits | 0x80000000u;
+    return int( bits >> 19);
+}
+
+// the smallest value that goes into a bin
+static double binStart( int bin)
+{
+    quint32 bits = quint32( bin) << 19;
+    bits = (bits & 0x80000000u) ? bits & 0x7fffffffu : ~ bits;
+    float f; memcpy( & f, & bits, 4);
+    return f;
+}
+
+void CubeStatistics::Plane::merge( const Plane & other)
+{
+    nans += other.nans;
+    if( other.count == 0)
+        return;
+    if( count == 0) {
+        qint64 n = nans;
+        * this = other;
+        nans = n;
+        return;
+    }
+    double n = double( count) + other.count;
+    double delta = other.mean - mean;
+    mean += delta * other.count / n;
+    m2 += other.m2 + delta * delta * (double( count) * other.count / n);
+    if( other.min < min) min = other.min;
+    if( other.max > max) max = other.max;
+    count += other.count;
+}
+
+// the values of a run of raw data, BLANKs become NaN
+template <int Bitpix>
+struct RawValues {
+    typedef FitsPixel<Bitpix> Pixel;
+    const uchar * p;
+    const PixelFormat & fmt;
+    bool scaled, blank;
+    double blankValue;
+    RawValues( const uchar * data, const PixelFormat & format) : p( data), fmt( format) {
+        scaled = fmt.bscale != 1 || fmt.bzero != 0;
+        blank = Pixel::Integer && fmt.hasBlank;
+        blankValue = double( fmt.blank);
+    }
+    double operator[]( qint64 i) const {
+        double v = Pixel::load( p + i * Pixel::Size);
+        if( blank && v == blankValue)
+            return numeric_limits<double>::quiet_NaN();
+        return scaled ? fmt.bzero + fmt.bscale * v : v;
+    }
+};
+
+// One run of values, all from the same plane. The sums are of the differences from the first
+// value, so that a big offset does not eat up the precision of the rms.
+template <class Values>
+static CubeStatistics::Plane accumulate( const Values & values, qint64 n, quint32 * histogram)
+{
+    double min = numeric_limits<double>::infinity(), max = - min;
+    double shift = 0, sum = 0, sumSq = 0;
+    qint64 count = 0, nans = 0;
+    for( qint64 i = 0 ; i < n ; i ++ ) {
+        double v = values[i];
+        // BLANKs, NaN and infinities
+        if( ! (v - v == 0)) {
+            nans ++;
+            continue;
+        }
+        if( count == 0) shift = v;
+        if( v < min) min = v;
+        if( v > max) max = v;
+        double d = v - shift;
+        sum += d;
+        sumSq += d * d;
+        count ++;
+        histogram[ histogramBin( v)] ++;
+    }
+    CubeStatistics::Plane plane;
+    plane.count = count;
+    plane.nans = nans;
+    if( count > 0) {
+        plane.min = min;
+        plane.max = max;
+        plane.mean = shift + sum / count;
+        plane.m2 = qMax( 0.0, sumSq - sum * sum / count);
+    }
+    return plane;
+}
+
+CubeStatistics::CubeStatistics( int channels)
+{
+    _planes.resize( channels);
+    _frequencies.resize( channels, 0);
+    _histogram.resize( HistogramBins, 0);
+}
+
+void CubeStatistics::setFrequency( int channel, double frequency)
+{
+    _frequencies[ channel] = frequency;
+}
+
+void CubeStatistics::add( const char * data, qint64 n, const PixelFormat & fmt, int channel0,
+                          qint64 planePixels, qint64 firstPixel)
+{
+    int pixelSize = abs( fmt.bitpix) / 8;
+    qint64 count = n / pixelSize;
+    // the chunk is summed up on its own first, only the merge is done under the lock
+    vector<quint32> histogram( HistogramBins, 0);
+    vector<pair<int, Plane> > parts;
+    const uchar * p = (const uchar *) data;
+    qint64 pixel = firstPixel;
+    while( count > 0) {
+        qint64 z = pixel / planePixels;
+        qint64 m = qMin( count, (z + 1) * planePixels - pixel);
+        Plane part;
+        switch( fmt.bitpix) {
+        case   8: part = accumulate( RawValues<8>( p, fmt), m, & histogram[0]); break;
+        case  16: part = accumulate( RawValues<16>( p, fmt), m, & histogram[0]); break;
+        case  32: part = accumulate( RawValues<32>( p, fmt), m, & histogram[0]); break;
+        case -32: part = accumulate( RawValues<-32>( p, fmt), m, & histogram[0]); break;
+        case -64: part = accumulate( RawValues<-64>( p, fmt), m, & histogram[0]); break;
+        default: throw QString( "Illegal value BITPIX = %1").arg( fmt.bitpix);
+        }
+        int channel = channel0 + int( z);
+        if( channel < 0 || channel >= int( _planes.size()))
+            throw QString( "Statistics for channel %1 of a cube with %2").arg( channel).arg( _planes.size());
+        parts.push_back( make_pair( channel, part));
+        p += m * pixelSize;
+        pixel += m;
+        count -= m;
+    }
+    QMutexLocker locker( & _mutex);
+    for( size_t i = 0 ; i < parts.size() ; i ++ )
+        _planes[ parts[i].first].merge( parts[i].second);
+    for( int i = 0 ; i < HistogramBins ; i ++ )
+        _histogram[i] += histogram[i];
+}
+
+void CubeStatistics::addValues( int channel, const double * values, qint64 n)
+{
+    if( channel < 0 || channel >= int( _planes.size()))
+        throw QString( "Statistics for channel %1 of a cube with %2").arg( channel).arg( _planes.size());
+    vector<quint32> histogram( HistogramBins, 0);
+    Plane part = accumulate( values, n, & histogram[0]);
+    QMutexLocker locker( & _mutex);
+    _planes[ channel].merge( part);
+    for( int i = 0 ; i < HistogramBins ; i ++ )
+        _histogram[i] += histogram[i];
+}
+
+bool CubeStatistics::range( double & min, double & max) const
+{
+    QMutexLocker locker( & _mutex);
+    bool found = false;
+    for( size_t i = 0 ; i < _planes.size() ; i ++ ) {
+        const Plane & plane = _planes[i];
+        if( plane.count == 0)
+            continue;
+        if( ! found || plane.min < min) min = plane.min;
+        if( ! found || plane.max > max) max = plane.max;
+        found = true;
+    }
+    return found;
+}
+
+QString CubeStatistics::fileName( const QString & output)
+{
+    return output + ".stats";
+}
+
+static QString number( double v)
+{
+    return QString::number( v, 'g', 10);
+}
+
+void CubeStatistics::write( const QString & fileName, const QString & title) const
+{
+    QMutexLocker locker( & _mutex);
+    QStringList lines;
+    lines << QString( "# plane statistics of %1").arg( title);
+    lines << "# channel frequency count nan min max mean rms";
+    for( size_t i = 0 ; i < _planes.size() ; i ++ ) {
+        const Plane & plane = _planes[i];
+        QString line = QString( "%1 %2 %3 %4").arg( i).arg( QString::number( _frequencies[i], 'g', 15))
+                .arg( plane.count).arg( plane.nans);
+        if( plane.count > 0)
+            line += QString( " %1 %2 %3 %4").arg( number( plane.min)).arg( number( plane.max))
+                    .arg( number( plane.mean)).arg( number( sqrt( plane.m2 / plane.count)));
+        else
+            line += " nan nan nan nan";
+        lines << line;
+    }
+    lines << "# histogram of all values: from to count";
+    for( int i = 0 ; i < HistogramBins ; i ++ ) {
+        if( _histogram[i] == 0)
+            continue;
+        lines << QString( "%1 %2 %3").arg( number( binStart( i))).arg( number( binStart( i + 1)))
+                 .arg( _histogram[i]);
+    }
+
+    QFile f( fileName);
+    QByteArray data = (lines.join( "\n") + "\n").toLocal8Bit();
+    if( ! f.open( QFile::WriteOnly | QFile::Truncate) || f.write( data) != data.size())
+        throw QString( "Could not write the statistics to %1").arg( fileName);
+}
@@ -0,0 +1,56 @@
+#pragma once
+
+#include <vector>
+#include <QMutex>
+#include <QString>
+
+#include "convert.h"
+
+// Statistics of every plane of a cube (count, NaNs, min, max, mean, rms) and a histogram of
+// all its values, collected from the chunks of data while they go through the combine, so
+// they do not need another read of the output. The chunks can come in any order and from
+// several threads at once.
+//
+// The histogram has 16 bins per octave on both sides of zero. That covers any value with a
+// resolution of a few percent, which is enough for picking the scaling of a viewer.
+class CubeStatistics {
+public:
+    CubeStatistics( int channels);
+
+    // frequency of a channel, for the table
+    void setFrequency( int channel, double frequency);
+
+    // Adds n bytes of values in the format fmt. channel0 is the channel of the first plane of
+    // the input they come from, planePixels the size of its planes and firstPixel the index
+    // of the first value in the input.
+    void add( const char * data, qint64 n, const PixelFormat & fmt, int channel0,
+              qint64 planePixels, qint64 firstPixel);
+
+    // n physical values of one channel (NaN for the undefined ones)
+    void addValues( int channel, const double * values, qint64 n);
+
+    // smallest and biggest finite value, false if there are none
+    bool range( double & min, double & max) const;
+
+    // the table (one line per channel) followed by the non-empty bins of the histogram
+    void write( const QString & fileName, const QString & title) const;
+    // sidecar file of an output
+    static QString fileName( const QString & output);
+
+    // running sums of one plane; the mean and the sum of the squared differences from it
+    // merge without losing precision
+    struct Plane {
+        qint64 count, nans;
+        double min, max, mean, m2;
+        Plane() { count = nans = 0; min = max = mean = m2 = 0; }
+        void merge( const Plane & other);
+    };
+
+    static const int HistogramBins = 8192;
+
+protected:
+    mutable QMutex _mutex;
+    std::vector<Plane> _planes;
+    std::vector<double> _frequencies;
+    std::vector<quint64> _histogram;
+};
@@ -0,0 +1,676 @@
+/*
+ *   Copyright 2013 Pavol Federl (federl@gmail.com)
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ *
+ */
+
+#include <iostream>
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+
+#include <QtEndian>
+#include <QThread>
+#include <QRunnable>
+#include <QSemaphore>
+
+#include "tilecompress.h"
+#include "checksum.h"
+
+using namespace std;
+
+// Rice coding works on blocks of this many pixels
+static const int RiceBlock = 32;
+// quantised value of the NaNs, it goes into ZBLANK
+static const qint32 NullValue = -2147483647;
+// number of quantisation levels a tile may use at most
+static const double MaxLevels = 1073741824.0;
+
+FitsHeader compressedPrimaryHeader()
+{
+    FitsHeader header;
+    header.setLogicalValue( "SIMPLE", true, "file does conform to FITS standard");
+    header.setIntValue( "BITPIX", 8, "number of bits per data pixel");
+    header.setIntValue( "NAXIS", 0, "number of data axes");
+    header.setLogicalValue( "EXTEND", true, "FITS dataset may contain extensions");
+    header.addRaw( "END");
+    return header;
+}
+
+// the cards that describe the structure of the image, the table has its own
+static bool isStructuralKey( const QString & key)
+{
+    return key == "SIMPLE" || key == "BITPIX" || key == "NAXIS" || key.startsWith( "NAXIS")
+            || key == "EXTEND" || key == "XTENSION" || key == "PCOUNT" || key == "GCOUNT"
+            || key == "EXTNAME" || key == "CHECKSUM" || key == "DATASUM";
+}
+
+FitsHeader compressedImageHeader( const FitsHeader & image, int tilePlanes, int ditherSeed)
+{
+    int bitpix = image.intValue( "BITPIX");
+    if( bitpix == 64)
+        throw QString( "RICE_1 cannot compress BITPIX = 64");
+    bool quantized = bitpix < 0;
+    int naxis = image.intValue( "NAXIS");
+    if( naxis < 3)
+        throw QString( "Cannot compress a cube with NAXIS = %1").arg( naxis);
+    int planes = image.intValue( "NAXIS3");
+    for( int i = 4 ; i <= naxis ; i ++ )
+        planes *= image.intValue( QString( "NAXIS%1").arg( i));
+    int tiles = (planes + tilePlanes - 1) / tilePlanes;
+
+    FitsHeader header;
+    header.setStringValue( "XTENSION", "BINTABLE", "binary table extension");
+    header.setIntValue( "BITPIX", 8, "8-bit bytes");
+    header.setIntValue( "NAXIS", 2, "2-dimensional binary table");
+    header.setIntValue( "NAXIS1", quantized ? 32 : 16, "width of table in bytes");
+    header.setIntValue( "NAXIS2", tiles, "number of rows in table");
+    header.setIntValue( "PCOUNT", 0, "size of special data area");
+    header.setIntValue( "GCOUNT", 1, "one data group (required keyword)");
+    header.setIntValue( "TFIELDS", quantized ? 3 : 1, "number of fields in each row");
+    header.setStringValue( "TTYPE1", "COMPRESSED_DATA", "label for field 1");
+    header.setStringValue( "TFORM1", "1QB(0)", "data format of field: variable length array");
+    if( quantized) {
+        header.setStringValue( "TTYPE2", "ZSCALE", "label for field 2");
+        header.setStringValue( "TFORM2", "1D", "data format of field: 8-byte DOUBLE");
+        header.setStringValue( "TTYPE3", "ZZERO", "label for field 3");
+        header.setStringValue( "TFORM3", "1D", "data format of field: 8-byte DOUBLE");
+    }
+    header.setLogicalValue( "ZIMAGE", true, "extension contains compressed image");
+    header.setLogicalValue( "ZSIMPLE", true, "file does conform to FITS standard");
+    header.setIntValue( "ZBITPIX", bitpix, "data type of original image");
+    header.setIntValue( "ZNAXIS", naxis, "dimension of original image");
+    for( int i = 1 ; i <= naxis ; i ++ ) {
+        QString axis = QString( "NAXIS%1").arg( i);
+        header.setIntValue( "Z" + axis, image.intValue( axis), "length of original image axis");
+    }
+    for( int i = 1 ; i <= naxis ; i ++ ) {
+        int tile = i < 3 ? image.intValue( QString( "NAXIS%1").arg( i)) : i == 3 ? tilePlanes : 1;
+        header.setIntValue( QString( "ZTILE%1").arg( i), tile, "size of tiles to be compressed");
+    }
+    header.setStringValue( "ZCMPTYPE", "RICE_1", "compression algorithm");
+    header.setStringValue( "ZNAME1", "BLOCKSIZE", "compression block size");
+    header.setIntValue( "ZVAL1", RiceBlock, "pixels per block");
+    header.setStringValue( "ZNAME2", "BYTEPIX", "bytes per pixel (1, 2, 4, or 8)");
+    header.setIntValue( "ZVAL2", quantized ? 4 : bitpix / 8, "bytes per pixel (1, 2, 4, or 8)");
+    if( quantized) {
+        header.setStringValue( "ZQUANTIZ", "SUBTRACTIVE_DITHER_1", "Pixel Quantization Algorithm");
+        header.setIntValue( "ZDITHER0", ditherSeed, "dithering offset when quantizing floats");
+        header.setIntValue( "ZBLANK", NullValue, "null value in the compressed integer array");
+    }
+    header.setStringValue( "EXTNAME", "COMPRESSED_IMAGE", "name of this binary table extension");
+
+    // everything else describes the image and goes along as it is
+    const vector<FitsLine> & lines = image.lines();
+    for( size_t i = 0 ; i < lines.size() ; i ++ ) {
+        QString key = lines[i].key().trimmed();
+        if( isStructuralKey( key) || (quantized && key == "BLANK"))
+            continue;
+        header.addRaw( lines[i].raw());
+    }
+    return header;
+}
+
+// The dither offsets, the same pseudo random sequence as cfitsio (a Park-Miller generator
+// seeded with 1), so that funpack can subtract them again.
+static const int RandomCount = 10000;
+static float randomValues[RandomCount];
+
+static void initRandomValues()
+{
+    static bool done = false;
+    if( done) return;
+    double a = 16807.0, m = 2147483647.0, seed = 1;
+    for( int i = 0 ; i < RandomCount ; i ++ ) {
+        double temp = a * seed;
+        seed = temp - m * double( qint64( temp / m));
+        randomValues[i] = float( seed / m);
+    }
+    if( qint64( seed) != 1043618065)
+        throw QString( "The dither sequence came out wrong, cannot quantise.");
+    done = true;
+}
+
+// writes a stream of bits, the most significant first, the way the Rice decoder reads them
+class BitWriter {
+public:
+    BitWriter( uchar * out) { _out = out; _acc = 0; _n = 0; }
+    // appends the lowest count (0..32) bits of value
+    void put( quint32 value, int count) {
+        quint32 mask = count == 32 ? 0xffffffffu : (1u << count) - 1;
+        _acc = (_acc << count) | (value & mask);
+        _n += count;
+        while( _n >= 8) {
+            _n -= 8;
+            * _out ++ = uchar( _acc >> _n);
+        }
+    }
+    void zeros( quint32 count) {
+        for( ; count > 24 ; count -= 24)
+            put( 0, 24);
+        put( 0, int( count));
+    }
+    // pads the last byte with zeros and returns the end of the output
+    uchar * finish() {
+        if( _n > 0)
+            * _out ++ = uchar( _acc << (8 - _n));
+        _n = 0;
+        return _out;
+    }
+protected:
+    uchar * _out;
+    quint64 _acc;
+    int _n;
+};
+
+// largest Rice code of n values, a block with a long unary part can be longer than raw
+static qint64 riceBound( qint64 n, int bytePix)
+{
+    return n * bytePix * 3 / 2 + (n / RiceBlock + 2) * 4 + 16;
+}
+
+// Rice codes n values of Bits bits each, exactly as cfitsio's fits_rcomp(): the first value
+// as it is, then for every block the differences of neighbours folded to unsigned, with
+// the number of low bits (fs) picked from their mean. Returns the number of bytes.
+template <int Bits>
+static qint64 riceEncode( const qint32 * values, qint64 n, uchar * out)
+{
+    const int fsBits = Bits == 8 ? 3 : Bits == 16 ? 4 : 5;
+    const int fsMax = Bits == 8 ? 6 : Bits == 16 ? 14 : 25;
+    const quint32 mask = Bits == 32 ? 0xffffffffu : (1u << Bits) - 1;
+    BitWriter bits( out);
+    if( n < 1)
+        return 0;
+    bits.put( quint32( values[0]), Bits);
+    quint32 last = quint32( values[0]);
+    quint32 diff[RiceBlock];
+    for( qint64 i = 0 ; i < n ; i += RiceBlock) {
+        int count = int( qMin( qint64( RiceBlock), n - i));
+        double sum = 0;
+        for( int j = 0 ; j < count ; j ++ ) {
+            quint32 v = quint32( values[i + j]);
+            // the difference wraps around at Bits bits, like in the decoder
+            quint32 d = (v - last) & mask;
+            qint32 sd = Bits == 32 ? qint32( d) : Bits == 16 ? qint32( qint16( d)) : qint32( qint8( d));
+            diff[j] = ((quint32( sd) << 1) ^ quint32( sd >> 31)) & mask;
+            sum += diff[j];
+            last = v;
+        }
+        double mean = (sum - count / 2 - 1) / count;
+        if( mean < 0) mean = 0;
+        quint32 psum = quint32( mean) >> 1;
+        int fs = 0;
+        for( ; psum > 0 ; fs ++ )
+            psum >>= 1;
+        if( fs >= fsMax) {
+            // high entropy, the differences go as they are
+            bits.put( fsMax + 1, fsBits);
+            for( int j = 0 ; j < count ; j ++ )
+                bits.put( diff[j], Bits);
+        } else if( fs == 0 && sum == 0) {
+            // all the differences are 0
+            bits.put( 0, fsBits);
+        } else {
+            bits.put( fs + 1, fsBits);
+            quint32 fsMask = (1u << fs) - 1;
+            for( int j = 0 ; j < count ; j ++ ) {
+                // the top bits in unary, then the fs low bits
+                bits.zeros( diff[j] >> fs);
+                bits.put( 1, 1);
+                if( fs > 0)
+                    bits.put( diff[j] & fsMask, fs);
+            }
+        }
+    }
+    return bits.finish() - out;
+}
+
+// what the encoders need to know about the cube
+struct TileFormat {
+    int bitpix;
+    qint64 rowLength; // pixels in an image row, the noise is measured along the rows
+    int ditherSeed;
+    double level;
+    int firstIndex; // fileIndex of the first input, for the filter
+};
+
+// The noise of a tile the way fpack estimates it (cfitsio's noise3): for every row the
+// median of |2 v[i] - v[i-2] - v[i+2]| over the good pixels, scaled to a sigma for gaussian
+// noise, and then the median over the rows. Returns 0 if there are not enough pixels.
+template <class T>
+static double tileNoise( const T * v, qint64 n, qint64 rowLength)
+{
+    vector<double> rowNoise, good, diffs;
+    for( qint64 r = 0 ; r + rowLength <= n ; r += rowLength) {
+        good.clear();
+        for( qint64 x = 0 ; x < rowLength ; x ++ )
+            if( std::isfinite( v[r + x]))
+                good.push_back( v[r + x]);
+        if( good.size() < 9)
+            continue;
+        diffs.clear();
+        for( size_t i = 2 ; i + 2 < good.size() ; i ++ )
+            diffs.push_back( fabs( 2 * good[i] - good[i - 2] - good[i + 2]));
+        nth_element( diffs.begin(), diffs.begin() + diffs.size() / 2, diffs.end());
+        rowNoise.push_back( 0.6052697 * diffs[ diffs.size() / 2]);
+    }
+    if( rowNoise.empty())
+        return 0;
+    nth_element( rowNoise.begin(), rowNoise.begin() + rowNoise.size() / 2, rowNoise.end());
+    return rowNoise[ rowNoise.size() / 2];
+}
+
+static qint32 nint( double x)
+{
+    return x >= 0 ? qint32( x + 0.5) : qint32( x - 0.5);
+}
+
+// Quantises the (host order) values of tile number 'tile' into out. The dither offsets
+// start at an index given by the tile number and ZDITHER0, as the decoder expects, and
+// NaNs become NullValue. Returns the step (ZSCALE) and zero point (ZZERO).
+template <class T>
+static void quantizeTile( const T * v, qint64 n, int tile, const TileFormat & format,
+                          qint32 * out, double & scale, double & zero)
+{
+    double minVal = 0, maxVal = 0;
+    qint64 good = 0;
+    for( qint64 i = 0 ; i < n ; i ++ ) {
+        if( ! std::isfinite( v[i])) continue;
+        if( good == 0 || v[i] < minVal) minVal = v[i];
+        if( good == 0 || v[i] > maxVal) maxVal = v[i];
+        good ++;
+    }
+    scale = 1; zero = 0;
+    if( good == 0) {
+        for( qint64 i = 0 ; i < n ; i ++ )
+            out[i] = NullValue;
+        return;
+    }
+    double delta = format.level > 0 ? tileNoise( v, n, format.rowLength) / format.level : - format.level;
+    double range = maxVal - minVal;
+    // a flat tile (or one without any measurable noise) gets a step fine enough to keep
+    // all the precision of the values, fpack would store it losslessly instead
+    if( delta <= 0 || range / delta > MaxLevels) {
+        if( range > 0) delta = range / MaxLevels;
+        else if( minVal != 0) delta = fabs( minVal) / 16777216.0;
+        else delta = 1;
+    }
+    // the zero point is a whole number of steps, so that repeated compressions agree
+    zero = double( qint64( minVal / delta + 0.5)) * delta;
+    scale = delta;
+    int seed = int( (tile + format.ditherSeed - 1) % RandomCount);
+    int next = int( randomValues[seed] * 500);
+    for( qint64 i = 0 ; i < n ; i ++ ) {
+        if( std::isfinite( v[i]))
+            out[i] = nint( (v[i] - zero) / delta + randomValues[next] - 0.5);
+        else
+            out[i] = NullValue;
+        if( ++ next == RandomCount) {
+            if( ++ seed == RandomCount) seed = 0;
+            next = int( randomValues[seed] * 500);
+        }
+    }
+}
+
+// where a part of a tile came from
+struct TilePiece {
+    const FitsInfo * info;
+    int input;
+    qint64 fileOffset; // of the piece in its input
+    qint64 offset, size; // of the piece in the tile
+};
+
+// one tile on its way from the reader through an encoder to the writer
+struct CompressSlot {
+    CompressSlot() { raw = data = 0; size = 0; tile = -1; encodedSize = 0; scale = 1; zero = 0; busy = false; }
+    char * raw;  // read buffer
+    char * data; // where in raw the big-endian values of the tile start
+    qint64 size;
+    vector<TilePiece> pieces;
+    int tile;
+    vector<qint32> values;
+    vector<uchar> encoded;
+    qint64 encodedSize;
+    double scale, zero;
+    CubeError error; // of the encoder, code None if it went well
+    bool busy; // queued to the encoders and not collected yet
+    QSemaphore done;
+};
+
+// filters, quantises and Rice codes one tile
+static void encodeTile( CompressSlot & s, const TileFormat & format, ChunkFilter * filter)
+{
+    if( filter) {
+        for( size_t i = 0 ; i < s.pieces.size() ; i ++ ) {
+            PipelineChunk chunk;
+            chunk.buffer = s.raw;
+            chunk.data = s.data + s.pieces[i].offset;
+            chunk.size = s.pieces[i].size;
+            chunk.fileIndex = format.firstIndex + s.pieces[i].input;
+            chunk.fileOffset = s.pieces[i].fileOffset;
+            filter-> process( chunk, * s.pieces[i].info);
+        }
+    }
+    int pixelSize = abs( format.bitpix) / 8;
+    qint64 n = s.size / pixelSize;
+    s.values.resize( n);
+    qint32 * values = & s.values[0];
+    uchar * p = (uchar *) s.data;
+    s.scale = 1; s.zero = 0;
+    switch( format.bitpix) {
+    case 8:
+        for( qint64 i = 0 ; i < n ; i ++ )
+            values[i] = p[i];
+        break;
+    case 16:
+        for( qint64 i = 0 ; i < n ; i ++ )
+            values[i] = qint16( qFromBigEndian<quint16>( p + 2 * i));
+        break;
+    case 32:
+        for( qint64 i = 0 ; i < n ; i ++ )
+            values[i] = qint32( qFromBigEndian<quint32>( p + 4 * i));
+        break;
+    case -32: {
+        // to host order in place, the raw values are not needed after this
+        float * v = (float *) p;
+        for( qint64 i = 0 ; i < n ; i ++ ) {
+            quint32 raw = qFromBigEndian<quint32>( p + 4 * i);
+            memcpy( v + i, & raw, 4);
+        }
+        quantizeTile( v, n, s.tile, format, values, s.scale, s.zero);
+        break;
+    }
+    case -64: {
+        double * v = (double *) p;
+        for( qint64 i = 0 ; i < n ; i ++ ) {
+            quint64 raw = qFromBigEndian<quint64>( p + 8 * i);
+            memcpy( v + i, & raw, 8);
+        }
+        quantizeTile( v, n, s.tile, format, values, s.scale, s.zero);
+        break;
+    }
+    default:
+        throw QString( "Cannot compress BITPIX = %1").arg( format.bitpix);
+    }
+    int bytePix = format.bitpix < 0 ? 4 : pixelSize;
+    s.encoded.resize( riceBound( n, bytePix));
+    switch( bytePix) {
+    case 1: s.encodedSize = riceEncode<8>( values, n, & s.encoded[0]); break;
+    case 2: s.encodedSize = riceEncode<16>( values, n, & s.encoded[0]); break;
+    default: s.encodedSize = riceEncode<32>( values, n, & s.encoded[0]); break;
+    }
+}
+
+struct EncodeTask : public QRunnable {
+    EncodeTask( CompressSlot * slot, const TileFormat * format, ChunkFilter * filter) {
+        _slot = slot; _format = format; _filter = filter;
+    }
+    void run() {
+        // nothing may leave the pool thread, the writer waits for done
+        try {
+            encodeTile( * _slot, * _format, _filter);
+        } catch ( const CubeError & e) {
+            _slot-> error = e;
+        } catch ( const QString & msg) {
+            _slot-> error = CubeError( CubeError::Failed, msg);
+        } catch ( const char * msg) {
+            _slot-> error = CubeError( CubeError::Failed, msg);
+        } catch ( ... ) {
+            _slot-> error = CubeError( CubeError::Failed, "Unknown error in the tile encoder.");
+        }
+        _slot-> done.release();
+    }
+    CompressSlot * _slot; const TileFormat * _format; ChunkFilter * _filter;
+};
+
+// the slots and readers of one run, released however the run ends; the encoders still
+// working on a slot are waited for first
+struct CompressBuffers {
+    CompressBuffers() { scratch = 0; }
+    ~CompressBuffers() {
+        for( size_t i = 0 ; i < slots.size() ; i ++ ) {
+            if( slots[i]-> busy)
+                slots[i]-> done.acquire();
+            freeIoBuffer( slots[i]-> raw);
+            delete slots[i];
+        }
+        freeIoBuffer( scratch);
+        for( size_t i = 0 ; i < readers.size() ; i ++ )
+            delete readers[i];
+    }
+    vector<CompressSlot *> slots;
+    char * scratch; // for tiles made of pieces of several inputs
+    vector<DataReader *> readers;
+};
+
+// a row of the table: the descriptor of the tile in the heap and its scaling
+struct TileRow {
+    qint64 count, offset;
+    double scale, zero;
+};
+
+TileCompressor::TileCompressor( ChunkFilter * filter, qint64 memory)
+{
+    _filter = filter;
+    _memory = memory;
+    _ioMode = IoBuffered;
+    _checksum = false;
+    _level = 4;
+    _firstIndex = 0;
+    _metrics = 0;
+    _log = & cerr;
+    _pool.setMaxThreadCount( QThread::idealThreadCount());
+    initRandomValues();
+}
+
+void TileCompressor::setIoMode( IoMode mode)
+{
+    _ioMode = mode;
+}
+
+void TileCompressor::setChecksum( bool on)
+{
+    _checksum = on;
+}
+
+void TileCompressor::setQuantizeLevel( double level)
+{
+    _level = level;
+}
+
+void TileCompressor::setMetrics( Metrics * metrics)
+{
+    _metrics = metrics;
+}
+
+quint32 TileCompressor::run( const vector<FitsInfo> & inputs, QFile * output, qint64 headerOffset,
+                             FitsHeader & header)
+{
+    const FitsInfo & first = inputs[0];
+    TileFormat format;
+    format.bitpix = first.bitpix;
+    format.rowLength = first.naxis1;
+    format.ditherSeed = header.intValue( "ZDITHER0", 1);
+    format.level = _level;
+    format.firstIndex = _firstIndex;
+    int pixelSize = abs( first.bitpix) / 8;
+    qint64 planeBytes = qint64( first.naxis1) * first.naxis2 * pixelSize;
+    int tilePlanes = header.intValue( "ZTILE3");
+    qint64 total = 0;
+    int planesLeft = 0;
+    for( size_t i = 0 ; i < inputs.size() ; i ++ ) {
+        total += inputs[i].dataSize;
+        planesLeft += inputs[i].naxis3;
+    }
+    int nTiles = header.intValue( "NAXIS2");
+    qint64 rowBytes = header.intValue( "NAXIS1");
+    if( nTiles != (planesLeft + tilePlanes - 1) / tilePlanes)
+        throw QString( "The compressed header of %1 does not match the inputs.").arg( output-> fileName());
+
+    // a tile in flight needs its read buffer, the quantised values and the Rice code
+    qint64 tileBytes = tilePlanes * planeBytes;
+    qint64 perSlot = tileBytes + tileBytes / pixelSize * 4 + riceBound( tileBytes / pixelSize, 4);
+    int nSlots = int( qMin( qint64( 2 * _pool.maxThreadCount()), _memory / perSlot));
+    if( nSlots < 2) {
+        nSlots = 2;
+        * _log << "--memory is too small for two tiles, using " << formatBytes( 2 * perSlot).toStdString() << "\n";
+    }
+    * _log << "Compressing " << nTiles << " tiles of " << tilePlanes << " planes with RICE_1, "
+           << nSlots << " at a time\n";
+
+    CompressBuffers buffers;
+    for( int i = 0 ; i < nSlots ; i ++ ) {
+        buffers.slots.push_back( new CompressSlot);
+        buffers.slots.back()-> raw = allocIoBuffer( tileBytes);
+        if( ! buffers.slots.back()-> raw)
+            throw QString( "Could not allocate the tile buffers.");
+    }
+    for( size_t i = 0 ; i < inputs.size() ; i ++ ) {
+        buffers.readers.push_back( new DataReader( inputs[i].fileName, _ioMode));
+        buffers.readers.back()-> setMetrics( _metrics);
+    }
+
+    if( ! output-> flush())
+        throw QString( "Failed to write to: %1").arg( output-> fileName());
+    // the table goes in front of the heap once all the rows are known
+    qint64 dataStart = output-> pos();
+    qint64 heapStart = dataStart + nTiles * rowBytes;
+    DataWriter writer( output-> fileName(), heapStart, _ioMode);
+    writer.setMetrics( _metrics);
+    vector<TileRow> rows( nTiles);
+    qint64 maxCount = 0;
+    quint32 heapSum = 0;
+    CopyProgress progress( total, * _log, _metrics);
+    // the main thread reads and writes, and waits for the encoders in between
+    qint64 readTime = 0, writeTime = 0, wait = 0;
+    size_t input = 0;
+    int plane = 0;
+    // tile t goes into slot t % nSlots, after the tile that was there is written out
+    for( int t = 0 ; t < nTiles + nSlots ; t ++ ) {
+        CompressSlot & s = * buffers.slots[ t % nSlots];
+        if( s.busy) {
+            qint64 t0 = _metrics ? Metrics::now() : 0;
+            s.done.acquire();
+            if( _metrics)
+                wait += Metrics::now() - t0;
+            s.busy = false;
+            if( s.error.code != CubeError::None)
+                s.error.rethrow();
+            TileRow & row = rows[ s.tile];
+            row.count = s.encodedSize;
+            row.offset = writer.position() - heapStart;
+            row.scale = s.scale;
+            row.zero = s.zero;
+            maxCount = qMax( maxCount, s.encodedSize);
+            const char * encoded = (const char *) & s.encoded[0];
+            if( _checksum)
+                heapSum = fitsSumAdd( heapSum, fitsSumAt( fitsDataSum( encoded, s.encodedSize),
+                                                          writer.position()));
+            qint64 t1 = _metrics ? Metrics::now() : 0;
+            writer.write( encoded, s.encodedSize);
+            if( _metrics)
+                writeTime += Metrics::now() - t1;
+            progress.add( s.size);
+        }
+        if( t >= nTiles)
+            continue;
+
+        // the planes of the tile, from one input or (at the ends of the inputs) from more
+        s.tile = t;
+        s.size = 0;
+        s.pieces.clear();
+        for( int n = qMin( tilePlanes, planesLeft) ; n > 0 ; ) {
+            const FitsInfo & info = inputs[input];
+            int count = qMin( n, info.naxis3 - plane);
+            TilePiece piece;
+            piece.info = & info;
+            piece.input = int( input);
+            piece.fileOffset = info.dataOffset + plane * planeBytes;
+            piece.offset = s.size;
+            piece.size = count * planeBytes;
+            s.pieces.push_back( piece);
+            s.size += piece.size;
+            n -= count;
+            planesLeft -= count;
+            plane += count;
+            if( plane == info.naxis3) {
+                input ++;
+                plane = 0;
+            }
+        }
+        qint64 t0 = _metrics ? Metrics::now() : 0;
+        if( s.pieces.size() == 1) {
+            const TilePiece & piece = s.pieces[0];
+            s.data = buffers.readers[ piece.input]-> read( s.raw, piece.fileOffset, piece.size);
+        } else {
+            // O_DIRECT reads cannot go to the middle of the tile, so they go through the scratch
+            if( ! buffers.scratch && ! (buffers.scratch = allocIoBuffer( tileBytes)))
+                throw QString( "Could not allocate the tile buffers.");
+            s.data = s.raw;
+            for( size_t i = 0 ; i < s.pieces.size() ; i ++ ) {
+                const TilePiece & piece = s.pieces[i];
+                const char * data = buffers.readers[ piece.input]-> read( buffers.scratch, piece.fileOffset, piece.size);
+                memcpy( s.data + piece.offset, data, piece.size);
+            }
+        }
+        if( _metrics) {
+            readTime += Metrics::now() - t0;
+            for( size_t i = 0 ; i < s.pieces.size() ; i ++ )
+                _metrics-> addFileBytes( s.pieces[i].info-> fileName, s.pieces[i].size, 0);
+        }
+        s.error = CubeError();
+        s.busy = true;
+        _pool.start( new EncodeTask( & s, & format, _filter));
+    }
+    writer.finish();
+    qint64 heapBytes = writer.position() - heapStart;
+    if( _metrics) {
+        _metrics-> addStage( StageRead, 1, readTime, 0);
+        _metrics-> addStage( StageWrite, 1, writeTime, wait);
+    }
+
+    // the table: a 64-bit descriptor (count, offset) of every tile, and its ZSCALE/ZZERO
+    QByteArray table( int( nTiles * rowBytes), 0);
+    for( int t = 0 ; t < nTiles ; t ++ ) {
+        uchar * p = (uchar *) table.data() + t * rowBytes;
+        qToBigEndian<quint64>( quint64( rows[t].count), p);
+        qToBigEndian<quint64>( quint64( rows[t].offset), p + 8);
+        if( rowBytes == 32) {
+            quint64 raw;
+            memcpy( & raw, & rows[t].scale, 8);
+            qToBigEndian<quint64>( raw, p + 16);
+            memcpy( & raw, & rows[t].zero, 8);
+            qToBigEndian<quint64>( raw, p + 24);
+        }
+    }
+    if( ! output-> seek( dataStart) || ! blockWrite( * output, table.constData(), table.size()))
+        throw QString( "Could not write the tile table of %1").arg( output-> fileName());
+    quint32 dataSum = _checksum ? fitsSumAdd( fitsDataSum( table.constData(), table.size()), heapSum) : 0;
+
+    header.setIntValue( "PCOUNT", heapBytes, "size of special data area");
+    header.setStringValue( "TFORM1", QString( "1QB(%1)").arg( maxCount),
+                           "data format of field: variable length array");
+    if( ! output-> seek( headerOffset) || ! header.write( * output))
+        throw QString( "Could not write the header of %1").arg( output-> fileName());
+    if( output-> pos() != dataStart)
+        throw QString( "The header of %1 changed size.").arg( output-> fileName());
+    if( ! output-> seek( heapStart + heapBytes))
+        throw QString( "Failed to seek in: %1").arg( output-> fileName());
+    * _log << "Compressed " << formatBytes( total).toStdString() << " to "
+           << formatBytes( heapBytes + table.size()).toStdString()
+           << QString( " (ratio %1)").arg( double( total) / (heapBytes + table.size()), 0, 'f', 2).toStdString()
+           << "\n";
+    return dataSum;
+}
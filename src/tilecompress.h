@@ -0,0 +1,64 @@
+#pragma once
+
+#include <vector>
+#include <QFile>
+#include <QThreadPool>
+
+#include "extractor.h"
+#include "pipeline.h"
+
+// Tile-compressed output, in the FITS tiled image convention that fpack/funpack and cfitsio
+// read. The file is an empty primary HDU followed by a binary table with one row per tile:
+// the row points at the Rice coded tile in the heap of the table. Integer cubes are coded
+// losslessly. Floating point cubes are quantised first (SUBTRACTIVE_DITHER_1), with a step
+// that is a fraction of the noise of every tile, as fpack does by default.
+
+// the empty primary header of a compressed file
+FitsHeader compressedPrimaryHeader();
+
+// The header of the binary table holding the image: the table cards, the Z cards describing
+// the image and its tiles (tilePlanes planes per tile) and the rest of the image's cards.
+// PCOUNT and TFORM1 are placeholders, TileCompressor::run() fills them in.
+FitsHeader compressedImageHeader( const FitsHeader & image, int tilePlanes, int ditherSeed);
+
+// Compresses the combined cube one tile at a time. The main thread reads the tiles in
+// order, a pool of threads filters and encodes them, and the main thread writes them into
+// the heap in order again as they come back, so the planes stream through once and all
+// the cores do the encoding. The table rows are written at the end, in front of the heap.
+class TileCompressor {
+public:
+    TileCompressor( ChunkFilter * filter, qint64 memory);
+    // how the inputs are read and the heap written
+    void setIoMode( IoMode mode);
+    // computes the data sum of the table and heap
+    void setChecksum( bool on);
+    // the number of inputs[0] in PipelineChunk::fileIndex, when the inputs of several
+    // outputs go through the same filter
+    void setFirstIndex( int index) { _firstIndex = index; }
+    // quantisation step for floating point data: noise / level for level > 0, and -level
+    // for level < 0 (the fpack -q convention)
+    void setQuantizeLevel( double level);
+    // the read and write times and the I/O latencies go here
+    void setMetrics( Metrics * metrics);
+    // where the progress is told, stderr by default
+    void setLog( std::ostream * log) { _log = log; }
+
+    // Compresses the inputs (sorted by frequency) into the output, after the table header
+    // from compressedImageHeader() that was written at headerOffset. The header is updated
+    // with the size of the heap and written again. Returns the data sum of the table and
+    // the heap and leaves the output positioned after the heap.
+    quint32 run( const std::vector<FitsInfo> & inputs, QFile * output, qint64 headerOffset,
+                 FitsHeader & header);
+
+protected:
+    ChunkFilter * _filter;
+    qint64 _memory;
+    IoMode _ioMode;
+    bool _checksum;
+    double _level;
+    int _firstIndex;
+    Metrics * _metrics;
+    std::ostream * _log;
+    // the encoders get their own threads, the filter may split its work on the global pool
+    QThreadPool _pool;
+};
@@ -0,0 +1,317 @@
+/*
+ *   Copyright 2013 Pavol Federl (federl@gmail.com)
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ *
+ */
+
+#include <iostream>
+#include <cstdlib>
+#include <cstring>
+
+#include <QThread>
+#include <QThreadPool>
+#include <QRunnable>
+#include <QSemaphore>
+#include <QRegExp>
+
+#include "transpose.h"
+#include "checksum.h"
+
+using namespace std;
+
+// the axis cards move with their axis: x -> 2, y -> 3, frequency -> 1
+static QString spectralMajorKey( const QString & key)
+{
+    QRegExp axisKey( "(NAXIS|CTYPE|CRVAL|CDELT|CRPIX|CUNIT|CROTA|CNAME|CRDER|CSYER)([123])");
+    QRegExp matrixKey( "(PC|CD)([123])_([123])");
+    if( axisKey.exactMatch( key))
+        return axisKey.cap( 1) + QString::number( axisKey.cap( 2).toInt() % 3 + 1);
+    if( matrixKey.exactMatch( key))
+        return matrixKey.cap( 1) + QString::number( matrixKey.cap( 2).toInt() % 3 + 1)
+                + "_" + QString::number( matrixKey.cap( 3).toInt() % 3 + 1);
+    return key;
+}
+
+FitsHeader spectralMajorHeader( const FitsHeader & header)
+{
+    FitsHeader res;
+    const vector<FitsLine> & lines = header.lines();
+    for( size_t i = 0 ; i < lines.size() ; i ++ ) {
+        QString raw = lines[i].raw();
+        QString key = lines[i].key().trimmed();
+        QString newKey = spectralMajorKey( key);
+        if( newKey != key)
+            raw = (newKey + "        ").left( 8) + raw.mid( 8);
+        res.addRaw( raw);
+    }
+    return res;
+}
+
+// Edge of the tiles the planes are transposed in: a tile writes into this many spectra of
+// the slab, whose cache lines stay around while a block of planes is scattered into them.
+static const int TilePixels = 64;
+// how many planes are read and transposed together
+static const int PlaneBlock = 64;
+
+// copies the pixels [pix0..pix1) of a block of planes into the slab, where the planes
+// become channels chan0, chan0+1, ... of the spectra that are 'channels' long
+template <class T>
+static void transposeTiles( const vector<const char *> & planes, qint64 pix0, qint64 pix1,
+                            char * slab, qint64 channels, qint64 chan0)
+{
+    T * out = (T *) slab;
+    for( qint64 p = pix0 ; p < pix1 ; p += TilePixels) {
+        qint64 pe = qMin( p + TilePixels, pix1);
+        for( size_t z = 0 ; z < planes.size() ; z ++ ) {
+            const T * in = (const T *) planes[z];
+            T * o = out + chan0 + z;
+            for( qint64 q = p ; q < pe ; q ++ )
+                o[ q * channels] = in[q];
+        }
+    }
+}
+
+// the values are only moved around, so the byte order does not matter, only the size
+static void transposeSlice( int pixelSize, const vector<const char *> & planes, qint64 pix0,
+                            qint64 pix1, char * slab, qint64 channels, qint64 chan0)
+{
+    switch( pixelSize) {
+    case 1: transposeTiles<quint8>( planes, pix0, pix1, slab, channels, chan0); break;
+    case 2: transposeTiles<quint16>( planes, pix0, pix1, slab, channels, chan0); break;
+    case 4: transposeTiles<quint32>( planes, pix0, pix1, slab, channels, chan0); break;
+    case 8: transposeTiles<quint64>( planes, pix0, pix1, slab, channels, chan0); break;
+    default: throw QString( "Cannot transpose pixels of %1 bytes").arg( pixelSize);
+    }
+}
+
+// one range of pixels, transposed on the global thread pool
+struct TransposeTask : public QRunnable {
+    TransposeTask( int pixelSize, const vector<const char *> * planes, qint64 pix0, qint64 pix1,
+                   char * slab, qint64 channels, qint64 chan0, QSemaphore * done) {
+        _pixelSize = pixelSize; _planes = planes; _pix0 = pix0; _pix1 = pix1;
+        _slab = slab; _channels = channels; _chan0 = chan0; _done = done;
+    }
+    void run() {
+        transposeSlice( _pixelSize, * _planes, _pix0, _pix1, _slab, _channels, _chan0);
+        _done-> release();
+    }
+    int _pixelSize; const vector<const char *> * _planes; qint64 _pix0, _pix1;
+    char * _slab; qint64 _channels, _chan0; QSemaphore * _done;
+};
+
+// blocks moving less than this are not worth splitting across the cores
+static const qint64 ParallelTransposeSize = 8 * 1024 * 1024;
+
+static void transposeBlock( int pixelSize, const vector<const char *> & planes, qint64 nPix,
+                            char * slab, qint64 channels, qint64 chan0)
+{
+    int nParts = QThread::idealThreadCount();
+    if( nPix * qint64( planes.size()) * pixelSize < ParallelTransposeSize || nParts < 2) {
+        transposeSlice( pixelSize, planes, 0, nPix, slab, channels, chan0);
+        return;
+    }
+    // whole tiles for everyone
+    qint64 step = (nPix / nParts + TilePixels - 1) / TilePixels * TilePixels;
+    QSemaphore done;
+    int queued = 0;
+    for( qint64 pos = step ; pos < nPix ; pos += step) {
+        QThreadPool::globalInstance()-> start( new TransposeTask(
+                    pixelSize, & planes, pos, qMin( pos + step, nPix), slab, channels, chan0, & done));
+        queued ++;
+    }
+    // the calling thread does the first range itself
+    transposeSlice( pixelSize, planes, 0, qMin( step, nPix), slab, channels, chan0);
+    done.acquire( queued);
+}
+
+SpectralTranspose::SpectralTranspose( ChunkFilter * filter, qint64 memory)
+{
+    _filter = filter;
+    _memory = memory;
+    _ioMode = IoBuffered;
+    _checksum = false;
+    _firstIndex = 0;
+    _metrics = 0;
+    _log = & cerr;
+}
+
+void SpectralTranspose::setIoMode( IoMode mode)
+{
+    _ioMode = mode;
+}
+
+void SpectralTranspose::setChecksum( bool on)
+{
+    _checksum = on;
+}
+
+void SpectralTranspose::setMetrics( Metrics * metrics)
+{
+    _metrics = metrics;
+}
+
+// the buffers and readers of one run, released however the run ends
+struct TransposeBuffers {
+    TransposeBuffers() { slab = planes = 0; }
+    ~TransposeBuffers() {
+        freeIoBuffer( slab);
+        freeIoBuffer( planes);
+        for( size_t i = 0 ; i < readers.size() ; i ++ )
+            delete readers[i];
+    }
+    char * slab, * planes;
+    vector<DataReader *> readers;
+};
+
+quint32 SpectralTranspose::run( const vector<FitsInfo> & inputs, QFile * output, Journal * journal,
+                                qint64 committed, quint32 dataSum)
+{
+    const FitsInfo & first = inputs[0];
+    int pixelSize = abs( first.bitpix) / 8;
+    qint64 width = first.naxis1, height = first.naxis2, channels = 0;
+    int maxPlanes = 0;
+    for( size_t i = 0 ; i < inputs.size() ; i ++ ) {
+        channels += inputs[i].naxis3;
+        maxPlanes = qMax( maxPlanes, inputs[i].naxis3);
+    }
+    qint64 rowBytes = width * channels * pixelSize;
+    if( committed % rowBytes != 0)
+        throw QString( "The journal of %1 does not end on a whole row, cannot resume.")
+            .arg( output-> fileName());
+
+    // every row of the slab needs its part of the output and of a block of planes
+    int block = qMin( PlaneBlock, maxPlanes);
+    qint64 perRow = rowBytes + block * width * pixelSize;
+    qint64 rows = qMin( height, _memory / perRow);
+    if( rows < 1) {
+        rows = 1;
+        * _log << "--memory is too small for one row, using " << formatBytes( perRow).toStdString() << "\n";
+    }
+    * _log << "Transposing to spectral-major order, " << rows << " rows at a time\n";
+
+    TransposeBuffers buffers;
+    qint64 planeBytes = rows * width * pixelSize;
+    // every plane is read into its own aligned region, for O_DIRECT
+    qint64 region = (planeBytes + IoAlignment - 1) / IoAlignment * IoAlignment + 2 * IoAlignment;
+    buffers.slab = allocIoBuffer( rows * rowBytes);
+    buffers.planes = allocIoBuffer( block * region);
+    if( ! buffers.slab || ! buffers.planes)
+        throw QString( "Could not allocate the transpose buffers.");
+    for( size_t i = 0 ; i < inputs.size() ; i ++ ) {
+        buffers.readers.push_back( new DataReader( inputs[i].fileName, _ioMode));
+        buffers.readers.back()-> setMetrics( _metrics);
+    }
+
+    if( ! output-> flush())
+        throw QString( "Failed to write to: %1").arg( output-> fileName());
+    DataWriter writer( output-> fileName(), output-> pos(), _ioMode);
+    writer.setMetrics( _metrics);
+    CopyProgress progress( (height - committed / rowBytes) * rowBytes, * _log, _metrics);
+    QElapsedTimer commitTimer; commitTimer.start();
+    // everything runs in this thread, one stage after the other; the transposing itself
+    // is what is left of the total
+    qint64 busy[ StageCount] = { 0 };
+    for( qint64 y0 = committed / rowBytes ; y0 < height ; y0 += rows) {
+        qint64 nRows = qMin( rows, height - y0);
+        qint64 nPix = nRows * width;
+        qint64 chan0 = 0;
+        for( size_t i = 0 ; i < inputs.size() ; i ++ ) {
+            const FitsInfo & info = inputs[i];
+            for( int z0 = 0 ; z0 < info.naxis3 ; z0 += block) {
+                int nPlanes = qMin( block, info.naxis3 - z0);
+                // the rows of the slab are one contiguous piece of every plane
+                vector<const char *> planes;
+                for( int z = 0 ; z < nPlanes ; z ++ ) {
+                    PipelineChunk chunk;
+                    chunk.buffer = buffers.planes + z * region;
+                    chunk.size = nPix * pixelSize;
+                    chunk.fileIndex = _firstIndex + int( i);
+                    chunk.fileOffset = info.dataOffset + ((z0 + z) * height + y0) * width * pixelSize;
+                    qint64 t0 = _metrics ? Metrics::now() : 0;
+                    chunk.data = buffers.readers[i]-> read( chunk.buffer, chunk.fileOffset, chunk.size);
+                    qint64 t1 = _metrics ? Metrics::now() : 0;
+                    if( _filter)
+                        _filter-> process( chunk, info);
+                    if( _metrics) {
+                        busy[ StageRead] += t1 - t0;
+                        busy[ StageFilter] += Metrics::now() - t1;
+                        _metrics-> addFileBytes( info.fileName, chunk.size, 0);
+                    }
+                    planes.push_back( chunk.data);
+                }
+                transposeBlock( pixelSize, planes, nPix, buffers.slab, channels, chan0 + z0);
+            }
+            chan0 += info.naxis3;
+        }
+        qint64 slabBytes = nPix * channels * pixelSize;
+        qint64 t0 = _metrics ? Metrics::now() : 0;
+        if( _checksum)
+            dataSum = fitsSumAdd( dataSum, fitsSumAt( fitsDataSum( buffers.slab, slabBytes),
+                                                      writer.position()));
+        qint64 t1 = _metrics ? Metrics::now() : 0;
+        writer.write( buffers.slab, slabBytes);
+        if( _metrics) {
+            if( _checksum)
+                busy[ StageChecksum] += t1 - t0;
+            busy[ StageWrite] += Metrics::now() - t1;
+        }
+        progress.add( slabBytes);
+        // the slabs are whole rows, so every commit is on a row
+        if( journal && commitTimer.elapsed() > CommitInterval) {
+            journal-> commit( writer.sync(), dataSum);
+            commitTimer.restart();
+        }
+    }
+    writer.finish();
+    if( journal)
+        journal-> commit( writer.sync(), dataSum);
+    for( int s = 0 ; _metrics && s < StageCount ; s ++ )
+        if( busy[s] > 0)
+            _metrics-> addStage( MetricsStage( s), 1, busy[s], 0);
+    if( ! output-> seek( writer.position()))
+        throw QString( "Failed to seek in: %1").arg( output-> fileName());
+    return dataSum;
+}
+
+// spectral axis types from the FITS WCS paper III
+static bool isSpectralType( const QString & ctype)
+{
+    // the value still has its quotes
+    QString t = fitsStringTrimmed( ctype).mid( 1, 4).toUpper();
+    return t == "FREQ" || t == "ENER" || t == "WAVN" || t == "VRAD" || t == "WAVE"
+            || t == "VOPT" || t == "ZOPT" || t == "AWAV" || t == "VELO" || t == "BETA"
+            || t == "FELO";
+}
+
+SpectrumReader::SpectrumReader( const QString & fileName)
+    : _cube( fileName)
+{
+    const FitsInfo & info = _cube.info();
+    _spectralMajor = isSpectralType( info.ctype1);
+    if( _spectralMajor) {
+        _channels = info.naxis1; _width = info.naxis2; _height = info.naxis3;
+    } else {
+        _width = info.naxis1; _height = info.naxis2; _channels = info.naxis3;
+    }
+}
+
+void SpectrumReader::read( int x, int y, vector<double> & spectrum)
+{
+    if( x < 0 || x >= _width || y < 0 || y >= _height)
+        throw QString( "Pixel %1,%2 is outside of %3").arg( x).arg( y).arg( _cube.info().fileName);
+    if( _spectralMajor)
+        _cube.readSubcube( 0, x, y, _channels, 1, 1, spectrum);
+    else
+        _cube.readSpectrum( x, y, spectrum);
+}
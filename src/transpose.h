@@ -0,0 +1,73 @@
+#pragma once
+
+#include <vector>
+#include <QFile>
+
+#include "extractor.h"
+#include "pipeline.h"
+#include "journal.h"
+#include "cubereader.h"
+
+// Spectral-major layout: the frequency axis is the fastest one, so the whole spectrum of a
+// pixel is one contiguous piece of the file. The cube is stored as NAXIS1 = channels,
+// NAXIS2 = the old NAXIS1 and NAXIS3 = the old NAXIS2, with the WCS cards moved along.
+
+// the header of the normal cube rearranged for the spectral-major layout
+FitsHeader spectralMajorHeader( const FitsHeader & header);
+
+// Writes the combined cube in the spectral-major layout with an out-of-core transpose. The
+// output is built in slabs of whole image rows: for every slab each input is read one
+// block of planes at a time (every plane of the slab is one contiguous read), and the
+// planes are transposed into the slab in tiles that fit in the cache. Full slabs are
+// written out in order, so the output is one sequential stream and the journal works as
+// for the normal layout. The slab and the plane buffers share the memory budget.
+class SpectralTranspose {
+public:
+    SpectralTranspose( ChunkFilter * filter, qint64 memory);
+    // how the inputs are read and the output written
+    void setIoMode( IoMode mode);
+    // computes the data sum of the output
+    void setChecksum( bool on);
+    // the number of inputs[0] in PipelineChunk::fileIndex, when the inputs of several
+    // outputs go through the same filter
+    void setFirstIndex( int index) { _firstIndex = index; }
+    // the stage times and I/O latencies go here
+    void setMetrics( Metrics * metrics);
+    // where the progress is told, stderr by default
+    void setLog( std::ostream * log) { _log = log; }
+
+    // Transposes the inputs (sorted by frequency) into the output, whose header has been
+    // written. When resuming, committed bytes of data are in the output already (whole
+    // rows, the slabs are committed whole) and dataSum is their sum. Returns the data sum
+    // of the whole data segment and leaves the output positioned after the data.
+    quint32 run( const std::vector<FitsInfo> & inputs, QFile * output, Journal * journal,
+                 qint64 committed, quint32 dataSum);
+
+protected:
+    ChunkFilter * _filter;
+    qint64 _memory;
+    IoMode _ioMode;
+    bool _checksum;
+    int _firstIndex;
+    Metrics * _metrics;
+    std::ostream * _log;
+};
+
+// Reads whole spectra (all the channels of one pixel) from a cube. From a spectral-major
+// cube that is one contiguous read, from a normal cube it is one value per plane, which
+// the block cache of the CubeReader keeps cheap for neighbouring pixels.
+class SpectrumReader {
+public:
+    SpectrumReader( const QString & fileName);
+    // is the first axis the spectral one?
+    bool isSpectralMajor() const { return _spectralMajor; }
+    int width() const { return _width; }
+    int height() const { return _height; }
+    int channels() const { return _channels; }
+    // the spectrum of pixel (x,y) with BZERO/BSCALE applied and BLANK turned into NaN
+    void read( int x, int y, std::vector<double> & spectrum);
+protected:
+    CubeReader _cube;
+    bool _spectralMajor;
+    int _width, _height, _channels;
+};
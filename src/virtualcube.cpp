@@ -0,0 +1,257 @@
+/*
+ *   Copyright 2013 Pavol Federl (federl@gmail.com)
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ *
+ */
+
+#include <iostream>
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QStringList>
+
+#include "virtualcube.h"
+
+using namespace std;
+
+static const char * VirtualMagic = "FitsCubeCombine virtual cube 1";
+
+static QString corrupted( const QString & fileName, int line)
+{
+    return QString( "The virtual cube %1 is corrupted (line %2).").arg( fileName).arg( line);
+}
+
+void writeVirtualCube( const QString & fileName, const FitsInfo & output,
+                       const vector<FitsInfo> & members, const CombineOptions & options)
+{
+    QStringList lines;
+    lines << VirtualMagic;
+    if( options.clip)
+        lines << QString( "clip %1 %2").arg( options.clipMin, 0, 'g', 17).arg( options.clipMax, 0, 'g', 17);
+    const vector<FitsLine> & cards = output.header.lines();
+    lines << QString( "header %1").arg( cards.size());
+    for( size_t i = 0 ; i < cards.size() ; i ++ ) {
+        QString card = cards[i].raw();
+        // the trailing spaces are put back by the reader
+        int n = card.size();
+        while( n > 0 && card[n - 1] == ' ') n --;
+        lines << card.left( n);
+    }
+    for( size_t i = 0 ; i < members.size() ; i ++ ) {
+        const FitsInfo & info = members[i];
+        lines << QString( "member %1 %2 %3 %4").arg( info.dataOffset).arg( info.dataSize)
+                 .arg( info.frameStart, 0, 'g', 17).arg( QFileInfo( info.fileName).absoluteFilePath());
+    }
+
+    QFile f( fileName);
+    QByteArray data = (lines.join( "\n") + "\n").toLocal8Bit();
+    if( ! f.open( QFile::WriteOnly | QFile::Truncate) || ! blockWrite( f, data.constData(), data.size())
+            || ! f.flush())
+        throw QString( "Cannot write the virtual cube %1").arg( fileName);
+    f.close();
+    combineLog( options) << "Wrote the virtual cube " << fileName.toStdString() << " of " << output.naxis3
+                         << " planes from " << members.size() << " inputs, "
+                         << formatBytes( output.dataSize).toStdString() << " of data left where it is.\n";
+}
+
+VirtualCubeReader::VirtualCubeReader( const QString & fileName, qint64 cacheSize, IoMode mode)
+{
+    _cacheSize = cacheSize;
+    _mode = mode;
+    _clip = false;
+    _clipMin = _clipMax = 0;
+
+    QFile f( fileName);
+    if( ! f.open( QFile::ReadOnly))
+        throw QString( "Cannot open the virtual cube %1.").arg( fileName);
+    QByteArray data = f.readAll();
+    f.close();
+    QStringList lines = QString::fromLocal8Bit( data.constData(), data.size()).split( "\n");
+    if( ! lines.isEmpty() && lines.last().isEmpty())
+        lines.removeLast();
+    if( lines.isEmpty() || lines[0] != VirtualMagic)
+        throw QString( "%1 is not a virtual cube.").arg( fileName);
+
+    int i = 1;
+    bool ok = true;
+    if( i < lines.size() && lines[i].startsWith( "clip ")) {
+        QStringList words = lines[i].split( " ");
+        ok = words.size() == 3;
+        _clipMin = ok ? words[1].toDouble( & ok) : 0;
+        _clipMax = ok ? words[2].toDouble( & ok) : 0;
+        if( ! ok)
+            throw corrupted( fileName, i + 1);
+        _clip = true;
+        i ++;
+    }
+    // the cards, padded back to 80 characters and whole blocks
+    int cards = 0;
+    ok = i < lines.size() && lines[i].startsWith( "header ");
+    if( ok)
+        cards = lines[i].mid( 7).toInt( & ok);
+    if( ! ok || cards < 1 || i + 1 + cards > lines.size())
+        throw corrupted( fileName, i + 1);
+    QByteArray raw;
+    for( int c = 0 ; c < cards ; c ++ )
+        raw += lines[i + 1 + c].leftJustified( 80, ' ', true).toLatin1();
+    raw += QByteArray( (2880 - raw.size() % 2880) % 2880, ' ');
+    FitsHeader header = FitsHeader::parse( raw.constData(), raw.size());
+    if( ! header.isValid())
+        throw QString( "Could not parse the header of the virtual cube %1").arg( fileName);
+    _info = parse( header, fileName);
+
+    for( i += 1 + cards ; i < lines.size() ; i ++ )
+        addMember( lines[i], i + 1);
+    if( _members.empty())
+        throw QString( "The virtual cube %1 has no members.").arg( fileName);
+    int planes = _z0.back() + _members.back().naxis3;
+    if( planes != _info.naxis3)
+        throw QString( "The members of the virtual cube %1 have %2 planes, its header says %3.")
+            .arg( fileName).arg( planes).arg( _info.naxis3);
+    _readers.assign( _members.size(), (CubeReader *) 0);
+    // the values were converted to the BITPIX of the header, and clipData() only clips
+    // floating point values
+    _toFloat = _info.bitpix == -32;
+    _clip = _clip && _info.bitpix < 0;
+}
+
+VirtualCubeReader::~VirtualCubeReader()
+{
+    for( size_t i = 0 ; i < _readers.size() ; i ++ )
+        delete _readers[i];
+}
+
+// The member's header is parsed again, the planes of the line have to be whole planes of
+// its data segment that start at the frequency the combine saw.
+void VirtualCubeReader::addMember( const QString & line, int number)
+{
+    QStringList words = line.split( " ");
+    bool ok = words.size() >= 5 && words[0] == "member";
+    qint64 offset = ok ? words[1].toLongLong( & ok) : 0;
+    qint64 size = ok ? words[2].toLongLong( & ok) : 0;
+    double frameStart = ok ? words[3].toDouble( & ok) : 0;
+    if( ! ok)
+        throw corrupted( _info.fileName, number);
+    // the path may have spaces in it
+    QString name = QStringList( words.mid( 4)).join( " ");
+    if( QFileInfo( name).isRelative())
+        name = QFileInfo( _info.fileName).dir().filePath( name);
+
+    FitsInfo info = parse( name);
+    qint64 planeBytes = qint64( info.naxis1) * info.naxis2 * (abs( info.bitpix) / 8);
+    qint64 skip = offset - info.dataOffset;
+    if( info.naxis1 != _info.naxis1 || info.naxis2 != _info.naxis2 || skip < 0 || size <= 0
+            || skip % planeBytes || size % planeBytes || skip + size > info.dataSize)
+        throw QString( "%1 does not match the virtual cube %2 anymore.").arg( name).arg( _info.fileName);
+    info.dataOffset = offset;
+    info.dataSize = size;
+    info.naxis3 = int( size / planeBytes);
+    info.frameStart += (skip / planeBytes) * info.cdelt3;
+    info.frameEnd = info.frameStart + (info.naxis3 - 1) * info.cdelt3;
+    info.frameNext = info.frameEnd + info.cdelt3;
+    if( fabs( info.frameStart - frameStart) > 1e-6 * fabs( info.cdelt3))
+        throw QString( "%1 does not match the virtual cube %2 anymore.").arg( name).arg( _info.fileName);
+
+    _z0.push_back( _members.empty() ? 0 : _z0.back() + _members.back().naxis3);
+    _members.push_back( info);
+}
+
+int VirtualCubeReader::member( int & z) const
+{
+    int m = int( upper_bound( _z0.begin(), _z0.end(), z) - _z0.begin()) - 1;
+    z -= _z0[m];
+    return m;
+}
+
+CubeReader & VirtualCubeReader::reader( int m)
+{
+    if( ! _readers[m])
+        _readers[m] = new CubeReader( _members[m], _cacheSize / qint64( _members.size()), _mode);
+    return * _readers[m];
+}
+
+void VirtualCubeReader::filter( double * values, qint64 n) const
+{
+    if( ! _toFloat && ! _clip)
+        return;
+    for( qint64 i = 0 ; i < n ; i ++ ) {
+        double v = values[i];
+        if( _toFloat)
+            v = float( v);
+        if( _clip && (v < _clipMin || v > _clipMax))
+            v = numeric_limits<double>::quiet_NaN();
+        values[i] = v;
+    }
+}
+
+void VirtualCubeReader::checkBox( int x0, int y0, int z0, int nx, int ny, int nz) const
+{
+    if( x0 < 0 || y0 < 0 || z0 < 0 || nx < 0 || ny < 0 || nz < 0
+            || x0 + nx > width() || y0 + ny > height() || z0 + nz > depth())
+        throw QString( "%1x%2x%3 at %4,%5,%6 is outside of %7").arg( nx).arg( ny).arg( nz)
+            .arg( x0).arg( y0).arg( z0).arg( _info.fileName);
+}
+
+double VirtualCubeReader::value( int x, int y, int z)
+{
+    checkBox( x, y, z, 1, 1, 1);
+    int m = member( z);
+    double val = reader( m).value( x, y, z);
+    filter( & val, 1);
+    return val;
+}
+
+void VirtualCubeReader::readPlane( int z, vector<double> & plane)
+{
+    checkBox( 0, 0, z, width(), height(), 1);
+    int m = member( z);
+    reader( m).readPlane( z, plane);
+    filter( & plane[0], plane.size());
+}
+
+void VirtualCubeReader::readSpectrum( int x, int y, vector<double> & spectrum)
+{
+    checkBox( x, y, 0, 1, 1, depth());
+    spectrum.resize( depth());
+    for( size_t m = 0 ; m < _members.size() ; m ++ ) {
+        reader( m).readSpectrum( x, y, _scratch);
+        copy( _scratch.begin(), _scratch.end(), spectrum.begin() + _z0[m]);
+    }
+    filter( & spectrum[0], spectrum.size());
+}
+
+// the box is cut where it crosses from one member into the next, every piece is a subcube
+// of one member
+void VirtualCubeReader::readSubcube( int x0, int y0, int z0, int nx, int ny, int nz, vector<double> & values)
+{
+    checkBox( x0, y0, z0, nx, ny, nz);
+    values.resize( qint64( nx) * ny * nz);
+    if( values.empty())
+        return;
+    qint64 done = 0;
+    for( int z = z0 ; z < z0 + nz ; ) {
+        int mz = z;
+        int m = member( mz);
+        int n = qMin( z0 + nz - z, _members[m].naxis3 - mz);
+        reader( m).readSubcube( x0, y0, mz, nx, ny, n, _scratch);
+        copy( _scratch.begin(), _scratch.end(), values.begin() + done);
+        done += _scratch.size();
+        z += n;
+    }
+    filter( & values[0], values.size());
+}
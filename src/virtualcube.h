@@ -0,0 +1,78 @@
+#pragma once
+
+#include <vector>
+#include <QString>
+
+#include "extractor.h"
+#include "cubereader.h"
+
+// Virtual combines (--virtual): instead of copying the inputs into one cube, only a small
+// text file is written that says how they make one. It has the header the combined cube
+// would have and, in the order of the planes, where the data of every input is:
+//
+//   FitsCubeCombine virtual cube 1
+//   clip -1000 1000
+//   header 42
+//   SIMPLE  =                    T / file does conform to FITS standard
+//   ...
+//   END
+//   member 2880 262144000 1400000000 /data/GALFACTS_N1_0001_Icube.fits
+//   ...
+//
+// Each member line has the dataOffset and dataSize of the planes that belong to the cube
+// (less than the whole input with --freq-range), the frequency of the first of them and
+// the absolute path of the input. The clip line is only there when clipping; it and the
+// conversion (the BITPIX of the header) are applied by the reader, as the values are read.
+
+// writes the descriptor of the combined cube 'output' (as outputInfo() makes it), the
+// members are the inputs in the order of the planes; throws QString
+void writeVirtualCube( const QString & fileName, const FitsInfo & output,
+                       const std::vector<FitsInfo> & members, const CombineOptions & options);
+
+// Reads a virtual cube as if it was one cube on disk, with the same calls as CubeReader.
+// Every member is read by its own CubeReader, opened on first use, with an equal share of
+// the cache. The values are what the physical combine would have in its output: converted
+// to the BITPIX of the header and clipped.
+class VirtualCubeReader {
+public:
+    // parses the descriptor and the headers of all members, throws QString if a member is
+    // missing or does not match
+    VirtualCubeReader( const QString & fileName, qint64 cacheSize = CubeReader::DefaultCacheSize,
+                       IoMode mode = IoBuffered);
+    ~VirtualCubeReader();
+
+    // the combined cube, fileName is the descriptor and the data offset/size are the ones
+    // of a physical combine
+    const FitsInfo & info() const { return _info; }
+    int width() const { return _info.naxis1; }
+    int height() const { return _info.naxis2; }
+    int depth() const { return _info.naxis3; }
+    // the planes of the inputs, in order
+    const std::vector<FitsInfo> & members() const { return _members; }
+
+    double value( int x, int y, int z);
+    void readPlane( int z, std::vector<double> & plane);
+    void readSpectrum( int x, int y, std::vector<double> & spectrum);
+    void readSubcube( int x0, int y0, int z0, int nx, int ny, int nz, std::vector<double> & values);
+
+protected:
+    void addMember( const QString & line, int number);
+    // the member with the plane z, z becomes the plane in that member
+    int member( int & z) const;
+    CubeReader & reader( int m);
+    // the conversion and the clipping
+    void filter( double * values, qint64 n) const;
+    void checkBox( int x0, int y0, int z0, int nx, int ny, int nz) const;
+
+    FitsInfo _info;
+    std::vector<FitsInfo> _members;
+    // first plane of every member in the cube
+    std::vector<int> _z0;
+    std::vector<CubeReader *> _readers;
+    // the values of one member before they go into place
+    std::vector<double> _scratch;
+    qint64 _cacheSize;
+    IoMode _mode;
+    bool _clip, _toFloat;
+    double _clipMin, _clipMax;
+};